@@ -124,22 +124,28 @@ namespace Blacklight
 
 				return Encrypt(key, iv, data);
 			}
-			// Decrypts the specified data with the key and iv-pair, throws CryptoPP exceptions on failure
-			std::vector<char> Decrypt(const CryptoPP::SecByteBlock& key, const std::vector<char>& raw)
+			// Returns how many bytes decrypting the specified data yields
+			static size_t GetDecryptedSize(const std::vector<char>& raw) noexcept
 			{
-				std::vector<char> res;
-
 				if (raw.size() < CryptoPP::AES::BLOCKSIZE + TAGSIZE)
+					return 0;
+
+				return raw.size() - CryptoPP::AES::BLOCKSIZE - TAGSIZE;
+			}
+			// Decrypts the specified data with the key and iv-pair straight into out, which must hold GetDecryptedSize(raw) bytes. Returns how many were written, throws CryptoPP exceptions on failure
+			size_t Decrypt(const CryptoPP::SecByteBlock& key, const std::vector<char>& raw, char* out, const size_t size)
+			{
+				if (raw.size() < CryptoPP::AES::BLOCKSIZE + TAGSIZE ||
+					size < GetDecryptedSize(raw))
 #if !(BLACKLIGHT_NOTHROW) && !(BLACKLIGHT_NOSTRINGS)
 					throw std::runtime_error("Size of decryption buffer is too small");
 #elif !(BLACKLIGHT_NOTHROW)
 					throw 1;
 #else
-					return res;
+					return 0;
 #endif
 
 				CryptoPP::SecByteBlock iv(reinterpret_cast<const CryptoPP::byte*>(raw.data()), CryptoPP::AES::BLOCKSIZE);
-				std::string data(raw.begin() + CryptoPP::AES::BLOCKSIZE, raw.end());
 
 				// initialize decryption
 				m_decryption.SetKeyWithIV(key.data(), key.size(), iv.data(), iv.size());
@@ -148,8 +154,18 @@ namespace Blacklight
 				if (std::find(m_previousIVs.begin(), m_previousIVs.end(), iv) == m_previousIVs.end())
 					m_previousIVs.push_back(iv);
 
-				CryptoPP::StringSource ss(data, true, new CryptoPP::AuthenticatedDecryptionFilter(m_decryption,
-					new CryptoPP::StringSinkTemplate<std::vector<char>>(res), CryptoPP::AuthenticatedDecryptionFilter::DEFAULT_FLAGS, TAGSIZE));
+				CryptoPP::ArraySource ss(reinterpret_cast<const CryptoPP::byte*>(raw.data()) + CryptoPP::AES::BLOCKSIZE, raw.size() - CryptoPP::AES::BLOCKSIZE, true,
+					new CryptoPP::AuthenticatedDecryptionFilter(m_decryption, new CryptoPP::ArraySink(reinterpret_cast<CryptoPP::byte*>(out), size),
+						CryptoPP::AuthenticatedDecryptionFilter::DEFAULT_FLAGS, TAGSIZE));
+
+				return GetDecryptedSize(raw);
+			}
+			// Decrypts the specified data with the key and iv-pair, throws CryptoPP exceptions on failure
+			std::vector<char> Decrypt(const CryptoPP::SecByteBlock& key, const std::vector<char>& raw)
+			{
+				std::vector<char> res(GetDecryptedSize(raw));
+
+				res.resize(Decrypt(key, raw, res.data(), res.size()));
 
 				return res;
 			}
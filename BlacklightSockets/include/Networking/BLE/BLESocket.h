@@ -126,6 +126,14 @@ namespace Blacklight
 					// we got data, let's decrypt it
 					try
 					{
+						// a block that fits is decrypted straight into buf, behind the overflow
+						if (overflowBytes + m_aes.GetDecryptedSize(*recvBuf) <= buf.size())
+						{
+							size_t decrypted = m_aes.Decrypt(m_key, *recvBuf, static_cast<char*>(buf.data()) + overflowBytes, buf.size() - overflowBytes);
+
+							return callback(boost::system::errc::make_error_code(boost::system::errc::success), decrypted + overflowBytes);
+						}
+
 						auto dec = m_aes.Decrypt(m_key, *recvBuf);
 
 						memcpy(buf.data(), dec.data() + overflowBytes, std::min(dec.size(), buf.size()) - overflowBytes);
@@ -179,7 +187,8 @@ namespace Blacklight
 				}
 
 				// I/O Operations:
-				// Blocking read from a socket, returns when any data is received with the number of bytes read, limited by the size of buf. Throws ErrorCode on error
+				// Blocking read from a socket, returns when any data is received with the number of bytes read, limited by the size of buf. A block that fits in buf is decrypted
+				// straight into it, so reading into where the data is going, such as guest memory through VM::ImageStream, saves copying it. Throws ErrorCode on error
 				template<typename MutableBufferSequence>
 				size_t read_some(const MutableBufferSequence& buf)
 				{
@@ -231,6 +240,10 @@ namespace Blacklight
 					// we got data, let's decrypt it
 					try
 					{
+						// a block that fits is decrypted straight into buf, behind the overflow
+						if (overflowBytes + m_aes.GetDecryptedSize(recvBuf) <= buf.size())
+							return m_aes.Decrypt(m_key, recvBuf, static_cast<char*>(buf.data()) + overflowBytes, buf.size() - overflowBytes) + overflowBytes;
+
 						auto dec = m_aes.Decrypt(m_key, recvBuf);
 
 						memcpy(buf.data(), dec.data() + overflowBytes, std::min(dec.size(), buf.size()) - overflowBytes);
@@ -0,0 +1,277 @@
+#include "AssemblerTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/Assembler.h>
+#include <VM/Linker.h>
+
+#include <iostream>
+#include <stdexcept>
+
+using Blacklight::VM::Assembler;
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::Linker;
+using Blacklight::VM::R_A;
+using Blacklight::VM::R_B;
+using Blacklight::VM::R_C;
+using Blacklight::VM::R_D;
+using Blacklight::VM::R_E;
+using Blacklight::VM::R_F;
+using Blacklight::VM::R_G;
+using Blacklight::VM::R_H;
+using Blacklight::VM::R_I;
+using Blacklight::VM::R_J;
+using Blacklight::VM::SC_TEXT;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x20000;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED };
+
+	// Every JMP starts out as a byte. B reaches past a byte on its own, which pushes A past one, C stays a
+	// byte, D is a dword on its own, F is a word on its own and pushes E from a word to a dword
+	const char* const RELAXATION = R"(
+			ldv a, 0
+			jmp t1			; A
+			jmp t3			; B
+			.space 125
+	t1:		add a, 1
+			jmp t3			; C
+			.space 10
+	t3:		add a, 2
+			jmp t4			; D
+			.space 40000
+	t4:		add a, 4
+			jmp t5			; E
+			jmp t5			; F
+			.space 32765
+	t5:		add a, 8
+			trap halt
+		)";
+
+	// calls and jumps forward into the second object and back into the first, and a dword holding an
+	// address from the other one
+	const char* const MAIN = R"(
+			.global back, value
+			ldv a, 3
+			call triple
+			jmp tail
+	back:	add a, 100
+			ld b, [value]
+			add a, b
+			trap halt
+			.data
+	value:	.dword 7
+		)";
+
+	const char* const LIBRARY = R"(
+			.global triple, tail
+	triple:	ldv b, a
+			add a, b
+			add a, b
+			ret
+	tail:	ld c, [pointer]
+			add a, c
+			jmp back
+			.data
+	pointer:	.dword back
+		)";
+
+	const char* const SIZES = R"(
+			ldv.b a, -1
+			ldv.w b, 0x8000
+			ldv.d c, 0x12345678
+			ldv.b d, c
+			ldv.w e, c
+			st.w [slot], c
+			ld f, [slot]
+			st.b [slot + 5], c
+			ld.w g, [slot + 4]
+			ldv h, 0x7F
+			add.b h, 0x7F
+			ldv i, 0x10
+			sub.w i, 0x20
+			ldv j, 0xFF
+			and.b j, 0x0F
+			trap halt
+			.data
+	slot:	.dword 0, 0
+		)";
+
+	struct ImmediateLength
+	{
+		const char* m_source;
+		size_t m_length;
+	};
+
+	// immediates without a size take the smallest that holds them once sign extended
+	const ImmediateLength IMMEDIATE_LENGTHS[] =
+	{
+		{ "ldv a, 5", 3 },
+		{ "ldv a, -1", 3 },
+		{ "ldv a, 300", 4 },
+		{ "ldv a, -300", 4 },
+		{ "ldv a, 70000", 6 },
+		{ "ldv a, 0xFFFFFFFF", 3 },
+		{ "ldv.w a, 5", 4 },
+		{ "ldv.d a, 5", 6 },
+		{ "add a, b", 2 },
+		{ "push 5", 5 },
+		{ "trap halt", 2 }
+	};
+
+	struct MalformedSource
+	{
+		const char* m_source;
+		const char* m_error;
+	};
+
+	const MalformedSource MALFORMED_SOURCES[] =
+	{
+		{ "foo a", "bad.s:1: Unknown instruction: foo" },
+		{ "x:\nx:", "bad.s:2: Symbol defined twice: x" },
+		{ "ldv a, [b]", "bad.s:1: ldv takes a register or an immediate second" },
+		{ "ldv a, [b", "bad.s:1: Missing ]: [b" },
+		{ "ldv.b a, 300", "bad.s:1: Immediate does not fit: 300" },
+		{ "ldv.x a, 1", "bad.s:1: Unknown size: ldv.x" },
+		{ "jmp.b x", "bad.s:1: jmp is sized by the linker" },
+		{ "\n\nbr x", "bad.s:3: br needs at least one flag, br.e for example" },
+		{ "br.z x", "bad.s:1: br takes the flags p, e and n: br.z" },
+		{ "push.w 5", "bad.s:1: push always pushes a dword" },
+		{ "trap nothing", "bad.s:1: Expected a number: nothing" },
+		{ "memcpy a, b", "bad.s:1: memcpy takes 3 operands" },
+		{ "memcpy a, b, 5", "bad.s:1: memcpy takes three registers, dst, src and count" },
+		{ "add a", "bad.s:1: add takes 2 operands" },
+		{ ".align 3", "bad.s:1: Alignment has to be a power of two up to 0x10000: 3" },
+		{ ".bogus 1", "bad.s:1: Unknown directive: .bogus" },
+		{ ".ascii hello", "bad.s:1: Expected a quoted string: hello" },
+		{ "jmp nowhere", "bad.s:1: Undefined symbol nowhere" }
+	};
+
+	// Returns the message a source fails to assemble or link with, empty if it does not
+	std::string GetError(const std::string& source)
+	{
+		try
+		{
+			Linker linker;
+			linker.Add(Assembler::Assemble(source, "bad.s"));
+			linker.Link();
+		}
+		catch (const std::runtime_error& error)
+		{
+			return error.what();
+		}
+
+		return std::string();
+	}
+
+	// Runs an image to the end under every mode, returns the CPU of the last one once they all agree
+	bool RunImage(const std::vector<uint8_t>& image, const std::string& what, std::unique_ptr<CPU>& pCPU)
+	{
+		bool passed = true;
+
+		for (DispatchMode mode : DISPATCH_MODES)
+		{
+			std::unique_ptr<CPU> pRun(new CPU(BLOCK_SIZE, mode));
+			pRun->LoadImage(image.data(), image.size());
+			pRun->Run();
+
+			if (pCPU != nullptr)
+				passed &= VM::CompareCPUs(*pCPU, *pRun, what);
+
+			pCPU = std::move(pRun);
+		}
+
+		return passed;
+	}
+}
+
+bool VM::RunAssemblerTests()
+{
+	std::cout << "Beginning Assembler Tests\n";
+
+	bool passed = true;
+
+	{
+		Linker linker;
+		linker.Add(Assembler::Assemble(RELAXATION, "relaxation.s"));
+		std::vector<uint8_t> image = linker.Link();
+
+		const Linker::Stats& stats = linker.GetStats();
+		passed &= Check(stats.m_byteBranches == 1 && stats.m_wordBranches == 3 && stats.m_dwordBranches == 2,
+			"relaxation leaves 1 byte, 3 word and 2 dword branches, not " + std::to_string(stats.m_byteBranches) + ", " +
+			std::to_string(stats.m_wordBranches) + " and " + std::to_string(stats.m_dwordBranches));
+
+		std::unique_ptr<CPU> pCPU;
+		passed &= RunImage(image, "relaxation", pCPU);
+		passed &= Check(pCPU->GetRegister(R_A) == 15, "relaxed branches reach their targets");
+	}
+
+	{
+		Linker linker;
+		linker.Add(Assembler::Assemble(MAIN, "main.s"));
+		linker.Add(Assembler::Assemble(LIBRARY, "library.s"));
+		std::vector<uint8_t> image = linker.Link();
+
+		std::unique_ptr<CPU> pCPU;
+		passed &= RunImage(image, "labels across objects", pCPU);
+
+		uint32_t back = linker.GetSymbolAddress("back");
+		passed &= Check(pCPU->GetRegister(R_C) == back, "a dword holds an address from another object");
+		passed &= Check(pCPU->GetRegister(R_A) == 9 + back + 100 + 7, "labels across objects are reached");
+		passed &= Check(GetError(".global x\nx: ret") == "" && GetError(".global x\ny: ret") ==
+			"bad.s: .global x is never defined", "a global has to be defined");
+	}
+
+	{
+		Linker linker;
+		linker.Add(Assembler::Assemble(".global x\nx: ret", "a.s"));
+		linker.Add(Assembler::Assemble(".global x\nx: ret", "b.s"));
+		try
+		{
+			linker.Link();
+			passed &= Check(false, "a symbol defined twice across objects does not link");
+		}
+		catch (const std::runtime_error& error)
+		{
+			passed &= Check(std::string(error.what()) == "Symbol x is defined in a.s and b.s", error.what());
+		}
+	}
+
+	{
+		std::unique_ptr<CPU> pCPU;
+		passed &= RunImage(Build(SIZES), "size suffixes", pCPU);
+
+		CPU& cpu = *pCPU;
+		passed &= Check(cpu.GetRegister(R_A) == 0xFFFFFFFF, "ldv.b sign extends its immediate");
+		passed &= Check(cpu.GetRegister(R_B) == 0xFFFF8000, "ldv.w sign extends its immediate");
+		passed &= Check(cpu.GetRegister(R_C) == 0x12345678, "ldv.d loads a dword");
+		passed &= Check(cpu.GetRegister(R_D) == 0x78, "ldv.b zero extends a register");
+		passed &= Check(cpu.GetRegister(R_E) == 0x5678, "ldv.w zero extends a register");
+		passed &= Check(cpu.GetRegister(R_F) == 0x5678, "st.w stores a word");
+		passed &= Check(cpu.GetRegister(R_G) == 0x7800, "st.b stores a byte");
+		passed &= Check(cpu.GetRegister(R_H) == 0xFE, "add.b adds a byte");
+		passed &= Check(cpu.GetRegister(R_I) == 0xFFFFFFF0, "sub.w subtracts a word");
+		passed &= Check(cpu.GetRegister(R_J) == 0x0F, "and.b ands a byte");
+	}
+
+	for (const ImmediateLength& immediate : IMMEDIATE_LENGTHS)
+	{
+		size_t length = Assembler::Assemble(immediate.m_source).m_sections[SC_TEXT][0].m_bytes.size();
+		passed &= Check(length == immediate.m_length, std::string(immediate.m_source) + " is " +
+			std::to_string(immediate.m_length) + " bytes, not " + std::to_string(length));
+	}
+
+	for (const MalformedSource& malformed : MALFORMED_SOURCES)
+	{
+		std::string error = GetError(malformed.m_source);
+		passed &= Check(error == malformed.m_error, "expected \"" + std::string(malformed.m_error) + "\", got \"" + error + "\"");
+	}
+
+	std::cout << (passed == true ? "Assembler Tests passed\n" : "Assembler Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
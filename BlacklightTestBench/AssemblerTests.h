@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_ASSEMBLERTESTS_H_
+#define TESTBENCH_ASSEMBLERTESTS_H_
+
+namespace VM
+{
+	bool RunAssemblerTests();
+}
+
+#endif
\ No newline at end of file
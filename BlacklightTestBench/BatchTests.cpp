@@ -0,0 +1,138 @@
+#include "BatchTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/Batch.h>
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+using Blacklight::VM::Batch;
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::R_A;
+
+namespace
+{
+	// not a power of two, so there are addresses between the end of memory and where they wrap that fault
+	constexpr size_t BLOCK_SIZE = 0x10100;
+	// more lanes than the widest vector holds
+	constexpr uint32_t LANE_COUNT = 12;
+
+	// the lane that writes code, and the one that faults
+	constexpr uint32_t EJECTED_LANE = 5;
+	constexpr uint32_t FAULTED_LANE = 6;
+
+	// a starts out as the lane, which k keeps. Every lane loops a different number of times, odd lanes call the host
+	// while even ones compare cnd, every lane compares it as dst and as src, one lane writes its code and leaves the
+	// batch and another loads past the end of memory
+	const char* const LANES = R"(
+			ldv k, a
+			ldv b, a
+			and b, 3
+			add b, 1
+			ldv c, 0
+			ldv d, 0x8000
+	loop:	add c, a
+			st [d], c
+			add d, 4
+			sub b, 1
+			cmp b, 0
+			br.n loop
+			ldv e, a
+			and e, 1
+			cmp e, 0
+			br.e even
+			add f, 7
+			cx 0
+			jmp joined
+	even:	sub f, 5
+			ldv cnd, k
+			cmp cnd, 2
+			ldv i, cnd
+	joined:	ldv h, k
+			cmp h, 5
+			br.pn kept
+			ldv i, patch + 2
+			st.b [i], h
+	kept:	cmp h, 6
+			br.pn inside
+			ld l, [0x18000]
+	inside:	ldv cnd, k
+			cmp cnd, 3
+			ldv b, cnd
+			ldv d, 8
+			cmp d, cnd
+			ldv e, cnd
+			push c
+			pop g
+	patch:	ldv.b j, 1
+			add j, k
+			st [0x9000], j
+			trap halt
+		)";
+
+	std::unique_ptr<CPU> Load(const std::vector<uint8_t>& image, const uint32_t lane)
+	{
+		std::unique_ptr<CPU> pCPU(new CPU(BLOCK_SIZE, DM_DECODED));
+		pCPU->AddFunction([](uint32_t a) { return a * 3 + 1; });
+		pCPU->LoadImage(image.data(), image.size());
+		pCPU->GetRegister(R_A) = lane;
+
+		return pCPU;
+	}
+}
+
+bool VM::RunBatchTests()
+{
+	std::cout << "Beginning Batch Tests\n";
+
+	bool passed = true;
+
+	std::vector<uint8_t> image = Build(LANES);
+
+	std::vector<std::unique_ptr<CPU>> lanes;
+	Batch batch;
+	for (uint32_t lane = 0; lane < LANE_COUNT; ++lane)
+	{
+		lanes.push_back(Load(image, lane));
+		batch.Add(lanes.back().get());
+	}
+
+	batch.Run();
+
+	// every lane has to end up where it would have on its own
+	for (uint32_t lane = 0; lane < LANE_COUNT; ++lane)
+	{
+		std::string what = "lane " + std::to_string(lane);
+
+		std::unique_ptr<CPU> pSolo = Load(image, lane);
+		bool faulted = false;
+		try
+		{
+			pSolo->Run();
+		}
+		catch (const std::runtime_error&)
+		{
+			faulted = true;
+		}
+
+		Batch::LaneStats stats = batch.GetLaneStats(lane);
+		passed &= Check(stats.m_faulted == faulted, what + " faults when it does on its own");
+		passed &= Check(stats.m_finished == (faulted == false), what + " finishes when it does on its own");
+		passed &= Check(stats.m_ejected == (lane == EJECTED_LANE), what + " leaves the batch when it writes code");
+		passed &= Check(faulted == (lane == FAULTED_LANE), what + " faults past the end of memory");
+
+		// a CPU keeps no count of the run it faulted in
+		passed &= CompareCPUs(*pSolo, *lanes[lane], what, faulted == true ? 0 : stats.m_instructions);
+	}
+
+	const Batch::Stats& stats = batch.GetStats();
+	passed &= Check(stats.m_divergentSteps != 0, "lanes run apart");
+	passed &= Check(stats.m_divergentSteps < stats.m_steps, "lanes come back together");
+	passed &= Check(stats.m_scalarSteps != 0, "lanes drop back to their own CPU");
+
+	std::cout << (passed == true ? "Batch Tests passed\n" : "Batch Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_BATCHTESTS_H_
+#define TESTBENCH_BATCHTESTS_H_
+
+namespace VM
+{
+	bool RunBatchTests();
+}
+
+#endif
\ No newline at end of file
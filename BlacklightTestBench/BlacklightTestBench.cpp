@@ -1,4 +1,21 @@
+#include "AssemblerTests.h"
+#include "BatchTests.h"
+#include "DispatchTests.h"
+#include "ExtendedTests.h"
+#include "FusionTests.h"
+#include "ImageCacheTests.h"
+#include "ImageStreamTests.h"
+#include "MemoryTests.h"
 #include "NetworkingTests.h"
+#include "OptimizerTests.h"
+#include "ProfilerTests.h"
+#include "ProgramTests.h"
+#include "SocketTests.h"
+#include "ThreadTests.h"
+#include "TraceTests.h"
+#include "TranslatorTests.h"
+#include "VerifierTests.h"
+#include "WideTests.h"
 
 constexpr size_t UDP_MAX = 0xFFE0;
 
@@ -18,5 +35,56 @@ int main()
 	if (Networking::RunEncryptedTCPTests(PACKET_COUNT, PACKET_SIZE) == false)
 		return 3;
 
+	if (VM::RunDispatchTests() == false)
+		return 4;
+
+	if (VM::RunMemoryTests() == false)
+		return 5;
+
+	if (VM::RunSocketTests() == false)
+		return 6;
+
+	if (VM::RunAssemblerTests() == false)
+		return 7;
+
+	if (VM::RunOptimizerTests() == false)
+		return 8;
+
+	if (VM::RunExtendedTests() == false)
+		return 9;
+
+	if (VM::RunVerifierTests() == false)
+		return 10;
+
+	if (VM::RunTranslatorTests() == false)
+		return 11;
+
+	if (VM::RunBatchTests() == false)
+		return 12;
+
+	if (VM::RunThreadTests() == false)
+		return 13;
+
+	if (VM::RunWideTests() == false)
+		return 14;
+
+	if (VM::RunTraceTests() == false)
+		return 15;
+
+	if (VM::RunProfilerTests() == false)
+		return 16;
+
+	if (VM::RunImageCacheTests() == false)
+		return 17;
+
+	if (VM::RunImageStreamTests() == false)
+		return 18;
+
+	if (VM::RunProgramTests() == false)
+		return 19;
+
+	if (VM::RunFusionTests() == false)
+		return 20;
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,234 @@
+#include "DispatchTests.h"
+#include "VMTestHelpers.h"
+
+#include <iostream>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_JIT;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DM_THREADED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::F_E;
+using Blacklight::VM::R_A;
+using Blacklight::VM::R_C;
+using Blacklight::VM::R_D;
+using Blacklight::VM::R_E;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+	constexpr uint32_t SLICE_SEEDS = 8;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT, DM_VERIFIED };
+
+	struct DispatchTest
+	{
+		const char* m_name;
+		const char* m_source;
+	};
+
+	const DispatchTest DISPATCH_TESTS[] =
+	{
+		{ "arithmetic", R"(
+			ldv a, 0
+			ldv b, 1
+			ldv c, 3000
+	loop:	add a, b
+			add.b b, 3
+			sub a, 7
+			and a, 0x7FFFFFFF
+			not b
+			not b
+			ldv.w d, a
+			add.w e, d
+			sub.b f, 1
+			ldv g, a
+			add g, b
+			sub c, 1
+			cmp c, 0
+			br.n loop
+			cmp.b a, b
+			br.pe done
+			ldv h, 1
+	done:	trap halt
+		)" },
+		{ "calls", R"(
+			ldv a, 18
+			call fib
+			trap halt
+	fib:	cmp a, 2
+			br.p small
+			push a
+			sub a, 1
+			call fib
+			pop b
+			push a
+			ldv a, b
+			sub a, 2
+			call fib
+			pop b
+			add a, b
+			ret
+	small:	ret
+		)" },
+		{ "memory", R"(
+			ldv a, table
+			ldv c, 0
+	fill:	st [a], c
+			st.b [bytes + 3], c
+			add a, 4
+			add c, 0x01010101
+			cmp c, 0x40404040
+			br.p fill
+			ldv a, table
+			ldv b, 0
+	sum:	ld.b d, [a]
+			add b, d
+			ld.w d, [a]
+			add b, d
+			ld e, [a]
+			add b, e
+			add a, 1
+			cmp a, table + 240
+			br.p sum
+			ld f, [bytes]
+			push b
+			push f
+			pop g
+			pop h
+			trap halt
+			.data
+	bytes:	.dword 0
+	table:	.space 256
+		)" },
+		{ "self-modifying", R"(
+			ld.b f, [subop]
+			st.b [other], f
+			ldv c, 40
+			ldv e, 0
+	loop:	st [patch + 2], c
+	patch:	ldv.d a, 0
+			add e, a
+			; flip the add below between an add and a sub of b
+			ld.b d, [flip]
+			ld.b f, [other]
+			st.b [flip], f
+			st.b [other], d
+			ldv b, 5
+	flip:	add b, c
+			add e, b
+			sub c, 1
+			cmp c, 0
+			br.n loop
+			; write code just ahead of where it runs in the same block
+			ldv g, 0x0B
+			st.b [ahead + 2], g
+	ahead:	ldv.b h, 0
+			trap halt
+	subop:	sub b, c
+			.data
+	other:	.byte 0
+		)" },
+		{ "extended", R"(
+			ldv a, source
+			ldv b, 0x5A
+			ldv c, 200
+			memset a, b, c
+			ldv a, destination
+			ldv b, source
+			ldv c, 150
+			memcpy a, b, c
+			ldv a, destination + 8
+			ldv b, destination
+			ldv c, 64
+			memcpy a, b, c
+			ldv b, destination
+			ldv c, 200
+			checksum d, b, c
+			ldv a, source
+			ldv b, destination
+			ldv c, 200
+			memcmp a, b, c
+			ldv a, counter
+			ldv b, 7
+			fetchadd a, b, e
+			ldv f, 7
+			ldv b, 9
+			cas a, b, f
+			trap halt
+			.data
+			.align 4
+	counter:	.dword 0
+	source:		.space 256
+	destination:	.space 256
+		)" },
+		{ "flags", R"(
+			ldv cnd, 0x12
+			cmp cnd, 0x10
+			ldv a, cnd
+			ldv cnd, 0x14
+			ldv b, 0x10
+			cmp b, cnd
+			ldv c, cnd
+			ldv cnd, 0x7
+			cmp.b cnd, cnd
+			ldv d, cnd
+			ldv cnd, 0xFF
+			cmp.w cnd, 0xF8
+			br.e equal
+			ldv e, 1
+	equal:	trap halt
+		)" }
+	};
+}
+
+bool VM::RunDispatchTests()
+{
+	std::cout << "Beginning Dispatch Tests\n";
+
+	bool passed = true;
+
+	for (const DispatchTest& test : DISPATCH_TESTS)
+	{
+		std::vector<uint8_t> image = Build(test.m_source);
+
+		// the table core is the reference the others are held to
+		CPU expected(BLOCK_SIZE, DM_TABLE);
+		expected.LoadImage(image.data(), image.size());
+		expected.Run();
+
+		// a CMP clears the flags before it reads R_CND as either side
+		if (std::string(test.m_name) == "flags")
+		{
+			passed &= Check(expected.GetRegister(R_A) == 0x12 && expected.GetRegister(R_C) == 0x12, "CMP on cnd compares what is left of it");
+			passed &= Check(expected.GetRegister(R_D) == F_E && expected.GetRegister(R_E) == 0, "CMP.B and CMP.W on cnd compare what is left of it");
+		}
+
+		for (DispatchMode mode : DISPATCH_MODES)
+		{
+			CPU cpu(BLOCK_SIZE, mode);
+			cpu.LoadImage(image.data(), image.size());
+			cpu.Run();
+			passed &= CompareCPUs(expected, cpu, std::string(test.m_name) + " under mode " + std::to_string(mode));
+		}
+
+		for (uint32_t seed = 0; seed < SLICE_SEEDS; ++seed)
+		{
+			for (DispatchMode mode : DISPATCH_MODES)
+			{
+				CPU cpu(BLOCK_SIZE, mode);
+				cpu.LoadImage(image.data(), image.size());
+
+				std::string what = std::string(test.m_name) + " under mode " + std::to_string(mode) + " sliced with seed " + std::to_string(seed);
+
+				passed &= RunSliced(cpu, seed) && CompareCPUs(expected, cpu, what);
+			}
+		}
+	}
+
+	std::cout << (passed == true ? "Dispatch Tests passed\n" : "Dispatch Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_DISPATCHTESTS_H_
+#define TESTBENCH_DISPATCHTESTS_H_
+
+namespace VM
+{
+	bool RunDispatchTests();
+}
+
+#endif
\ No newline at end of file
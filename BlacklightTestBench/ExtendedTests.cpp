@@ -0,0 +1,356 @@
+#include "ExtendedTests.h"
+#include "VMTestHelpers.h"
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_JIT;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DM_THREADED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::F_E;
+using Blacklight::VM::F_N;
+using Blacklight::VM::F_P;
+using Blacklight::VM::MM_FLAT;
+using Blacklight::VM::MM_PAGED;
+using Blacklight::VM::MemoryController;
+using Blacklight::VM::MemoryMode;
+using Blacklight::VM::R_C;
+using Blacklight::VM::R_CND;
+using Blacklight::VM::R_D;
+using Blacklight::VM::R_E;
+using Blacklight::VM::R_F;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+
+	// where the host lays out a pattern for the tests that cross pages
+	constexpr uint32_t REGION_START = 0x8000;
+	constexpr uint32_t REGION_END = 0xB000;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT, DM_VERIFIED };
+	const MemoryMode MEMORY_MODES[] = { MM_FLAT, MM_PAGED };
+
+	struct Expected
+	{
+		uint32_t m_register;
+		uint32_t m_value;
+	};
+
+	struct ExtendedTest
+	{
+		const char* m_name;
+		const char* m_source;
+		std::vector<Expected> m_expected;
+	};
+
+	const ExtendedTest EXTENDED_TESTS[] =
+	{
+		// MEMCMP sets the flags CMP dst, src would for the first bytes that differ, unsigned
+		{ "memcmp equal", R"(
+				ldv a, x
+				ldv b, y
+				ldv c, 4
+				memcmp a, b, c
+				trap halt
+				.data
+		x:		.byte 1, 2, 3, 4
+		y:		.byte 1, 2, 3, 4
+			)", { { R_C, 4 }, { R_CND, F_E } } },
+		{ "memcmp src above", R"(
+				ldv a, x
+				ldv b, y
+				ldv c, 4
+				memcmp a, b, c
+				trap halt
+				.data
+		x:		.byte 1, 2, 3, 0x10
+		y:		.byte 1, 2, 3, 0x20
+			)", { { R_C, 3 }, { R_CND, F_P } } },
+		{ "memcmp src below unsigned", R"(
+				ldv a, x
+				ldv b, y
+				ldv c, 4
+				memcmp a, b, c
+				trap halt
+				.data
+		x:		.byte 1, 0x80, 3, 4
+		y:		.byte 1, 0x01, 3, 4
+			)", { { R_C, 1 }, { R_CND, F_N } } },
+		{ "memcmp past count", R"(
+				ldv a, x
+				ldv b, y
+				ldv c, 3
+				memcmp a, b, c
+				trap halt
+				.data
+		x:		.byte 1, 2, 3, 4
+		y:		.byte 1, 2, 3, 5
+			)", { { R_C, 3 }, { R_CND, F_E } } },
+		{ "memcmp empty", R"(
+				ldv a, 4
+				cmp a, 5
+				ldv a, x
+				ldv b, y
+				ldv c, 0
+				memcmp a, b, c
+				trap halt
+				.data
+		x:		.byte 1
+		y:		.byte 2
+			)", { { R_C, 0 }, { R_CND, F_E } } },
+		// MEMCHR only looks for the low byte of src
+		{ "memchr found", R"(
+				ldv a, text
+				ldv b, 0x163
+				ldv c, 6
+				memchr a, b, c
+				trap halt
+				.data
+		text:	.ascii "abcdef"
+			)", { { R_C, 2 }, { R_CND, F_E } } },
+		{ "memchr not found", R"(
+				ldv a, text
+				ldv b, 'z'
+				ldv c, 6
+				memchr a, b, c
+				trap halt
+				.data
+		text:	.ascii "abcdef"
+			)", { { R_C, 6 }, { R_CND, F_N } } },
+		{ "memchr past count", R"(
+				ldv a, text
+				ldv b, 'f'
+				ldv c, 5
+				memchr a, b, c
+				trap halt
+				.data
+		text:	.ascii "abcdef"
+			)", { { R_C, 5 }, { R_CND, F_N } } },
+		{ "memchr empty", R"(
+				ldv a, text
+				ldv b, 'a'
+				ldv c, 0
+				memchr a, b, c
+				trap halt
+				.data
+		text:	.ascii "abcdef"
+			)", { { R_C, 0 }, { R_CND, F_N } } },
+		// the example in RFC 1071 section 3, and an IPv4 header with its checksum zeroed
+		{ "checksum rfc 1071", R"(
+				ldv b, data
+				ldv c, 8
+				checksum d, b, c
+				trap halt
+				.data
+		data:	.byte 0x00, 0x01, 0xF2, 0x03, 0xF4, 0xF5, 0xF6, 0xF7
+			)", { { R_D, 0x220D } } },
+		{ "checksum ipv4 header", R"(
+				ldv b, data
+				ldv c, 20
+				checksum d, b, c
+				trap halt
+				.data
+		data:	.byte 0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11
+				.byte 0x00, 0x00, 0xC0, 0xA8, 0x00, 0x01, 0xC0, 0xA8, 0x00, 0xC7
+			)", { { R_D, 0xB861 } } },
+		// an odd byte is padded with a zero on its right
+		{ "checksum odd length", R"(
+				ldv b, data + 1
+				ldv c, 3
+				checksum d, b, c
+				trap halt
+				.data
+		data:	.byte 0xEE, 0x01, 0x02, 0x03, 0xEE
+			)", { { R_D, 0xFBFD } } },
+		{ "checksum carries", R"(
+				ldv b, data
+				ldv c, 4
+				checksum d, b, c
+				trap halt
+				.data
+		data:	.byte 0xFF, 0xFF, 0xFF, 0xFF
+			)", { { R_D, 0x0000 } } },
+		{ "checksum empty", R"(
+				ldv b, data
+				ldv c, 0
+				checksum d, b, c
+				trap halt
+				.data
+		data:	.byte 0xFF
+			)", { { R_D, 0xFFFF } } },
+		// MEMCPY copies like memmove whichever way the ranges overlap
+		{ "memcpy overlapping up", R"(
+				ldv a, data + 2
+				ldv b, data
+				ldv c, 6
+				memcpy a, b, c
+				ld d, [data]
+				ld e, [data + 4]
+				ld.w f, [data + 8]
+				trap halt
+				.data
+		data:	.ascii "0123456789"
+			)", { { R_D, 0x31303130 }, { R_E, 0x35343332 }, { R_F, 0x3938 } } },
+		{ "memcpy overlapping down", R"(
+				ldv a, data
+				ldv b, data + 2
+				ldv c, 6
+				memcpy a, b, c
+				ld d, [data]
+				ld e, [data + 4]
+				ld.w f, [data + 8]
+				trap halt
+				.data
+		data:	.ascii "0123456789"
+			)", { { R_D, 0x35343332 }, { R_E, 0x37363736 }, { R_F, 0x3938 } } },
+		{ "memcpy onto itself", R"(
+				ldv a, data
+				ldv b, data
+				ldv c, 10
+				memcpy a, b, c
+				ld d, [data]
+				trap halt
+				.data
+		data:	.ascii "0123456789"
+			)", { { R_D, 0x33323130 } } }
+	};
+
+	// crossing pages from an odd address, over the pattern the host lays out
+	const char* const REGION_CHECKSUM = R"(
+			ldv b, 0x8FFD
+			ldv c, 0x1003
+			checksum d, b, c
+			trap halt
+		)";
+
+	const char* const REGION_COPY_UP = R"(
+			ldv a, 0x8FF3
+			ldv b, 0x8FE0
+			ldv c, 0x1100
+			memcpy a, b, c
+			trap halt
+		)";
+
+	const char* const REGION_COPY_DOWN = R"(
+			ldv a, 0x8FE0
+			ldv b, 0x8FF3
+			ldv c, 0x1100
+			memcpy a, b, c
+			trap halt
+		)";
+
+	uint8_t Pattern(const uint32_t address)
+	{
+		return static_cast<uint8_t>(address * 7 + (address >> 8));
+	}
+
+	// The RFC 1071 checksum of the pattern, summed as big endian words the way the RFC describes it
+	uint16_t PatternChecksum(const uint32_t address, const uint32_t size)
+	{
+		uint64_t sum = 0;
+		for (uint32_t i = 0; i < size; i += 2)
+			sum += (static_cast<uint32_t>(Pattern(address + i)) << 8) | (i + 1 < size ? Pattern(address + i + 1) : 0);
+
+		while ((sum >> 16) != 0)
+			sum = (sum & 0xFFFF) + (sum >> 16);
+
+		return static_cast<uint16_t>(~sum);
+	}
+
+	// Runs an image to the end with the pattern laid out
+	std::unique_ptr<CPU> Run(const std::vector<uint8_t>& image, const DispatchMode mode, const MemoryMode memoryMode)
+	{
+		std::unique_ptr<CPU> pCPU(new CPU(BLOCK_SIZE, mode, memoryMode));
+		pCPU->LoadImage(image.data(), image.size());
+
+		MemoryController& mc = pCPU->GetMemoryController();
+		for (uint32_t address = REGION_START; address < REGION_END; ++address)
+			mc.Write8(address, Pattern(address));
+
+		pCPU->Run();
+		return pCPU;
+	}
+
+	// Returns whether memory holds the pattern after memmove(dst, src, size)
+	bool CheckCopy(CPU& cpu, const uint32_t dst, const uint32_t src, const uint32_t size, const std::string& what)
+	{
+		std::vector<uint8_t> expected(REGION_END - REGION_START);
+		for (uint32_t i = 0; i < expected.size(); ++i)
+			expected[i] = Pattern(REGION_START + i);
+		memmove(&expected[dst - REGION_START], &expected[src - REGION_START], size);
+
+		const MemoryController& mc = cpu.GetMemoryController();
+		for (uint32_t i = 0; i < expected.size(); ++i)
+		{
+			if (mc.Read8(REGION_START + i) != expected[i])
+			{
+				std::cout << what << ": memory differs first at " << REGION_START + i << '\n';
+				return false;
+			}
+		}
+
+		return true;
+	}
+}
+
+bool VM::RunExtendedTests()
+{
+	std::cout << "Beginning Extended Tests\n";
+
+	bool passed = true;
+
+	for (MemoryMode memoryMode : MEMORY_MODES)
+	{
+		for (const ExtendedTest& test : EXTENDED_TESTS)
+		{
+			std::vector<uint8_t> image = Build(test.m_source);
+
+			// the table core is the reference the others are held to
+			std::unique_ptr<CPU> pExpected = Run(image, DM_TABLE, memoryMode);
+
+			for (DispatchMode mode : DISPATCH_MODES)
+			{
+				std::unique_ptr<CPU> pCPU = Run(image, mode, memoryMode);
+
+				std::string what = std::string(test.m_name) + " under mode " + std::to_string(mode) +
+					(memoryMode == MM_PAGED ? " paged" : " flat");
+
+				for (const Expected& expected : test.m_expected)
+				{
+					if (pCPU->GetRegister(expected.m_register) != expected.m_value)
+					{
+						std::cout << what << ": register " << expected.m_register << " is " <<
+							pCPU->GetRegister(expected.m_register) << ", expected " << expected.m_value << '\n';
+						passed = false;
+					}
+				}
+
+				passed &= CompareCPUs(*pExpected, *pCPU, what);
+			}
+		}
+
+		for (DispatchMode mode : DISPATCH_MODES)
+		{
+			std::string what = " under mode " + std::to_string(mode) + (memoryMode == MM_PAGED ? " paged" : " flat");
+
+			std::unique_ptr<CPU> pCPU = Run(Build(REGION_CHECKSUM), mode, memoryMode);
+			passed &= Check(pCPU->GetRegister(R_D) == PatternChecksum(0x8FFD, 0x1003), "checksum across pages" + what);
+
+			pCPU = Run(Build(REGION_COPY_UP), mode, memoryMode);
+			passed &= CheckCopy(*pCPU, 0x8FF3, 0x8FE0, 0x1100, "memcpy up across pages" + what);
+
+			pCPU = Run(Build(REGION_COPY_DOWN), mode, memoryMode);
+			passed &= CheckCopy(*pCPU, 0x8FE0, 0x8FF3, 0x1100, "memcpy down across pages" + what);
+		}
+	}
+
+	std::cout << (passed == true ? "Extended Tests passed\n" : "Extended Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
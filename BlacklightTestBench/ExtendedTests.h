@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_EXTENDEDTESTS_H_
+#define TESTBENCH_EXTENDEDTESTS_H_
+
+namespace VM
+{
+	bool RunExtendedTests();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include "FusionTests.h"
+#include "VMTestHelpers.h"
+
+#include <iostream>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DM_THREADED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DecodeCache;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::FUSION_COUNT;
+using Blacklight::VM::FusionE;
+using Blacklight::VM::R_A;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+
+	// the cores that run superinstructions
+	const DispatchMode DISPATCH_MODES[] = { DM_DECODED, DM_THREADED, DM_VERIFIED };
+
+	// runs a loop with one pair of each kind in it twice over. Between the two, it writes the LDV at loop over
+	// with the same bytes, which drops that pair's fusion for the second time round
+	const char* const GUEST = R"(
+			ldv a, 0
+			ldv f, 2
+	again:	ldv b, 10
+	loop:	ldv c, 3
+			add a, c
+			ldv d, 1
+			sub b, d
+			push a
+			call inc
+			pop e
+			cmp b, 0
+			br.n loop
+			ldv g, loop + 2
+			st.b [g], c
+			sub f, 1
+			cmp f, 0
+			br.n again
+			trap halt
+	inc:	add a, 1
+			ret
+		)";
+
+	// two CMP+BR, the loop's LDV+ADD and LDV+SUB and one PUSH+CALL
+	const uint64_t FORMED[FUSION_COUNT] = { 2, 2, 1 };
+
+	// both loops' CMP+BR 20 times and again's twice, LDV+ADD 10 times before the write and LDV+SUB 20 times,
+	// and PUSH+CALL 20 times
+	const uint64_t EXECUTED[FUSION_COUNT] = { 20 + 2, 10 + 20, 20 };
+
+	// Returns whether the counts for every kind of superinstruction are the expected ones
+	bool CheckCounts(const uint64_t (&counts)[FUSION_COUNT], const uint64_t (&expected)[FUSION_COUNT], const std::string& what)
+	{
+		bool passed = true;
+		for (uint32_t fusion = 0; fusion < FUSION_COUNT; ++fusion)
+		{
+			if (counts[fusion] != expected[fusion])
+			{
+				std::cout << what << ": " << DecodeCache::GetFusionName(static_cast<FusionE>(fusion)) << " counted " << counts[fusion] <<
+					", expected " << expected[fusion] << '\n';
+				passed = false;
+			}
+		}
+
+		return passed;
+	}
+}
+
+bool VM::RunFusionTests()
+{
+	std::cout << "Beginning Fusion Tests\n";
+
+	bool passed = true;
+
+	std::vector<uint8_t> image = Build(GUEST);
+
+	// the table core is the reference the others are held to
+	CPU expected(BLOCK_SIZE, DM_TABLE);
+	expected.LoadImage(image.data(), image.size());
+	expected.Run();
+	passed &= Check(expected.GetRegister(R_A) == 2 * 10 * (3 + 1), "the guest adds up every time round both loops");
+
+	for (DispatchMode mode : DISPATCH_MODES)
+	{
+		std::string what = " under mode " + std::to_string(mode);
+
+		CPU cpu(BLOCK_SIZE, mode);
+		cpu.LoadImage(image.data(), image.size());
+		passed &= CheckCounts(cpu.GetFusionStats().m_formed, FORMED, "superinstructions formed" + what);
+
+		cpu.Run();
+		passed &= CompareCPUs(expected, cpu, "fused" + what);
+		passed &= CheckCounts(cpu.GetFusionStats().m_executed, EXECUTED, "superinstructions run" + what);
+	}
+
+	std::cout << (passed == true ? "Fusion Tests passed\n" : "Fusion Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_FUSIONTESTS_H_
+#define TESTBENCH_FUSIONTESTS_H_
+
+namespace VM
+{
+	bool RunFusionTests();
+}
+
+#endif
\ No newline at end of file
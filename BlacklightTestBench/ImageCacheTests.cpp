@@ -0,0 +1,194 @@
+#include "ImageCacheTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/ImageCache.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::FUSION_COUNT;
+using Blacklight::VM::ImageCache;
+using Blacklight::VM::Verifier;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+
+	// the cache keeps its files next to the test bench, which takes them away again
+	const char* const CACHE_DIRECTORY = ".";
+
+	const DispatchMode DISPATCH_MODES[] = { DM_DECODED, DM_VERIFIED };
+
+	// a loop with fused pairs in it, a call and a store into its own code
+	const char* const GUEST = R"(
+			ldv a, 0
+			ldv b, 40
+	loop:	add a, b
+			push a
+			call twice
+			pop c
+			sub b, 1
+			cmp b, 0
+			br.n loop
+			ldv g, patch + 2
+			st.b [g], a
+	patch:	ldv.b h, 1
+			trap halt
+	twice:	add d, 2
+			ret
+		)";
+
+	// another image, whose file stands in for the guest's
+	const char* const OTHER = R"(
+			ldv a, 7
+			add a, 3
+			trap halt
+		)";
+
+	// Returns the file an image's decoded form is kept in
+	std::string GetPath(const ImageCache& cache, const std::vector<uint8_t>& image, const DispatchMode mode)
+	{
+		uint32_t origin;
+		memcpy(&origin, image.data() + 4, sizeof(origin));
+
+		return cache.GetPath(image.data() + 8, origin, image.size() - 8, BLOCK_SIZE, mode == DM_VERIFIED);
+	}
+
+	std::vector<char> ReadAll(const std::string& path)
+	{
+		std::ifstream in(path, std::ios_base::binary);
+		return std::vector<char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	}
+
+	void WriteAll(const std::string& path, const std::vector<char>& data)
+	{
+		std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+		out.write(data.data(), static_cast<std::streamsize>(data.size()));
+	}
+
+	// Loads and runs an image through a cache, or without one when pCache is nullptr
+	std::unique_ptr<CPU> Run(const std::vector<uint8_t>& image, const DispatchMode mode, ImageCache* pCache)
+	{
+		std::unique_ptr<CPU> pCPU(new CPU(BLOCK_SIZE, mode));
+		pCPU->SetImageCache(pCache);
+		pCPU->LoadImage(image.data(), image.size());
+		pCPU->Run();
+
+		return pCPU;
+	}
+
+	// Returns whether a CPU that loaded through the cache ran like one that decoded the image itself, with the same
+	// fusions formed and in DM_VERIFIED the same proof
+	bool CompareLoads(CPU& expected, CPU& actual, const std::string& what)
+	{
+		bool passed = VM::CompareCPUs(expected, actual, what);
+
+		passed &= VM::Check(memcmp(expected.GetFusionStats().m_formed, actual.GetFusionStats().m_formed, sizeof(uint64_t) * FUSION_COUNT) == 0,
+			what + " forms the same fusions");
+
+		const Verifier::Stats& expectedStats = expected.GetVerifier().GetStats();
+		const Verifier::Stats& stats = actual.GetVerifier().GetStats();
+		passed &= VM::Check(stats.m_instructions == expectedStats.m_instructions && stats.m_verified == expectedStats.m_verified &&
+			stats.m_regions == expectedStats.m_regions && actual.GetVerifier().GetRegions().size() == expected.GetVerifier().GetRegions().size(),
+			what + " is proven the same");
+
+		return passed;
+	}
+
+	// Returns whether a cache's counts are what they should be
+	bool CheckStats(const ImageCache& cache, const uint64_t hits, const uint64_t misses, const uint64_t stores, const std::string& what)
+	{
+		ImageCache::Stats stats = cache.GetStats();
+
+		bool passed = stats.m_hits == hits && stats.m_misses == misses && stats.m_stores == stores;
+		if (passed == false)
+		{
+			std::cout << what << ": " << stats.m_hits << " hits, " << stats.m_misses << " misses and " << stats.m_stores <<
+				" stores, expected " << hits << ", " << misses << " and " << stores << '\n';
+		}
+
+		return passed;
+	}
+}
+
+bool VM::RunImageCacheTests()
+{
+	std::cout << "Beginning Image Cache Tests\n";
+
+	bool passed = true;
+
+	std::vector<uint8_t> image = Build(GUEST);
+	std::vector<uint8_t> other = Build(OTHER);
+
+	for (DispatchMode mode : DISPATCH_MODES)
+	{
+		std::string what = " under mode " + std::to_string(mode);
+
+		ImageCache cache(CACHE_DIRECTORY);
+		std::string path = GetPath(cache, image, mode);
+		std::string otherPath = GetPath(cache, other, mode);
+		std::remove(path.c_str());
+		std::remove(otherPath.c_str());
+
+		// the image decoded without the cache is what every load through it is held to
+		std::unique_ptr<CPU> pExpected = Run(image, mode, nullptr);
+
+		std::unique_ptr<CPU> pCold = Run(image, mode, &cache);
+		passed &= CompareLoads(*pExpected, *pCold, "a cold load" + what);
+		passed &= CheckStats(cache, 0, 1, 1, "a cold load" + what + " misses and stores");
+
+		std::unique_ptr<CPU> pWarm = Run(image, mode, &cache);
+		passed &= CompareLoads(*pExpected, *pWarm, "a warm load" + what);
+		passed &= CheckStats(cache, 1, 1, 1, "a warm load" + what + " hits");
+
+		Run(other, mode, &cache);
+		std::vector<char> stored = ReadAll(path);
+
+		// a file cut short, one another version wrote and one for other code are each a miss and written over
+		std::vector<char> truncated(stored.begin(), stored.begin() + stored.size() / 2);
+		std::vector<char> stale = stored;
+		++stale[4];
+		std::vector<char> wrong = ReadAll(otherPath);
+
+		uint64_t hits = 1;
+		uint64_t misses = 2;
+		uint64_t stores = 2;
+
+		const std::pair<const char*, const std::vector<char>*> BAD_FILES[] =
+		{
+			{ "a truncated file", &truncated },
+			{ "a file from another version", &stale },
+			{ "another image's file", &wrong }
+		};
+
+		for (const auto& bad : BAD_FILES)
+		{
+			WriteAll(path, *bad.second);
+
+			std::unique_ptr<CPU> pMissed = Run(image, mode, &cache);
+			passed &= CompareLoads(*pExpected, *pMissed, std::string(bad.first) + what);
+			passed &= CheckStats(cache, hits, ++misses, ++stores, std::string(bad.first) + what + " misses and is written over");
+
+			std::unique_ptr<CPU> pRewritten = Run(image, mode, &cache);
+			passed &= CompareLoads(*pExpected, *pRewritten, std::string(bad.first) + " written over" + what);
+			passed &= CheckStats(cache, ++hits, misses, stores, std::string(bad.first) + " written over" + what + " hits");
+			passed &= Check(ReadAll(path) == stored, std::string(bad.first) + " is written over with the same file" + what);
+		}
+
+		std::remove(path.c_str());
+		std::remove(otherPath.c_str());
+	}
+
+	std::cout << (passed == true ? "Image Cache Tests passed\n" : "Image Cache Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_IMAGECACHETESTS_H_
+#define TESTBENCH_IMAGECACHETESTS_H_
+
+namespace VM
+{
+	bool RunImageCacheTests();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,192 @@
+#include "ImageStreamTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/ImageStream.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_JIT;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DM_THREADED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::FUSION_COUNT;
+using Blacklight::VM::ImageStream;
+using Blacklight::VM::MM_FLAT;
+using Blacklight::VM::MM_PAGED;
+using Blacklight::VM::MemoryMode;
+using Blacklight::VM::Verifier;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+
+	// far more than the guest runs, so one that was decoded wrong and never halts fails rather than hangs
+	constexpr uint64_t MAX_INSTRUCTIONS = 0x100000;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT, DM_VERIFIED };
+	const MemoryMode MEMORY_MODES[] = { MM_FLAT, MM_PAGED };
+
+	// how many bytes each record holds, over and over: the first splits the header, and the odd sizes split
+	// instructions and pages
+	const size_t RECORD_SIZES[] = { 5, 11, 1, 300, 7, 0x1000, 64 };
+
+	// a loop with fused pairs in it, a call, a store into its own code and data reaching past the first page
+	const char* const GUEST = R"(
+			ldv a, 0
+			ldv b, 40
+	loop:	add a, b
+			push a
+			call twice
+			pop c
+			sub b, 1
+			cmp b, 0
+			br.n loop
+			st [table + 0x1700], a
+			ld e, [table + 0x1700]
+			ldv g, patch + 2
+			st.b [g], a
+	patch:	ldv.b h, 1
+			trap halt
+	twice:	add d, 2
+			ret
+			.data
+			.align 4
+	table:	.space 0x1800
+		)";
+
+	// Hands an image out in records of RECORD_SIZES, as a socket would, stopping after limit bytes
+	class Records
+	{
+	public:
+		Records(const std::vector<uint8_t>& image, const size_t limit) :
+			m_image(image),
+			m_limit(std::min(limit, image.size())),
+			m_sent(0),
+			m_record(0),
+			m_left(RECORD_SIZES[0]),
+			m_reads(0)
+		{
+		}
+
+		// Copies at most size bytes of the current record to pData, returns how many, 0 once it has stopped
+		size_t Read(uint8_t* pData, const size_t size)
+		{
+			size_t count = std::min(std::min(size, m_left), m_limit - m_sent);
+			memcpy(pData, m_image.data() + m_sent, count);
+
+			m_sent += count;
+			m_left -= count;
+			if (m_left == 0)
+			{
+				m_record = (m_record + 1) % (sizeof(RECORD_SIZES) / sizeof(RECORD_SIZES[0]));
+				m_left = RECORD_SIZES[m_record];
+			}
+
+			m_reads += count != 0;
+			return count;
+		}
+
+		size_t GetReads() const
+		{
+			return m_reads;
+		}
+	private:
+		const std::vector<uint8_t>& m_image;
+		size_t m_limit;
+		size_t m_sent;
+		size_t m_record;
+		size_t m_left;
+		size_t m_reads;
+	};
+
+	// Returns whether a streamed CPU decoded and proved its image as one given all of it at once did
+	bool CompareDecoding(CPU& expected, CPU& actual, const std::string& what)
+	{
+		bool passed = VM::Check(memcmp(expected.GetFusionStats().m_formed, actual.GetFusionStats().m_formed, sizeof(uint64_t) * FUSION_COUNT) == 0,
+			what + " forms the same fusions");
+
+		const Verifier::Stats& expectedStats = expected.GetVerifier().GetStats();
+		const Verifier::Stats& stats = actual.GetVerifier().GetStats();
+		passed &= VM::Check(stats.m_instructions == expectedStats.m_instructions && stats.m_verified == expectedStats.m_verified &&
+			stats.m_regions == expectedStats.m_regions, what + " is proven the same");
+
+		return passed;
+	}
+}
+
+bool VM::RunImageStreamTests()
+{
+	std::cout << "Beginning Image Stream Tests\n";
+
+	bool passed = true;
+
+	std::vector<uint8_t> image = Build(GUEST);
+
+	for (MemoryMode memoryMode : MEMORY_MODES)
+	{
+		for (DispatchMode mode : DISPATCH_MODES)
+		{
+			std::string what = std::string(memoryMode == MM_FLAT ? " in flat memory" : " in paged memory") + " under mode " + std::to_string(mode);
+
+			// the same bytes handed over whole are what the stream is held to
+			CPU expected(BLOCK_SIZE, mode, memoryMode);
+			expected.LoadImage(image.data(), image.size());
+
+			CPU cpu(BLOCK_SIZE, mode, memoryMode);
+			ImageStream stream(&cpu, image.size());
+			Records records(image, image.size());
+			try
+			{
+				stream.Receive([&records](uint8_t* pData, size_t size) { return records.Read(pData, size); });
+			}
+			catch (const std::runtime_error& error)
+			{
+				std::cout << "streaming" << what << ": " << error.what() << '\n';
+				passed = false;
+				continue;
+			}
+
+			passed &= Check(stream.IsComplete() == true && stream.GetReceived() == image.size(), "a stream" + what + " takes every byte");
+			passed &= Check(records.GetReads() > image.size() / 0x1000 + 2, "a stream" + what + " takes the image in several records");
+
+			passed &= CompareCPUs(expected, cpu, "a streamed image" + what + " before it runs");
+			passed &= CompareDecoding(expected, cpu, "a streamed image" + what);
+
+			expected.Run();
+			cpu.Run(MAX_INSTRUCTIONS);
+			passed &= Check(cpu.IsFinished() == true, "a streamed image" + what + " halts") && CompareCPUs(expected, cpu, "a streamed image" + what);
+
+			// a stream that stops part way, in the header or in the code, throws and leaves the image unloaded
+			for (size_t limit : { static_cast<size_t>(3), image.size() / 2, image.size() - 1 })
+			{
+				CPU cut(BLOCK_SIZE, mode, memoryMode);
+				ImageStream cutStream(&cut, image.size());
+				Records cutRecords(image, limit);
+
+				bool threw = false;
+				try
+				{
+					cutStream.Receive([&cutRecords](uint8_t* pData, size_t size) { return cutRecords.Read(pData, size); });
+				}
+				catch (const std::runtime_error&)
+				{
+					threw = true;
+				}
+
+				std::string cutWhat = "a stream cut short after " + std::to_string(limit) + " bytes" + what;
+				passed &= Check(threw == true, cutWhat + " throws");
+				passed &= Check(cutStream.IsComplete() == false && cutStream.GetReceived() == limit, cutWhat + " keeps what arrived");
+			}
+		}
+	}
+
+	std::cout << (passed == true ? "Image Stream Tests passed\n" : "Image Stream Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
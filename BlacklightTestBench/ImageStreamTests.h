@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_IMAGESTREAMTESTS_H_
+#define TESTBENCH_IMAGESTREAMTESTS_H_
+
+namespace VM
+{
+	bool RunImageStreamTests();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,434 @@
+#include "MemoryTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/Assembler.h>
+#include <VM/Linker.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+
+using Blacklight::VM::Assembler;
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_JIT;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::Linker;
+using Blacklight::VM::MM_FLAT;
+using Blacklight::VM::MM_PAGED;
+using Blacklight::VM::MemoryController;
+using Blacklight::VM::MemoryMode;
+using Blacklight::VM::R_A;
+using Blacklight::VM::R_B;
+using Blacklight::VM::R_C;
+using Blacklight::VM::SC_TEXT;
+using Blacklight::VM::SharedImage;
+
+namespace
+{
+	// less than a page, a page, a power of two, one that is not a whole number of pages, and one that is
+	// not a whole number of dwords
+	const size_t BLOCK_SIZES[] = { 0x100, 0x1000, 0x10000, 0x10100, 0x10102 };
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_JIT };
+	const MemoryMode MEMORY_MODES[] = { MM_FLAT, MM_PAGED };
+
+	// snapshots and forks are taken of memory with a few pages between the image and the end, the pages two CPUs
+	// that share memory copy-on-write write in that
+	constexpr size_t SNAPSHOT_BLOCK_SIZE = 0x10000;
+	constexpr uint32_t FORK_PARENT_ADDRESS = 0x4000;
+	constexpr uint32_t FORK_CHILD_ADDRESS = 0x6000;
+
+	// one image whose code starts part way into a page, which is laid out once for every CPU that maps it, and one
+	// whose code starts on a page right after its header, which is mapped from the file as it is
+	const uint32_t SHARED_ORIGINS[] = { 0x1040, 0x2008 };
+	const char* const SHARED_IMAGE_PATH = "MemoryTests.bin";
+
+	// Links source with a stack small enough for the image to fit in the smallest block
+	std::vector<uint8_t> BuildSmall(const std::string& source)
+	{
+		Linker linker;
+		linker.SetStackSize(0x40);
+		linker.Add(Assembler::Assemble(source));
+		return linker.Link();
+	}
+
+	// Runs an image with b holding an address, returns whether it faulted
+	bool Faults(const size_t blockSize, const MemoryMode memoryMode, const DispatchMode mode,
+		const std::vector<uint8_t>& image, const uint32_t address, const std::vector<uint8_t>& input = {})
+	{
+		CPU cpu(blockSize, mode, memoryMode);
+		cpu.LoadImage(image.data(), image.size());
+		cpu.GetRegister(R_A) = 0x12345678;
+		cpu.GetRegister(R_B) = address;
+
+		if (input.empty() == false)
+			cpu.WriteInput(address, input.data(), input.size());
+
+		try
+		{
+			cpu.Run();
+		}
+		catch (const std::runtime_error&)
+		{
+			return true;
+		}
+
+		return false;
+	}
+
+	// Runs an image that stores a into the address in b, returns whether it ran to the end and the dword at wrapped
+	// is what it stored
+	bool Wraps(const size_t blockSize, const MemoryMode memoryMode, const DispatchMode mode,
+		const std::vector<uint8_t>& image, const uint32_t address, const uint32_t wrapped)
+	{
+		CPU cpu(blockSize, mode, memoryMode);
+		cpu.LoadImage(image.data(), image.size());
+		cpu.GetRegister(R_A) = 0x12345678;
+		cpu.GetRegister(R_B) = address;
+
+		try
+		{
+			cpu.Run();
+		}
+		catch (const std::runtime_error&)
+		{
+			return false;
+		}
+
+		return cpu.GetMemoryController().Read32(wrapped) == 0x12345678;
+	}
+
+	std::string Describe(const size_t blockSize, const MemoryMode memoryMode, const DispatchMode mode,
+		const std::string& what, const uint32_t address)
+	{
+		return what + " at " + std::to_string(address) + " in " + std::to_string(blockSize) + " bytes of " +
+			(memoryMode == MM_FLAT ? "flat" : "paged") + " memory under " + (mode == DM_JIT ? "the JIT" : "the table");
+	}
+
+	// Returns whether a CPU and one forked from it each write a page the other only reads, and neither sees the other's
+	// write, as with two forks of the same snapshot
+	bool CheckFork(const MemoryMode memoryMode)
+	{
+		const std::string what = memoryMode == MM_FLAT ? " in flat memory" : " in paged memory";
+		const std::vector<uint8_t> image = BuildSmall("st [b], a\ntrap halt");
+
+		CPU parent(SNAPSHOT_BLOCK_SIZE, DM_TABLE, memoryMode);
+		parent.LoadImage(image.data(), image.size());
+		for (uint32_t address : { FORK_PARENT_ADDRESS, FORK_CHILD_ADDRESS })
+			parent.GetMemoryController().Write32(address, 0x11111111);
+
+		std::unique_ptr<CPU> pChild = parent.Fork();
+		pChild->GetRegister(R_A) = 0x22222222;
+		pChild->GetRegister(R_B) = FORK_CHILD_ADDRESS;
+		pChild->Run();
+
+		parent.GetRegister(R_A) = 0x33333333;
+		parent.GetRegister(R_B) = FORK_PARENT_ADDRESS;
+		parent.Run();
+
+		MemoryController& mc = parent.GetMemoryController();
+		MemoryController& childMc = pChild->GetMemoryController();
+		bool passed = VM::Check(childMc.Read32(FORK_CHILD_ADDRESS) == 0x22222222 && mc.Read32(FORK_CHILD_ADDRESS) == 0x11111111,
+			"a fork's write stays out of its parent" + what);
+		passed &= VM::Check(mc.Read32(FORK_PARENT_ADDRESS) == 0x33333333 && childMc.Read32(FORK_PARENT_ADDRESS) == 0x11111111,
+			"a parent's write stays out of its fork" + what);
+
+		// forks of one snapshot only share what neither writes
+		auto pSnapshot = parent.TakeSnapshot();
+		std::unique_ptr<CPU> pFirst = parent.Fork(pSnapshot);
+		std::unique_ptr<CPU> pSecond = parent.Fork(pSnapshot);
+		pFirst->GetMemoryController().Write32(FORK_CHILD_ADDRESS, 0x44444444);
+		pSecond->GetMemoryController().Write32(FORK_CHILD_ADDRESS, 0x55555555);
+		passed &= VM::Check(pFirst->GetMemoryController().Read32(FORK_CHILD_ADDRESS) == 0x44444444 &&
+			pSecond->GetMemoryController().Read32(FORK_CHILD_ADDRESS) == 0x55555555 && mc.Read32(FORK_CHILD_ADDRESS) == 0x11111111,
+			"forks of one snapshot keep their writes to themselves" + what);
+
+		return passed;
+	}
+
+	// Returns whether restoring the snapshot being tracked after a run puts back the pages the guest wrote, one write
+	// straddling two of them, and leaves every other page as it is
+	bool CheckDirtyRestore(const MemoryMode memoryMode)
+	{
+		const std::string what = memoryMode == MM_FLAT ? " in flat memory" : " in paged memory";
+		const std::vector<uint8_t> image = BuildSmall("st [b], a\nst [c], a\ntrap halt");
+		const uint32_t straddle = 0x7FFE;
+
+		CPU cpu(SNAPSHOT_BLOCK_SIZE, DM_TABLE, memoryMode);
+		cpu.LoadImage(image.data(), image.size());
+
+		std::vector<uint8_t> pattern(MemoryController::PAGE_SIZE * 6);
+		for (size_t i = 0; i < pattern.size(); ++i)
+			pattern[i] = static_cast<uint8_t>(i * 7 + 1);
+		cpu.WriteInput(0x3000, pattern.data(), pattern.size());
+
+		auto pSnapshot = cpu.TakeSnapshot();
+		cpu.GetRegister(R_A) = 0xDEADBEEF;
+		cpu.GetRegister(R_B) = 0x5004;
+		cpu.GetRegister(R_C) = straddle;
+		cpu.Run();
+
+		MemoryController& mc = cpu.GetMemoryController();
+		const uint8_t* pDirty = mc.GetDirtyMap();
+		const size_t pageCount = SNAPSHOT_BLOCK_SIZE / MemoryController::PAGE_SIZE;
+
+		std::vector<size_t> dirtied;
+		for (size_t page = 0; page < pageCount; ++page)
+		{
+			if (pDirty[page] != 0)
+				dirtied.push_back(page);
+		}
+		bool passed = VM::Check(dirtied == std::vector<size_t>{ 5, 7, 8 }, "only the pages the guest wrote are dirty" + what);
+
+		// flat memory written behind the dirty map's back shows which pages a restore copies
+		if (memoryMode == MM_FLAT)
+			mc.GetRawMemory()[0x3000] = 0x99;
+
+		cpu.Restore(pSnapshot);
+
+		bool restored = cpu.GetRegister(R_A) == 0;
+		for (size_t i = MemoryController::PAGE_SIZE; i < pattern.size(); ++i)
+			restored &= mc.Read8(0x3000 + i) == pattern[i];
+		restored &= mc.Read8(0x9000) == 0;
+		passed &= VM::Check(restored == true, "restoring the last snapshot puts back the pages the guest wrote" + what);
+
+		if (memoryMode == MM_FLAT)
+			passed &= VM::Check(mc.Read8(0x3000) == 0x99, "restoring the last snapshot copies only the pages the guest wrote" + what);
+
+		bool clean = true;
+		for (size_t page = 0; page < pageCount; ++page)
+			clean &= pDirty[page] == 0;
+		passed &= VM::Check(clean == true, "restoring the last snapshot leaves no page dirty" + what);
+
+		// and it is still the snapshot being tracked
+		cpu.Run();
+		cpu.Restore(pSnapshot);
+		passed &= VM::Check(mc.Read32(0x5004) == *reinterpret_cast<const uint32_t*>(pattern.data() + 0x2004),
+			"the last snapshot restores again after another run" + what);
+
+		return passed;
+	}
+
+#if __linux__
+	// Returns the line of /proc/self/maps for the mapping an address is in, or an empty string if it is in none
+	std::string GetMapping(const void* pAddress)
+	{
+		std::ifstream in("/proc/self/maps");
+		unsigned long long address = reinterpret_cast<uintptr_t>(pAddress);
+
+		for (std::string line; std::getline(in, line);)
+		{
+			unsigned long long start = 0;
+			unsigned long long end = 0;
+			if (sscanf(line.c_str(), "%llx-%llx", &start, &end) == 2 && address >= start && address < end)
+				return line;
+		}
+
+		return std::string();
+	}
+#endif
+
+	// Returns whether two CPUs that map the same image each see its code as it is in the file, share its pages
+	// copy-on-write where memory is flat, and keep a guest's write to them to themselves
+	bool CheckSharedImage(const MemoryMode memoryMode, const uint32_t origin)
+	{
+		const std::string what = std::string(memoryMode == MM_FLAT ? " in flat memory" : " in paged memory") + " at origin " + std::to_string(origin);
+
+		Linker linker;
+		linker.SetStackSize(0x40);
+		linker.SetOrigin(origin);
+		linker.Add(Assembler::Assemble("ld a, [value]\nadd a, b\nst [value], a\ntrap halt\n.align 4\nvalue: .dword 0x55"));
+		const std::vector<uint8_t> image = linker.Link();
+		const uint32_t value = origin + static_cast<uint32_t>(image.size() - 8 - 4);
+
+		{
+			std::ofstream out(SHARED_IMAGE_PATH, std::ios_base::binary | std::ios_base::trunc);
+			out.write(reinterpret_cast<const char*>(image.data()), static_cast<std::streamsize>(image.size()));
+		}
+
+		bool passed = true;
+		try
+		{
+			SharedImage shared(SHARED_IMAGE_PATH);
+
+			CPU first(SNAPSHOT_BLOCK_SIZE, DM_TABLE, memoryMode);
+			first.LoadImage(shared);
+			CPU second(SNAPSHOT_BLOCK_SIZE, DM_TABLE, memoryMode);
+			second.LoadImage(shared);
+
+#if __linux__
+			// both map the same file privately, rather than each holding a copy
+			if (memoryMode == MM_FLAT)
+			{
+				std::string mapping = GetMapping(first.GetMemoryController().GetRawMemory() + shared.GetMapAddress());
+				std::string otherMapping = GetMapping(second.GetMemoryController().GetRawMemory() + shared.GetMapAddress());
+
+				char permissions[5] = {};
+				unsigned long long inode = 0;
+				sscanf(mapping.c_str(), "%*s %4s %*s %*s %llu", permissions, &inode);
+
+				passed &= VM::Check(inode != 0 && std::string(permissions) == "rw-p" &&
+					mapping.substr(mapping.find(' ')) == otherMapping.substr(otherMapping.find(' ')),
+					"two CPUs map an image's code from the same file" + what);
+			}
+#endif
+
+			first.GetRegister(R_B) = 0x1111;
+			first.Run();
+			passed &= VM::Check(first.GetRegister(R_A) == 0x55 + 0x1111 && first.GetMemoryController().Read32(value) == 0x55 + 0x1111,
+				"a guest writes into a mapped image" + what);
+			passed &= VM::Check(second.GetMemoryController().Read32(value) == 0x55, "a guest's write stays out of another CPU's image" + what);
+
+			second.GetRegister(R_B) = 0x2222;
+			second.Run();
+			passed &= VM::Check(second.GetRegister(R_A) == 0x55 + 0x2222 && first.GetMemoryController().Read32(value) == 0x55 + 0x1111,
+				"a second guest runs the image as it is in the file" + what);
+
+			// and neither reached the image itself
+			CPU third(SNAPSHOT_BLOCK_SIZE, DM_TABLE, memoryMode);
+			third.LoadImage(shared);
+			passed &= VM::Check(third.GetMemoryController().Read32(value) == 0x55, "a guest's write stays out of the image it mapped" + what);
+		}
+		catch (const std::runtime_error& error)
+		{
+			std::cout << "mapping an image" << what << ": " << error.what() << '\n';
+			passed = false;
+		}
+
+		std::ifstream in(SHARED_IMAGE_PATH, std::ios_base::binary);
+		std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		passed &= VM::Check(file == image, "an image file is left as it was" + what);
+
+		in.close();
+		std::remove(SHARED_IMAGE_PATH);
+
+		return passed;
+	}
+}
+
+bool VM::RunMemoryTests()
+{
+	std::cout << "Beginning Memory Tests\n";
+
+	bool passed = true;
+
+	const std::vector<uint8_t> halt = Assembler::Assemble("trap halt").m_sections[SC_TEXT][0].m_bytes;
+	const std::vector<uint8_t> jump = BuildSmall("jmp b");
+	const std::vector<uint8_t> store = BuildSmall("st [b], a\ntrap halt");
+
+	for (size_t blockSize : BLOCK_SIZES)
+	{
+		// the power of two addresses are masked into
+		uint32_t reach = 0x1000;
+		while (reach < blockSize)
+			reach <<= 1;
+
+		for (MemoryMode memoryMode : MEMORY_MODES)
+		{
+			for (DispatchMode mode : DISPATCH_MODES)
+			{
+				for (const char* suffix : { "b", "w", "d" })
+				{
+					const uint32_t size = suffix[0] == 'b' ? 1 : (suffix[0] == 'w' ? 2 : 4);
+
+					for (const std::string& instruction : { std::string("ld.") + suffix + " c, [b]", std::string("st.") + suffix + " [b], a" })
+					{
+						std::vector<uint8_t> image = BuildSmall(instruction + "\ntrap halt");
+
+						// the last access that fits, every one that reaches past the end, and the top of the masked range
+						uint32_t last = static_cast<uint32_t>(blockSize) - size;
+						passed &= Check(Faults(blockSize, memoryMode, mode, image, last) == false,
+							Describe(blockSize, memoryMode, mode, instruction, last) + " does not fault");
+
+						for (uint32_t address : { last + 1, static_cast<uint32_t>(blockSize), reach - size })
+						{
+							// addresses from the top of the masked range on wrap around
+							if (address <= last ||
+								address >= reach)
+								continue;
+
+							passed &= Check(Faults(blockSize, memoryMode, mode, image, address) == true,
+								Describe(blockSize, memoryMode, mode, instruction, address) + " faults");
+						}
+					}
+				}
+
+				// an instruction that ends at the end of memory runs, and one that runs past it faults, however
+				// much is fetched along with it
+				uint32_t end = static_cast<uint32_t>(blockSize) - static_cast<uint32_t>(halt.size());
+				passed &= Check(Faults(blockSize, memoryMode, mode, jump, end, halt) == false,
+					Describe(blockSize, memoryMode, mode, "trap halt", end) + " runs");
+				passed &= Check(Faults(blockSize, memoryMode, mode, jump, end + 1, { halt[0] }) == true,
+					Describe(blockSize, memoryMode, mode, "half a trap halt", end + 1) + " faults");
+				if (blockSize < reach)
+					passed &= Check(Faults(blockSize, memoryMode, mode, jump, static_cast<uint32_t>(blockSize)) == true,
+						Describe(blockSize, memoryMode, mode, "code", static_cast<uint32_t>(blockSize)) + " faults");
+
+				// masking rather than checking leaves only [blockSize, reach) to fault. A dword at reach or past it is
+				// not an error, and lands where its high bits being dropped puts it
+				const uint32_t lastDword = static_cast<uint32_t>(blockSize - 4) & ~3u;
+				for (uint32_t address : { static_cast<uint32_t>(blockSize + 3) & ~3u, reach - 4 })
+				{
+					if (address < blockSize ||
+						address >= reach)
+						continue;
+
+					passed &= Check(Faults(blockSize, memoryMode, mode, store, address) == true,
+						Describe(blockSize, memoryMode, mode, "st [b], a below the top of the masked range", address) + " faults");
+				}
+
+				for (uint32_t address : { reach + lastDword, 0u - reach + lastDword })
+				{
+					passed &= Check(Wraps(blockSize, memoryMode, mode, store, address, lastDword) == true,
+						Describe(blockSize, memoryMode, mode, "st [b], a from the top of the masked range on", address) + " wraps around");
+				}
+			}
+
+			// the last dword is atomic however memory sits on the host
+			CPU cpu(blockSize, DM_TABLE, memoryMode);
+			std::vector<uint8_t> image = BuildSmall("fetchadd b, a, c\nldv d, 7\nldv e, 3\ncas b, d, e\ntrap halt");
+			cpu.LoadImage(image.data(), image.size());
+			cpu.GetRegister(R_A) = 3;
+			cpu.GetRegister(R_B) = static_cast<uint32_t>(blockSize - 4) & ~3u;
+			cpu.Run();
+			passed &= Check(cpu.GetMemoryController().Read32(cpu.GetRegister(R_B)) == 7,
+				"atomics on the last dword of " + std::to_string(blockSize) + " bytes");
+		}
+
+		// a snapshot of flat memory that does not start on a host page comes back whole
+		CPU cpu(blockSize, DM_TABLE, MM_FLAT);
+		std::vector<uint8_t> image = BuildSmall("st.b [b], a\ntrap halt");
+		cpu.LoadImage(image.data(), image.size());
+		cpu.GetRegister(R_A) = 0x5A;
+		cpu.GetRegister(R_B) = static_cast<uint32_t>(blockSize - 1);
+
+		// restoring a snapshot other than the last one taken maps it back whole
+		auto pBefore = cpu.TakeSnapshot();
+		cpu.Run();
+		auto pAfter = cpu.TakeSnapshot();
+
+		cpu.Restore(pBefore);
+		passed &= Check(cpu.GetMemoryController().Read8(blockSize - 1) == 0,
+			"a snapshot of " + std::to_string(blockSize) + " bytes from before the write restores");
+		cpu.Restore(pAfter);
+		passed &= Check(cpu.GetMemoryController().Read8(blockSize - 1) == 0x5A,
+			"a snapshot of " + std::to_string(blockSize) + " bytes from after the write restores");
+	}
+
+	for (MemoryMode memoryMode : MEMORY_MODES)
+	{
+		passed &= CheckFork(memoryMode);
+		passed &= CheckDirtyRestore(memoryMode);
+
+		for (uint32_t origin : SHARED_ORIGINS)
+			passed &= CheckSharedImage(memoryMode, origin);
+	}
+
+	std::cout << (passed == true ? "Memory Tests passed\n" : "Memory Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
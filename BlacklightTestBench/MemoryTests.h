@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_MEMORYTESTS_H_
+#define TESTBENCH_MEMORYTESTS_H_
+
+namespace VM
+{
+	bool RunMemoryTests();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,300 @@
+#include "OptimizerTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/Optimizer.h>
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::MemoryController;
+using Blacklight::VM::Optimizer;
+using Blacklight::VM::R_A;
+using Blacklight::VM::R_B;
+using Blacklight::VM::R_COUNT;
+using Blacklight::VM::R_PRG;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED };
+
+	struct Program
+	{
+		const char* m_name;
+		const char* m_source;
+	};
+
+	// Each leaves everything it worked out in registers or after its code, where an optimized run has
+	// to match it. The barriers only come out right when CX and TRAP are taken to read and write every register
+	const Program PROGRAMS[] =
+	{
+		{ "passes", R"(
+				ldv a, 0
+				ldv b, 10
+				ldv c, 0
+		loop:	ldv d, 1
+				add a, d
+				ldv d, 1
+				push a
+				pop e
+				cmp a, 3
+				sub b, 1
+				cmp b, 0
+				br.n hop
+				jmp done
+		hop:	jmp loop
+		done:	ldv f, 5
+				ldv g, 6
+				add f, g
+				cmp f, 11
+				br.e yes
+				ldv h, 99
+		yes:	st [out], a
+				trap halt
+				.data
+		out:	.dword 0
+			)" },
+		{ "dead flags", R"(
+				ldv a, 4
+				cmp a, 4
+				ldv b, 1
+				cmp b, 9
+				ldv c, 0
+				not c
+				and c, 0xF0
+				trap halt
+			)" },
+		// the host function reads b, which is written over straight after, and returns into a
+		{ "cx barrier", R"(
+				ldv a, 2
+				ldv b, 7
+				cx 0
+				ldv b, 1
+				st [out], a
+				cmp a, 2
+				br.e wrong
+				ldv c, 1
+		wrong:	trap halt
+				.data
+		out:	.dword 0
+			)" },
+		// puts reads a, which is written over straight after, and leaves the length of the string in it
+		{ "trap barrier", R"(
+				ldv a, word
+				st [out], a
+				ldv a, blank
+				trap puts
+				ldv b, a
+				cmp a, blank
+				br.e wrong
+				ldv c, 1
+		wrong:	ldv a, 3
+				trap halt
+				.data
+		out:	.dword 0
+		word:	.asciz "not printed"
+		blank:	.byte 0
+			)" },
+		// the extended page names its registers, memcpy reads all three
+		{ "extended trap", R"(
+				ldv a, to
+				ldv b, from
+				ldv c, 4
+				memcpy a, b, c
+				ldv a, 0
+				ldv b, 0
+				ldv c, 0
+				trap halt
+				.data
+		from:	.dword 0x12345678
+		to:		.dword 0
+			)" }
+	};
+
+	struct Refusal
+	{
+		const char* m_source;
+		const char* m_reason;
+	};
+
+	const Refusal REFUSALS[] =
+	{
+		{ "ldv a, x\njmp a\nx: trap halt", "Code jumps or calls through a register" },
+		{ "ldv a, x\ncall a\ntrap halt\nx: ret", "Code jumps or calls through a register" },
+		{ "ldv a, prg\ntrap halt", "R_PRG is used as an operand" },
+		{ "add prg, 2\ntrap halt", "R_PRG is used as an operand" },
+		{ "start: ld a, [start]\ntrap halt", "Code loads or stores inside of itself" },
+		{ "ldv a, 1\nst [x], a\nx: trap halt", "Code loads or stores inside of itself" },
+		// the jump lands on the RET in the immediate
+		{ "br.e x + 2\nx: ldv.d a, 0xD0D0D0D0\ntrap halt", "Instructions overlap" }
+	};
+
+	// Returns whether two CPUs that ran an image and its optimized copy agree on every register but R_PRG,
+	// which is wherever the code ended up, and on the memory after the code. The stack below it
+	// is not kept, see Optimizer
+	bool CompareResults(CPU& expected, CPU& actual, const size_t from, const std::string& what)
+	{
+		bool same = true;
+
+		for (uint32_t i = 0; i < R_COUNT; ++i)
+		{
+			if (i != R_PRG &&
+				expected.GetRegister(i) != actual.GetRegister(i))
+			{
+				std::cout << what << ": register " << i << " is " << actual.GetRegister(i) <<
+					", expected " << expected.GetRegister(i) << '\n';
+				same = false;
+			}
+		}
+
+		const MemoryController& expectedMemory = expected.GetMemoryController();
+		const MemoryController& actualMemory = actual.GetMemoryController();
+
+		for (size_t address = from; address < expectedMemory.GetBlockSize(); ++address)
+		{
+			if (expectedMemory.Read8(address) != actualMemory.Read8(address))
+			{
+				std::cout << what << ": memory differs first at " << address << '\n';
+				same = false;
+				break;
+			}
+		}
+
+		return same;
+	}
+
+	std::unique_ptr<CPU> Run(const std::vector<uint8_t>& image, const DispatchMode mode)
+	{
+		std::unique_ptr<CPU> pCPU(new CPU(BLOCK_SIZE, mode));
+		pCPU->AddFunction([](CPU& cpu, uint32_t a) { return a + cpu.GetRegister(R_B) * 3; });
+		pCPU->LoadImage(image.data(), image.size());
+		pCPU->Run();
+
+		return pCPU;
+	}
+
+	// Returns whether the optimizer refuses an image for the reason given, leaving it as it was
+	bool CheckRefusal(const std::vector<uint8_t>& image, const std::string& reason, const std::string& what)
+	{
+		Optimizer optimizer;
+		std::vector<uint8_t> optimized = optimizer.Optimize(image.data(), image.size());
+		const Optimizer::Stats& stats = optimizer.GetStats();
+
+		bool passed = VM::Check(stats.m_optimized == false, what + " is refused");
+		passed &= VM::Check(optimized == image, what + " is left as it was");
+
+		if (stats.m_reason != reason)
+		{
+			std::cout << what << ": refused with \"" << stats.m_reason << "\", expected \"" << reason << "\"\n";
+			passed = false;
+		}
+
+		return passed;
+	}
+}
+
+bool VM::RunOptimizerTests()
+{
+	std::cout << "Beginning Optimizer Tests\n";
+
+	bool passed = true;
+
+	for (const Program& program : PROGRAMS)
+	{
+		std::vector<uint8_t> image = Build(program.m_source);
+
+		Optimizer optimizer;
+		std::vector<uint8_t> optimized = optimizer.Optimize(image.data(), image.size());
+		const Optimizer::Stats& stats = optimizer.GetStats();
+
+		if (stats.m_optimized == false)
+		{
+			std::cout << program.m_name << ": refused with \"" << stats.m_reason << "\"\n";
+			passed = false;
+			continue;
+		}
+
+		passed &= Check(optimized.size() == image.size(), std::string(program.m_name) + " keeps its size");
+		passed &= Check(stats.m_sizeAfter <= stats.m_sizeBefore, std::string(program.m_name) + " does not grow");
+
+		uint32_t origin;
+		memcpy(&origin, image.data() + 4, sizeof(origin));
+
+		for (DispatchMode mode : DISPATCH_MODES)
+		{
+			std::unique_ptr<CPU> pExpected = Run(image, mode);
+			std::unique_ptr<CPU> pActual = Run(optimized, mode);
+
+			std::string what = std::string(program.m_name) + " under mode " + std::to_string(mode);
+			passed &= Check(pExpected->GetInstructionCount() >= pActual->GetInstructionCount(),
+				what + " runs no more instructions");
+			passed &= CompareResults(*pExpected, *pActual, origin + stats.m_sizeBefore, what);
+		}
+	}
+
+	// every pass has something to do in the first one
+	{
+		std::vector<uint8_t> image = Build(PROGRAMS[0].m_source);
+
+		Optimizer optimizer;
+		optimizer.Optimize(image.data(), image.size());
+		const Optimizer::Stats& stats = optimizer.GetStats();
+
+		passed &= Check(stats.m_instructionsAfter < stats.m_instructionsBefore, "instructions are removed");
+		passed &= Check(stats.m_unreachable != 0, "unreachable code is dropped");
+		passed &= Check(stats.m_threaded != 0, "jumps are threaded");
+		passed &= Check(stats.m_folded != 0, "constants are folded");
+		passed &= Check(stats.m_stack != 0, "pushes into pops are moved");
+		passed &= Check(stats.m_dead != 0, "dead writes are removed");
+	}
+
+	// the values the barriers left where they could be seen
+	{
+		std::unique_ptr<CPU> pCPU = Run(Build(PROGRAMS[2].m_source), DM_TABLE);
+		passed &= Check(pCPU->GetRegister(R_A) == 2 + 7 * 3, "the host function sees b");
+
+		pCPU = Run(Build(PROGRAMS[3].m_source), DM_TABLE);
+		passed &= Check(pCPU->GetRegister(R_B) == 0, "puts sees the blank string");
+	}
+
+	for (const Refusal& refusal : REFUSALS)
+		passed &= CheckRefusal(Build(refusal.m_source), refusal.m_reason, refusal.m_source);
+
+	// images cut short inside an instruction, and jumping past their end
+	{
+		std::vector<uint8_t> image = Build("ldv a, 1\nldv.d b, 2");
+		image.resize(image.size() - 1);
+		passed &= CheckRefusal(image, "An instruction runs off the end of the image", "a cut short image");
+
+		image = Build("jmp x\nx: trap halt");
+		image.resize(image.size() - 2);
+		passed &= CheckRefusal(image, "Code reaches outside of the image", "a jump past the end");
+	}
+
+	{
+		const uint8_t header[7] = {};
+
+		bool threw = false;
+		try
+		{
+			Optimizer().Optimize(header, sizeof(header));
+		}
+		catch (const std::runtime_error&)
+		{
+			threw = true;
+		}
+
+		passed &= Check(threw, "an image shorter than its header throws");
+	}
+
+	std::cout << (passed == true ? "Optimizer Tests passed\n" : "Optimizer Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_OPTIMIZERTESTS_H_
+#define TESTBENCH_OPTIMIZERTESTS_H_
+
+namespace VM
+{
+	bool RunOptimizerTests();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,237 @@
+#include "ProfilerTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/Profiler.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_JIT;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DM_THREADED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::OP_BR;
+using Blacklight::VM::OP_CALL;
+using Blacklight::VM::OP_COUNT;
+using Blacklight::VM::OP_RET;
+using Blacklight::VM::OpcodeE;
+using Blacklight::VM::Profiler;
+using Blacklight::VM::R_C;
+using Blacklight::VM::R_D;
+using Blacklight::VM::R_PRG;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+	constexpr uint32_t SLICE_SEEDS = 4;
+
+	const char* const FOLDED_PATH = "ProfilerTests.folded";
+	const char* const PROFILE_PATH = "ProfilerTests.blvp";
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT, DM_VERIFIED };
+
+	// calls inc 10 times from a loop whose BR is taken 9 times and falls through once, then calls twice, which calls
+	// inc twice more. c and d hold where inc and twice are
+	const char* const CALLS = R"(
+			ldv a, 0
+			ldv b, 10
+			ldv c, inc
+			ldv d, twice
+	loop:	call inc
+			sub b, 1
+			cmp b, 0
+			br.n loop
+			call twice
+			trap halt
+	inc:	add a, 1
+			ret
+	twice:	call inc
+			call inc
+			ret
+		)";
+
+	// instructions the guest runs in each function, sampled under the function it is in. A CALL counts under its
+	// caller and a RET under the function it returns from
+	constexpr uint64_t OUTER_INSTRUCTIONS = 4 + 4 * 10 + 2;
+	constexpr uint64_t INC_INSTRUCTIONS = 2;
+	constexpr uint64_t TWICE_INSTRUCTIONS = 3;
+
+	// Returns a value of T read from in in host byte order, as Profiler::Save writes it
+	template<typename T>
+	T Get(std::istream& in)
+	{
+		T value = 0;
+		in.read(reinterpret_cast<char*>(&value), sizeof(value));
+
+		return value;
+	}
+
+	// Returns whether a profile saved to path holds everything profiler recorded
+	bool CheckSaved(const Profiler& profiler, const uint32_t sampleInterval, const char* path)
+	{
+		std::ifstream in(path, std::ios_base::binary);
+
+		char magic[4] = {};
+		in.read(magic, sizeof(magic));
+		bool passed = VM::Check(memcmp(magic, "BLVP", sizeof(magic)) == 0 && Get<uint32_t>(in) == 1, "a saved profile starts with its magic and version");
+		passed &= VM::Check(Get<uint32_t>(in) == sampleInterval, "a saved profile keeps its sample interval");
+
+		std::map<uint8_t, uint64_t> encodings;
+		for (uint32_t count = Get<uint32_t>(in); count > 0 && in.good() == true; --count)
+		{
+			uint8_t opcode = Get<uint8_t>(in);
+			encodings[opcode] = Get<uint64_t>(in);
+		}
+
+		bool same = true;
+		for (uint32_t opcode = 0; opcode < 0x100; ++opcode)
+		{
+			auto it = encodings.find(static_cast<uint8_t>(opcode));
+			same &= (it != encodings.end() ? it->second : 0) == profiler.GetEncodingCount(static_cast<uint8_t>(opcode));
+		}
+		passed &= VM::Check(same == true, "a saved profile keeps every encoding's count");
+
+		uint64_t taken = Get<uint64_t>(in);
+		uint64_t notTaken = Get<uint64_t>(in);
+		passed &= VM::Check(taken == profiler.GetBranchesTaken() && notTaken == profiler.GetBranchesNotTaken(), "a saved profile keeps its branches");
+
+		std::map<uint32_t, uint64_t> samples;
+		for (uint32_t count = Get<uint32_t>(in); count > 0 && in.good() == true; --count)
+		{
+			uint32_t address = Get<uint32_t>(in);
+			samples[address] = Get<uint64_t>(in);
+		}
+		passed &= VM::Check(samples == profiler.GetSamples(), "a saved profile keeps its samples");
+
+		std::map<std::pair<uint32_t, uint32_t>, uint64_t> callGraph;
+		for (uint32_t count = Get<uint32_t>(in); count > 0 && in.good() == true; --count)
+		{
+			uint32_t caller = Get<uint32_t>(in);
+			uint32_t callee = Get<uint32_t>(in);
+			callGraph[std::make_pair(caller, callee)] = Get<uint64_t>(in);
+		}
+		passed &= VM::Check(callGraph == profiler.GetCallGraph(), "a saved profile keeps its call graph");
+
+		uint64_t stacked = 0;
+		for (uint32_t count = Get<uint32_t>(in); count > 0 && in.good() == true; --count)
+		{
+			for (uint32_t depth = Get<uint32_t>(in); depth > 0; --depth)
+				Get<uint32_t>(in);
+			stacked += Get<uint64_t>(in);
+		}
+
+		uint64_t sampled = 0;
+		for (const auto& sample : profiler.GetSamples())
+			sampled += sample.second;
+
+		passed &= VM::Check(stacked == sampled, "a saved profile keeps a stack for every sample");
+		passed &= VM::Check(in.good() == true && in.peek() == std::char_traits<char>::eof(), "a saved profile ends after its stacks");
+
+		return passed;
+	}
+}
+
+bool VM::RunProfilerTests()
+{
+	std::cout << "Beginning Profiler Tests\n";
+
+	bool passed = true;
+
+	std::vector<uint8_t> image = Build(CALLS);
+
+	// the same run without a profiler is what the profiled runs are held to
+	CPU expected(BLOCK_SIZE, DM_TABLE);
+	expected.LoadImage(image.data(), image.size());
+	uint32_t outer = expected.GetRegister(R_PRG);
+	expected.Run();
+
+	uint32_t inc = expected.GetRegister(R_C);
+	uint32_t twice = expected.GetRegister(R_D);
+
+	// every instruction is sampled
+	Profiler reference(1);
+
+	for (DispatchMode mode : DISPATCH_MODES)
+	{
+		std::string what = " under mode " + std::to_string(mode);
+
+		Profiler profiler(1);
+		CPU cpu(BLOCK_SIZE, mode);
+		cpu.LoadImage(image.data(), image.size());
+		cpu.SetProfiler(&profiler);
+		cpu.Run();
+		passed &= CompareCPUs(expected, cpu, "profiled" + what);
+
+		uint64_t counted = 0;
+		for (uint8_t op = 0; op < OP_COUNT; ++op)
+			counted += profiler.GetOpcodeCount(static_cast<OpcodeE>(op));
+
+		passed &= Check(counted == cpu.GetInstructionCount(), "opcode counts" + what + " add up to the instructions run");
+		passed &= Check(profiler.GetOpcodeCount(OP_CALL) == 13 && profiler.GetOpcodeCount(OP_RET) == 13, "every CALL and RET" + what + " is counted");
+		passed &= Check(profiler.GetOpcodeCount(OP_BR) == 10, "every BR" + what + " is counted");
+		passed &= Check(profiler.GetBranchesTaken() == 9 && profiler.GetBranchesNotTaken() == 1, "the loop's BR" + what + " is taken all but once");
+
+		std::map<std::pair<uint32_t, uint32_t>, uint64_t> callGraph;
+		callGraph[std::make_pair(outer, inc)] = 10;
+		callGraph[std::make_pair(outer, twice)] = 1;
+		callGraph[std::make_pair(twice, inc)] = 2;
+		passed &= Check(profiler.GetCallGraph() == callGraph, "the call graph" + what + " has every CALL edge");
+
+		if (mode == DM_TABLE)
+			reference = profiler;
+
+		// slices pick up the shadow stack where the last one left it
+		for (uint32_t seed = 0; seed < SLICE_SEEDS; ++seed)
+		{
+			Profiler sliced(1);
+			CPU slicedCPU(BLOCK_SIZE, mode);
+			slicedCPU.LoadImage(image.data(), image.size());
+			slicedCPU.SetProfiler(&sliced);
+
+			std::string slicedWhat = what + " sliced with seed " + std::to_string(seed);
+			passed &= RunSliced(slicedCPU, seed) && CompareCPUs(expected, slicedCPU, "profiled" + slicedWhat);
+			passed &= Check(sliced.GetSamples() == profiler.GetSamples() && sliced.GetCallGraph() == profiler.GetCallGraph(), "the profile" + slicedWhat + " matches a whole run");
+		}
+	}
+
+	// every stack the guest was sampled in, outermost first, each with how many instructions ran in it
+	char expectedFolded[0x100];
+	snprintf(expectedFolded, sizeof(expectedFolded),
+		"0x%08X %llu\n0x%08X;0x%08X %llu\n0x%08X;0x%08X %llu\n0x%08X;0x%08X;0x%08X %llu\n",
+		outer, static_cast<unsigned long long>(OUTER_INSTRUCTIONS),
+		outer, inc, static_cast<unsigned long long>(10 * INC_INSTRUCTIONS),
+		outer, twice, static_cast<unsigned long long>(TWICE_INSTRUCTIONS),
+		outer, twice, inc, static_cast<unsigned long long>(2 * INC_INSTRUCTIONS));
+
+	try
+	{
+		reference.SaveFoldedStacks(FOLDED_PATH);
+
+		std::ifstream in(FOLDED_PATH);
+		std::string folded((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		passed &= Check(folded == expectedFolded, "folded stacks list every stack the guest was sampled in");
+
+		reference.Save(PROFILE_PATH);
+		passed &= CheckSaved(reference, 1, PROFILE_PATH);
+	}
+	catch (const std::runtime_error& error)
+	{
+		std::cout << "saving a profile: " << error.what() << '\n';
+		passed = false;
+	}
+
+	std::remove(FOLDED_PATH);
+	std::remove(PROFILE_PATH);
+
+	std::cout << (passed == true ? "Profiler Tests passed\n" : "Profiler Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
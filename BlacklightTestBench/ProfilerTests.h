@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_PROFILERTESTS_H_
+#define TESTBENCH_PROFILERTESTS_H_
+
+namespace VM
+{
+	bool RunProfilerTests();
+}
+
+#endif
\ No newline at end of file
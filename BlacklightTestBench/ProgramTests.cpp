@@ -0,0 +1,168 @@
+#include "ProgramTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/InstructionGeneration/Program.h>
+
+#include <array>
+#include <iostream>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_JIT;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DM_THREADED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::F_N;
+using Blacklight::VM::R_A;
+using Blacklight::VM::R_C;
+using Blacklight::VM::R_D;
+using Blacklight::VM::R_E;
+using Blacklight::VM::TC_HALT;
+using Blacklight::VM::InstructionGeneration::Label;
+using Blacklight::VM::InstructionGeneration::Program;
+using Blacklight::VM::InstructionGeneration::SZ_BYTE;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT, DM_VERIFIED };
+
+	// counts c down from 10, then jumps forward over nothing to halt
+	constexpr auto COUNTDOWN = []
+	{
+		Program<32> program;
+		Label loop = program.NewLabel();
+		Label done = program.NewLabel();
+
+		program.Ldv(R_C, 10);
+		program.Bind(loop);
+		program.Sub(R_C, 1);
+		program.Cmp(R_C, 0);
+		program.Br(F_N, loop);
+		program.Jmp(done);
+		program.Bind(done);
+		program.Trap(TC_HALT);
+		return program;
+	}();
+	constexpr auto COUNTDOWN_IMAGE = COUNTDOWN.GetImage<COUNTDOWN.GetSize()>();
+
+	// the stack size and origin, then byte immediates, a BR back 11 bytes and a forward JMP that is a dword
+	constexpr uint8_t COUNTDOWN_BYTES[] =
+	{
+		0x00, 0x10, 0x00, 0x00, 0x40, 0x10, 0x00, 0x00,
+		0x1C, 0x20, 0x0A,
+		0x6C, 0x20, 0x01,
+		0x9C, 0x20, 0x00,
+		0xA9, 0xF5, 0xFF, 0xFF, 0xFF,
+		0xB9, 0x00, 0x00, 0x00, 0x00,
+		0xF0, TC_HALT
+	};
+
+	template<size_t N>
+	constexpr bool SameBytes(const std::array<uint8_t, N>& image, const uint8_t (&bytes)[N])
+	{
+		for (size_t i = 0; i < N; ++i)
+		{
+			if (image[i] != bytes[i])
+				return false;
+		}
+
+		return true;
+	}
+
+	static_assert(COUNTDOWN.GetSize() == sizeof(COUNTDOWN_BYTES), "a built program is as long as its instructions");
+	static_assert(SameBytes(COUNTDOWN_IMAGE, COUNTDOWN_BYTES), "a built program encodes as expected");
+	// done is the second label handed out
+	static_assert(COUNTDOWN.GetAddress(Label{ 1 }) == 0x1040 + 19, "labels are placed after the origin");
+
+	// calls, the stack and loads and stores of a label, with CALL and JMP to labels further on sized to what the
+	// assembler picks for them
+	constexpr auto CALLS = []
+	{
+		Program<128> program;
+		Label loop = program.NewLabel();
+		Label twice = program.NewLabel();
+		Label value = program.NewLabel();
+		Label done = program.NewLabel();
+
+		program.Ldv(R_C, 10);
+		program.Ldv(R_A, 0);
+		program.Bind(loop);
+		program.Call(twice, SZ_BYTE);
+		program.Sub(R_C, 1);
+		program.Cmp(R_C, 0);
+		program.Br(F_N, loop);
+		program.St(value, R_A);
+		program.Ld(R_D, value);
+		program.Push(R_D);
+		program.Pop(R_E);
+		program.Jmp(done, SZ_BYTE);
+		program.Bind(twice);
+		program.Add(R_A, 0x1234);
+		program.Ret();
+		program.Bind(done);
+		program.Trap(TC_HALT);
+		program.Align(4);
+		program.Bind(value);
+		program.Dword(0);
+		return program;
+	}();
+	constexpr auto CALLS_IMAGE = CALLS.GetImage<CALLS.GetSize()>();
+
+	const char* const CALLS_SOURCE = R"(
+			ldv c, 10
+			ldv a, 0
+	loop:	call twice
+			sub c, 1
+			cmp c, 0
+			br.n loop
+			st [value], a
+			ld d, [value]
+			push d
+			pop e
+			jmp done
+	twice:	add a, 0x1234
+			ret
+	done:	trap halt
+			.align 4
+	value:	.dword 0
+		)";
+}
+
+bool VM::RunProgramTests()
+{
+	std::cout << "Beginning Program Tests\n";
+
+	bool passed = true;
+
+	std::vector<uint8_t> assembled = Build(CALLS_SOURCE);
+	std::vector<uint8_t> built(CALLS_IMAGE.begin(), CALLS_IMAGE.end());
+	passed &= Check(built == assembled, "a built program encodes like the assembled one");
+
+	for (DispatchMode mode : DISPATCH_MODES)
+	{
+		std::string what = " under mode " + std::to_string(mode);
+
+		CPU expected(BLOCK_SIZE, mode);
+		expected.LoadImage(assembled.data(), assembled.size());
+		expected.Run();
+
+		CPU cpu(BLOCK_SIZE, mode);
+		cpu.LoadImage(CALLS_IMAGE.data(), CALLS_IMAGE.size());
+		cpu.Run();
+		passed &= CompareCPUs(expected, cpu, "a built program" + what);
+		passed &= Check(cpu.GetRegister(R_A) == 10 * 0x1234 && cpu.GetRegister(R_E) == 10 * 0x1234, "a built program" + what + " stores and loads its sum");
+
+		CPU countdown(BLOCK_SIZE, mode);
+		countdown.LoadImage(COUNTDOWN_IMAGE.data(), COUNTDOWN_IMAGE.size());
+		countdown.Run();
+		passed &= Check(countdown.IsFinished() == true && countdown.GetRegister(R_C) == 0 && countdown.GetInstructionCount() == 1 + 3 * 10 + 2,
+			"a built countdown" + what + " runs to the end");
+	}
+
+	std::cout << (passed == true ? "Program Tests passed\n" : "Program Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_PROGRAMTESTS_H_
+#define TESTBENCH_PROGRAMTESTS_H_
+
+namespace VM
+{
+	bool RunProgramTests();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,314 @@
+#include "SocketTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/EventLoop.h>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#if __linux__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_JIT;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DM_THREADED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::EventLoop;
+using Blacklight::VM::R_A;
+using Blacklight::VM::R_B;
+using Blacklight::VM::R_F;
+using Blacklight::VM::R_G;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT, DM_VERIFIED };
+
+	// selects on every handle there could be, with sets that are all the handles there are, or none at all,
+	// and a timeout of zero so that it does not wait
+	const char* const SELECT_ALL = R"(
+			ldv.d a, -1
+			ldv b, 0
+			ldv c, 0
+			ldv d, 0
+			ldv e, timeout
+			trap select
+			ldv f, a
+			ldv.d a, -1
+			ldv b, sets
+			ldv c, sets + 4
+			ldv d, sets + 8
+			trap select
+			trap halt
+			.data
+	timeout:	.dword 0, 0
+	sets:		.dword 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF
+		)";
+
+#if __linux__
+	// where the host writes what a guest binds to or how long it selects for, and where an echo server receives
+	constexpr uint32_t INPUT_ADDRESS = 0x8000;
+	constexpr uint32_t BUFFER_ADDRESS = 0x9000;
+
+	// few enough instructions at a time that the guest which only counts takes many turns
+	constexpr uint64_t QUANTUM = 0x100;
+
+	// how long a select with nothing to wait on waits, and how long the client keeps a server waiting for its
+	// message, in milliseconds
+	constexpr uint32_t SELECT_TIMEOUT = 30;
+	constexpr uint32_t CLIENT_DELAY = 50;
+
+	// how long the client keeps trying to reach a server that is not listening yet
+	constexpr auto CONNECT_TIMEOUT = std::chrono::seconds(5);
+
+	// accepts one client on the address the host wrote, sends back what it gets once and halts, with how much that
+	// was in g
+	const char* const ECHO = R"(
+			ldv a, 2
+			ldv b, 1
+			ldv c, 0
+			trap socket
+			ldv e, a
+			ldv b, 0x8000
+			ldv c, 16
+			trap bind
+			ldv a, e
+			ldv b, 1
+			trap listen
+			ldv a, e
+			ldv b, 0
+			ldv c, 0
+			trap accept
+			ldv f, a
+			ldv b, 0x9000
+			ldv c, 0x100
+			ldv d, 0
+			trap recv
+			ldv g, a
+			ldv c, a
+			ldv a, f
+			ldv b, 0x9000
+			ldv d, 0
+			trap send
+			ldv a, f
+			trap close
+			ldv a, e
+			trap close
+			trap halt
+		)";
+
+	// waits on no socket for as long as the host wrote
+	const char* const SLEEP = R"(
+			ldv a, 0
+			ldv b, 0
+			ldv c, 0
+			ldv d, 0
+			ldv e, 0x8000
+			trap select
+			trap halt
+		)";
+
+	// never waits on anything
+	const char* const COUNT = R"(
+			ldv a, 20000
+	loop:	sub a, 1
+			cmp a, 0
+			br.n loop
+			trap halt
+		)";
+
+	// Returns a port on 127.0.0.1 nothing is listening on
+	uint16_t GetFreePort()
+	{
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t length = sizeof(address);
+
+		bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+		getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length);
+		close(fd);
+
+		return ntohs(address.sin_port);
+	}
+
+	// Connects to every port, then for the last one first sends a message a while after connecting and reads it back.
+	// Returns whether every server sent back what it got
+	bool RunClient(const std::vector<sockaddr_in>& addresses)
+	{
+		std::vector<int> sockets;
+		bool passed = true;
+
+		for (const sockaddr_in& address : addresses)
+		{
+			// the server may not be listening yet
+			auto deadline = std::chrono::steady_clock::now() + CONNECT_TIMEOUT;
+			for (;;)
+			{
+				int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+				if (fd != -1 &&
+					connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0)
+				{
+					sockets.push_back(fd);
+					break;
+				}
+
+				if (fd != -1)
+					close(fd);
+
+				if (std::chrono::steady_clock::now() > deadline)
+				{
+					passed = false;
+					break;
+				}
+
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		// every server has long been parked on its recv by the time its message comes
+		for (size_t i = sockets.size(); i-- > 0 && passed == true;)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(CLIENT_DELAY));
+
+			char message[32];
+			int size = snprintf(message, sizeof(message), "message for server %u", static_cast<uint32_t>(i));
+			passed &= send(sockets[i], message, static_cast<size_t>(size), MSG_NOSIGNAL) == size;
+
+			char reply[sizeof(message)] = {};
+			int received = 0;
+			while (received < size && passed == true)
+			{
+				ssize_t count = recv(sockets[i], reply + received, static_cast<size_t>(size - received), 0);
+				passed &= count > 0;
+				received += static_cast<int>(count);
+			}
+
+			passed &= memcmp(reply, message, static_cast<size_t>(size)) == 0;
+		}
+
+		for (int fd : sockets)
+			close(fd);
+
+		return passed;
+	}
+
+	// Returns whether an event loop runs echo servers, one that sleeps in select and one that only counts side by side,
+	// waking each of the first when what it waits on is ready and the sleeper when its timeout runs out
+	bool CheckEventLoop(const DispatchMode mode)
+	{
+		const std::string what = " under mode " + std::to_string(mode);
+		const std::vector<uint8_t> echo = VM::Build(ECHO);
+		const std::vector<uint8_t> sleep = VM::Build(SLEEP);
+		const std::vector<uint8_t> count = VM::Build(COUNT);
+
+		std::vector<sockaddr_in> addresses(2);
+		std::vector<std::unique_ptr<CPU>> cpus;
+		EventLoop loop(QUANTUM);
+
+		for (sockaddr_in& address : addresses)
+		{
+			address.sin_family = AF_INET;
+			address.sin_port = htons(GetFreePort());
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+			cpus.emplace_back(new CPU(BLOCK_SIZE, mode));
+			cpus.back()->LoadImage(echo.data(), echo.size());
+			cpus.back()->WriteInput(INPUT_ADDRESS, reinterpret_cast<const uint8_t*>(&address), sizeof(address));
+		}
+
+		const uint32_t timeout[] = { 0, SELECT_TIMEOUT * 1000 };
+		cpus.emplace_back(new CPU(BLOCK_SIZE, mode));
+		cpus.back()->LoadImage(sleep.data(), sleep.size());
+		cpus.back()->WriteInput(INPUT_ADDRESS, reinterpret_cast<const uint8_t*>(timeout), sizeof(timeout));
+
+		cpus.emplace_back(new CPU(BLOCK_SIZE, mode));
+		cpus.back()->LoadImage(count.data(), count.size());
+
+		for (const std::unique_ptr<CPU>& pCPU : cpus)
+			loop.Add(pCPU.get());
+
+		bool echoed = false;
+		auto begin = std::chrono::steady_clock::now();
+		std::thread client([&] { echoed = RunClient(addresses); });
+
+		loop.Run();
+		client.join();
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+
+		bool passed = VM::Check(echoed == true, "every echo server" + what + " sends back what it gets");
+
+		for (size_t i = 0; i < cpus.size(); ++i)
+		{
+			EventLoop::InstanceStats stats = loop.GetInstanceStats(i);
+			passed &= VM::Check(stats.m_finished == true && stats.m_faulted == false && cpus[i]->IsFinished() == true,
+				"guest " + std::to_string(i) + what + " runs to the end in the event loop");
+			passed &= VM::Check(stats.m_instructions == cpus[i]->GetInstructionCount(),
+				"the event loop" + what + " counts every instruction guest " + std::to_string(i) + " ran");
+		}
+
+		// a guest only parks when it would block, and is only woken when it can go on, once for its accept at most
+		// and once for its recv
+		for (size_t i = 0; i < addresses.size(); ++i)
+		{
+			uint64_t suspensions = loop.GetInstanceStats(i).m_suspensions;
+			passed &= VM::Check(suspensions >= 1 && suspensions <= 2 && cpus[i]->GetRegister(R_G) == strlen("message for server 0"),
+				"echo server " + std::to_string(i) + what + " parks until its message comes");
+		}
+
+		EventLoop::InstanceStats sleeper = loop.GetInstanceStats(2);
+		passed &= VM::Check(sleeper.m_suspensions >= 1 && sleeper.m_suspensions <= 2 && cpus[2]->GetRegister(R_A) == 0 && elapsed >= SELECT_TIMEOUT,
+			"a select with nothing to wait on" + what + " parks until it times out");
+
+		EventLoop::InstanceStats counter = loop.GetInstanceStats(3);
+		passed &= VM::Check(counter.m_suspensions == 0 && counter.m_instructions > 2 * QUANTUM && cpus[3]->GetRegister(R_A) == 0,
+			"a guest that never waits" + what + " takes turns without parking");
+
+		return passed;
+	}
+#endif
+}
+
+bool VM::RunSocketTests()
+{
+	std::cout << "Beginning Socket Tests\n";
+
+	bool passed = true;
+
+	std::vector<uint8_t> image = Build(SELECT_ALL);
+
+	for (DispatchMode mode : DISPATCH_MODES)
+	{
+		CPU cpu(BLOCK_SIZE, mode);
+		cpu.LoadImage(image.data(), image.size());
+		cpu.Run();
+
+		// without a socket open nothing is ready, and the handles in the sets that are not open are left alone
+		passed &= Check(cpu.GetRegister(R_F) == 0 && cpu.GetRegister(R_A) == 0,
+			"select on " + std::to_string(UINT32_MAX) + " handles under mode " + std::to_string(mode));
+		passed &= Check(cpu.GetMemoryController().Read32(cpu.GetRegister(R_B)) == 0xFFFFFFFF,
+			"select leaves handles that are not open alone under mode " + std::to_string(mode));
+	}
+
+#if __linux__
+	for (DispatchMode mode : DISPATCH_MODES)
+		passed &= CheckEventLoop(mode);
+#endif
+
+	std::cout << (passed == true ? "Socket Tests passed\n" : "Socket Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_SOCKETTESTS_H_
+#define TESTBENCH_SOCKETTESTS_H_
+
+namespace VM
+{
+	bool RunSocketTests();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,242 @@
+#include "ThreadTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/Scheduler.h>
+#include <VM/ThreadGroup.h>
+
+#include <iostream>
+#include <memory>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_JIT;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DM_THREADED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::R_E;
+using Blacklight::VM::R_F;
+using Blacklight::VM::R_H;
+using Blacklight::VM::R_I;
+using Blacklight::VM::Scheduler;
+using Blacklight::VM::ThreadGroup;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+
+	// more workers than the build machine has cores, and a quantum shorter than a thread's work, so threads are
+	// taken off of cores in the middle of it
+	constexpr size_t WORKER_COUNT = 2;
+	constexpr uint64_t QUANTUM = 0x1000;
+
+	// the threads each program spawns besides the first
+	constexpr uint32_t COUNTER_THREADS = 4;
+	constexpr uint32_t SPINLOCK_THREADS = 4;
+
+	// what the first thread of COUNTER runs with every TC_JOIN counted once, however many times it had to wait
+	constexpr uint64_t COUNTER_JOINER_INSTRUCTIONS = 3 + 4 * 10 + 3 + 4 * 7 + 2;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT, DM_VERIFIED };
+
+	// four threads add 1 to [0x8000] 20000 times each with FETCHADD and halt with three times their argument, which
+	// the first sums up in e as it joins them
+	const char* const COUNTER = R"(
+			ldv d, 0x9000
+			ldv g, 4
+			ldv h, 0xC000
+	spawn:	ldv a, worker
+			ldv b, h
+			ldv c, g
+			trap spawn
+			st [d], a
+			add d, 4
+			add h, 0x400
+			sub g, 1
+			cmp g, 0
+			br.n spawn
+			ldv d, 0x9000
+			ldv g, 4
+			ldv e, 0
+	join:	ld a, [d]
+			trap join
+			add e, a
+			add d, 4
+			sub g, 1
+			cmp g, 0
+			br.n join
+			ld f, [0x8000]
+			trap halt
+	worker:	ldv e, a
+			ldv b, 0x8000
+			ldv c, 1
+			ldv d, 20000
+	loop:	fetchadd b, c, f
+			sub d, 1
+			cmp d, 0
+			br.n loop
+			ldv a, e
+			add a, e
+			add a, e
+			trap halt
+		)";
+
+	// four threads take a CAS spinlock at [0x8004] 2000 times each to add 1 to [0x8008] with plain loads and stores
+	const char* const SPINLOCK = R"(
+			ldv d, 0x9000
+			ldv g, 4
+			ldv h, 0xC000
+	spawn:	ldv a, worker
+			ldv b, h
+			trap spawn
+			st [d], a
+			add d, 4
+			add h, 0x400
+			sub g, 1
+			cmp g, 0
+			br.n spawn
+			ldv d, 0x9000
+			ldv g, 4
+	join:	ld a, [d]
+			trap join
+			add d, 4
+			sub g, 1
+			cmp g, 0
+			br.n join
+			ld f, [0x8008]
+			ld e, [0x8004]
+			trap halt
+	worker:	ldv b, 0x8004
+			ldv e, 1
+			ldv d, 2000
+	loop:	ldv c, 0
+			cas b, e, c
+			br.n loop
+			ld f, [0x8008]
+			add f, 1
+			st [0x8008], f
+			fence
+			ldv c, 0
+			st [b], c
+			sub d, 1
+			cmp d, 0
+			br.n loop
+			trap halt
+		)";
+
+	// the second thread writes an immediate of the first's before it raises a flag at [0x8010] and another after,
+	// which the first runs once it has seen the flag and once it has joined it
+	const char* const PATCH = R"(
+			ldv a, patcher
+			ldv b, 0xC000
+			trap spawn
+			ldv g, a
+	wait:	ld f, [0x8010]
+			fence
+			cmp f, 0
+			br.e wait
+	first:	ldv.b h, 1
+			ldv a, g
+			trap join
+	second:	ldv.b i, 1
+			trap halt
+	patcher:
+			ldv b, first + 2
+			ldv c, 0x5A
+			st.b [b], c
+			ldv b, 0x8010
+			ldv c, 1
+			fetchadd b, c, d
+			ldv b, second + 2
+			ldv c, 0x3C
+			st.b [b], c
+			trap halt
+		)";
+
+	// A guest run to the end, the first thread and the scheduler outliving the group
+	struct Guest
+	{
+		std::unique_ptr<CPU> m_pMain;
+		Scheduler m_scheduler;
+		ThreadGroup m_group;
+
+		Guest(const std::vector<uint8_t>& image, const DispatchMode mode) :
+			m_pMain(new CPU(BLOCK_SIZE, mode)),
+			m_scheduler(WORKER_COUNT, QUANTUM),
+			m_group(m_scheduler)
+		{
+			m_pMain->LoadImage(image.data(), image.size());
+			m_group.Start(m_pMain.get());
+			m_group.Wait();
+		}
+	};
+
+	// Returns whether every thread of a guest ran as many instructions as the same thread of another
+	bool CompareCounts(const Guest& expected, const Guest& actual, const uint32_t first, const std::string& what)
+	{
+		bool passed = VM::Check(actual.m_group.GetThreadCount() == expected.m_group.GetThreadCount(), what + " spawns every thread");
+
+		for (uint32_t id = first; id < expected.m_group.GetThreadCount() && passed == true; ++id)
+		{
+			uint64_t count = actual.m_group.GetThread(id)->GetInstructionCount();
+			uint64_t expectedCount = expected.m_group.GetThread(id)->GetInstructionCount();
+
+			if (count != expectedCount)
+			{
+				std::cout << what << ": thread " << id << " ran " << count << " instructions, expected " << expectedCount << '\n';
+				passed = false;
+			}
+		}
+
+		return passed;
+	}
+}
+
+bool VM::RunThreadTests()
+{
+	std::cout << "Beginning Thread Tests\n";
+
+	bool passed = true;
+
+	std::vector<uint8_t> counter = Build(COUNTER);
+	std::vector<uint8_t> spinlock = Build(SPINLOCK);
+	std::vector<uint8_t> patch = Build(PATCH);
+
+	// the table core is the reference the others are held to
+	Guest expected(counter, DM_TABLE);
+	Guest expectedPatch(patch, DM_TABLE);
+
+	for (DispatchMode mode : DISPATCH_MODES)
+	{
+		std::string what = " under mode " + std::to_string(mode);
+
+		Guest guest(counter, mode);
+		passed &= Check(guest.m_group.GetStats().m_faulted == 0, "counter" + what + " runs without faults");
+		passed &= Check(guest.m_pMain->GetRegister(R_F) == COUNTER_THREADS * 20000, "counter" + what + " adds up every FETCHADD");
+		passed &= Check(guest.m_pMain->GetRegister(R_E) == 3 * (4 + 3 + 2 + 1), "counter" + what + " joins with what each thread halted with");
+
+		// nothing races for control flow, so every thread runs the same instructions however they are scheduled
+		passed &= CompareCounts(expected, guest, 0, "counter" + what);
+		passed &= Check(guest.m_pMain->GetInstructionCount() == COUNTER_JOINER_INSTRUCTIONS, "counter" + what + " counts a TC_JOIN once");
+
+		// the first thread only runs again when a thread it joins finishes, rather than every quantum
+		passed &= Check(guest.m_scheduler.GetInstanceStats(0).m_slices <= COUNTER_THREADS + 1, "counter" + what + " parks the thread that joins");
+
+		Guest locked(spinlock, mode);
+		passed &= Check(locked.m_group.GetStats().m_faulted == 0, "spinlock" + what + " runs without faults");
+		passed &= Check(locked.m_pMain->GetRegister(R_F) == SPINLOCK_THREADS * 2000, "spinlock" + what + " loses no increments");
+		passed &= Check(locked.m_pMain->GetRegister(R_E) == 0, "spinlock" + what + " leaves the lock free");
+
+		Guest patched(patch, mode);
+		passed &= Check(patched.m_group.GetStats().m_faulted == 0, "patch" + what + " runs without faults");
+		passed &= Check(patched.m_pMain->GetRegister(R_H) == 0x5A, "patch" + what + " runs code written before a flag it saw");
+		passed &= Check(patched.m_pMain->GetRegister(R_I) == 0x3C, "patch" + what + " runs code written by a thread it joined");
+
+		// the first thread waits on the flag for however long it takes
+		passed &= CompareCounts(expectedPatch, patched, 1, "patch" + what);
+	}
+
+	std::cout << (passed == true ? "Thread Tests passed\n" : "Thread Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_THREADTESTS_H_
+#define TESTBENCH_THREADTESTS_H_
+
+namespace VM
+{
+	bool RunThreadTests();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include "TraceTests.h"
+#include "VMTestHelpers.h"
+
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_JIT;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DM_THREADED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DispatchMode;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+	constexpr uint32_t SLICE_SEEDS = 4;
+
+	// where the host writes how many times the guest calls it, and what it adds to each result
+	constexpr uint32_t INPUT_ADDRESS = 0x8000;
+	constexpr uint32_t INPUT[] = { 6, 0x1234 };
+
+	const char* const TRACE_PATH = "TraceTests.blvt";
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT, DM_VERIFIED };
+
+	// calls the host as many times as the host wrote it should, storing what comes back after adding what else the
+	// host wrote, then fills memory on the extended page and halts with the sum of the results
+	const char* const GUEST = R"(
+			ld g, [0x8000]
+			ld h, [0x8004]
+			ldv e, 0
+			ldv d, 0x9000
+	loop:	ldv a, g
+			cx 0
+			add a, h
+			add e, a
+			st [d], a
+			add d, 4
+			sub g, 1
+			cmp g, 0
+			br.n loop
+			ldv a, 0xA000
+			ldv b, 0x5A
+			ldv c, 0x20
+			memset a, b, c
+			ldv a, e
+			trap halt
+		)";
+
+	// Runs the guest to the end while recording it, with a host function that returns something else every call
+	std::unique_ptr<CPU> Record(const std::vector<uint8_t>& image, const DispatchMode mode, uint32_t& calls)
+	{
+		std::unique_ptr<CPU> pCPU(new CPU(BLOCK_SIZE, mode));
+		pCPU->AddFunction([&calls](uint32_t a) { return a * 0x10001 + ++calls * 0x777; });
+
+		pCPU->StartRecording(TRACE_PATH);
+		pCPU->LoadImage(image.data(), image.size());
+		pCPU->WriteInput(INPUT_ADDRESS, reinterpret_cast<const uint8_t*>(INPUT), sizeof(INPUT));
+		pCPU->Run();
+		pCPU->StopRecording();
+
+		return pCPU;
+	}
+
+	// Returns a CPU ready to replay the trace, whose host function returns nothing like it did while recording
+	std::unique_ptr<CPU> Replay(const DispatchMode mode, uint32_t& calls)
+	{
+		std::unique_ptr<CPU> pCPU(new CPU(BLOCK_SIZE, mode));
+		pCPU->AddFunction([&calls](uint32_t) { return ++calls; });
+		pCPU->StartReplay(TRACE_PATH);
+
+		return pCPU;
+	}
+}
+
+bool VM::RunTraceTests()
+{
+	std::cout << "Beginning Trace Tests\n";
+
+	bool passed = true;
+
+	std::vector<uint8_t> image = Build(GUEST);
+
+	// the table core is the reference the others are held to
+	uint32_t calls = 0;
+	std::unique_ptr<CPU> pExpected = Record(image, DM_TABLE, calls);
+	passed &= Check(calls == INPUT[0], "the guest calls the host as many times as it was told to");
+
+	for (DispatchMode mode : DISPATCH_MODES)
+	{
+		std::string what = " under mode " + std::to_string(mode);
+
+		try
+		{
+			calls = 0;
+			std::unique_ptr<CPU> pRecorded = Record(image, mode, calls);
+			passed &= CompareCPUs(*pExpected, *pRecorded, "recording" + what);
+
+			// the trace stands in for the host, which is never called
+			calls = 0;
+			std::unique_ptr<CPU> pReplayed = Replay(mode, calls);
+			pReplayed->Run();
+			passed &= CompareCPUs(*pExpected, *pReplayed, "replay" + what);
+			passed &= Check(calls == 0, "replay" + what + " leaves the host alone");
+
+			for (uint32_t seed = 0; seed < SLICE_SEEDS; ++seed)
+			{
+				pReplayed = Replay(mode, calls);
+				passed &= RunSliced(*pReplayed, seed) && CompareCPUs(*pExpected, *pReplayed, "replay" + what + " sliced with seed " + std::to_string(seed));
+			}
+		}
+		catch (const std::runtime_error& error)
+		{
+			std::cout << "trace" << what << ": " << error.what() << '\n';
+			passed = false;
+		}
+
+		// a guest that calls the host once more than it did while recording goes past the trace
+		bool strayed = false;
+		try
+		{
+			std::unique_ptr<CPU> pDiverged = Replay(mode, calls);
+			pDiverged->GetMemoryController().Write32(INPUT_ADDRESS, INPUT[0] + 1);
+			pDiverged->Run();
+		}
+		catch (const std::runtime_error&)
+		{
+			strayed = true;
+		}
+
+		passed &= Check(strayed == true, "replay" + what + " throws when the guest strays from the trace");
+	}
+
+	std::remove(TRACE_PATH);
+
+	std::cout << (passed == true ? "Trace Tests passed\n" : "Trace Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_TRACETESTS_H_
+#define TESTBENCH_TRACETESTS_H_
+
+namespace VM
+{
+	bool RunTraceTests();
+}
+
+#endif
\ No newline at end of file
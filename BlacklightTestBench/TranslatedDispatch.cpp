@@ -0,0 +1,169 @@
+// Translated ahead of time from a BlacklightVM image by the Translator, do not edit
+#include <VM/CPU.h>
+#include <VM/Native.h>
+
+#include <cstring>
+
+namespace
+{
+	void Run(Blacklight::VM::NativeContext& context)
+	{
+		using namespace Blacklight::VM;
+
+		MemoryController& mc = *context.m_pMemory;
+		uint64_t budget = context.m_budget;
+
+		uint32_t r[R_COUNT];
+		memcpy(r, context.m_pRegisters, sizeof(r));
+
+		uint32_t prg = r[R_PRG];
+
+	L_DISPATCH:
+		switch (prg)
+		{
+		case 0x1040u: goto L_1040;
+		case 0x104Cu: goto L_104C;
+		case 0x1050u: goto L_1050;
+		case 0x1052u: goto L_1052;
+		case 0x105Du: goto L_105D;
+		case 0x1068u: goto L_1068;
+		case 0x106Au: goto L_106A;
+		case 0x108Eu: goto L_108E;
+		case 0x1092u: goto L_1092;
+		default: goto L_EXIT;
+		}
+
+	L_1040:
+		if (budget < 3)
+		{
+			prg = 0x1040u;
+			goto L_EXIT;
+		}
+		budget -= 3;
+		r[0] = 0x0u;
+		r[1] = 0x32u;
+		r[4] = 0x108Eu;
+	L_104C:
+		if (budget < 2)
+		{
+			prg = 0x104Cu;
+			goto L_EXIT;
+		}
+		budget -= 2;
+		r[0] += r[1];
+		r[R_SF] -= 4; mc.Write32(r[R_SF], 0x1050u); prg = r[4];
+		if (mc.HasCodeWrite() == true)
+		{
+			goto L_EXIT;
+		}
+		goto L_DISPATCH;
+	L_1050:
+		if (budget < 1)
+		{
+			prg = 0x1050u;
+			goto L_EXIT;
+		}
+		budget -= 1;
+		r[R_SF] -= 4; mc.Write32(r[R_SF], 0x1052u); prg = 0x1092u;
+		if (mc.HasCodeWrite() == true)
+		{
+			goto L_EXIT;
+		}
+		goto L_1092;
+	L_1052:
+		if (budget < 3)
+		{
+			prg = 0x1052u;
+			goto L_EXIT;
+		}
+		budget -= 3;
+		r[1] -= 0x1u;
+		{ r[R_CND] &= ~(F_P | F_E | F_N); uint32_t d = r[1]; uint32_t s = 0x0u; r[R_CND] |= s > d ? F_P : (s == d ? F_E : F_N); }
+		if (r[R_CND] & 1) goto L_104C;
+	L_105D:
+		if (budget < 3)
+		{
+			prg = 0x105Du;
+			goto L_EXIT;
+		}
+		budget -= 3;
+		r[5] = 0x106Au;
+		{ r[R_CND] &= ~(F_P | F_E | F_N); uint32_t d = r[0]; uint32_t s = 0x0u; r[R_CND] |= s > d ? F_P : (s == d ? F_E : F_N); }
+		if (r[R_CND] & 4) { prg = r[5]; goto L_DISPATCH; }
+	L_1068:
+		if (budget < 1)
+		{
+			prg = 0x1068u;
+			goto L_EXIT;
+		}
+		budget -= 1;
+		prg = r[5]; goto L_DISPATCH;
+	L_106A:
+		if (budget < 11)
+		{
+			prg = 0x106Au;
+			goto L_EXIT;
+		}
+		budget -= 11;
+		mc.Write32(0x8000u, r[0]);
+		if (mc.HasCodeWrite() == true)
+		{
+			budget += 10;
+			prg = 0x1070u;
+			goto L_EXIT;
+		}
+		r[6] = 0x107Au;
+		mc.Write8(r[6], static_cast<uint8_t>(r[0]));
+		if (mc.HasCodeWrite() == true)
+		{
+			budget += 8;
+			prg = 0x1078u;
+			goto L_EXIT;
+		}
+		r[7] = 0x1u;
+		r[7] += r[2];
+		r[15] = 0x12u;
+		{ r[R_CND] &= ~(F_P | F_E | F_N); uint32_t d = r[15]; uint32_t s = 0x10u; r[R_CND] |= s > d ? F_P : (s == d ? F_E : F_N); }
+		r[9] = r[15];
+		r[10] = 0x10u;
+		{ r[R_CND] &= ~(F_P | F_E | F_N); uint32_t d = r[10]; uint32_t s = r[15]; r[R_CND] |= s > d ? F_P : (s == d ? F_E : F_N); }
+		r[11] = r[15];
+		{ prg = 0x108Cu; goto L_EXIT; }
+	L_108E:
+		if (budget < 2)
+		{
+			prg = 0x108Eu;
+			goto L_EXIT;
+		}
+		budget -= 2;
+		r[2] += 0x2u;
+		prg = mc.Read32(r[R_SF]); r[R_SF] += 4; goto L_DISPATCH;
+	L_1092:
+		if (budget < 4)
+		{
+			prg = 0x1092u;
+			goto L_EXIT;
+		}
+		budget -= 4;
+		r[3] += 0x3u;
+		r[R_SF] -= 4; mc.Write32(r[R_SF], r[3]);
+		if (mc.HasCodeWrite() == true)
+		{
+			budget += 2;
+			prg = 0x1097u;
+			goto L_EXIT;
+		}
+		r[8] = mc.Read32(r[R_SF]); r[R_SF] += 4;
+		prg = mc.Read32(r[R_SF]); r[R_SF] += 4; goto L_DISPATCH;
+	L_EXIT:
+		r[R_PRG] = prg;
+		memcpy(context.m_pRegisters, r, sizeof(r));
+		context.m_budget = budget;
+		(void)mc;
+	}
+}
+
+extern const Blacklight::VM::NativeImage TranslatedDispatch =
+{
+	0x1040u, 0x5Au, 0x77FCEF9B150959E1ull, Run
+};
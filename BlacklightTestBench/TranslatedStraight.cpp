@@ -0,0 +1,100 @@
+// Translated ahead of time from a BlacklightVM image by the Translator, do not edit
+#include <VM/CPU.h>
+#include <VM/Native.h>
+
+#include <cstring>
+
+namespace
+{
+	void Run(Blacklight::VM::NativeContext& context)
+	{
+		using namespace Blacklight::VM;
+
+		MemoryController& mc = *context.m_pMemory;
+		uint64_t budget = context.m_budget;
+
+		uint32_t r[R_COUNT];
+		memcpy(r, context.m_pRegisters, sizeof(r));
+
+		uint32_t prg = r[R_PRG];
+
+		switch (prg)
+		{
+		case 0x1040u: goto L_1040;
+		case 0x104Cu: goto L_104C;
+		case 0x106Eu: goto L_106E;
+		case 0x1070u: goto L_1070;
+		case 0x1073u: goto L_1073;
+		default: goto L_EXIT;
+		}
+
+	L_1040:
+		if (budget < 3)
+		{
+			prg = 0x1040u;
+			goto L_EXIT;
+		}
+		budget -= 3;
+		r[0] = 0x0u;
+		r[1] = 0x64u;
+		r[2] = 0x8000u;
+	L_104C:
+		if (budget < 10)
+		{
+			prg = 0x104Cu;
+			goto L_EXIT;
+		}
+		budget -= 10;
+		r[0] += r[1];
+		mc.Write16(r[2], static_cast<uint16_t>(r[0]));
+		if (mc.HasCodeWrite() == true)
+		{
+			budget += 8;
+			prg = 0x1050u;
+			goto L_EXIT;
+		}
+		r[2] += 0x2u;
+		r[3] = mc.Read8(0x8001u);
+		r[4] += r[3];
+		r[5] = ~r[5];
+		r[5] &= 0xFF00FFu;
+		r[1] -= 0x1u;
+		{ r[R_CND] &= ~(F_P | F_E | F_N); uint32_t d = r[1]; uint32_t s = 0x0u; r[R_CND] |= s > d ? F_P : (s == d ? F_E : F_N); }
+		if (r[R_CND] & 1) goto L_104C;
+	L_106E:
+		if (budget < 1)
+		{
+			prg = 0x106Eu;
+			goto L_EXIT;
+		}
+		budget -= 1;
+		goto L_1073;
+	L_1070:
+		if (budget < 1)
+		{
+			prg = 0x1070u;
+			goto L_EXIT;
+		}
+		budget -= 1;
+		r[6] = 0x1u;
+	L_1073:
+		if (budget < 1)
+		{
+			prg = 0x1073u;
+			goto L_EXIT;
+		}
+		budget -= 1;
+		r[7] = static_cast<uint16_t>(r[0]);
+		{ prg = 0x1075u; goto L_EXIT; }
+	L_EXIT:
+		r[R_PRG] = prg;
+		memcpy(context.m_pRegisters, r, sizeof(r));
+		context.m_budget = budget;
+		(void)mc;
+	}
+}
+
+extern const Blacklight::VM::NativeImage TranslatedStraight =
+{
+	0x1040u, 0x35u, 0x48498A0BF6EB797Bull, Run
+};
@@ -0,0 +1,155 @@
+#include "TranslatorTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/Native.h>
+#include <VM/Translator.h>
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::NativeImage;
+using Blacklight::VM::Translator;
+
+// the Translator's output for the sources below, compiled in. They are written again with Translator::Translate
+// when a source changes, which the hash each keeps of its code catches
+extern const NativeImage TranslatedDispatch;
+extern const NativeImage TranslatedStraight;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+	constexpr uint32_t SLICE_SEEDS = 8;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED };
+
+	struct TranslatorTest
+	{
+		const char* m_name;
+		const char* m_source;
+		const NativeImage* m_pImage;
+		bool m_dispatches;		// whether it goes through a register or RET, and so needs the switch over the blocks again
+	};
+
+	const TranslatorTest TRANSLATOR_TESTS[] =
+	{
+		// calls and branches through registers, a store that detaches the translated code, CMPs on cnd and a TRAP left
+		// to the CPU
+		{ "dispatch", R"(
+				ldv a, 0
+				ldv b, 50
+				ldv e, twice
+		loop:	add a, b
+				call e
+				call triple
+				sub b, 1
+				cmp b, 0
+				br.n loop
+				ldv f, done
+				cmp a, 0
+				br.p f
+				jmp f
+		done:	st [0x8000], a
+				ldv g, patch + 2
+				st.b [g], a
+		patch:	ldv.b h, 1
+				add h, c
+				ldv cnd, 0x12
+				cmp cnd, 0x10
+				ldv j, cnd
+				ldv k, 0x10
+				cmp k, cnd
+				ldv l, cnd
+				trap halt
+		twice:	add c, 2
+				ret
+		triple:	add d, 3
+				push d
+				pop i
+				ret
+			)", &TranslatedDispatch, true },
+		// only direct branches, so nothing jumps back to the switch
+		{ "straight", R"(
+				ldv a, 0
+				ldv b, 100
+				ldv c, 0x8000
+		loop:	add a, b
+				st.w [c], a
+				add c, 2
+				ld.b d, [0x8001]
+				add e, d
+				not f
+				and f, 0x00FF00FF
+				sub b, 1
+				cmp b, 0
+				br.n loop
+				jmp over
+				ldv g, 1
+		over:	ldv.w h, a
+				trap halt
+			)", &TranslatedStraight, false }
+	};
+
+	std::unique_ptr<CPU> Load(const std::vector<uint8_t>& image, const DispatchMode mode, const NativeImage* pNative)
+	{
+		std::unique_ptr<CPU> pCPU(new CPU(BLOCK_SIZE, mode));
+		pCPU->LoadImage(image.data(), image.size());
+		pCPU->SetNativeImage(pNative);
+
+		return pCPU;
+	}
+}
+
+bool VM::RunTranslatorTests()
+{
+	std::cout << "Beginning Translator Tests\n";
+
+	bool passed = true;
+
+	for (const TranslatorTest& test : TRANSLATOR_TESTS)
+	{
+		std::vector<uint8_t> image = Build(test.m_source);
+
+		// the label the switch starts at is only there when something goes back to it
+		std::string source = Translator().Translate(image.data(), image.size(), "Translated");
+		bool labelled = source.find("L_DISPATCH:") != std::string::npos;
+		bool used = source.find("goto L_DISPATCH;") != std::string::npos;
+		passed &= Check(labelled == used && used == test.m_dispatches, std::string(test.m_name) + " labels L_DISPATCH when it is used");
+
+		// the interpreter is the reference the translated code is held to
+		std::unique_ptr<CPU> pExpected = Load(image, DM_TABLE, nullptr);
+		pExpected->Run();
+
+		for (DispatchMode mode : DISPATCH_MODES)
+		{
+			std::string what = std::string(test.m_name) + " translated under mode " + std::to_string(mode);
+
+			try
+			{
+				std::unique_ptr<CPU> pCPU = Load(image, mode, test.m_pImage);
+				pCPU->Run();
+				passed &= CompareCPUs(*pExpected, *pCPU, what);
+
+				for (uint32_t seed = 0; seed < SLICE_SEEDS; ++seed)
+				{
+					pCPU = Load(image, mode, test.m_pImage);
+					passed &= RunSliced(*pCPU, seed) && CompareCPUs(*pExpected, *pCPU, what + " sliced with seed " + std::to_string(seed));
+				}
+			}
+			catch (const std::runtime_error& error)
+			{
+				// the source changed since it was translated
+				std::cout << what << ": " << error.what() << '\n';
+				passed = false;
+			}
+		}
+	}
+
+	std::cout << (passed == true ? "Translator Tests passed\n" : "Translator Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
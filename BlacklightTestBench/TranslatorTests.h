@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_TRANSLATORTESTS_H_
+#define TESTBENCH_TRANSLATORTESTS_H_
+
+namespace VM
+{
+	bool RunTranslatorTests();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,85 @@
+#include "VMTestHelpers.h"
+
+#include <VM/Assembler.h>
+#include <VM/Linker.h>
+
+using Blacklight::VM::Assembler;
+using Blacklight::VM::CPU;
+using Blacklight::VM::Linker;
+using Blacklight::VM::MemoryController;
+using Blacklight::VM::R_COUNT;
+
+std::vector<uint8_t> VM::Build(const std::string& source)
+{
+	Linker linker;
+	linker.Add(Assembler::Assemble(source));
+	return linker.Link();
+}
+
+bool VM::RunSliced(CPU& cpu, uint32_t seed)
+{
+	uint64_t total = 0;
+
+	while (cpu.IsFinished() == false)
+	{
+		// mostly short slices, so they end on every kind of instruction, with the odd long one
+		seed = seed * 1103515245 + 12345;
+		uint64_t slice = (seed >> 16) % 8 == 0 ? (seed >> 8) % 2000 : (seed >> 16) % 13;
+
+		uint64_t ran = cpu.Run(slice);
+		if (ran > slice || (ran < slice && cpu.IsFinished() == false))
+		{
+			std::cout << "A slice of " << slice << " ran " << ran << " instructions\n";
+			return false;
+		}
+
+		total += ran;
+	}
+
+	return Check(total == cpu.GetInstructionCount(), "slices add up to the instruction count");
+}
+
+bool VM::CompareCPUs(CPU& expected, CPU& actual, const std::string& what, const uint64_t uncounted)
+{
+	bool same = true;
+
+	for (uint32_t i = 0; i < R_COUNT; ++i)
+	{
+		if (expected.GetRegister(i) != actual.GetRegister(i))
+		{
+			std::cout << what << ": register " << i << " is " << actual.GetRegister(i) <<
+				", expected " << expected.GetRegister(i) << '\n';
+			same = false;
+		}
+	}
+
+	const MemoryController& expectedMemory = expected.GetMemoryController();
+	const MemoryController& actualMemory = actual.GetMemoryController();
+
+	for (size_t address = 0; address < expectedMemory.GetBlockSize(); ++address)
+	{
+		if (expectedMemory.Read8(address) != actualMemory.Read8(address))
+		{
+			std::cout << what << ": memory differs first at " << address << '\n';
+			same = false;
+			break;
+		}
+	}
+
+	if (expected.GetInstructionCount() != actual.GetInstructionCount() + uncounted)
+	{
+		std::cout << what << ": ran " << actual.GetInstructionCount() + uncounted << " instructions, expected " <<
+			expected.GetInstructionCount() << '\n';
+		same = false;
+	}
+
+	return same;
+}
+
+bool VM::Check(const bool condition, const std::string& what)
+{
+	if (condition == false)
+		std::cout << "Failed: " << what << '\n';
+
+	return condition;
+}
\ No newline at end of file
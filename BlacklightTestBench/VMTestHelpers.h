@@ -0,0 +1,29 @@
+#ifndef TESTBENCH_VMTESTHELPERS_H_
+#define TESTBENCH_VMTESTHELPERS_H_
+
+#include <VM/CPU.h>
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace VM
+{
+	// Assembles and links a single source file into an image that starts at its first instruction
+	std::vector<uint8_t> Build(const std::string& source);
+
+	// Runs a CPU to the end in slices of varying length drawn from seed, returns whether the counts
+	// each slice reported add up to the CPU's instruction count
+	bool RunSliced(Blacklight::VM::CPU& cpu, uint32_t seed);
+
+	// Prints every register, byte of memory and count that differs between two CPUs that
+	// ran the same image, returns whether none did. uncounted is how many instructions were run for
+	// actual that its own count leaves out, the ones a Batch ran in lockstep for example
+	bool CompareCPUs(Blacklight::VM::CPU& expected, Blacklight::VM::CPU& actual, const std::string& what, const uint64_t uncounted = 0);
+
+	// Prints what failed when a check does not hold, returns the check
+	bool Check(const bool condition, const std::string& what);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,437 @@
+#include "VerifierTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/Verifier.h>
+
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::DM_DECODED;
+using Blacklight::VM::DM_JIT;
+using Blacklight::VM::DM_TABLE;
+using Blacklight::VM::DM_THREADED;
+using Blacklight::VM::DM_VERIFIED;
+using Blacklight::VM::DispatchMode;
+using Blacklight::VM::MM_FLAT;
+using Blacklight::VM::MM_PAGED;
+using Blacklight::VM::MemoryMode;
+using Blacklight::VM::Verifier;
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 0x10000;
+
+	// random programs, each run whole and in slices
+	constexpr uint32_t PROGRAM_SEEDS = 48;
+	constexpr size_t PROGRAM_SIZE = 60;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT, DM_VERIFIED };
+	const MemoryMode MEMORY_MODES[] = { MM_FLAT, MM_PAGED };
+
+	struct VerifierTest
+	{
+		const char* m_name;
+		const char* m_source;
+		bool m_proven;		// whether every instruction reached is proven
+	};
+
+	// code the Verifier can not prove has to run the same as everywhere else, as does code it did prove
+	// once it is written over
+	const VerifierTest VERIFIER_TESTS[] =
+	{
+		{ "proven", R"(
+				ldv a, 0
+				ldv b, 20
+		loop:	add a, b
+				st [0x8000], a
+				sub b, 1
+				cmp b, 0
+				br.n loop
+				call double
+				ld c, [0x8000]
+				trap halt
+		double:	add a, a
+				ret
+			)", true },
+		// a store through a register rewrites the immediate of an LDV the loop runs again
+		{ "self modifying", R"(
+				ldv a, 0
+				ldv b, 10
+				ldv e, 3
+		loop:	ldv f, 0
+		patch:	ldv.b c, 1
+				add a, c
+				ldv d, patch + 2
+				add e, 3
+				st.b [d], e
+				sub b, 1
+				cmp b, 0
+				br.n loop
+				trap halt
+			)", true },
+		// the same through a fixed address, which is never proven
+		{ "store into code", R"(
+				ldv a, 0
+				ldv b, 5
+		loop:	ldv.b c, 1
+				add a, c
+				add c, 2
+				st.b [loop + 2], c
+				sub b, 1
+				cmp b, 0
+				br.n loop
+				trap halt
+			)", false },
+		// a CALL into the immediate of an LDV, which hides an ADD and a RET
+		{ "overlapping", R"(
+				ldv a, 3
+				ldv.d b, 0xD007005C
+		again:	cmp a, 100
+				br.n take
+				trap halt
+		take:	call again - 4
+				jmp again
+			)", false },
+		// code the guest writes past the image, jumped to through a register and back
+		{ "outside of the image", R"(
+				ldv a, 0x3000
+				ldv b, 0xB005405C
+				st [a], b
+				ldv b, 0x0B
+				add a, 4
+				st.b [a], b
+				sub a, 4
+				ldv l, back
+				jmp a
+		back:	add e, 1
+				ld g, [0x3000]
+				trap halt
+			)", true },
+		// fixed addresses past the end of memory wrap into it, and one that is only reached when a branch is not
+		// taken. The last instruction is cut short after the image is built
+		{ "out of range", R"(
+				ldv a, 1
+				cmp a, 1
+				br.e skip
+				ld b, [0x20000]
+		skip:	ld c, [0xFFFC]
+				st [0x18000], a
+				ld d, [0x8000]
+				trap halt
+				ldv.d a, 0x12345678
+			)", false }
+	};
+
+	/*
+	 *	Writes random programs a seed at a time, so a failure can be run again.
+	 *	a to i hold values, j addresses, k the data and l loop counts. The data
+	 *	lies outside of the image, as the Verifier never proves a store into it
+	 */
+	class Generator
+	{
+	public:
+		explicit Generator(const uint32_t seed) :
+			m_seed(seed),
+			m_labels(0)
+		{
+		}
+
+		std::string Generate(const size_t size)
+		{
+			m_code << "ldv k, " << DATA << '\n';
+			for (const char* reg : VALUES)
+				m_code << "ldv " << reg << ", " << Next32() << '\n';
+
+			for (size_t i = 0; i < size; ++i)
+				Operation(0);
+
+			m_code << "trap halt\n";
+
+			for (const std::string& sub : m_subs)
+			{
+				m_code << sub << ":\n";
+				for (uint32_t i = Below(5) + 1; i > 0; --i)
+				{
+					const char* g = Value();
+					const char* h = Value();
+					switch (Below(3))
+					{
+					case 0:
+						m_code << ALU[Below(3)] << ' ' << g << ", " << h << '\n';
+						break;
+					case 1:
+						m_code << "add.b " << g << ", " << Below(0x100) << '\n';
+						break;
+					default:
+						m_code << "push " << g << "\npop " << h << '\n';
+						break;
+					}
+				}
+				m_code << "ret\n";
+			}
+
+			return m_code.str();
+		}
+	private:
+		static constexpr uint32_t DATA = 0x8000;
+		static constexpr const char* VALUES[] = { "a", "b", "c", "d", "e", "f", "g", "h", "i" };
+		static constexpr const char* ALU[] = { "add", "sub", "and", "ldv", "cmp" };
+		static constexpr const char* SIZES[] = { ".b", ".w", "" };
+		static constexpr const char* FLAGS[] = { "p", "e", "n", "pe", "pn", "en", "pen" };
+
+		uint32_t Next()
+		{
+			m_seed = m_seed * 1103515245 + 12345;
+			return m_seed >> 16;
+		}
+
+		uint32_t Next32()
+		{
+			return (Next() << 16) ^ Next();
+		}
+
+		uint32_t Below(const uint32_t count)
+		{
+			return Next() % count;
+		}
+
+		const char* Value()
+		{
+			return VALUES[Below(9)];
+		}
+
+		std::string Label()
+		{
+			return "l" + std::to_string(m_labels++);
+		}
+
+		// an immediate that fits the size
+		uint32_t Immediate(const size_t size)
+		{
+			return size == 0 ? Next32() & 0xFF : (size == 1 ? Next32() & 0xFFFF : Next32());
+		}
+
+		// puts a dword aligned address in the data into j
+		void Address()
+		{
+			m_code << "ldv" << SIZES[Below(3)] << " j, " << Value() << '\n';
+			m_code << "and j, 0xFC\nadd j, k\n";
+		}
+
+		void Operation(const int depth)
+		{
+			const char* g = Value();
+			const char* h = Value();
+			size_t size = Below(3);
+
+			switch (Below(19))
+			{
+			case 0:
+			case 1:
+			case 2:
+			case 3:
+			case 4:
+				if (Below(2) == 0)
+					m_code << ALU[Below(5)] << SIZES[size] << ' ' << g << ", " << Immediate(size) << '\n';
+				else
+					m_code << ALU[Below(5)] << SIZES[size] << ' ' << g << ", " << h << '\n';
+				break;
+			case 5:
+				m_code << "not " << g << '\n';
+				break;
+			case 6:
+				m_code << "st" << SIZES[size] << " [" << DATA + Below(0x100) << "], " << g << '\n';
+				break;
+			case 7:
+				m_code << "ld" << SIZES[size] << ' ' << g << ", [" << DATA + Below(0x100) << "]\n";
+				break;
+			case 8:
+				Address();
+				m_code << "st" << SIZES[size] << " [j], " << g << '\n';
+				break;
+			case 9:
+				Address();
+				m_code << "ld" << SIZES[size] << ' ' << g << ", [j]\n";
+				break;
+			case 10:
+				if (Below(2) == 0)
+					m_code << "push " << g << '\n';
+				else
+					m_code << "push " << Next32() << '\n';
+				for (uint32_t i = Below(3); i > 0; --i)
+					Operation(depth + 1);
+				m_code << "pop " << h << '\n';
+				break;
+			case 11:
+			{
+				if (depth >= 2)
+					break;
+
+				std::string skip = Label();
+				m_code << "cmp " << g << ", " << h << "\nbr." << FLAGS[Below(7)] << ' ' << skip << '\n';
+				for (uint32_t i = Below(3) + 1; i > 0; --i)
+					Operation(depth + 1);
+				m_code << skip << ":\n";
+				break;
+			}
+			case 12:
+			{
+				if (depth >= 2)
+					break;
+
+				std::string skip = Label();
+				m_code << "jmp " << skip << '\n';
+				for (uint32_t i = Below(3); i > 0; --i)
+					Operation(depth + 1);
+				m_code << skip << ":\n";
+				break;
+			}
+			case 13:
+			{
+				if (depth >= 1)
+					break;
+
+				std::string loop = Label();
+				m_code << "ldv l, " << Below(19) + 1 << '\n' << loop << ":\npush l\n";
+				for (uint32_t i = Below(4) + 1; i > 0; --i)
+					Operation(depth + 1);
+				m_code << "pop l\nsub l, 1\ncmp l, 0\nbr.n " << loop << '\n';
+				break;
+			}
+			case 14:
+			{
+				if (depth >= 2)
+					break;
+
+				m_subs.push_back(Label());
+				if (Below(10) < 7)
+					m_code << "call " << m_subs.back() << '\n';
+				else
+					m_code << "ldv j, " << m_subs.back() << "\ncall j\n";
+				break;
+			}
+			case 15:
+			{
+				// rewrites the immediate of the LDV after it
+				std::string patch = Label();
+				m_code << "ldv j, " << patch << " + 2\nst" << SIZES[size] << " [j], " << g << '\n';
+				m_code << patch << ": ldv.d " << h << ", " << Next32() << '\n';
+				break;
+			}
+			case 16:
+				m_code << "cmp.b " << g << ", " << Immediate(0) << '\n';
+				m_code << "ldv" << SIZES[size] << ' ' << h << ", " << Immediate(size) << '\n';
+				m_code << (Below(2) == 0 ? "add" : "sub") << SIZES[Below(3)] << ' ' << g << ", " << h << '\n';
+				break;
+			case 17:
+			{
+				if (depth >= 2)
+					break;
+
+				m_subs.push_back(Label());
+				if (Below(2) == 0)
+					m_code << "push " << g << '\n';
+				else
+					m_code << "push " << Next32() << '\n';
+				m_code << "call " << m_subs.back() << "\npop " << h << '\n';
+				break;
+			}
+			case 18:
+			{
+				if (depth >= 2)
+					break;
+
+				// rewrites which flags the BR after it takes
+				std::string patch = Label();
+				std::string skip = Label();
+				m_code << "ldv j, " << patch << "\nldv l, " << (0xA8 | Below(8)) << "\nst.b [j], l\n";
+				if (Below(2) == 0)
+					m_code << "cmp " << g << ", " << h << '\n';
+				else
+					m_code << "cmp.d " << g << ", " << Next32() << '\n';
+				m_code << patch << ": br." << FLAGS[Below(7)] << ' ' << skip << '\n';
+				for (uint32_t i = Below(2) + 1; i > 0; --i)
+					Operation(depth + 1);
+				m_code << skip << ":\n";
+				break;
+			}
+			}
+		}
+
+		uint32_t m_seed;
+		uint32_t m_labels;
+		std::ostringstream m_code;
+		std::vector<std::string> m_subs;
+	};
+
+	std::unique_ptr<CPU> Load(const std::vector<uint8_t>& image, const DispatchMode mode, const MemoryMode memoryMode)
+	{
+		std::unique_ptr<CPU> pCPU(new CPU(BLOCK_SIZE, mode, memoryMode));
+		pCPU->LoadImage(image.data(), image.size());
+
+		return pCPU;
+	}
+
+	// Runs an image under every mode whole and sliced, returns whether they all agree with the table core
+	bool RunImage(const std::vector<uint8_t>& image, const uint32_t seed, const std::string& name)
+	{
+		bool passed = true;
+
+		std::unique_ptr<CPU> pExpected = Load(image, DM_TABLE, MM_FLAT);
+		pExpected->Run();
+
+		for (MemoryMode memoryMode : MEMORY_MODES)
+		{
+			for (DispatchMode mode : DISPATCH_MODES)
+			{
+				std::string what = name + " under mode " + std::to_string(mode) + (memoryMode == MM_PAGED ? " paged" : " flat");
+
+				std::unique_ptr<CPU> pCPU = Load(image, mode, memoryMode);
+				pCPU->Run();
+				passed &= VM::CompareCPUs(*pExpected, *pCPU, what);
+
+				pCPU = Load(image, mode, memoryMode);
+				passed &= VM::RunSliced(*pCPU, seed) && VM::CompareCPUs(*pExpected, *pCPU, what + " sliced");
+			}
+		}
+
+		return passed;
+	}
+}
+
+bool VM::RunVerifierTests()
+{
+	std::cout << "Beginning Verifier Tests\n";
+
+	bool passed = true;
+
+	for (const VerifierTest& test : VERIFIER_TESTS)
+	{
+		std::vector<uint8_t> image = Build(test.m_source);
+		if (std::string(test.m_name) == "out of range")
+			image.resize(image.size() - 3);
+
+		Verifier verifier;
+		verifier.VerifyImage(image.data(), image.size(), BLOCK_SIZE);
+		const Verifier::Stats& stats = verifier.GetStats();
+
+		passed &= Check((stats.m_verified == stats.m_instructions) == test.m_proven,
+			std::string(test.m_name) + (test.m_proven == true ? " is proven" : " is not proven"));
+		passed &= Check(verifier.GetIssues().empty() == test.m_proven,
+			std::string(test.m_name) + (test.m_proven == true ? " has no issues" : " has issues"));
+
+		passed &= RunImage(image, 1, test.m_name);
+	}
+
+	for (uint32_t seed = 1; seed <= PROGRAM_SEEDS; ++seed)
+	{
+		std::vector<uint8_t> image = Build(Generator(seed).Generate(PROGRAM_SIZE));
+		passed &= RunImage(image, seed, "program " + std::to_string(seed));
+	}
+
+	std::cout << (passed == true ? "Verifier Tests passed\n" : "Verifier Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_VERIFIERTESTS_H_
+#define TESTBENCH_VERIFIERTESTS_H_
+
+namespace VM
+{
+	bool RunVerifierTests();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,192 @@
+#include "WideTests.h"
+#include "VMTestHelpers.h"
+
+#include <VM/WideCPU.h>
+
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+
+using Blacklight::VM::MM_FLAT;
+using Blacklight::VM::MM_PAGED;
+using Blacklight::VM::MemoryController;
+using Blacklight::VM::MemoryMode;
+using Blacklight::VM::R_E;
+using Blacklight::VM::R_F;
+using Blacklight::VM::R_G;
+using Blacklight::VM::WideCPU;
+
+namespace
+{
+	// past what a CPU can address, of which the host only backs what is touched
+	constexpr uint64_t MEMORY_SIZE = 7ull << 30;
+
+	// the qwords the guest writes and sums, one every STRIDE bytes of [4 GiB, 6 GiB)
+	constexpr uint64_t QWORDS_START = 4ull << 30;
+	constexpr uint64_t QWORDS_END = 6ull << 30;
+	constexpr uint64_t STRIDE = 0x100000;
+	constexpr uint64_t MIX = 0x9E3779B97F4A7C15;
+
+	// far more than the guest runs, so one that decodes wrong and never halts fails rather than hangs
+	constexpr uint64_t MAX_INSTRUCTIONS = 0x100000;
+
+	// where the guest fills memory up to and across the 4 GiB line, and a qword that straddles it
+	constexpr uint64_t FILL_START = 0xFFFFF000;
+	constexpr uint64_t FILL_SIZE = 0x2000;
+	constexpr uint64_t STRADDLE = 0xFFFFFFFC;
+	constexpr uint64_t STRADDLED = 0x1122334455667788;
+
+	const MemoryMode MEMORY_MODES[] = { MM_FLAT, MM_PAGED };
+
+	// writes address + MIX to every qword and sums them up in e, fills across the 4 GiB line and writes a qword
+	// over it, which it reads back in f, and runs an immediate it wrote over into g
+	const char* const WIDE = R"(
+			ldv.q a, 0x100000000
+			ldv.q b, 0x180000000
+			ldv.q c, 0x9E3779B97F4A7C15
+	fill:	ldv.q d, a
+			add.q d, c
+			st.q [a], d
+			add.q a, 0x100000
+			cmp.q a, b
+			br.p fill
+			ldv.q a, 0x100000000
+			ldv.q e, 0
+	sum:	ld.q d, [a]
+			add.q e, d
+			add.q a, 0x100000
+			cmp.q a, b
+			br.p sum
+			ldv.q a, 0xFFFFF000
+			ldv.q b, 0xA5
+			ldv.q c, 0x2000
+			memset a, b, c
+			ldv.q a, 0xFFFFFFFC
+			ldv.q d, 0x1122334455667788
+			st.q [a], d
+			ld.q f, [a]
+			ldv.q i, patch + 2
+			ldv.q h, 0x77
+			st.b [i], h
+	patch:	ldv.b g, 1
+			trap halt
+		)";
+
+	// past the end of memory, and a qword that runs off of it
+	const char* const FAULTS[] =
+	{
+		R"(
+			ldv.q a, 0x1C0000000
+			ld.q b, [a]
+			trap halt
+		)",
+		R"(
+			ldv.q a, 0x1BFFFFFFC
+			ldv.q b, 1
+			st.q [a], b
+			trap halt
+		)"
+	};
+
+	// Returns the sum the guest comes to
+	uint64_t QwordSum()
+	{
+		uint64_t sum = 0;
+		for (uint64_t address = QWORDS_START; address < QWORDS_END; address += STRIDE)
+			sum += address + MIX;
+
+		return sum;
+	}
+
+	// Returns whether the fill the guest did, with the qword over the 4 GiB line on top of it, is in memory
+	bool CheckFill(MemoryController& mc, const std::string& what)
+	{
+		for (uint64_t address = FILL_START; address < FILL_START + FILL_SIZE; ++address)
+		{
+			uint8_t expected = 0xA5;
+			if (address >= STRADDLE &&
+				address < STRADDLE + 8)
+				expected = static_cast<uint8_t>(STRADDLED >> ((address - STRADDLE) * 8));
+
+			if (mc.Read8(address) != expected)
+			{
+				std::cout << what << ": memory differs first at " << address << '\n';
+				return false;
+			}
+		}
+
+		return true;
+	}
+}
+
+bool VM::RunWideTests()
+{
+	std::cout << "Beginning Wide Tests\n";
+
+	bool passed = true;
+
+	std::vector<uint8_t> image = Build(WIDE);
+	uint64_t count = 0;
+
+	for (MemoryMode memoryMode : MEMORY_MODES)
+	{
+		std::string what = memoryMode == MM_PAGED ? " paged" : " flat";
+
+		std::unique_ptr<WideCPU> pCPU;
+		try
+		{
+			pCPU.reset(new WideCPU(MEMORY_SIZE, memoryMode));
+		}
+		catch (const std::bad_alloc&)
+		{
+			// the host may not let a process reserve this much address space
+			std::cout << "Could not reserve " << MEMORY_SIZE << " bytes" << what << ", skipped\n";
+			continue;
+		}
+
+		pCPU->LoadImage(image.data(), image.size());
+		pCPU->Run(MAX_INSTRUCTIONS);
+
+		if (Check(pCPU->IsFinished() == true, "the wide guest halts" + what) == false)
+		{
+			passed = false;
+			continue;
+		}
+
+		MemoryController& mc = pCPU->GetMemoryController();
+		passed &= Check(pCPU->GetRegister(R_E) == QwordSum(), "qwords between 4 and 6 GiB add up" + what);
+		passed &= Check(mc.Read64(QWORDS_END - STRIDE) == QWORDS_END - STRIDE + MIX, "the last qword is in memory" + what);
+		passed &= Check(pCPU->GetRegister(R_F) == STRADDLED, "a qword over the 4 GiB line reads back" + what);
+		passed &= CheckFill(mc, "memset across the 4 GiB line" + what);
+		passed &= Check(pCPU->GetRegister(R_G) == 0x77, "code the guest wrote runs" + what);
+
+		// the memory modes run the same instructions
+		passed &= Check(count == 0 || pCPU->GetInstructionCount() == count, "instruction counts match" + what);
+		count = pCPU->GetInstructionCount();
+
+		for (const char* const source : FAULTS)
+		{
+			std::vector<uint8_t> fault = Build(source);
+
+			pCPU.reset(new WideCPU(MEMORY_SIZE, memoryMode));
+			pCPU->LoadImage(fault.data(), fault.size());
+
+			bool faulted = false;
+			try
+			{
+				pCPU->Run();
+			}
+			catch (const std::runtime_error&)
+			{
+				faulted = true;
+			}
+
+			passed &= Check(faulted == true, "accesses past the end of memory fault" + what);
+		}
+	}
+
+	std::cout << (passed == true ? "Wide Tests passed\n" : "Wide Tests failed\n");
+
+	return passed;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef TESTBENCH_WIDETESTS_H_
+#define TESTBENCH_WIDETESTS_H_
+
+namespace VM
+{
+	bool RunWideTests();
+}
+
+#endif
\ No newline at end of file
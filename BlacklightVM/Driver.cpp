@@ -6,33 +6,19 @@
 #include <stdio.h>
 #include <utility>
 
-#if _WIN32 && !_WIN64
-#define FASTCALL __fastcall
-#define STDCALL __stdcall
-#define CDECL __cdecl
-#elif __linux__ && !__x86_64__
-#define FASTCALL __attribute__((fastcall))
-#define STDCALL __attribute__((stdcall))
-#define CDECL __attribute__((cdecl))
-#else
-#define FASTCALL
-#define STDCALL
-#define CDECL
-#endif
-
-int FASTCALL FastcallTest(int a, int b, int c, int d)
+int FastcallTest(int a, int b, int c, int d)
 {
 	printf("FastcallTest: %d %d %d %d\n", a, b, c, d);
 	return a + b + c + d;
 }
 
-int STDCALL StdcallTest(int a, int b, int c, int d)
+int StdcallTest(int a, int b, int c, int d)
 {
 	printf("StdcallTest: %d %d %d %d\n", a, b, c, d);
 	return a + b + c + d;
 }
 
-int CDECL CdeclTest(int a, int b, int c, int d)
+int CdeclTest(int a, int b, int c, int d)
 {
 	printf("CdeclTest: %d %d %d %d\n", a, b, c, d);
 	return a + b + c + d;
@@ -77,35 +63,36 @@ int main()
 		TRAP(), TC_HALT,								// 46 Finish execution of the virtual machine
 		ADD(true, SZ_BYTE), Reg(R_A), 53,				// 49 Add 53 to R_A (-13)
 		LDV(false, SZ_DWORD), Reg(R_G, R_A),			// 4B Load the DWORD from R_A (-13) into R_G
-#if _WIN32 && !_WIN64
-		LDV(true, SZ_BYTE), Reg(R_A), 5,				// 4E Load 5 into R_A (x86 arg 0)
-		LDV(true, SZ_BYTE), Reg(R_B), 6,				// 51 Load 6 into R_B (x86 arg 1)
-		LDV(true, SZ_BYTE), Reg(R_C), 7,				// 54 Load 7 into R_C (x86 arg 2)
-		LDV(true, SZ_BYTE), Reg(R_D), 3,				// 57 Load 3 into R_D (x86 arg 3)
-		LDV(true, SZ_BYTE), Reg(R_L), 4,				// 5A Load 4 into R_L (x86 arg count)
-		CX(CNV_STDCALL), 0x0,							// 5C call the STDCALL x86 function at index 0 in the x86 call table. In this case, `int __stdcall StdcallTest(int a, int b, int c, int d)`. Result is stored in R_A (21)
-		CX(CNV_CDECL), 0x1,								// 5E call the CDECL x86 function at index 1 in the x86 call table. In this case, `int __cdecl CdeclTest(int a, int b, int c, int d)`. Result is stored in R_A (37)
-		CX(CNV_FASTCALL), 0x2,							// 60 call the FASTCALL x86 function at index 2 in the x86 call table. In this case, `int __fastcall FastcallTest(int a, int b, int c, int d)`. Result is stored in R_A (53)
-		LDV(false, SZ_BYTE), Reg(R_B, R_A),				// 62 Load the byte R_A (53) into R_B
-#endif
-		RET(),											// 63 Return to the caller (0x42)
+		LDV(true, SZ_BYTE), Reg(R_A), 5,				// 4E Load 5 into R_A (host arg 0)
+		LDV(true, SZ_BYTE), Reg(R_B), 6,				// 51 Load 6 into R_B (host arg 1)
+		LDV(true, SZ_BYTE), Reg(R_C), 7,				// 54 Load 7 into R_C (host arg 2)
+		LDV(true, SZ_BYTE), Reg(R_D), 3,				// 57 Load 3 into R_D (host arg 3)
+		CX(CNV_STDCALL), 0x0,							// 59 call the host function at index 0 in the host function table. In this case, `int StdcallTest(int a, int b, int c, int d)`. Result is stored in R_A (21)
+		CX(CNV_CDECL), 0x1,								// 5B call the host function at index 1 in the host function table. In this case, `int CdeclTest(int a, int b, int c, int d)`. Result is stored in R_A (37)
+		CX(CNV_FASTCALL), 0x2,							// 5D call the host function at index 2 in the host function table. In this case, `int FastcallTest(int a, int b, int c, int d)`. Result is stored in R_A (53)
+		LDV(false, SZ_BYTE), Reg(R_B, R_A),				// 5F Load the byte R_A (53) into R_B
+		RET(),											// 60 Return to the caller (0x42)
 	};
 
 	CPU cpu(0x100);
 	cpu.LoadImage(buf, sizeof(buf));
-#if !_WIN64 && !__x86_64__
-	cpu.AddFunction(StdcallTest);
-	cpu.AddFunction(CdeclTest);
-	cpu.AddFunction(FastcallTest);
-#endif
+	cpu.AddFunction<StdcallTest>();
+	cpu.AddFunction<CdeclTest>();
+	cpu.AddFunction<FastcallTest>();
 	cpu.Run();
 
 	// final result is stored in R_A
 	printf("Final result of assembly (R_A): %d\n", cpu.GetRegister(R_A));
 
-#if !_WIN64 && !__x86_64__
-	printf("Final result of x86 calls (R_B): %d\n", cpu.GetRegister(R_B));
-#endif
+	printf("Final result of host calls (R_B): %d\n", cpu.GetRegister(R_B));
+
+	// superinstructions the decode cache formed out of the buffer
+	const FusionStats& fusionStats = cpu.GetFusionStats();
+	for (int i = 0; i < FUSION_COUNT; ++i)
+	{
+		printf("%s: formed %llu, executed %llu\n", DecodeCache::GetFusionName(static_cast<FusionE>(i)),
+			static_cast<unsigned long long>(fusionStats.m_formed[i]), static_cast<unsigned long long>(fusionStats.m_executed[i]));
+	}
 
 #if _WIN64 || __x86_64__
 	printf("Size of bytecode buffer: %llu\n", sizeof(buf) - 8);
@@ -31,6 +31,13 @@ namespace Blacklight
 			R_COUNT
 		};
 
+		enum Flags
+		{
+			F_N = (1 << 0),
+			F_E = (1 << 1),
+			F_P = (1 << 2)
+		};
+
 		enum OpcodeE
 		{
 			OP_LD,
@@ -65,7 +72,28 @@ namespace Blacklight
 			TC_RECV,
 			TC_SEND,
 			TC_SHUTDOWN,
-			TC_HALT
+			TC_HALT,
+			TC_CLOSE,
+			TC_SPAWN,	// starts a thread at a with its stack at b and c in its a, leaving its id in a, see ThreadGroup
+			TC_JOIN		// waits for the thread with the id in a to halt, leaving what it had in a when it did in a
+		};
+
+		// Operations on the extended page. They are encoded as TRAP with its immediate bit set, then one of these,
+		// then Reg(dst, src) and the register holding a byte count in the high nibble of the last byte
+		enum ExtendedOpcodeE
+		{
+			XOP_MEMCPY,		// copies count bytes from [src] to [dst], the ranges may overlap
+			XOP_MEMSET,		// fills count bytes at [dst] with the low byte of src
+			XOP_MEMCMP,		// compares count bytes at [dst] with [src] like CMP does the first that differs,
+							// leaving how many were equal in count
+			XOP_MEMCHR,		// finds the low byte of src in count bytes at [dst], leaving its offset in count and
+							// setting F_E, or leaving count and setting F_N when it is not there
+			XOP_CHECKSUM,	// puts the RFC 1071 internet checksum of count bytes at [src] in dst
+			XOP_CAS,		// replaces the dword at [dst] with src and sets F_E if it equals count, otherwise sets
+							// F_N, leaving what was there in count. Atomic, like the two after it
+			XOP_FETCHADD,	// adds src to the dword at [dst], leaving what was there in count
+			XOP_FENCE,		// orders every access before it against every access after it, its registers are unused
+			XOP_COUNT
 		};
 
 	}
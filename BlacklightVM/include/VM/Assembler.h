@@ -0,0 +1,120 @@
+#ifndef BLACKLIGHT_VM_ASSEMBLER_H_
+#define BLACKLIGHT_VM_ASSEMBLER_H_
+
+/*
+Bytecode Assembler
+10/17/26 21:10
+*/
+
+#include <VM/Arch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		// Sections of an object, laid out in this order with every object's text before any data
+		enum SectionE
+		{
+			SC_TEXT,
+			SC_DATA,
+			SC_COUNT
+		};
+
+		enum FragmentKindE
+		{
+			FK_DATA,	// bytes, some of them filled in once symbols have addresses
+			FK_BRANCH,	// a JMP or CALL to a symbol, as short as the linker can make it
+			FK_ALIGN	// padding up to a multiple of m_alignment
+		};
+
+		// A dword in a fragment that holds a symbol's address once it is known
+		struct Fixup
+		{
+			size_t m_offset;
+			// relative fixups hold the distance from this point in the fragment, the end of their instruction
+			size_t m_end;
+			bool m_relative;
+			// an empty symbol is the absolute address in m_addend
+			std::string m_symbol;
+			int32_t m_addend;
+			size_t m_line;
+		};
+
+		// A piece of a section that only moves as a whole while the linker relaxes branches
+		struct Fragment
+		{
+			FragmentKindE m_kind;
+
+			// FK_DATA
+			std::vector<uint8_t> m_bytes;
+			std::vector<Fixup> m_fixups;
+
+			// FK_BRANCH, m_opcode is OP_JMP or OP_CALL and the target is an address like a fixup's
+			uint8_t m_opcode;
+			std::string m_symbol;
+			int32_t m_addend;
+
+			// FK_ALIGN
+			uint32_t m_alignment;
+
+			size_t m_line;
+		};
+
+		// A label, at an offset into one of an object's fragments
+		struct Symbol
+		{
+			SectionE m_section;
+			size_t m_fragment;
+			size_t m_offset;
+			bool m_global;
+		};
+
+		// An assembled source file, for the Linker
+		struct Object
+		{
+			std::string m_name;
+			std::vector<Fragment> m_sections[SC_COUNT];
+			std::map<std::string, Symbol> m_symbols;
+		};
+
+		/*
+		 *	Assembles source text into an Object. A line holds an optional label
+		 *	and an instruction or directive, and ';' starts a comment:
+		 *
+		 *		loop:	ldv.b a, 5		; sizes are .b, .w, .d or .q
+		 *				ld b, [a]		; [register] or [address], from memory
+		 *				st [counter], b
+		 *				add a, b
+		 *				cmp a, 10
+		 *				br.pn loop		; taken on any of the p, e and n flags
+		 *				jmp done		; JMP and CALL are sized by the linker
+		 *				trap halt
+		 *
+		 *	Immediates without a size take the smallest one that holds them.
+		 *	.q is the whole register of a WideCPU, so it only runs on one, and
+		 *	the only size whose immediates go past 32 bits. Registers are a to
+		 *	l, sf, sb, prg and cnd, and traps go by their names without TC_.
+		 *	The extended page is memcpy, memset, memcmp, memchr, checksum, cas
+		 *	and fetchadd, which each take dst, src and count registers, and
+		 *	fence, which takes none. Directives are .text, .data, .global, .equ
+		 *	(before it is used), .byte, .word, .dword, .qword, .ascii, .asciz,
+		 *	.space and .align. Addresses are a number or a symbol plus or minus
+		 *	a number. Labels are only seen by other objects once they are
+		 *	.global
+		 */
+		class Assembler
+		{
+		public:
+			// Throws std::runtime_error, naming the line, if the source does not assemble
+			static Object Assemble(const std::string& source, const std::string& name = "<source>");
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,138 @@
+#ifndef BLACKLIGHT_VM_BATCH_H_
+#define BLACKLIGHT_VM_BATCH_H_
+
+/*
+Lockstep Batch
+10/17/26 22:40
+*/
+
+#include <VM/Arch.h>
+#include <VM/CPU.h>
+#include <VM/DecodeCache.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Runs up to 16 CPUs that have the same image loaded in lockstep, one
+		 *	instruction for every lane at a time. The registers are kept a row
+		 *	per register with a column per lane, so LDV, ADD, SUB, AND, NOT and
+		 *	CMP run as vector operations across the lanes, with AVX2 when the
+		 *	compiler targets it and SSE2 otherwise. Loads, stores and the stack
+		 *	go through each lane's own memory.
+		 *
+		 *	Lanes that branch apart are masked. Each step goes to the lowest
+		 *	address any lane is at and runs only the lanes there, so lanes come
+		 *	back together where their paths meet. CX, TRAP, accesses outside of
+		 *	memory and code outside of the image drop back to a single step in
+		 *	the lane's own CPU, after which it rejoins. A lane that writes code,
+		 *	or stops at a trap that would block, leaves the batch and runs on
+		 *	its own CPU
+		 */
+		class Batch
+		{
+		public:
+			static constexpr size_t MAX_LANES = 16;
+
+			struct Stats
+			{
+				uint64_t m_steps;			// instructions issued, each for every lane at its address
+				uint64_t m_divergentSteps;	// of them, the ones issued while lanes were apart
+				uint64_t m_scalarSteps;		// single steps a lane took in its own CPU
+			};
+
+			struct LaneStats
+			{
+				uint64_t m_instructions;	// instructions run in lockstep, the CPU counts the rest
+				bool m_finished;
+				bool m_faulted;				// Run threw, the CPU was dropped
+				bool m_ejected;				// it left the batch to run on its own
+			};
+
+			Batch();
+
+			// Adds a CPU with an image loaded as the next lane, returns the lane. The CPU is only run by the
+			// batch until Run returns. Throws std::runtime_error when the batch is full, or its image is not
+			// the one the first lane has loaded
+			size_t Add(CPU* pCPU);
+
+			// Runs every lane until it finishes or faults, lanes that leave the batch included. The registers
+			// are back in each CPU when it returns
+			void Run();
+
+			const Stats& GetStats() const;
+			LaneStats GetLaneStats(const size_t lane) const;
+		private:
+			struct Lane
+			{
+				CPU* m_pCPU;
+				MemoryController* m_pMemory;
+				size_t m_blockSize;
+				uint64_t m_instructions;
+				// m_convergedSteps when the lane last caught up on it
+				uint64_t m_convergedBase;
+				bool m_finished;
+				bool m_faulted;
+				bool m_ejected;
+			};
+
+			// Returns the micro-op at an address in the image, nullptr outside of it
+			const MicroOp* Fetch(const uint32_t address);
+
+			// Runs one instruction for the lanes in active, all of them at pc
+			void Step(const uint32_t pc, const uint32_t active);
+			// Runs a load, store, stack or call micro-op in a single lane. Returns false, having run
+			// nothing, when it would access memory outside of the lane's
+			bool StepLane(const MicroOp& op, const size_t lane, const uint32_t pc, uint32_t& target);
+			// Runs the instruction at pc in the lane's own CPU. Returns false when the lane left the batch
+			bool StepScalar(const size_t lane, const uint32_t pc, uint32_t& target);
+
+			// Moves the lanes running this step to target
+			void Jump(const uint32_t target);
+			// Moves each lane in active to its own target
+			void Branch(const uint32_t active, const uint32_t* pTargets);
+			// Spreads the shared address out to every lane, as they are about to go their own ways
+			void Diverge();
+			// Masks the lanes at an address into m_masks, returns them as bits
+			uint32_t MaskLanes(const uint32_t pc);
+
+			// Counts an instruction for the lanes that ran it in lockstep
+			void Count(const uint32_t lanes);
+
+			// Takes a lane out of the batch, its registers being back in its CPU
+			void Retire(const size_t lane);
+			// Hands a lane's registers back to its CPU, to carry on at pc on its own
+			void Eject(const size_t lane, const uint32_t pc);
+
+			std::vector<Lane> m_lanes;
+			size_t m_chunks;
+			uint32_t m_live;
+
+			// one row per register, one column per lane
+			alignas(32) uint32_t m_registers[R_COUNT][MAX_LANES];
+			// all ones for the lanes in the batch, and for the lanes running this step
+			alignas(32) uint32_t m_liveMask[MAX_LANES];
+			alignas(32) uint32_t m_masks[MAX_LANES];
+
+			// while every lane is at the same address it lives here rather than in the R_PRG row
+			bool m_converged;
+			uint32_t m_pc;
+			// steps taken while converged, which every live lane ran
+			uint64_t m_convergedSteps;
+
+			uint32_t m_origin;
+			size_t m_size;
+			std::vector<uint8_t> m_code;
+			std::vector<MicroOp> m_ops;
+
+			Stats m_stats;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef BLACKLIGHT_VM_BITS_H_
+#define BLACKLIGHT_VM_BITS_H_
+
+/*
+Bit Helpers
+10/17/26 23:50
+*/
+
+#include <cstdint>
+
+#if _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		// Returns the index of the lowest bit set in a mask that is not zero
+		inline uint32_t GetLowestBit(const uint32_t mask)
+		{
+#if _MSC_VER
+			unsigned long index;
+			_BitScanForward(&index, mask);
+
+			return static_cast<uint32_t>(index);
+#else
+			return static_cast<uint32_t>(__builtin_ctz(mask));
+#endif
+		}
+	}
+}
+
+#endif
\ No newline at end of file
@@ -7,68 +7,274 @@ VM CPU
 */
 
 #include <VM/Arch.h>
+#include <VM/DecodeCache.h>
+#include <VM/HostFunctions.h>
+#include <VM/ImageCache.h>
 #include <VM/MemoryController.h>
 #include <VM/Instruction.h>
+#include <VM/JIT.h>
+#include <VM/Native.h>
+#include <VM/Profiler.h>
+#include <VM/Semantics.h>
+#include <VM/SharedImage.h>
+#include <VM/SocketTable.h>
+#include <VM/Trace.h>
+#include <VM/Verifier.h>
 
 #include <cstddef>
+#include <memory>
+#include <utility>
 
 namespace Blacklight
 {
 	namespace VM
 	{		
-		enum Flags
+		using Register = uint32_t;
+
+		class ThreadGroup;
+
+		// Interpreter cores a CPU can run with
+		enum DispatchMode
 		{
-			F_N = (1 << 0),
-			F_E = (1 << 1),
-			F_P = (1 << 2)
+			DM_TABLE,		// decodes every instruction through the Instruction table
+			DM_DECODED,		// switch over the pre-decoded micro-ops
+			DM_THREADED,	// threaded dispatch over the micro-ops with the registers kept in locals
+			DM_JIT,			// translates the micro-ops to x86-64, DM_THREADED on other hosts or with MM_PAGED
+			DM_VERIFIED		// threaded dispatch without checks over the code the Verifier proved, the rest through the Instruction table
 		};
 
-		using Register = uint32_t;
+		// A CPU's registers and memory at one point, see CPU::TakeSnapshot
+		struct CPUSnapshot
+		{
+			Register m_registers[R_COUNT];
+			bool m_finished;
+			// the image its instructions are decoded from
+			uint32_t m_origin;
+			size_t m_size;
+			std::shared_ptr<const MemorySnapshot> m_pMemory;
+		};
 
 		// Main BL CPU
 		class CPU
 		{
 		public:
-			CPU(const size_t blockSize);
+			CPU(const size_t blockSize, const DispatchMode mode = DM_DECODED, const MemoryMode memoryMode = MM_FLAT);
+
+			// Returns the interpreter core the CPU was constructed with
+			DispatchMode GetDispatchMode() const;
 
 			// Returns the CPU's MemoryController
 			MemoryController& GetMemoryController();
 			// Returns the CPU's registers
 			Register& GetRegister(const uint32_t reg);
+			// Returns where the code of the loaded image starts in memory, and how long it is
+			uint32_t GetImageOrigin() const;
+			size_t GetImageSize() const;
 
 			// Notifies the CPU that it should finish executing
 			void NotifyFinished();
+			// Returns whether the CPU has finished executing
+			bool IsFinished() const;
+			// Returns whether Run stopped at a socket trap that would block, see GetSocketTable for what it waits for,
+			// or at a TC_JOIN on a thread that is still running. Run(maxInstructions) retries it, and counts every
+			// try, while Run waits until it can go through
+			bool IsSuspended() const;
 
-			// Loads an file image into virtual memory
+			// Returns the sockets the guest has opened
+			const SocketTable& GetSocketTable() const;
+
+			// Returns how many instructions the CPU has run across every call to Run
+			uint64_t GetInstructionCount() const;
+
+			// Loads an file image into virtual memory, mapping it copy-on-write where the host can
 			void LoadImage(const char* path);
 
+			// Maps an image that is shared with other CPUs into virtual memory copy-on-write
+			void LoadImage(const SharedImage& image);
+
 			// Loads an image from memory into virtual memory
 			void LoadImage(const uint8_t* buf, size_t size);
 			
-#if !__WIN64 && !__x86_64__
-			// Adds an x86 function to the call table, acting as a stack. Call after LoadImage and before Run
-			template<typename T>
-			void AddFunction(T fn)
+			// Adds a host function for CX to call and returns its index, see HostFunctionTable for how it is
+			// called. Fn is known at compile time and called directly, anything else callable is kept in a copy.
+			// Throws std::runtime_error when the table is full
+			template<auto Fn>
+			uint8_t AddFunction()
 			{
-				Register& cnd = GetRegister(R_CND);
+				return m_hostFunctions.Add<Fn>();
+			}
+			template<typename F>
+			uint8_t AddFunction(F fn)
+			{
+				return m_hostFunctions.Add(std::move(fn));
+			}
 
-				uint8_t numFns = (cnd >> 16) & 0xF;
+			// Runs the image that is loaded until it finishes
+			void Run();
 
-				m_memory.Write32(GetRegister(R_SB) + (numFns * 4), reinterpret_cast<uint32_t>(fn));
+			// Runs at most maxInstructions of the image that is loaded, returns how many ran. Stops
+			// early when it finishes, and can be called again to carry on where it stopped
+			uint64_t Run(const uint64_t maxInstructions);
 
-				cnd &= 0x0000FFFF;
-				cnd |= ((++numFns) << 16);
-			}
-#endif
+			// Runs every instruction through the instruction table and records it in pProfiler, whatever the
+			// dispatch mode, until it is set back to nullptr. Costs nothing while there is no profiler
+			void SetProfiler(Profiler* pProfiler);
 
-			// Runs the image that is loaded
-			void Run();
+			// Runs the loaded image through code the Translator produced for it ahead of time, whatever the
+			// dispatch mode, handing what it was not translated for to the instruction table. Only the span it
+			// was translated from is watched for code writes while it is attached, and a write into that span
+			// or loading another image detaches it. nullptr detaches it. Throws std::runtime_error if it was
+			// translated from other code
+			void SetNativeImage(const NativeImage* pImage);
+
+			// Takes the decoded form of every image loaded from then on from pCache, rather than decoding it, and in
+			// DM_VERIFIED the proof for it as well. Images that are not in it yet are decoded and written to it.
+			// The cache has to outlive the CPU and the CPUs forked from it, nullptr stops using it
+			void SetImageCache(ImageCache* pCache);
+
+			// Writes bytes from the host into guest memory, recording them while a trace is being recorded
+			void WriteInput(const uint32_t address, const uint8_t* pData, const size_t size);
+
+			// Records everything the guest takes from the host to a trace at path: the image, writes through
+			// WriteInput, the registers it starts with and what every CX and TRAP did. Start before LoadImage.
+			// The rest of the run is deterministic, so nothing else is recorded. Throws std::runtime_error if
+			// the trace can not be created
+			void StartRecording(const char* path);
+			// Writes out the rest of the trace and ends it
+			void StopRecording();
+
+			// Loads the image from a trace recorded with the same block size, after which Run stands in the
+			// recorded results for every CX and TRAP rather than running them. Throws std::runtime_error if
+			// the trace can not be read or the guest strays from it
+			void StartReplay(const char* path);
+
+			// Takes a snapshot of the registers, whether the CPU has finished and guest memory. The pages
+			// the guest writes are tracked from then on, so restoring it only costs those pages
+			std::shared_ptr<const CPUSnapshot> TakeSnapshot();
+
+			// Puts the CPU back the way it was in a snapshot taken from a CPU with the same block size and
+			// memory mode. Throws std::runtime_error if it does not match. Snapshots other than the last
+			// one taken or restored are restored whole, after which it is the one being tracked. Sockets
+			// are not part of a snapshot and stay open
+			void Restore(const std::shared_ptr<const CPUSnapshot>& pSnapshot);
+
+			// Creates a CPU like this one, with the same host functions, in the state of a snapshot, sharing
+			// the pages neither of them writes copy-on-write. Hosts that can not map copy MM_FLAT memory instead
+			std::unique_ptr<CPU> Fork(const std::shared_ptr<const CPUSnapshot>& pSnapshot) const;
+			// Forks the CPU as it is now, taking a snapshot of it to share
+			std::unique_ptr<CPU> Fork();
+
+			// Creates another thread of the guest, a CPU like this one with the same host functions over the same
+			// MM_FLAT memory, starting at entry with its stack at stack and argument in R_A. It takes what was
+			// decoded and proven of the image as it is now rather than decoding it again. See ThreadGroup, which
+			// runs them for TC_SPAWN. Throws std::runtime_error in MM_PAGED
+			std::unique_ptr<CPU> Spawn(const uint32_t entry, const uint32_t stack, const Register argument);
+
+			// Returns what the Verifier proved about the loaded image, only verified in DM_VERIFIED. Code written
+			// since it was loaded is no longer proven
+			const Verifier& GetVerifier() const;
+
+			// Returns which superinstructions were formed for the loaded image and how often they ran.
+			// DM_TABLE forms none and DM_JIT does not count them
+			const FusionStats& GetFusionStats() const;
 		private:
+			// loads images straight into memory and the decode cache as they arrive
+			friend class ImageStream;
+			// runs the threads of a guest
+			friend class ThreadGroup;
+
+			// Creates a CPU over pSharedMemory's memory, or memory of its own when it is nullptr
+			CPU(const size_t blockSize, const DispatchMode mode, const MemoryMode memoryMode, MemoryController* pSharedMemory);
+
+			// Runs at most maxInstructions, for Run(maxInstructions) to tell the thread group when it finishes
+			uint64_t RunSlice(const uint64_t maxInstructions);
+
+			// Sets up the registers, code watch and caches for an image loaded at origin. decoded is set when the
+			// decode cache was built for it while it arrived
+			void PrepareImage(const uint32_t stackSize, const uint32_t origin, const size_t size, const bool decoded = false);
+			// Sets up the code watch and caches for an image that is already in memory
+			void PrepareCode(const uint32_t origin, const size_t size, const bool decoded = false);
+			// Decodes, unless it already is, and in DM_VERIFIED verifies, the code of an image that is already in memory
+			void DecodeCode(const uint32_t origin, const size_t size, const bool decoded);
+
+			// Swaps the trace handler in for CX and TRAP, or back out again
+			void SwapTraceInstructions();
+			// Stands in for CX and TRAP while recording or replaying
+			static void TraceInstruction(CPU* pCPU, const uint8_t opcode);
+			// Runs an instruction from the extended opcode page, which TRAP escapes to. They only touch the
+			// registers and memory, so a trace replays them rather than recording what they did
+			static void ExtendedInstruction(CPU* pCPU, const uint8_t opcode);
+
+			// Interpreter cores, each returns how many instructions it ran
+			uint64_t RunTable(const uint64_t maxInstructions);
+			uint64_t RunDecoded(const uint64_t maxInstructions);
+			uint64_t RunThreaded(const uint64_t maxInstructions);
+			uint64_t RunJIT(const uint64_t maxInstructions);
+			uint64_t RunVerified(const uint64_t maxInstructions);
+			uint64_t RunProfiled(const uint64_t maxInstructions);
+			uint64_t RunNative(const uint64_t maxInstructions);
+
+			// Sets the flags in R_CND for a CMP micro-op. variant is 0 for an immediate,
+			// then 1, 2 or 3 for an 8, 16 or 32 bit source register
+			static void Compare(Register* r, const MicroOp& op, const int variant)
+			{
+				r[R_CND] = ClearFlags(r[R_CND]);
+
+				Register dst = r[op.m_dst];
+				Register src = op.m_imm;
+				if (variant == 1)
+					src = static_cast<uint8_t>(r[op.m_src]);
+				else if (variant == 2)
+					src = static_cast<uint16_t>(r[op.m_src]);
+				else if (variant == 3)
+					src = r[op.m_src];
+
+				r[R_CND] |= CompareFlag(dst, src);
+			}
+
+			// Throws away decoded instructions that the guest wrote over
+			void SyncDecodeCache()
+			{
+				if (m_memory.HasCodeWrite() == true)
+					InvalidateCodeWrite();
+			}
+			void InvalidateCodeWrite();
+			// Throws away everything decoded or translated from [low, high]
+			void InvalidateCode(const uint32_t low, const uint32_t high);
+
+			DispatchMode m_mode;
+			// stops the cores, along with m_suspended when it is only until a trap can be retried. m_joining is
+			// set when that trap is a TC_JOIN rather than a socket trap
 			bool m_finished;
+			bool m_suspended;
+			bool m_joining;
 
 			Instruction m_instructions[OP_COUNT];
 			MemoryController m_memory;
 			Register m_registers[R_COUNT];
+			HostFunctionTable m_hostFunctions;
+			SocketTable m_sockets;
+			uint64_t m_instructionCount;
+			uint32_t m_imageOrigin;
+			size_t m_imageSize;
+
+			DecodeCache m_decodeCache;
+			Verifier m_verifier;
+			std::unique_ptr<JIT> m_pJit;
+			Profiler* m_pProfiler;
+			const NativeImage* m_pNativeImage;
+			ImageCache* m_pImageCache;
+
+			// the group the CPU is a thread of, and its id in it
+			ThreadGroup* m_pThreadGroup;
+			uint32_t m_threadId;
+
+			// while tracing these hold the real CX and TRAP handlers and the table holds TraceInstruction
+			Instruction m_traceInstructions[2];
+			std::unique_ptr<TraceWriter> m_pTraceWriter;
+			std::unique_ptr<TraceReader> m_pTraceReader;
+			TraceEvent m_traceEvent;
+			bool m_traceStarted;
 		};
 	}
 }
@@ -0,0 +1,215 @@
+#ifndef BLACKLIGHT_VM_DECODECACHE_H_
+#define BLACKLIGHT_VM_DECODECACHE_H_
+
+/*
+Decode Cache
+10/17/26 09:12
+*/
+
+#include <VM/MemoryController.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		// Pre-decoded operations. Each opcode is split up by its imm/b/w/d bits so
+		// the executor never has to look at them again
+		enum MicroOpE : uint8_t
+		{
+			UOP_UNDECODED,	// slot has not been decoded yet (or was thrown away)
+			UOP_INTERP,		// run through the instruction table (CX, TRAP, truncated instructions)
+			UOP_NOP,		// LD without a size
+			UOP_LD8_ABS,
+			UOP_LD16_ABS,
+			UOP_LD32_ABS,
+			UOP_LD8,
+			UOP_LD16,
+			UOP_LD32,
+			UOP_LDV_IMM,
+			UOP_LDV8,
+			UOP_LDV16,
+			UOP_LDV32,
+			UOP_ST8_ABS,
+			UOP_ST16_ABS,
+			UOP_ST32_ABS,
+			UOP_ST8,
+			UOP_ST16,
+			UOP_ST32,
+			UOP_PUSH_IMM,
+			UOP_PUSH,
+			UOP_POP,
+			UOP_ADD_IMM,
+			UOP_ADD8,
+			UOP_ADD16,
+			UOP_ADD32,
+			UOP_SUB_IMM,
+			UOP_SUB8,
+			UOP_SUB16,
+			UOP_SUB32,
+			UOP_AND_IMM,
+			UOP_AND8,
+			UOP_AND16,
+			UOP_AND32,
+			UOP_NOT,
+			UOP_CMP_IMM,
+			UOP_CMP8,
+			UOP_CMP16,
+			UOP_CMP32,
+			UOP_BR_IMM,
+			UOP_BR,
+			UOP_JMP_IMM,
+			UOP_JMP,
+			UOP_CALL_IMM,
+			UOP_CALL,
+			UOP_RET,
+			// superinstructions formed by DecodeCache::Build. They keep the fields and length
+			// of their first instruction, the second is the slot right after it
+			UOP_CMP_IMM_BR,	// CMP followed by BR imm
+			UOP_CMP8_BR,
+			UOP_CMP16_BR,
+			UOP_CMP32_BR,
+			UOP_LDV_ADD,	// LDV imm followed by a 32 bit ADD
+			UOP_LDV_SUB,	// LDV imm followed by a 32 bit SUB
+			UOP_PUSH_IMM_CALL,	// PUSH followed by CALL imm
+			UOP_PUSH_CALL,
+			UOP_COUNT
+		};
+
+		// Kinds of superinstruction, for statistics
+		enum FusionE
+		{
+			FUSION_CMP_BR,
+			FUSION_LDV_ALU,
+			FUSION_PUSH_CALL,
+			FUSION_COUNT
+		};
+
+		// How many superinstructions of each kind were formed, and how many times they ran
+		struct FusionStats
+		{
+			uint64_t m_formed[FUSION_COUNT];
+			uint64_t m_executed[FUSION_COUNT];
+		};
+
+		// A single pre-decoded instruction
+		struct MicroOp
+		{
+			MicroOpE m_kind;
+			uint8_t m_dst;		// resolved destination register, or the condition mask for BR
+			uint8_t m_src;		// resolved source register
+			uint8_t m_length;	// instruction length in bytes
+			uint32_t m_imm;		// sign-extended immediate, absolute address or absolute branch target
+		};
+
+		// DecodeCache holds one micro-op slot per byte of the loaded image, so any
+		// branch target can be looked up directly. Slots are decoded eagerly along
+		// the linear sweep of the image and lazily for everything else
+		class DecodeCache
+		{
+		public:
+			// longest encoding a slot can cover, in bytes
+			static constexpr uint32_t MAX_LENGTH = 6;
+			// longest run of bytes a slot can depend on, counting superinstructions (CMP + BR)
+			static constexpr uint32_t MAX_SPAN = MAX_LENGTH + 5;
+			static_assert(MAX_LENGTH <= MemoryController::FETCH_SIZE, "Decoding reads past what Fetch guarantees");
+
+			DecodeCache();
+
+			DecodeCache(const DecodeCache&) = delete;
+			DecodeCache& operator=(const DecodeCache&) = delete;
+
+			// Throws away the cache, decodes the code range [address, address + size) and fuses
+			// common pairs along it into superinstructions
+			void Build(const MemoryController& mc, const uint32_t address, const size_t size);
+
+			// Build a piece at a time, for code that is still arriving. Begin throws away the cache for the
+			// range, and each Extend carries the sweep on as far as the first available bytes of it are enough
+			// to decode. Once all of them are, the cache is the same as Build leaves it
+			void Begin(const uint32_t address, const size_t size);
+			void Extend(const MemoryController& mc, const size_t available);
+
+			// Throws away the cache and takes size slots for the code range at address that were decoded
+			// before, see ImageCache. pStorage keeps pOps alive until the next Build or Adopt, and the slots
+			// have to be writable, copy-on-write if they are shared
+			void Adopt(const uint32_t address, MicroOp* pOps, const size_t size, const FusionStats& fusionStats, std::shared_ptr<void> pStorage);
+
+			// Throws away the cache and takes a copy of another's slots, for another thread running the same code
+			void Copy(const DecodeCache& other);
+
+			// Returns the slot for an address, or nullptr if it is not inside the cached range
+			const MicroOp* Lookup(const uint32_t address) const
+			{
+				uint32_t offset = address - m_begin;
+
+				return offset < m_size ? &m_pOps[offset] : nullptr;
+			}
+
+			// Returns the first address, slot count and slots of the cached range
+			uint32_t GetAddress() const
+			{
+				return m_begin;
+			}
+			size_t GetSize() const
+			{
+				return m_size;
+			}
+			const MicroOp* GetOps() const
+			{
+				return m_pOps;
+			}
+
+			// Decodes the slot at an address inside the cached range
+			void DecodeAt(const MemoryController& mc, const uint32_t address);
+
+			// Throws away every slot that decoded a byte in [low, high]
+			void Invalidate(const uint32_t low, const uint32_t high);
+
+			// Returns the statistics for the superinstructions formed by the last Build
+			FusionStats& GetFusionStats()
+			{
+				return m_fusionStats;
+			}
+			const FusionStats& GetFusionStats() const
+			{
+				return m_fusionStats;
+			}
+
+			// Returns the kind a superinstruction's first instruction decoded to, or kind itself
+			static MicroOpE GetUnfusedKind(const MicroOpE kind);
+
+			// Returns the kind of superinstruction a micro-op is, or FUSION_COUNT
+			static FusionE GetFusion(const MicroOpE kind);
+
+			// Returns a printable name for a kind of superinstruction
+			static const char* GetFusionName(const FusionE fusion);
+
+			// Decodes one instruction from its bytes, limited to available bytes. code must hold FETCH_SIZE
+			// bytes. The Verifier decodes with it so that it proves what the cores run
+			static MicroOp Decode(const uint8_t* code, const uint32_t address, const size_t available);
+		private:
+
+			// Returns the superinstruction for a pair of micro-ops, or UOP_UNDECODED if there is none
+			static MicroOpE Fuse(const MicroOp& first, const MicroOp& second);
+
+			uint32_t m_begin;
+			// the slots, in m_ops once built or in storage kept by m_pStorage once adopted
+			MicroOp* m_pOps;
+			size_t m_size;
+			std::vector<MicroOp> m_ops;
+			std::shared_ptr<void> m_pStorage;
+
+			// where the linear sweep, and fusing behind it, carry on from
+			size_t m_sweep;
+			size_t m_fuse;
+
+			FusionStats m_fusionStats;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,140 @@
+#ifndef BLACKLIGHT_VM_ENCODING_H_
+#define BLACKLIGHT_VM_ENCODING_H_
+
+/*
+Instruction Encoding
+10/17/26 23:55
+*/
+
+#include <VM/Arch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		// The fields of an instruction as every decoder reads them, before they are turned into a core's own ops
+		struct Encoding
+		{
+			uint8_t m_op;			// the OpcodeE in the high nibble
+			uint8_t m_low;			// the low nibble, which is also the condition mask of a BR
+			bool m_imm;
+			bool m_b;
+			bool m_w;
+			bool m_d;
+			uint8_t m_dst;			// from the register byte, zero when there is none
+			uint8_t m_src;
+			uint8_t m_length;		// bytes the whole instruction takes
+			uint8_t m_immOffset;	// where its immediate starts
+			uint8_t m_immLength;	// 0 when it has none, which TRAP never has even with m_imm set
+		};
+
+		// Reads a little endian T without caring about alignment, sign extended to the register width R
+		template<typename R, typename T>
+		R ReadImmediate(const uint8_t* code)
+		{
+			T val;
+			memcpy(&val, code, sizeof(T));
+
+			return static_cast<R>(static_cast<typename std::make_signed<R>::type>(val));
+		}
+
+		// Splits up an instruction, of which available bytes are in memory. A CPU reads an instruction without any
+		// of the b, w and d size bits as a dword, a WideCPU (wide) as a qword
+		inline Encoding Split(const uint8_t* code, const size_t available, const bool wide)
+		{
+			Encoding encoding = {};
+
+			uint8_t inst = code[0] & 0xF;
+
+			encoding.m_op = (code[0] >> 4) & 0xF;
+			encoding.m_low = inst;
+			encoding.m_imm = (inst >> 3) & 0x1;
+			encoding.m_b = (inst >> 2) & 0x1;
+			encoding.m_w = (inst >> 1) & 0x1;
+			encoding.m_d = inst & 0x1;
+
+			// every encoding but RET carries a register or trap byte
+			uint8_t reg = available > 1 ? code[1] : 0;
+			encoding.m_dst = (reg >> 4) & 0xF;
+			encoding.m_src = reg & 0xF;
+
+			// immediates for the dst/src forms sit after the register byte, branch offsets and addresses stop at a dword
+			uint8_t sized = encoding.m_b ? 1 : (encoding.m_w ? 2 : (encoding.m_d == true || wide == false ? 4 : 8));
+			uint8_t offset = encoding.m_b ? 1 : (encoding.m_w ? 2 : 4);
+
+			switch (encoding.m_op)
+			{
+			case OP_LD:
+			case OP_ST:
+				encoding.m_immOffset = 2;
+				encoding.m_immLength = 4;
+				break;
+			case OP_LDV:
+			case OP_ADD:
+			case OP_SUB:
+			case OP_AND:
+			case OP_CMP:
+				encoding.m_immOffset = 2;
+				encoding.m_immLength = sized;
+				break;
+			case OP_PUSH:
+			case OP_BR:
+				encoding.m_immOffset = 1;
+				encoding.m_immLength = 4;
+				break;
+			case OP_JMP:
+			case OP_CALL:
+				encoding.m_immOffset = 1;
+				encoding.m_immLength = offset;
+				break;
+			case OP_RET:
+				encoding.m_length = 1;
+				return encoding;
+			case OP_TRAP:
+				// the extended page TRAP escapes to has a byte for its opcode and two for its registers
+				encoding.m_length = encoding.m_imm ? 4 : 2;
+				return encoding;
+			default:
+				// POP, NOT and CX have nothing after the register byte whatever their bits are
+				encoding.m_length = 2;
+				return encoding;
+			}
+
+			if (encoding.m_imm == false)
+			{
+				encoding.m_immOffset = 0;
+				encoding.m_immLength = 0;
+			}
+
+			encoding.m_length = encoding.m_imm ? encoding.m_immOffset + encoding.m_immLength : 2;
+
+			return encoding;
+		}
+
+		// Returns the sign extended immediate of an instruction whose m_immLength is not 0 and is all in memory
+		template<typename R>
+		R ReadImmediate(const uint8_t* code, const Encoding& encoding)
+		{
+			const uint8_t* pImm = code + encoding.m_immOffset;
+
+			switch (encoding.m_immLength)
+			{
+			case 1:
+				return ReadImmediate<R, int8_t>(pImm);
+			case 2:
+				return ReadImmediate<R, int16_t>(pImm);
+			case 4:
+				return ReadImmediate<R, int32_t>(pImm);
+			default:
+				return ReadImmediate<R, int64_t>(pImm);
+			}
+		}
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,104 @@
+#ifndef BLACKLIGHT_VM_EVENTLOOP_H_
+#define BLACKLIGHT_VM_EVENTLOOP_H_
+
+/*
+VM Event Loop
+10/17/26 20:55
+*/
+
+#include <VM/CPU.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Runs many CPUs that do socket I/O on the calling thread. Each CPU runs
+		 *	for at most a quantum of instructions at a time. A CPU that suspends
+		 *	on a socket trap is parked until epoll reports one of the sockets it
+		 *	waits on is ready, or its timeout runs out, so a thread can serve any
+		 *	number of mostly idle guests. Hosts other than Linux never suspend
+		 *	and just take turns
+		 */
+		class EventLoop
+		{
+		public:
+			// Statistics for a single CPU
+			struct InstanceStats
+			{
+				uint64_t m_instructions;	// instructions run under the loop
+				uint64_t m_suspensions;		// times it was parked
+				bool m_finished;
+				bool m_faulted;				// Run threw, the CPU was dropped
+			};
+
+			// Gives CPUs at most quantum instructions at a time. Throws std::runtime_error if there is no epoll instance to be had
+			EventLoop(const uint64_t quantum = 0x10000);
+
+			EventLoop(const EventLoop&) = delete;
+			EventLoop& operator=(const EventLoop&) = delete;
+
+			// Adds a CPU that has an image loaded, returns its id. The CPU belongs to the loop until it finishes
+			size_t Add(CPU* pCPU);
+
+			// Runs until every CPU added so far has finished or faulted
+			void Run();
+
+			// Returns the statistics for a CPU by the id Add returned
+			InstanceStats GetInstanceStats(const size_t id) const;
+
+			~EventLoop();
+		private:
+			using Clock = std::chrono::steady_clock;
+
+			struct Instance
+			{
+				CPU* m_pCPU;
+				// bumped whenever it is woken, so whatever else it was parked on is ignored when it fires
+				uint64_t m_generation;
+				bool m_parked;
+
+				uint64_t m_instructions;
+				uint64_t m_suspensions;
+				bool m_finished;
+				bool m_faulted;
+			};
+
+			// an instance by id and the generation it was parked in
+			using Waiter = std::pair<size_t, uint64_t>;
+			using Timer = std::pair<Clock::time_point, Waiter>;
+
+			// Waits on what a suspended CPU's trap waits for
+			void Park(const size_t id);
+			// Puts a parked CPU back in line if it is still parked in the same generation
+			void Wake(const Waiter& waiter);
+
+			// Waits for sockets and timers, for at most timeout milliseconds (-1 for ever)
+			void Poll(const int timeout);
+
+			uint64_t m_quantum;
+			int m_epoll;
+
+			std::deque<Instance> m_instances;
+			std::deque<size_t> m_ready;
+			size_t m_unfinished;
+
+			// who is parked on each socket
+			std::unordered_map<int, Waiter> m_waiting;
+			std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> m_timers;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,213 @@
+#ifndef BLACKLIGHT_VM_HOSTFUNCTIONS_H_
+#define BLACKLIGHT_VM_HOSTFUNCTIONS_H_
+
+/*
+Host Functions
+10/17/26 21:55
+*/
+
+#include <VM/Arch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		class CPU;
+
+		// Takes the arguments of a host function out of the registers, from R_A onwards
+		template<typename... Args>
+		struct HostArguments
+		{
+			static constexpr size_t REGISTERS = sizeof...(Args);
+
+			template<typename T>
+			static T FromRegister(const uint32_t value)
+			{
+				static_assert(std::is_integral<T>::value || std::is_enum<T>::value,
+					"Host function arguments must be integers or enums, take CPU& first to reach guest memory");
+				static_assert(sizeof(T) <= sizeof(uint32_t), "Host function arguments must fit in a register");
+
+				if constexpr (std::is_same<T, bool>::value)
+					return value != 0;
+				else
+					return static_cast<T>(value);
+			}
+
+			template<typename F, size_t... I>
+			static decltype(auto) Apply(F&& fn, CPU&, const uint32_t* r, std::index_sequence<I...>)
+			{
+				return fn(FromRegister<std::decay_t<Args>>(r[R_A + I])...);
+			}
+		};
+
+		// Functions that take the CPU first get it, and their other arguments from R_A onwards
+		template<typename... Args>
+		struct HostArguments<CPU&, Args...>
+		{
+			static constexpr size_t REGISTERS = sizeof...(Args);
+
+			template<typename F, size_t... I>
+			static decltype(auto) Apply(F&& fn, CPU& cpu, const uint32_t* r, std::index_sequence<I...>)
+			{
+				return fn(cpu, HostArguments<Args...>::template FromRegister<std::decay_t<Args>>(r[R_A + I])...);
+			}
+		};
+
+		// What a host function returns and takes, from a function pointer or the call operator of anything else
+		template<typename T>
+		struct HostSignature : HostSignature<decltype(&T::operator())>
+		{
+		};
+
+		template<typename R, typename... Args>
+		struct HostSignature<R(*)(Args...)>
+		{
+			using Result = R;
+			using Arguments = HostArguments<Args...>;
+		};
+
+		template<typename R, typename... Args>
+		struct HostSignature<R(*)(Args...) noexcept> : HostSignature<R(*)(Args...)>
+		{
+		};
+
+#if _WIN32 && !_WIN64
+		template<typename R, typename... Args>
+		struct HostSignature<R(__stdcall*)(Args...)> : HostSignature<R(*)(Args...)>
+		{
+		};
+
+		template<typename R, typename... Args>
+		struct HostSignature<R(__fastcall*)(Args...)> : HostSignature<R(*)(Args...)>
+		{
+		};
+#endif
+
+		template<typename C, typename R, typename... Args>
+		struct HostSignature<R(C::*)(Args...)> : HostSignature<R(*)(Args...)>
+		{
+		};
+
+		template<typename C, typename R, typename... Args>
+		struct HostSignature<R(C::*)(Args...) const> : HostSignature<R(*)(Args...)>
+		{
+		};
+
+		template<typename C, typename R, typename... Args>
+		struct HostSignature<R(C::*)(Args...) noexcept> : HostSignature<R(*)(Args...)>
+		{
+		};
+
+		template<typename C, typename R, typename... Args>
+		struct HostSignature<R(C::*)(Args...) const noexcept> : HostSignature<R(*)(Args...)>
+		{
+		};
+
+		/*
+		 *	The host functions CX calls, by the index in its second byte. Each
+		 *	one is added with its own C++ signature and gets a thunk, made when
+		 *	it is added, that passes R_A onwards as its arguments and leaves what
+		 *	it returns in R_A, so there is no calling convention to emulate and
+		 *	nothing to copy. Arguments and results are integers, enums or bool of
+		 *	at most 32 bits, and there are at most as many arguments as there are
+		 *	registers before R_L. A function that takes CPU& first is handed the
+		 *	CPU, to reach guest memory or stop it, and takes the rest of its
+		 *	arguments from R_A as usual. Functions that return void leave R_A
+		 *	as it was
+		 */
+		class HostFunctionTable
+		{
+		public:
+			// the most functions a table holds, one for every index CX names
+			static constexpr size_t MAX_FUNCTIONS = 0x100;
+			// the most arguments a function takes, R_A to R_K
+			static constexpr size_t MAX_ARGUMENTS = R_L - R_A;
+
+			HostFunctionTable();
+
+			// Adds a function known at compile time, which the thunk calls directly, and returns its index.
+			// Throws std::runtime_error when the table is full
+			template<auto Fn>
+			uint8_t Add()
+			{
+				return Insert([](void*, CPU& cpu, uint32_t* r)
+				{
+					Invoke<HostSignature<decltype(Fn)>>(Fn, cpu, r);
+				}, nullptr);
+			}
+
+			// Adds a function pointer, lambda or other callable, which the table keeps a copy of, and returns
+			// its index. Throws std::runtime_error when the table is full
+			template<typename F>
+			uint8_t Add(F fn)
+			{
+				std::shared_ptr<F> pFn = std::make_shared<F>(std::move(fn));
+
+				return Insert([](void* pTarget, CPU& cpu, uint32_t* r)
+				{
+					Invoke<HostSignature<F>>(*static_cast<F*>(pTarget), cpu, r);
+				}, pFn);
+			}
+
+			// Returns how many functions have been added
+			size_t GetCount() const;
+
+			// Calls the function at index with the CPU's registers. Throws std::runtime_error if there is none
+			void Call(const uint8_t index, CPU& cpu, uint32_t* r) const
+			{
+				if (index >= m_functions.size())
+					ThrowMissing(index);
+
+				const Entry& entry = m_functions[index];
+				entry.m_thunk(entry.m_pTarget, cpu, r);
+			}
+		private:
+			using Thunk = void(*)(void* pTarget, CPU& cpu, uint32_t* r);
+
+			struct Entry
+			{
+				Thunk m_thunk;
+				void* m_pTarget;
+				// keeps the callable m_pTarget points to alive, shared with the tables of forked CPUs
+				std::shared_ptr<void> m_pOwner;
+			};
+
+			template<typename Signature, typename F>
+			static void Invoke(F&& fn, CPU& cpu, uint32_t* r)
+			{
+				using Arguments = typename Signature::Arguments;
+				using Result = typename Signature::Result;
+
+				static_assert(Arguments::REGISTERS <= MAX_ARGUMENTS, "Host functions take at most 11 arguments");
+
+				if constexpr (std::is_void<Result>::value)
+				{
+					Arguments::Apply(fn, cpu, r, std::make_index_sequence<Arguments::REGISTERS>());
+				}
+				else
+				{
+					static_assert(std::is_integral<Result>::value || std::is_enum<Result>::value,
+						"Host functions must return an integer, an enum or void");
+					static_assert(sizeof(Result) <= sizeof(uint32_t), "Host function results must fit in a register");
+
+					r[R_A] = static_cast<uint32_t>(Arguments::Apply(fn, cpu, r, std::make_index_sequence<Arguments::REGISTERS>()));
+				}
+			}
+
+			uint8_t Insert(const Thunk thunk, const std::shared_ptr<void>& pOwner);
+
+			[[noreturn]] static void ThrowMissing(const uint8_t index);
+
+			std::vector<Entry> m_functions;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef BLACKLIGHT_VM_IMAGECACHE_H_
+#define BLACKLIGHT_VM_IMAGECACHE_H_
+
+/*
+Decoded Image Cache
+10/17/26 22:50
+*/
+
+#include <VM/DecodeCache.h>
+#include <VM/Verifier.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Keeps the decoded form of images in a directory, so that a process
+		 *	loading an image that was loaded before skips decoding and verifying
+		 *	it. A file holds a header, the DecodeCache slots as the cores read
+		 *	them and the Verifier's proof, laid out in host byte order. It is
+		 *	named after a hash of the code along with everything else the slots
+		 *	depend on, the format version, the micro-op layout, the origin and
+		 *	the memory size, so a changed image or build never finds a stale one.
+		 *
+		 *	The file is mapped copy-on-write where the host can map, so only the
+		 *	pages the guest runs through are read in, and a CPU invalidating or
+		 *	lazily decoding slots keeps its changes to itself. Files are written
+		 *	whole and renamed into place, so any number of processes can share
+		 *	the directory. They are trusted like the host's own files, and only
+		 *	checked to be for this code and build
+		 */
+		class ImageCache
+		{
+		public:
+			struct Stats
+			{
+				uint64_t m_hits;
+				uint64_t m_misses;
+				uint64_t m_stores;	// files written after a miss
+			};
+
+			// Keeps its files in directory, which has to exist already
+			ImageCache(const char* directory);
+
+			ImageCache(const ImageCache&) = delete;
+			ImageCache& operator=(const ImageCache&) = delete;
+
+			// Hands the decoded form of size bytes of code loaded at origin, in memorySize bytes of guest memory,
+			// to cache, and the proof for it to pVerifier unless it is nullptr. Returns false, having changed
+			// nothing, when there is no file for it
+			bool Load(const uint8_t* pCode, const uint32_t origin, const size_t size, const size_t memorySize, DecodeCache& cache, Verifier* pVerifier);
+
+			// Writes out what cache, and pVerifier unless it is nullptr, hold for the code for the next Load to
+			// find. Returns false when the file could not be written, which only costs the next load a decode
+			bool Store(const uint8_t* pCode, const uint32_t origin, const size_t size, const size_t memorySize, const DecodeCache& cache, const Verifier* pVerifier);
+
+			// Returns the file the decoded form of the code is kept in
+			std::string GetPath(const uint8_t* pCode, const uint32_t origin, const size_t size, const size_t memorySize, const bool verified) const;
+
+			// Safe to call while other threads load through the cache
+			Stats GetStats() const;
+		private:
+			std::string m_directory;
+
+			std::atomic<uint64_t> m_hits;
+			std::atomic<uint64_t> m_misses;
+			std::atomic<uint64_t> m_stores;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,87 @@
+#ifndef BLACKLIGHT_VM_IMAGESTREAM_H_
+#define BLACKLIGHT_VM_IMAGESTREAM_H_
+
+/*
+Streaming Image Loader
+10/17/26 22:55
+*/
+
+#include <VM/CPU.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Loads an image into a CPU a piece at a time as it arrives, rather
+		 *	than from a buffer holding all of it. Once the header is in, every
+		 *	byte goes where it is loaded in guest memory, through the windows
+		 *	GetWindow hands out, so a socket reads or decrypts straight into
+		 *	them. The decode cache follows the code as it is committed, so when
+		 *	the last of it arrives only the instructions it completes are left
+		 *	to decode. The Verifier needs all of the code to prove any of it,
+		 *	so in DM_VERIFIED it still runs once the stream is complete.
+		 *
+		 *	The CPU has no image to run until then, and must not be run while
+		 *	the stream is loading it
+		 */
+		class ImageStream
+		{
+		public:
+			// Starts loading an image of size bytes, laid out as LoadImage(buf, size) takes it, into a CPU. Throws
+			// std::runtime_error when it is too short for its header
+			ImageStream(CPU* pCPU, const size_t size);
+
+			ImageStream(const ImageStream&) = delete;
+			ImageStream& operator=(const ImageStream&) = delete;
+
+			// Returns where the next bytes of the image go and in size how many of them fit there, nullptr once
+			// it is complete. Throws std::runtime_error if the code does not fit in guest memory
+			uint8_t* GetWindow(size_t& size);
+			// Takes count bytes written to the last window, loading the image into the CPU with the last of them.
+			// Throws std::runtime_error if they did not fit in it
+			void Commit(const size_t count);
+
+			// Reads the rest of the image through read(uint8_t* pData, size_t size), which returns how many bytes
+			// it wrote to pData, 0 once there are no more. Throws std::runtime_error if they end early
+			template<typename F>
+			void Receive(F read)
+			{
+				while (IsComplete() == false)
+				{
+					size_t size;
+					uint8_t* pWindow = GetWindow(size);
+
+					size_t count = read(pWindow, size);
+					if (count == 0)
+						throw std::runtime_error("Image stream ended early");
+
+					Commit(count);
+				}
+			}
+
+			// Returns whether the whole image has arrived and been loaded
+			bool IsComplete() const;
+			// Returns how many bytes of the image have arrived
+			size_t GetReceived() const;
+		private:
+			// size of the image header, the stack size followed by the origin
+			static constexpr size_t HEADER_SIZE = 8;
+
+			CPU* m_pCPU;
+			size_t m_size;
+			size_t m_received;
+			size_t m_window;
+
+			uint8_t m_header[HEADER_SIZE];
+			uint32_t m_stackSize;
+			uint32_t m_origin;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -33,6 +33,7 @@ namespace Blacklight
 
 			enum Size
 			{
+				SZ_QWORD = 0,		// none of the bits, the whole register of a WideCPU
 				SZ_DWORD = 1 << 0,
 				SZ_WORD = 1 << 1,
 				SZ_BYTE = 1 << 2
@@ -192,6 +193,8 @@ namespace Blacklight
 				}
 			} constexpr RET;
 
+			// Calling conventions CX can name. The CPU calls host functions through the signature they were
+			// added with, so these only document the call
 			enum Convention
 			{
 				CNV_CDECL = (1 << 0),
@@ -220,6 +223,18 @@ namespace Blacklight
 					return (INS << 4);
 				}
 			} constexpr TRAP;
+
+			// TRAP with its immediate bit, the escape to the extended opcode page
+			class XOPFactory : public InstructionFactory<0b1111>
+			{
+			public:
+				constexpr XOPFactory() {}
+
+				constexpr const uint8_t operator()() const
+				{
+					return (INS << 4) | (1 << 3);
+				}
+			} constexpr XOP;
 		}
 	}
 }
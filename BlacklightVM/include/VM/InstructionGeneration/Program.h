@@ -0,0 +1,511 @@
+#ifndef BLACKLIGHT_INSTRUCTIONGENERATION_PROGRAM_H_
+#define BLACKLIGHT_INSTRUCTIONGENERATION_PROGRAM_H_
+
+/*
+Compile Time Programs
+10/17/26 21:40
+*/
+
+#include <VM/Arch.h>
+#include <VM/InstructionGeneration/InstructionGeneration.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		namespace InstructionGeneration
+		{
+			// A place in a Program, handed out by NewLabel and given an address by Bind
+			struct Label
+			{
+				size_t m_index;
+			};
+
+			/*
+			 *	Builds an image out of the factories above, in a constant expression
+			 *	when it is declared constexpr:
+			 *
+			 *		constexpr auto COUNTDOWN = []
+			 *		{
+			 *			Program<64> program;
+			 *			Label loop = program.NewLabel();
+			 *
+			 *			program.Ldv(R_C, 10);
+			 *			program.Bind(loop);
+			 *			program.Sub(R_C, 1);
+			 *			program.Cmp(R_C, 0);
+			 *			program.Br(F_N, loop);
+			 *			program.Trap(TC_HALT);
+			 *			return program;
+			 *		}();
+			 *		constexpr auto IMAGE = COUNTDOWN.GetImage<COUNTDOWN.GetSize()>();
+			 *
+			 *	Labels can be used before or after they are bound. Immediates without
+			 *	a size take the smallest one that holds them once sign extended, and
+			 *	JMP and CALL to a label that is already bound take the smallest form
+			 *	that reaches it, while one to a label further on is a dword unless it
+			 *	is given a size. Anything that does not encode, an immediate that
+			 *	does not fit its size, a branch that does not reach or a label that
+			 *	is never bound, throws std::runtime_error, which fails to compile in
+			 *	a constant expression. The image starts at the origin, so the entry
+			 *	is the first instruction
+			 */
+			template<size_t CodeCapacity, size_t MaxLabels = 32, size_t MaxFixups = 64>
+			class Program
+			{
+			public:
+				// The origin defaults to just above the stack and the room the CX call table used to take, like the Linker's
+				constexpr explicit Program(const uint32_t stackSize = 0x1000) :
+					Program(stackSize, stackSize + CALL_TABLE_SIZE)
+				{
+				}
+
+				constexpr Program(const uint32_t stackSize, const uint32_t origin) :
+					m_stackSize(stackSize),
+					m_origin(origin),
+					m_code(),
+					m_size(0),
+					m_labels(),
+					m_labelCount(0),
+					m_fixups(),
+					m_fixupCount(0)
+				{
+				}
+
+				constexpr Label NewLabel()
+				{
+					if (m_labelCount == MaxLabels)
+						throw std::runtime_error("Too many labels, raise MaxLabels");
+
+					m_labels[m_labelCount] = UNBOUND;
+					return { m_labelCount++ };
+				}
+
+				// Binds a label to the next instruction or data
+				constexpr void Bind(const Label label)
+				{
+					if (GetLabel(label) != UNBOUND)
+						throw std::runtime_error("Label is bound twice");
+
+					m_labels[label.m_index] = m_size;
+				}
+
+				// ld dst, [src]
+				constexpr void Ld(const RegisterE dst, const RegisterE src, const Size sz = SZ_DWORD)
+				{
+					Emit(LD(false, CheckSize(sz)), Reg(CheckRegister(dst), CheckRegister(src)));
+				}
+
+				// ld dst, [label]
+				constexpr void Ld(const RegisterE dst, const Label label, const Size sz = SZ_DWORD)
+				{
+					Emit(LD(true, CheckSize(sz)), Reg(CheckRegister(dst)));
+					EmitFixup(label, 4, true);
+				}
+
+				// st [dst], src
+				constexpr void St(const RegisterE dst, const RegisterE src, const Size sz = SZ_DWORD)
+				{
+					Emit(ST(false, CheckSize(sz)), Reg(CheckRegister(dst), CheckRegister(src)));
+				}
+
+				// st [label], src
+				constexpr void St(const Label label, const RegisterE src, const Size sz = SZ_DWORD)
+				{
+					Emit(ST(true, CheckSize(sz)), Reg(R_A, CheckRegister(src)));
+					EmitFixup(label, 4, true);
+				}
+
+				// the register forms zero extend bytes and words for LDV, AND and CMP, and sign extend them for ADD and SUB
+				constexpr void Ldv(const RegisterE dst, const RegisterE src, const Size sz = SZ_DWORD) { Registers(LDV, dst, src, sz); }
+				constexpr void Ldv(const RegisterE dst, const int64_t value) { Immediate(LDV, dst, value, GetImmediateSize(value), false); }
+				constexpr void Ldv(const RegisterE dst, const int64_t value, const Size sz) { Immediate(LDV, dst, value, sz, true); }
+				// ldv dst, the address of label
+				constexpr void Ldv(const RegisterE dst, const Label label)
+				{
+					Emit(LDV(true, SZ_DWORD), Reg(CheckRegister(dst)));
+					EmitFixup(label, 4, false);
+				}
+
+				constexpr void Add(const RegisterE dst, const RegisterE src, const Size sz = SZ_DWORD) { Registers(ADD, dst, src, sz); }
+				constexpr void Add(const RegisterE dst, const int64_t value) { Immediate(ADD, dst, value, GetImmediateSize(value), false); }
+				constexpr void Add(const RegisterE dst, const int64_t value, const Size sz) { Immediate(ADD, dst, value, sz, true); }
+
+				constexpr void Sub(const RegisterE dst, const RegisterE src, const Size sz = SZ_DWORD) { Registers(SUB, dst, src, sz); }
+				constexpr void Sub(const RegisterE dst, const int64_t value) { Immediate(SUB, dst, value, GetImmediateSize(value), false); }
+				constexpr void Sub(const RegisterE dst, const int64_t value, const Size sz) { Immediate(SUB, dst, value, sz, true); }
+
+				constexpr void And(const RegisterE dst, const RegisterE src, const Size sz = SZ_DWORD) { Registers(AND, dst, src, sz); }
+				constexpr void And(const RegisterE dst, const int64_t value) { Immediate(AND, dst, value, GetImmediateSize(value), false); }
+				constexpr void And(const RegisterE dst, const int64_t value, const Size sz) { Immediate(AND, dst, value, sz, true); }
+
+				constexpr void Cmp(const RegisterE dst, const RegisterE src, const Size sz = SZ_DWORD) { Registers(CMP, dst, src, sz); }
+				constexpr void Cmp(const RegisterE dst, const int64_t value) { Immediate(CMP, dst, value, GetImmediateSize(value), false); }
+				constexpr void Cmp(const RegisterE dst, const int64_t value, const Size sz) { Immediate(CMP, dst, value, sz, true); }
+
+				constexpr void Not(const RegisterE dst)
+				{
+					Emit(NOT(), Reg(CheckRegister(dst)));
+				}
+
+				constexpr void Push(const RegisterE src)
+				{
+					Emit(PUSH(false), Reg(R_A, CheckRegister(src)));
+				}
+
+				// PUSH only has the dword form
+				constexpr void Push(const int64_t value)
+				{
+					Emit(PUSH(true));
+					EmitData(CheckImmediate(value, 4, false), 4);
+				}
+
+				// push the address of label
+				constexpr void Push(const Label label)
+				{
+					Emit(PUSH(true));
+					EmitFixup(label, 4, false);
+				}
+
+				constexpr void Pop(const RegisterE dst)
+				{
+					Emit(POP(), Reg(CheckRegister(dst)));
+				}
+
+				// Branches if any of F_P, F_E and F_N in flags are set. BR only has the dword form
+				constexpr void Br(const int flags, const Label label)
+				{
+					Emit(BR(true, CheckFlags(flags)));
+					EmitFixup(label, 4, true);
+				}
+
+				constexpr void Br(const int flags, const RegisterE src)
+				{
+					Emit(BR(false, CheckFlags(flags)), Reg(R_A, CheckRegister(src)));
+				}
+
+				constexpr void Jmp(const Label label) { Branch(JMP, label, GetBranchSize(label)); }
+				constexpr void Jmp(const Label label, const Size sz) { Branch(JMP, label, CheckSize(sz)); }
+				constexpr void Jmp(const RegisterE src) { Emit(JMP(false), Reg(R_A, CheckRegister(src))); }
+
+				constexpr void Call(const Label label) { Branch(CALL, label, GetBranchSize(label)); }
+				constexpr void Call(const Label label, const Size sz) { Branch(CALL, label, CheckSize(sz)); }
+				constexpr void Call(const RegisterE src) { Emit(CALL(false), Reg(R_A, CheckRegister(src))); }
+
+				constexpr void Ret()
+				{
+					Emit(RET());
+				}
+
+				constexpr void Cx(const uint8_t index, const Convention cnv = CNV_CDECL)
+				{
+					if (cnv != CNV_CDECL && cnv != CNV_STDCALL && cnv != CNV_FASTCALL)
+						throw std::runtime_error("Unknown calling convention");
+
+					Emit(CX(cnv), index);
+				}
+
+				constexpr void Trap(const uint8_t code)
+				{
+					Emit(TRAP(), code);
+				}
+
+				// the extended page, see ExtendedOpcodeE
+				constexpr void Memcpy(const RegisterE dst, const RegisterE src, const RegisterE count) { Extended(XOP_MEMCPY, dst, src, count); }
+				constexpr void Memset(const RegisterE dst, const RegisterE src, const RegisterE count) { Extended(XOP_MEMSET, dst, src, count); }
+				constexpr void Memcmp(const RegisterE dst, const RegisterE src, const RegisterE count) { Extended(XOP_MEMCMP, dst, src, count); }
+				constexpr void Memchr(const RegisterE dst, const RegisterE src, const RegisterE count) { Extended(XOP_MEMCHR, dst, src, count); }
+				constexpr void Checksum(const RegisterE dst, const RegisterE src, const RegisterE count) { Extended(XOP_CHECKSUM, dst, src, count); }
+				constexpr void Cas(const RegisterE dst, const RegisterE src, const RegisterE count) { Extended(XOP_CAS, dst, src, count); }
+				constexpr void FetchAdd(const RegisterE dst, const RegisterE src, const RegisterE count) { Extended(XOP_FETCHADD, dst, src, count); }
+				constexpr void Fence() { Extended(XOP_FENCE, R_A, R_A, R_A); }
+
+				// data, in among the code
+				constexpr void Byte(const uint8_t data)
+				{
+					Emit(data);
+				}
+
+				constexpr void Word(const uint16_t data)
+				{
+					EmitData(data, 2);
+				}
+
+				constexpr void Dword(const uint32_t data)
+				{
+					EmitData(data, 4);
+				}
+
+				// the address of label
+				constexpr void Dword(const Label label)
+				{
+					EmitFixup(label, 4, false);
+				}
+
+				// a string without its terminator
+				template<size_t N>
+				constexpr void Ascii(const char (&text)[N])
+				{
+					for (size_t i = 0; i + 1 < N; ++i)
+						Emit(static_cast<uint8_t>(text[i]));
+				}
+
+				// a string with its terminator, for TC_PUTS
+				template<size_t N>
+				constexpr void Asciz(const char (&text)[N])
+				{
+					Ascii(text);
+					Emit(0);
+				}
+
+				constexpr void Space(const size_t size)
+				{
+					for (size_t i = 0; i < size; ++i)
+						Emit(0);
+				}
+
+				// Pads with zeros up to an address that is a multiple of alignment
+				constexpr void Align(const uint32_t alignment)
+				{
+					if (alignment == 0)
+						throw std::runtime_error("Alignment of zero");
+
+					while ((m_origin + m_size) % alignment != 0)
+						Emit(0);
+				}
+
+				// Returns the size of the image, header included, for GetImage
+				constexpr size_t GetSize() const
+				{
+					return HEADER_SIZE + m_size;
+				}
+
+				// Returns where a bound label ends up once the image is loaded
+				constexpr uint32_t GetAddress(const Label label) const
+				{
+					size_t offset = GetLabel(label);
+					if (offset == UNBOUND)
+						throw std::runtime_error("Label is never bound");
+
+					return static_cast<uint32_t>(m_origin + offset);
+				}
+
+				// Returns the image for CPU::LoadImage with every label filled in. N has to be GetSize()
+				template<size_t N>
+				constexpr std::array<uint8_t, N> GetImage() const
+				{
+					if (N != GetSize())
+						throw std::runtime_error("Image size is not GetSize()");
+
+					std::array<uint8_t, N> image = {};
+					Put(image, 0, m_stackSize, 4);
+					Put(image, 4, m_origin, 4);
+
+					for (size_t i = 0; i < m_size; ++i)
+						image[HEADER_SIZE + i] = m_code[i];
+
+					for (size_t i = 0; i < m_fixupCount; ++i)
+					{
+						const Fixup& fixup = m_fixups[i];
+
+						// relative fixups hold the distance from the end of their instruction
+						int64_t value = fixup.m_relative == true ?
+							static_cast<int64_t>(GetAddress(fixup.m_label)) - static_cast<int64_t>(m_origin + fixup.m_end) :
+							static_cast<int64_t>(GetAddress(fixup.m_label));
+
+						if (fixup.m_size < 4 &&
+							(value < -(INT64_C(1) << (fixup.m_size * 8 - 1)) || value >= (INT64_C(1) << (fixup.m_size * 8 - 1))))
+							throw std::runtime_error("Branch does not reach its label, give it a larger size");
+
+						Put(image, HEADER_SIZE + fixup.m_offset, static_cast<uint32_t>(value), fixup.m_size);
+					}
+
+					return image;
+				}
+			private:
+				static constexpr size_t HEADER_SIZE = 8;
+				// the room the CX call table took in guest memory, kept so images keep their layout
+				static constexpr uint32_t CALL_TABLE_SIZE = 16 * 4;
+				static constexpr size_t UNBOUND = SIZE_MAX;
+
+				// bytes in the code that hold a label's address or distance once the image is built
+				struct Fixup
+				{
+					size_t m_offset;
+					size_t m_size;
+					size_t m_end;
+					bool m_relative;
+					Label m_label;
+				};
+
+				template<size_t N>
+				static constexpr void Put(std::array<uint8_t, N>& image, const size_t at, const uint32_t data, const size_t size)
+				{
+					for (size_t i = 0; i < size; ++i)
+						image[at + i] = static_cast<uint8_t>(data >> (i * 8));
+				}
+
+				static constexpr RegisterE CheckRegister(const RegisterE reg)
+				{
+					if (reg < R_A || reg >= R_COUNT)
+						throw std::runtime_error("Unknown register");
+
+					return reg;
+				}
+
+				static constexpr Size CheckSize(const Size sz)
+				{
+					if (sz != SZ_BYTE && sz != SZ_WORD && sz != SZ_DWORD)
+						throw std::runtime_error("Unknown size");
+
+					return sz;
+				}
+
+				static constexpr int CheckFlags(const int flags)
+				{
+					// F_P, F_E and F_N
+					if (flags == 0 || (flags & ~0b111) != 0)
+						throw std::runtime_error("BR takes at least one of F_P, F_E and F_N");
+
+					return flags;
+				}
+
+				static constexpr size_t GetBytes(const Size sz)
+				{
+					return sz == SZ_BYTE ? 1 : (sz == SZ_WORD ? 2 : 4);
+				}
+
+				// Returns the bits of an immediate that fits in size bytes, either sign or zero extended when it
+				// was given a size, or once it is sign extended when it was picked for it
+				static constexpr uint32_t CheckImmediate(const int64_t value, const size_t size, const bool sized)
+				{
+					if (value < INT32_MIN || value > UINT32_MAX)
+						throw std::runtime_error("Immediate does not fit in a dword");
+
+					int64_t extended = sized == true ? value : static_cast<int32_t>(static_cast<uint32_t>(value));
+					if (size < 4 &&
+						(extended < -(INT64_C(1) << (size * 8 - 1)) || extended >= (INT64_C(1) << (size * 8))))
+						throw std::runtime_error("Immediate does not fit its size");
+
+					return static_cast<uint32_t>(value);
+				}
+
+				static constexpr Size GetImmediateSize(const int64_t value)
+				{
+					int64_t extended = static_cast<int32_t>(static_cast<uint32_t>(CheckImmediate(value, 4, false)));
+					if (extended >= INT8_MIN && extended <= INT8_MAX)
+						return SZ_BYTE;
+					if (extended >= INT16_MIN && extended <= INT16_MAX)
+						return SZ_WORD;
+
+					return SZ_DWORD;
+				}
+
+				constexpr size_t GetLabel(const Label label) const
+				{
+					if (label.m_index >= m_labelCount)
+						throw std::runtime_error("Label is not from this program");
+
+					return m_labels[label.m_index];
+				}
+
+				// The smallest JMP or CALL that reaches a bound label, a dword for one further on
+				constexpr Size GetBranchSize(const Label label) const
+				{
+					size_t target = GetLabel(label);
+					if (target == UNBOUND)
+						return SZ_DWORD;
+
+					int64_t displacement = static_cast<int64_t>(target) - static_cast<int64_t>(m_size + 2);
+					if (displacement >= INT8_MIN && displacement <= INT8_MAX)
+						return SZ_BYTE;
+
+					displacement = static_cast<int64_t>(target) - static_cast<int64_t>(m_size + 3);
+					if (displacement >= INT16_MIN && displacement <= INT16_MAX)
+						return SZ_WORD;
+
+					return SZ_DWORD;
+				}
+
+				template<typename Factory>
+				constexpr void Registers(const Factory& factory, const RegisterE dst, const RegisterE src, const Size sz)
+				{
+					Emit(factory(false, CheckSize(sz)), Reg(CheckRegister(dst), CheckRegister(src)));
+				}
+
+				template<typename Factory>
+				constexpr void Immediate(const Factory& factory, const RegisterE dst, const int64_t value, const Size sz, const bool sized)
+				{
+					size_t size = GetBytes(CheckSize(sz));
+					uint32_t data = CheckImmediate(value, size, sized);
+
+					Emit(factory(true, sz), Reg(CheckRegister(dst)));
+					EmitData(data, size);
+				}
+
+				template<typename Factory>
+				constexpr void Branch(const Factory& factory, const Label label, const Size sz)
+				{
+					Emit(factory(true, sz));
+					EmitFixup(label, GetBytes(sz), true);
+				}
+
+				constexpr void Extended(const ExtendedOpcodeE xop, const RegisterE dst, const RegisterE src, const RegisterE count)
+				{
+					Emit(XOP(), static_cast<uint8_t>(xop));
+					Emit(Reg(CheckRegister(dst), CheckRegister(src)), Reg(CheckRegister(count)));
+				}
+
+				constexpr void Emit(const uint8_t data)
+				{
+					if (m_size == CodeCapacity)
+						throw std::runtime_error("Program is larger than its CodeCapacity");
+
+					m_code[m_size++] = data;
+				}
+
+				constexpr void Emit(const uint8_t opcode, const uint8_t operand)
+				{
+					Emit(opcode);
+					Emit(operand);
+				}
+
+				constexpr void EmitData(const uint32_t data, const size_t size)
+				{
+					for (size_t i = 0; i < size; ++i)
+						Emit(static_cast<uint8_t>(data >> (i * 8)));
+				}
+
+				// Leaves room for a label's address, or its distance from the end of the instruction the room ends
+				constexpr void EmitFixup(const Label label, const size_t size, const bool relative)
+				{
+					GetLabel(label);
+					if (m_fixupCount == MaxFixups)
+						throw std::runtime_error("Too many label uses, raise MaxFixups");
+
+					m_fixups[m_fixupCount++] = { m_size, size, m_size + size, relative, label };
+					EmitData(0, size);
+				}
+
+				uint32_t m_stackSize;
+				uint32_t m_origin;
+
+				std::array<uint8_t, CodeCapacity> m_code;
+				size_t m_size;
+
+				std::array<size_t, MaxLabels> m_labels;
+				size_t m_labelCount;
+
+				std::array<Fixup, MaxFixups> m_fixups;
+				size_t m_fixupCount;
+			};
+		}
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+#ifndef BLACKLIGHT_VM_JIT_H_
+#define BLACKLIGHT_VM_JIT_H_
+
+/*
+Baseline x86-64 JIT
+10/17/26 13:40
+*/
+
+#include <VM/DecodeCache.h>
+#include <VM/MemoryController.h>
+
+#include <Memory/Allocators.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// the JIT only emits x86-64, everything else stays on the interpreter
+#if _M_X64 || __x86_64__
+#define BLACKLIGHT_VM_JIT 1
+#else
+#define BLACKLIGHT_VM_JIT 0
+#endif
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Translates basic blocks of micro-ops into x86-64. Guest registers
+		 *	stay in their register file, which is pinned to rbx while
+		 *	translated code runs, with guest memory pinned to r12 and its
+		 *	dirty page map to r14. Blocks
+		 *	end at control flow or at anything the interpreter has to do
+		 *	(CX, TRAP), and static exits are patched to jump straight into
+		 *	the next block once it exists
+		 */
+		class JIT
+		{
+		public:
+			// why translated code returned to the CPU, or the exit to link
+			enum ExitE : uintptr_t
+			{
+				EXIT_DISPATCH,		// R_PRG needs to be looked up (or interpreted)
+				EXIT_CODE_WRITE,	// the guest wrote to its image, see GetCodeWrite
+				EXIT_BUDGET,		// the block at R_PRG has more instructions than the budget has left
+				EXIT_LINK			// anything at or above this is an exit that can be linked
+			};
+
+			JIT();
+
+			// Throws away every translation and prepares for the image range [address, address + size)
+			void Reset(const uint32_t address, const size_t size);
+
+			// Returns translated code for an address, translating it if needed, and links the
+			// exit that left for it. Returns nullptr if the first instruction has to be interpreted
+			void* GetBlock(DecodeCache& cache, const MemoryController& mc, const uint32_t address, const uintptr_t exit = EXIT_DISPATCH);
+
+			// Runs translated code until it leaves for the CPU or runs out of budget, taking the
+			// instructions it ran out of budget. Stores mark their pages in pDirty. Returns an ExitE
+			// or an exit to link
+			uintptr_t Enter(uint32_t* pRegisters, uint8_t* pMemory, uint8_t* pDirty, void* pBlock, uint64_t& budget);
+
+			// Returns the range of the last EXIT_CODE_WRITE
+			void GetCodeWrite(uint32_t& low, uint32_t& high) const;
+
+			// Throws away every block translated from a byte in [low, high]
+			void Invalidate(const uint32_t low, const uint32_t high);
+
+			// the most instructions translated into a single block
+			static constexpr size_t MAX_BLOCK_OPS = 32;
+		private:
+			// executable memory is handed out in chunks, blocks are packed into them
+			struct CodeChunk
+			{
+				uint8_t m_code[0x4000];
+			};
+
+			// the largest a single block can be, including its exits
+			static constexpr size_t MAX_BLOCK_SIZE = 0x1000;
+			static constexpr size_t CHUNK_COUNT = 0x100;
+
+			struct Block
+			{
+				uint32_t m_end;
+				uint8_t* m_pCode;
+				// exits in other blocks that were linked to this one
+				std::vector<uint8_t*> m_links;
+			};
+
+			// state shared with translated code, pinned to r13
+			struct Context
+			{
+				uint32_t m_writeAddress;
+				uint32_t m_writeSize;
+				// instructions left to run, each block takes its own on entry
+				int64_t m_budget;
+				uint8_t* m_pDirty;
+			};
+
+			// Throws away everything and starts over with the entry stub
+			void Flush();
+
+			// Returns space for a block of at most MAX_BLOCK_SIZE, or nullptr when out of chunks
+			uint8_t* Reserve();
+
+			// Points an exit at a block, or back at its own stub when pBlock is nullptr
+			static void Patch(uint8_t* pExit, const uint8_t* pBlock);
+
+			// Translates the block starting at an address
+			uint8_t* Translate(DecodeCache& cache, const MemoryController& mc, const uint32_t address);
+
+			Memory::ProtectedPoolAllocator<CodeChunk> m_allocator;
+			std::vector<CodeChunk*> m_chunks;
+			uint8_t* m_pCursor;
+			uint8_t* m_pLimit;
+
+			// entry/exit stubs at the start of the first chunk
+			uint8_t* m_pEnter;
+			uint8_t* m_pExit;
+			uint8_t* m_pExitDispatch;
+
+			uint32_t m_begin;
+			// translated code per image byte, read by translated code for indirect branches
+			std::vector<uint8_t*> m_entries;
+			// blocks by the address they were translated from
+			std::unordered_map<uint32_t, Block> m_blocks;
+
+			Context m_context;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
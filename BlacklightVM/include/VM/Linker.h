@@ -0,0 +1,78 @@
+#ifndef BLACKLIGHT_VM_LINKER_H_
+#define BLACKLIGHT_VM_LINKER_H_
+
+/*
+Bytecode Linker
+10/17/26 21:10
+*/
+
+#include <VM/Assembler.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Lays objects out one after another from the origin and links them into
+		 *	an image for CPU::LoadImage. Every JMP and CALL to a symbol starts out
+		 *	as the byte form and only grows to the word or dword form once its
+		 *	target is out of reach, which repeats until nothing grows, so branches
+		 *	end up as short as they can be. BR only has the dword form
+		 */
+		class Linker
+		{
+		public:
+			// How many JMPs and CALLs ended up in each form
+			struct Stats
+			{
+				size_t m_byteBranches;
+				size_t m_wordBranches;
+				size_t m_dwordBranches;
+				size_t m_codeSize;
+			};
+
+			Linker();
+
+			// Adds an object, in the order it is laid out in
+			void Add(const Object& object);
+
+			// Sets the image header. The origin defaults to just above the stack and the room
+			// the CX call table used to take
+			void SetStackSize(const uint32_t stackSize);
+			void SetOrigin(const uint32_t origin);
+			// Sets the global symbol the image starts at, by default the start of the first object's text.
+			// An entry anywhere else gets a jump to it at the origin
+			void SetEntry(const std::string& entry);
+
+			// Links every object added so far. Throws std::runtime_error on symbols that are undefined
+			// or defined twice, and on images that do not fit in 32 bits
+			std::vector<uint8_t> Link();
+
+			// Returns where a global symbol ended up in the last image linked, throws std::runtime_error if there is none
+			uint32_t GetSymbolAddress(const std::string& name) const;
+			// Returns the statistics for the last image linked
+			const Stats& GetStats() const;
+		private:
+			// the room the CX call table took in guest memory, kept so images keep their layout
+			static constexpr uint32_t CALL_TABLE_SIZE = 16 * 4;
+
+			std::vector<Object> m_objects;
+
+			uint32_t m_stackSize;
+			uint32_t m_origin;
+			bool m_hasOrigin;
+			std::string m_entry;
+
+			std::map<std::string, uint32_t> m_addresses;
+			Stats m_stats;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -6,36 +6,479 @@ Memory Controller
 5/27/19 22:53
 */
 
+#include <atomic>
+#include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#if __linux__
+#include <setjmp.h>
+#endif
 
 namespace Blacklight
 {
 	namespace VM
 	{
+		class MemoryController;
+		class SharedImage;
+
+		// How a MemoryController backs guest memory
+		enum MemoryMode
+		{
+			MM_FLAT,	// one block the size of guest memory, which the JIT addresses directly
+			MM_PAGED	// pages allocated the first time they are written, found through a software TLB
+		};
+
+		/*
+		 *	Guest memory at one point, see MemoryController::TakeSnapshot. In
+		 *	MM_FLAT it is a file that memory is mapped from copy-on-write, or a
+		 *	copy where the host can not map. In MM_PAGED it takes the pages
+		 *	themselves, which memory then shares until it writes to them
+		 */
+		class MemorySnapshot
+		{
+		public:
+			MemorySnapshot(const MemorySnapshot&) = delete;
+			MemorySnapshot& operator=(const MemorySnapshot&) = delete;
+
+			~MemorySnapshot();
+		private:
+			friend class MemoryController;
+
+			MemorySnapshot(const size_t blockSize, const MemoryMode mode);
+
+			size_t m_blockSize;
+			MemoryMode m_mode;
+
+			// MM_FLAT, m_pView is where memory starts in a view of whole host pages that starts m_viewOffset before it
+			int m_file;
+			const uint8_t* m_pView;
+			size_t m_viewSize;
+			size_t m_viewOffset;
+			std::vector<uint8_t> m_copy;
+
+			// MM_PAGED, nullptr for pages that read as zero. Pages it did not take are its parent's
+			std::vector<const uint8_t*> m_pages;
+			std::vector<std::unique_ptr<uint8_t[]>> m_owned;
+			std::shared_ptr<const MemorySnapshot> m_pParent;
+		};
+
 		// MemoryController provides an interface to virtual memory
 		class MemoryController
 		{
 		public:
-			MemoryController(const size_t blockSize);
+			// size of a page in MM_PAGED
+			static constexpr uintptr_t PAGE_SHIFT = 12;
+			static constexpr uintptr_t PAGE_SIZE = static_cast<uintptr_t>(1) << PAGE_SHIFT;
+			// bytes Fetch guarantees are readable, at least the longest instruction
+			static constexpr size_t FETCH_SIZE = 8;
+
+			// Creates guest memory of blockSize bytes, which can be more than 4 GiB for a WideCPU, or with pShared another view of the MM_FLAT memory pShared
+			// has, which has to be the same size, for another thread of its guest. Writes to code through any
+			// view are reported to the code watch of every one of them. Throws std::runtime_error if pShared
+			// does not match
+			MemoryController(const size_t blockSize, const MemoryMode mode = MM_FLAT, MemoryController* pShared = nullptr);
+
+			MemoryController(const MemoryController&) = delete;
+			MemoryController& operator=(const MemoryController&) = delete;
+
+			// Returns the designated size data at an address. Defined here so the interpreter cores can inline them.
+			// Accesses outside of memory fault, see FaultTrap
+			const uint8_t Read8(const uintptr_t address) const
+			{
+				uintptr_t bounded = Bound(address, sizeof(uint8_t));
+
+				if (m_memory == nullptr)
+					return ReadPaged<uint8_t>(bounded);
+
+				return m_memory[bounded];
+			}
+			const uint16_t Read16(const uintptr_t address) const
+			{
+				uintptr_t bounded = Bound(address, sizeof(uint16_t));
+
+				if (m_memory == nullptr)
+					return ReadPaged<uint16_t>(bounded);
 
-			// Returns the designated size data at an address
-			const uint8_t Read8(const uintptr_t address) const;
-			const uint16_t Read16(const uintptr_t address) const;
-			const uint32_t Read32(const uintptr_t address) const;
+				// faster than bitwise
+				return *reinterpret_cast<uint16_t*>(&m_memory[bounded]);
+			}
+			const uint32_t Read32(const uintptr_t address) const
+			{
+				uintptr_t bounded = Bound(address, sizeof(uint32_t));
+
+				if (m_memory == nullptr)
+					return ReadPaged<uint32_t>(bounded);
+
+				return *reinterpret_cast<uint32_t*>(&m_memory[bounded]);
+			}
+			const uint64_t Read64(const uintptr_t address) const
+			{
+				uintptr_t bounded = Bound(address, sizeof(uint64_t));
+
+				if (m_memory == nullptr)
+					return ReadPaged<uint64_t>(bounded);
+
+				return *reinterpret_cast<uint64_t*>(&m_memory[bounded]);
+			}
 
 			// Writes the designated size data to an address
-			void Write8(const uintptr_t address, const uint8_t data);
-			void Write16(const uintptr_t address, const uint16_t data);
-			void Write32(const uintptr_t address, const uint32_t data);
+			void Write8(const uintptr_t address, const uint8_t data)
+			{
+				uintptr_t bounded = Bound(address, sizeof(data));
+
+				if (m_memory == nullptr)
+					WritePaged<uint8_t>(bounded, data);
+				else
+				{
+					m_memory[bounded] = data;
+					m_dirty[bounded >> PAGE_SHIFT] = 1;
+				}
+
+				CheckCodeWrite(bounded, sizeof(data));
+			}
+			void Write16(const uintptr_t address, const uint16_t data)
+			{
+				uintptr_t bounded = Bound(address, sizeof(data));
+
+				if (m_memory == nullptr)
+					WritePaged<uint16_t>(bounded, data);
+				else
+				{
+					*reinterpret_cast<uint16_t*>(&m_memory[bounded]) = data;
+					MarkDirty(bounded, sizeof(data));
+				}
+
+				CheckCodeWrite(bounded, sizeof(data));
+			}
+			void Write32(const uintptr_t address, const uint32_t data)
+			{
+				uintptr_t bounded = Bound(address, sizeof(data));
+
+				if (m_memory == nullptr)
+					WritePaged<uint32_t>(bounded, data);
+				else
+				{
+					*reinterpret_cast<uint32_t*>(&m_memory[bounded]) = data;
+					MarkDirty(bounded, sizeof(data));
+				}
+
+				CheckCodeWrite(bounded, sizeof(data));
+			}
+			void Write64(const uintptr_t address, const uint64_t data)
+			{
+				uintptr_t bounded = Bound(address, sizeof(data));
+
+				if (m_memory == nullptr)
+					WritePaged<uint64_t>(bounded, data);
+				else
+				{
+					*reinterpret_cast<uint64_t*>(&m_memory[bounded]) = data;
+					MarkDirty(bounded, sizeof(data));
+				}
+
+				CheckCodeWrite(bounded, sizeof(data));
+			}
+
+			// Maps an image's code copy-on-write at its origin, falling back to a copy where the host can not
+			// map. Throws std::runtime_error if it does not fit
+			void MapImage(const SharedImage& image);
+
+			// Returns FETCH_SIZE bytes starting at an address for decoding an instruction. The pointer
+			// is only good until the next call
+			const uint8_t* Fetch(const uintptr_t address) const
+			{
+				uintptr_t bounded = Bound(address, 1);
+
+#if __linux__
+				// the guard region faults the part of a fetch that the instruction reads past the end of memory
+				if (m_memory != nullptr)
+					return m_memory + bounded;
+#else
+				if (m_memory != nullptr &&
+					bounded + FETCH_SIZE <= m_blockSize)
+					return m_memory + bounded;
+#endif
+
+				const TlbEntry& entry = m_readTlb[(bounded >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+				if (entry.m_page == (bounded >> PAGE_SHIFT) &&
+					(bounded & (PAGE_SIZE - 1)) <= PAGE_SIZE - FETCH_SIZE)
+					return entry.m_pData + (bounded & (PAGE_SIZE - 1));
+
+				return FetchSlow(bounded);
+			}
+
+			// Copies between guest memory and a buffer
+			void ReadBlock(const uintptr_t address, uint8_t* pData, const size_t size) const;
+			void WriteBlock(const uintptr_t address, const uint8_t* pData, const size_t size);
+
+			// Returns host memory that guest memory from an address can be written through directly, and in size
+			// how much of it, no more than was asked for and in MM_PAGED no further than the end of the page. It
+			// is marked dirty and reported to the code watch up front. Throws std::runtime_error if the address
+			// is outside of memory
+			uint8_t* GetWriteSpan(const uintptr_t address, size_t& size);
+
+			// Bulk operations for the extended opcode page. Each checks its whole range once, throwing
+			// std::runtime_error if any of it is outside of memory, and then works on host memory a page at a time
+			void Copy(const uintptr_t dst, const uintptr_t src, const size_t size);
+			void Fill(const uintptr_t dst, const uint8_t value, const size_t size);
+			// Returns the offset of the first byte that differs, size if none do
+			size_t Compare(const uintptr_t a, const uintptr_t b, const size_t size) const;
+			// Returns the offset of the first byte equal to value, size if there is none
+			size_t Find(const uintptr_t address, const uint8_t value, const size_t size) const;
+			// Returns the RFC 1071 internet checksum, as the big endian word it is stored as
+			uint16_t Checksum(const uintptr_t address, const size_t size) const;
+
+			// Atomic dword operations for the extended opcode page, sequentially consistent across every view
+			// of shared memory. Each returns what was there before, throwing std::runtime_error if the dword is
+			// outside of memory or not aligned to its size
+			uint32_t CompareExchange32(const uintptr_t address, const uint32_t expected, const uint32_t desired);
+			uint32_t FetchAdd32(const uintptr_t address, const uint32_t value);
+
+			// Returns the memory mode the controller was constructed with
+			MemoryMode GetMemoryMode() const;
 
-			// Returns the raw memory buffer
+			// Returns the size of guest memory the controller was constructed with
+			size_t GetBlockSize() const;
+
+			// Returns whether other controllers are views of the same memory
+			bool IsShared() const;
+
+			// Returns the raw memory buffer, nullptr in MM_PAGED. Writes through it are not seen by the code watch or the dirty map
 			uint8_t* GetRawMemory();
+			const uint8_t* GetRawMemory() const;
+
+			// Returns the mask every guest address is reduced by, one less than the power of two reserved for memory.
+			// Addresses are wrapped by it rather than checked against it, see Bound
+			uintptr_t GetAddressMask() const;
+
+			// Returns a byte per page that is set when the page is written, which translated code marks directly
+			uint8_t* GetDirtyMap();
+
+			// Takes a snapshot of memory and tracks the pages written from then on against it. Throws
+			// std::runtime_error if it is shared, as other threads would write it underneath the snapshot
+			std::shared_ptr<const MemorySnapshot> TakeSnapshot();
+			// Puts memory back the way it was in a snapshot of the same size and mode, throws std::runtime_error
+			// if it does not match or memory is shared. Only the pages written since are copied when it is the
+			// snapshot being tracked, after which it is. Restored code is reported through the code watch
+			void Restore(const std::shared_ptr<const MemorySnapshot>& pSnapshot);
+
+			// Returns how many bytes of host memory back the guest. Everything in MM_FLAT, the pages written so far in MM_PAGED
+			size_t GetResidentSize() const;
+
+			// Watches the range holding code so that decoded instructions can be thrown away when it is written
+			void WatchCode(const uintptr_t address, const size_t size);
+
+			// Returns whether code was written since the last call to TakeCodeWrite
+			bool HasCodeWrite() const
+			{
+				return m_codeWritten.load(std::memory_order_relaxed);
+			}
+			// Returns how many writes to watched code there have been, which tells whether any were made
+			// across a call that may take them
+			uint64_t GetCodeWriteCount() const
+			{
+				return m_codeWrites.load(std::memory_order_relaxed);
+			}
+
+			// Returns the lowest and highest byte of code written since the last call and resets it
+			void TakeCodeWrite(uintptr_t& low, uintptr_t& high);
+
+			// Reports a write to code that went around the controller, as translated code's do, to the code watch
+			void ReportCodeWrite(const uintptr_t address, const size_t size)
+			{
+				CheckCodeWrite(address, size);
+			}
+
+			// Where a thread goes back to when a guest access faults. Guest code is run with one armed so that
+			// the guard regions around flat memory turn a stray access into an error rather than a crash
+			struct FaultTrap
+			{
+				// Arms the trap for the calling thread until it is destroyed, only faults in pMemory are caught
+				FaultTrap(const MemoryController* pMemory);
+
+				FaultTrap(const FaultTrap&) = delete;
+				FaultTrap& operator=(const FaultTrap&) = delete;
+
+				// Returns whether a host address is in the reservation of the memory it watches
+				bool Catches(const uintptr_t hostAddress) const;
+
+				~FaultTrap();
+
+#if __linux__
+				sigjmp_buf m_jump;
+#endif
+				const MemoryController* m_pMemory;
+				FaultTrap* m_pPrevious;
+			};
 
 			~MemoryController();
 		private:
+			// Keeps an access of size bytes inside of our reservation. Flat memory ends right where its guard
+			// region starts, so anything past the memory allocated to us faults instead of reaching the host,
+			// without a compare on the way. Paged memory only puts whole pages in its TLBs and checks the rest.
+			// Hosts without guard regions compare. Every one of them masks first, so only an address in
+			// [blockSize, reach) faults, reach being the power of two GetAddressMask is one less than. An address
+			// at or past reach is not an error: it wraps around into guest memory, as its high bits are dropped
+			uintptr_t Bound(const uintptr_t address, [[maybe_unused]] const size_t size) const
+			{
+#if BLACKLIGHT_VM_UNCHECKED
+				// ensure we are not trying to access memory that is not allocated to us
+				assert(address + size <= m_blockSize);
+
+				return address;
+#elif __linux__
+				return address & m_mask;
+#else
+				uintptr_t bounded = address & m_mask;
+				if (bounded + size > m_blockSize)
+					throw std::runtime_error("Access outside of memory");
+
+				return bounded;
+#endif
+			}
+
+
+			// Records a write to watched code
+			void CheckCodeWrite(const uintptr_t address, const size_t size)
+			{
+				if (address + size > m_watchBegin &&
+					address < m_watchEnd)
+					RecordCodeWrite(address, size);
+			}
+			void RecordCodeWrite(const uintptr_t address, const size_t size);
+			// Grows the range of code written until it is taken, under the sharing lock when memory is shared
+			void AddCodeWrite(const uintptr_t address, const size_t size);
+
+			// Returns host memory for an atomic access to the dword at an address, throwing std::runtime_error
+			// if it is outside of memory or not aligned
+			uint8_t* GetAtomic(const uintptr_t address);
+
+			// Throws std::runtime_error if size bytes at an address are not all in memory
+			void CheckRange(const uintptr_t address, const size_t size) const;
+
+			// Memory that is not a whole number of host pages ends on a page boundary rather than starting on
+			// one, so its dwords need not be aligned on the host. Atomics on those are only atomic against
+			// each other, under the sharing lock, which is what LockUnaligned takes when memory is shared
+			static bool IsHostAligned(const uint8_t* pData);
+			std::unique_lock<std::mutex> LockUnaligned();
+
+			// Marks every page a flat write of size bytes touched
+			void MarkDirtyRange(const uintptr_t address, const size_t size);
+
+			// Marks the pages a flat write of size bytes touched
+			void MarkDirty(const uintptr_t address, const size_t size)
+			{
+				m_dirty[address >> PAGE_SHIFT] = 1;
+				m_dirty[(address + size - 1) >> PAGE_SHIFT] = 1;
+			}
+
+			// Returns the first dirty page at or after page, m_dirty.size() if there is none
+			size_t NextDirty(size_t page) const;
+
+			// Throws away every TLB entry
+			void FlushTlb();
+
+			// A guest page number and where it lives on the host
+			struct TlbEntry
+			{
+				uintptr_t m_page;
+				uint8_t* m_pData;
+			};
+
+			// entries in each direct mapped TLB
+			static constexpr size_t TLB_SIZE = 64;
+			// pages in each table of the page directory
+			static constexpr uintptr_t TABLE_SHIFT = 10;
+
+			// Paged accesses, the TLB hit when the access does not cross into the next page
+			template<typename T>
+			T ReadPaged(const uintptr_t address) const
+			{
+				const TlbEntry& entry = m_readTlb[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+
+				T data;
+				if (entry.m_page == (address >> PAGE_SHIFT) &&
+					(address & (PAGE_SIZE - 1)) <= PAGE_SIZE - sizeof(T))
+					memcpy(&data, entry.m_pData + (address & (PAGE_SIZE - 1)), sizeof(T));
+				else
+					ReadBlock(address, reinterpret_cast<uint8_t*>(&data), sizeof(T));
+
+				return data;
+			}
+			template<typename T>
+			void WritePaged(const uintptr_t address, const T data)
+			{
+				const TlbEntry& entry = m_writeTlb[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+
+				if (entry.m_page == (address >> PAGE_SHIFT) &&
+					(address & (PAGE_SIZE - 1)) <= PAGE_SIZE - sizeof(T))
+					memcpy(entry.m_pData + (address & (PAGE_SIZE - 1)), &data, sizeof(T));
+				else
+					WriteBlock(address, reinterpret_cast<const uint8_t*>(&data), sizeof(T));
+			}
+
+			// Returns whether a page is all in memory. A page that runs past the end never goes in the TLBs,
+			// so every access to it is checked
+			bool IsWholePage(const uintptr_t page) const;
+
+			// Fills the TLBs for a page. Pages that have not been written read as zero and are allocated on the first write
+			const uint8_t* TranslateRead(const uintptr_t page) const;
+			uint8_t* TranslateWrite(const uintptr_t page);
+
+			// Copies an instruction that crosses a page, or misses the TLB, into the fetch buffer. One that
+			// runs off the end of memory is copied up against a guard page where there is one, and faults
+			// otherwise
+			const uint8_t* FetchSlow(const uintptr_t address) const;
+
 			size_t m_blockSize;
 			uint8_t* m_memory;
+			uintptr_t m_mask;
+			// the whole reservation behind m_memory, guard regions included
+			uint8_t* m_pReservation;
+			size_t m_reservedSize;
+
+			// MM_PAGED, a directory of page tables which are allocated along with their first page
+			std::vector<std::unique_ptr<uint8_t*[]>> m_directory;
+			size_t m_pageCount;
+			mutable TlbEntry m_readTlb[TLB_SIZE];
+			TlbEntry m_writeTlb[TLB_SIZE];
+			mutable uint8_t m_fetchBuffer[FETCH_SIZE];
+			// the end of a page that is followed by a guard page, nullptr where there is none
+			uint8_t* m_pFetchTail;
+
+			// pages written since the last snapshot. In MM_PAGED a clean page that is there is shared with m_pBase
+			std::vector<uint8_t> m_dirty;
+			std::shared_ptr<const MemorySnapshot> m_pBase;
+
+			// The views of shared memory, which owns the reservation from then on so that it outlives all of them
+			struct Sharing
+			{
+				~Sharing();
+
+				uint8_t* m_pReservation;
+				size_t m_reservedSize;
+
+				// guards the views and their code watches, which other threads write to
+				std::mutex m_mutex;
+				std::vector<MemoryController*> m_views;
+			};
+
+			std::shared_ptr<Sharing> m_pSharing;
+
+			// the code watch. Another thread sharing memory can report a write at any time, so the flag
+			// and count it checks without the lock are atomic
+			uintptr_t m_watchBegin;
+			uintptr_t m_watchEnd;
+			std::atomic<bool> m_codeWritten;
+			uintptr_t m_codeWriteLow;
+			uintptr_t m_codeWriteHigh;
+			std::atomic<uint64_t> m_codeWrites;
 		};
 	}
 }
@@ -0,0 +1,56 @@
+#ifndef BLACKLIGHT_VM_NATIVE_H_
+#define BLACKLIGHT_VM_NATIVE_H_
+
+/*
+Native Images
+10/17/26 22:30
+*/
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		class MemoryController;
+
+		// What translated code runs with. R_PRG holds where it starts, and where it stopped once it returns
+		struct NativeContext
+		{
+			uint32_t* m_pRegisters;
+			MemoryController* m_pMemory;
+			// instructions it may run, less the ones it ran once it returns
+			uint64_t m_budget;
+		};
+
+		// An image the Translator turned into C++, see CPU::SetNativeImage
+		struct NativeImage
+		{
+			// the span of code it was translated from, instruction by instruction, and its hash. It is all the
+			// CPU watches for code writes while the image is attached
+			uint32_t m_begin;
+			uint32_t m_size;
+			uint64_t m_hash;
+
+			// Runs from R_PRG until the budget runs out, it reaches an instruction it was not translated for,
+			// or a store writes over the span
+			void (*m_pRun)(NativeContext& context);
+		};
+
+		// Returns the hash a NativeImage keeps of the code it was translated from, 64 bit FNV-1a
+		inline uint64_t HashNativeCode(const uint8_t* pCode, const size_t size)
+		{
+			uint64_t hash = 0xCBF29CE484222325ull;
+			for (size_t i = 0; i < size; ++i)
+			{
+				hash ^= pCode[i];
+				hash *= 0x100000001B3ull;
+			}
+
+			return hash;
+		}
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+#ifndef BLACKLIGHT_VM_OPTIMIZER_H_
+#define BLACKLIGHT_VM_OPTIMIZER_H_
+
+/*
+Bytecode Optimizer
+10/17/26 21:25
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Rewrites an image ahead of time. The code reached from the origin is
+		 *	split into basic blocks, then until nothing changes: unreachable
+		 *	blocks are dropped, jumps to jumps are threaded and jumps to the next
+		 *	block removed, constants are propagated through the registers to drop
+		 *	LDVs of values already there and decide branches, PUSHes straight
+		 *	into POPs become moves, and writes to registers and flags nothing
+		 *	reads are removed. The blocks are then linked back together with
+		 *	JMP and CALL as short as they can be.
+		 *
+		 *	CX and TRAP are left exactly where they are, with every register
+		 *	taken to be read by them and anything after them, as are loads and
+		 *	stores. The image after the code keeps its addresses. Images are
+		 *	returned unchanged, with the reason in GetStats, when they jump or
+		 *	call through a register, use R_PRG as an operand, load or store
+		 *	inside their own code, or do not decode. Code that writes over itself
+		 *	through a register or returns anywhere but after its CALL is not
+		 *	supported, and the values PUSH left below the stack are not kept
+		 */
+		class Optimizer
+		{
+		public:
+			struct Stats
+			{
+				bool m_optimized;
+				std::string m_reason;	// why the image was left as it was
+
+				// instructions reached from the origin and the bytes they take up
+				size_t m_instructionsBefore;
+				size_t m_instructionsAfter;
+				size_t m_sizeBefore;
+				size_t m_sizeAfter;
+
+				// instructions each pass removed or rewrote
+				size_t m_unreachable;
+				size_t m_threaded;
+				size_t m_folded;
+				size_t m_stack;
+				size_t m_dead;
+			};
+
+			Optimizer();
+
+			// Returns the optimized image, or a copy of it when it can not be. Throws std::runtime_error
+			// when it is too short for its header
+			std::vector<uint8_t> Optimize(const uint8_t* pImage, const size_t size);
+
+			// Returns the statistics for the last image optimized
+			const Stats& GetStats() const;
+		private:
+			Stats m_stats;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,104 @@
+#ifndef BLACKLIGHT_VM_PROFILER_H_
+#define BLACKLIGHT_VM_PROFILER_H_
+
+/*
+VM Profiler
+10/17/26 19:10
+*/
+
+#include <VM/Arch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Records where a CPU spends its instructions: how often every opcode
+		 *	ran, how often BR was taken, a sampled histogram of R_PRG and the
+		 *	guest call graph, kept as a shadow stack of CALL targets. Samples
+		 *	are taken along with the shadow stack, so they export as folded
+		 *	stacks for flamegraphs as well as to a compact binary file
+		 */
+		class Profiler
+		{
+		public:
+			// deepest shadow stack that is kept, deeper calls are only counted
+			static constexpr size_t MAX_DEPTH = 0x400;
+
+			// Samples R_PRG once every sampleInterval instructions
+			Profiler(const uint32_t sampleInterval = 0x100);
+
+			// Called by the CPU whenever it starts running with the profiler. The first address becomes the
+			// outermost function of the shadow stack
+			void Start(const uint32_t address);
+
+			// Records an instruction that is about to run at address. Called by the CPU
+			void RecordInstruction(const uint8_t opcode, const uint32_t address)
+			{
+				++m_opcodeCounts[opcode];
+
+				if (--m_untilSample == 0)
+					Sample(address);
+			}
+			// Records whether a BR was taken
+			void RecordBranch(const bool taken)
+			{
+				++m_branchCounts[taken ? 1 : 0];
+			}
+			// Records a CALL that went to target, and the RET that comes back from it
+			void RecordCall(const uint32_t target);
+			void RecordReturn();
+
+			// Returns how often an opcode ran, every size and addressing variant of it counted together
+			uint64_t GetOpcodeCount(const OpcodeE op) const;
+			// Returns how often a single encoding of an opcode ran
+			uint64_t GetEncodingCount(const uint8_t opcode) const;
+
+			// Returns how often a BR was taken and how often it fell through
+			uint64_t GetBranchesTaken() const;
+			uint64_t GetBranchesNotTaken() const;
+
+			// Returns how often each R_PRG was sampled
+			const std::map<uint32_t, uint64_t>& GetSamples() const;
+			// Returns how often each function called each other function, keyed by caller then callee
+			const std::map<std::pair<uint32_t, uint32_t>, uint64_t>& GetCallGraph() const;
+
+			// Writes every sample as a line of ';' separated functions, outermost first, followed by a count.
+			// Throws std::runtime_error if the file can not be written
+			void SaveFoldedStacks(const char* path) const;
+
+			// Writes everything recorded to a binary file, see Profiler.cpp for the layout. Throws
+			// std::runtime_error if the file can not be written
+			void Save(const char* path) const;
+
+			// Throws away everything recorded
+			void Clear();
+		private:
+			// Adds a sample of address under the current shadow stack
+			void Sample(const uint32_t address);
+
+			uint32_t m_sampleInterval;
+			uint32_t m_untilSample;
+
+			uint64_t m_opcodeCounts[0x100];
+			uint64_t m_branchCounts[2];
+
+			std::map<uint32_t, uint64_t> m_samples;
+			std::map<std::pair<uint32_t, uint32_t>, uint64_t> m_callGraph;
+			std::map<std::vector<uint32_t>, uint64_t> m_stacks;
+
+			// functions entered and not yet returned from, the first is wherever profiling started
+			std::vector<uint32_t> m_shadowStack;
+			// calls past MAX_DEPTH that have not returned
+			size_t m_overflow;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,130 @@
+#ifndef BLACKLIGHT_VM_SCHEDULER_H_
+#define BLACKLIGHT_VM_SCHEDULER_H_
+
+/*
+VM Scheduler
+10/17/26 16:05
+*/
+
+#include <VM/CPU.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Multiplexes many CPUs over a pool of worker threads. Each CPU runs for
+		 *	at most a quantum of instructions at a time and then goes to the back
+		 *	of its worker's queue. Workers that run out of CPUs steal from the
+		 *	back of another worker's queue
+		 */
+		class Scheduler
+		{
+		public:
+			// Statistics for a single CPU
+			struct InstanceStats
+			{
+				uint64_t m_instructions;	// instructions run under the scheduler
+				uint64_t m_slices;			// quanta it was given
+				bool m_finished;
+				bool m_faulted;				// Run threw, the CPU was dropped
+			};
+
+			// Statistics for a single worker thread
+			struct WorkerStats
+			{
+				uint64_t m_slices;
+				uint64_t m_steals;
+			};
+
+			// Starts workerCount threads (one per hardware thread when 0), each giving CPUs at most quantum instructions at a time
+			Scheduler(const size_t workerCount = 0, const uint64_t quantum = 0x10000);
+
+			// Adds a CPU that has an image loaded, returns its id. The CPU belongs to the scheduler until it finishes
+			size_t Add(CPU* pCPU);
+
+			// Blocks until every CPU added so far has finished
+			void Wait();
+			// Blocks until the CPU by the id Add returned has finished, after which the scheduler no longer touches it
+			void Wait(const size_t id);
+
+			// Leaves the CPU by the id Add returned out of the queues once its quantum ends, until it is resumed. Called
+			// from inside its Run when it can not go on until something else happens
+			void Park(const size_t id);
+			// Puts a parked CPU back in a queue, or keeps one that is still running from being parked
+			void Resume(const size_t id);
+
+			// Returns the statistics for a CPU by the id Add returned
+			InstanceStats GetInstanceStats(const size_t id) const;
+			// Returns the statistics for every CPU, in the order they were added
+			std::vector<InstanceStats> GetInstanceStats() const;
+			// Returns the statistics for every worker thread
+			std::vector<WorkerStats> GetWorkerStats() const;
+
+			// Stops the workers once they finish their current quanta. CPUs that have not finished are left as they are
+			void Stop();
+
+			~Scheduler();
+		private:
+			struct Instance
+			{
+				CPU* m_pCPU;
+				std::atomic<uint64_t> m_instructions;
+				std::atomic<uint64_t> m_slices;
+				std::atomic<bool> m_finished;
+				std::atomic<bool> m_faulted;
+
+				// under m_stateMutex, m_parking from Park until its quantum ends and m_parked from then until Resume
+				bool m_parking;
+				bool m_parked;
+			};
+
+			struct Worker
+			{
+				std::mutex m_mutex;
+				std::deque<Instance*> m_queue;
+				std::thread m_thread;
+
+				std::atomic<uint64_t> m_slices;
+				std::atomic<uint64_t> m_steals;
+			};
+
+			// Runs CPUs on a worker thread until the scheduler stops
+			void WorkerMain(const size_t index);
+
+			// Takes the next CPU from a worker's own queue, or steals one. Returns nullptr if there are none
+			Instance* Take(const size_t index);
+
+			// Puts a CPU at the back of a worker's queue and wakes a worker for it
+			void Queue(const size_t index, Instance* pInstance);
+
+			uint64_t m_quantum;
+			std::vector<std::unique_ptr<Worker>> m_workers;
+
+			// instances never move once added, so workers can hold on to them
+			mutable std::mutex m_instanceMutex;
+			std::deque<std::unique_ptr<Instance>> m_instances;
+			std::atomic<size_t> m_nextWorker;
+
+			// CPUs sitting in queues, workers sleep while there are none
+			std::atomic<size_t> m_queued;
+			std::mutex m_stateMutex;
+			std::condition_variable m_workCondition;
+			std::condition_variable m_finishedCondition;
+			size_t m_unfinished;
+			std::atomic<bool> m_stop;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
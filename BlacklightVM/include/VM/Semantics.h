@@ -0,0 +1,117 @@
+#ifndef BLACKLIGHT_VM_SEMANTICS_H_
+#define BLACKLIGHT_VM_SEMANTICS_H_
+
+/*
+Instruction Semantics
+10/17/26 23:58
+*/
+
+#include <VM/Arch.h>
+#include <VM/MemoryController.h>
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		// Returns R_CND with the P, E and N flags cleared, which CMP does before it reads either operand so that a
+		// CMP on R_CND compares what is left of it
+		template<typename R>
+		R ClearFlags(const R cnd)
+		{
+			return cnd & ~static_cast<R>(F_P | F_E | F_N);
+		}
+
+		// Returns R_CND with one of the P, E and N flags set in place of the others
+		template<typename R>
+		R SetFlag(const R cnd, const uint32_t flag)
+		{
+			return ClearFlags(cnd) | flag;
+		}
+
+		// Returns the flag CMP sets for dst against src, unsigned at the register width R
+		template<typename R>
+		uint32_t CompareFlag(const R dst, const R src)
+		{
+			return src > dst ? F_P : (src == dst ? F_E : F_N);
+		}
+
+		// Runs the extended instruction at R_PRG for a core with registers r of width R. Counts and addresses are
+		// the whole register, XOP_CAS and XOP_FETCHADD work on dwords whatever the width. Throws
+		// std::runtime_error if its opcode is unknown
+		template<typename R>
+		void RunExtended(MemoryController& mc, R* r)
+		{
+			const uint8_t* pCode = mc.Fetch(r[R_PRG]);
+			uint8_t xop = pCode[1];
+			uint8_t dst = pCode[2] >> 4;
+			uint8_t src = pCode[2] & 0xF;
+			uint8_t count = pCode[3] >> 4;
+
+			// every operand is read before anything is written, R_PRG included
+			R dstValue = r[dst];
+			R srcValue = r[src];
+			R size = r[count];
+
+			r[R_PRG] += 4;
+
+			switch (xop)
+			{
+			case XOP_MEMCPY:
+				mc.Copy(dstValue, srcValue, size);
+				break;
+			case XOP_MEMSET:
+				mc.Fill(dstValue, static_cast<uint8_t>(srcValue), size);
+				break;
+			case XOP_MEMCMP:
+			{
+				R equal = static_cast<R>(mc.Compare(dstValue, srcValue, size));
+
+				// the flags CMP would set for the first pair that differs
+				if (equal == size)
+					r[R_CND] = SetFlag(r[R_CND], F_E);
+				else
+					r[R_CND] = SetFlag(r[R_CND], mc.Read8(srcValue + equal) > mc.Read8(dstValue + equal) ? F_P : F_N);
+
+				r[count] = equal;
+				break;
+			}
+			case XOP_MEMCHR:
+			{
+				R offset = static_cast<R>(mc.Find(dstValue, static_cast<uint8_t>(srcValue), size));
+
+				r[R_CND] = SetFlag(r[R_CND], offset != size ? F_E : F_N);
+
+				r[count] = offset;
+				break;
+			}
+			case XOP_CHECKSUM:
+				r[dst] = mc.Checksum(srcValue, size);
+				break;
+			case XOP_CAS:
+			{
+				uint32_t expected = static_cast<uint32_t>(size);
+				uint32_t previous = mc.CompareExchange32(dstValue, expected, static_cast<uint32_t>(srcValue));
+
+				r[R_CND] = SetFlag(r[R_CND], previous == expected ? F_E : F_N);
+
+				r[count] = previous;
+				break;
+			}
+			case XOP_FETCHADD:
+				r[count] = mc.FetchAdd32(dstValue, static_cast<uint32_t>(srcValue));
+				break;
+			case XOP_FENCE:
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				break;
+			default:
+				throw std::runtime_error("Unknown extended opcode");
+			}
+		}
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef BLACKLIGHT_VM_SHAREDIMAGE_H_
+#define BLACKLIGHT_VM_SHAREDIMAGE_H_
+
+/*
+Shared Image
+10/17/26 17:20
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	An image file opened once and mapped copy-on-write into any number of
+		 *	MemoryControllers, so its pages are only read in when they are touched
+		 *	and are shared until a CPU writes to them. The file is mapped directly
+		 *	when its code already sits page aligned for its origin, otherwise the
+		 *	code is laid out once in an anonymous shared file. Hosts without
+		 *	mapping support keep a single copy and every CPU copies from it
+		 */
+		class SharedImage
+		{
+		public:
+			// Opens an image file, throws std::runtime_error if it can not be read or mapped
+			SharedImage(const char* path);
+
+			SharedImage(const SharedImage&) = delete;
+			SharedImage& operator=(const SharedImage&) = delete;
+
+			// Returns the values from the image header
+			uint32_t GetStackSize() const;
+			uint32_t GetOrigin() const;
+			// Returns the size of the code, which is loaded at the origin
+			size_t GetCodeSize() const;
+
+			// Returns the file and offset to map copy-on-write at GetMapAddress, -1 if the host can not map
+			int GetMapFile() const;
+			uint64_t GetMapOffset() const;
+			// Returns the page aligned range of guest memory the mapping covers
+			uintptr_t GetMapAddress() const;
+			size_t GetMapSize() const;
+
+			// Returns the code for hosts that can not map
+			const uint8_t* GetCode() const;
+
+			~SharedImage();
+		private:
+			uint32_t m_stackSize;
+			uint32_t m_origin;
+			size_t m_codeSize;
+
+			int m_mapFile;
+			uint64_t m_mapOffset;
+			uintptr_t m_mapAddress;
+			size_t m_mapSize;
+
+			std::vector<uint8_t> m_code;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,88 @@
+#ifndef BLACKLIGHT_VM_SOCKETTABLE_H_
+#define BLACKLIGHT_VM_SOCKETTABLE_H_
+
+/*
+Guest Sockets
+10/17/26 20:40
+*/
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		class CPU;
+
+		// What a suspended trap waits on a socket for, the same bits as POLLIN and POLLOUT
+		enum SocketEventE : uint32_t
+		{
+			SE_READ = (1 << 0),
+			SE_WRITE = (1 << 2)
+		};
+
+		// A host socket a suspended trap waits on
+		struct SocketWait
+		{
+			int m_fd;
+			uint32_t m_events;
+		};
+
+		/*
+		 *	The sockets a guest has opened through TRAP, by the handles the guest
+		 *	sees. Every host socket is non-blocking, so a trap that would block
+		 *	returns false rather than waiting and leaves what it would have
+		 *	waited for in GetWait. Running it again retries it. Arguments and
+		 *	results follow the trap table in doc/VMArch.docx, with pointers into
+		 *	guest memory and fd_sets holding a bit per handle. Hosts other than
+		 *	Linux fail every socket trap
+		 */
+		class SocketTable
+		{
+		public:
+			SocketTable();
+
+			SocketTable(const SocketTable&) = delete;
+			SocketTable& operator=(const SocketTable&) = delete;
+
+			// Runs a socket trap with its arguments in the CPU's registers, leaving its result in R_A.
+			// Returns false if it would block
+			bool Trap(CPU& cpu, const uint8_t tc);
+
+			// Returns what the last trap that would block waits for, and how many milliseconds it waits at most (-1 for ever)
+			const std::vector<SocketWait>& GetWait() const;
+			int GetWaitTimeout() const;
+			// Blocks until something the last trap that would block waits for is ready, or it times out
+			void Wait() const;
+
+			// Closes every socket
+			~SocketTable();
+		private:
+			// the most one recv or send moves
+			static constexpr size_t TRANSFER_SIZE = 0x10000;
+
+			// Returns the host socket behind a handle, -1 if there is none
+			int Find(const uint32_t handle) const;
+			// Returns a handle for a host socket
+			uint32_t Insert(const int fd);
+
+			bool Select(CPU& cpu);
+
+			// host sockets by handle, -1 where the handle is free
+			std::vector<int> m_sockets;
+
+			// what recv and send move through
+			std::vector<uint8_t> m_buffer;
+
+			std::vector<SocketWait> m_wait;
+			// when a SELECT that is waiting gives up, so retrying it does not start its timeout over
+			bool m_hasDeadline;
+			std::chrono::steady_clock::time_point m_deadline;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
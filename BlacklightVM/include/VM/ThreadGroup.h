@@ -0,0 +1,116 @@
+#ifndef BLACKLIGHT_VM_THREADGROUP_H_
+#define BLACKLIGHT_VM_THREADGROUP_H_
+
+/*
+Guest Threads
+10/17/26 23:20
+*/
+
+#include <VM/CPU.h>
+#include <VM/Scheduler.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Runs the threads of one guest, each a CPU with registers and decoded
+		 *	code of its own over the same MM_FLAT memory, on the workers of a
+		 *	Scheduler, so they spread over as many host cores as it has. TC_SPAWN
+		 *	starts a thread at a, with the top of its stack in b and c in its a,
+		 *	and leaves its id in a, or -1 when the group is full. TC_JOIN waits
+		 *	for the thread whose id is in a to halt and leaves what it had in a
+		 *	then in a. Joining a thread that faulted faults too.
+		 *
+		 *	Aligned loads and stores of up to a dword never tear, but nothing
+		 *	orders them against other threads apart from XOP_CAS and XOP_FETCHADD,
+		 *	which are sequentially consistent, and XOP_FENCE, a sequentially
+		 *	consistent fence. Everything a thread did before TC_SPAWN is seen by
+		 *	the thread it starts, and everything a thread did before it halted is
+		 *	seen by whoever joins it. Code one thread writes is run by the others
+		 *	from their next extended instruction or trap on at the latest.
+		 *
+		 *	Snapshots, forks and traces are of one thread, so shared memory
+		 *	refuses to be snapshotted and a CPU that traces can not be started
+		 */
+		class ThreadGroup
+		{
+		public:
+			struct Stats
+			{
+				uint64_t m_spawned;
+				uint64_t m_refused;		// TC_SPAWNs turned down while the group was full
+				uint64_t m_joins;		// TC_JOINs that went through
+				uint64_t m_faulted;
+			};
+
+			// Runs threads on scheduler, at most maxThreads of them at once counting the first, any number when 0.
+			// The group has to outlive its threads' time on the scheduler, Wait for them or stop it first
+			ThreadGroup(Scheduler& scheduler, const size_t maxThreads = 0);
+
+			ThreadGroup(const ThreadGroup&) = delete;
+			ThreadGroup& operator=(const ThreadGroup&) = delete;
+
+			// Makes pCPU, which has an image loaded in MM_FLAT memory, the first thread of the guest with id 0 and
+			// adds it to the scheduler. Throws std::runtime_error if the group has started already, or the CPU
+			// records or replays a trace
+			void Start(CPU* pCPU);
+
+			// Blocks until every thread has finished or faulted and the scheduler has let go of them
+			void Wait();
+			// Blocks until the thread with an id has finished or faulted. Throws std::runtime_error if there is none
+			void Wait(const uint32_t id);
+
+			// Returns how many threads were started, the first one included
+			size_t GetThreadCount() const;
+			// Returns the CPU of a thread, which must be left alone until it finishes. The ones TC_SPAWN created
+			// belong to the group. Throws std::out_of_range if there is none
+			CPU* GetThread(const uint32_t id) const;
+
+			Stats GetStats() const;
+		private:
+			// the traps and Run(maxInstructions) go through these
+			friend class CPU;
+
+			// Starts a thread for TC_SPAWN from parent and returns its id, UINT32_MAX when the group is full
+			uint32_t Spawn(CPU& parent, const uint32_t entry, const uint32_t stack, const Register argument);
+			// For TC_JOIN from cpu, returns false while the thread is still running and parks cpu on the scheduler
+			// until it finishes, and leaves what it halted with in result once it has. Throws std::runtime_error if
+			// the thread faulted, is cpu or was never started
+			bool Join(const CPU& cpu, const uint32_t id, Register& result);
+			// Records that a thread finished, once, and resumes the threads parked joining it
+			void Finish(const uint32_t id, const Register result, const bool faulted);
+
+			struct Thread
+			{
+				std::unique_ptr<CPU> m_pOwned;
+				CPU* m_pCPU;
+				size_t m_schedulerId;
+				bool m_finished;
+				bool m_faulted;
+				Register m_result;
+				std::vector<uint32_t> m_joiners;	// threads parked in TC_JOIN until this one finishes
+			};
+
+			Scheduler& m_scheduler;
+			size_t m_maxThreads;
+
+			// threads never move once started, so their CPUs can hold on to their ids
+			mutable std::mutex m_mutex;
+			std::condition_variable m_finishedCondition;
+			std::deque<Thread> m_threads;
+			size_t m_running;
+			Stats m_stats;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+#ifndef BLACKLIGHT_VM_TRACE_H_
+#define BLACKLIGHT_VM_TRACE_H_
+
+/*
+Record/Replay Trace
+10/17/26 20:05
+*/
+
+#include <VM/Arch.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		// What a trace records. Everything between them is deterministic
+		enum TraceEventE : uint8_t
+		{
+			TE_IMAGE,	// the image that was loaded
+			TE_INPUT,	// bytes the host wrote into guest memory
+			TE_START,	// the registers when the guest started running
+			TE_RESULT,	// what a CX or TRAP did to the registers
+			TE_END
+		};
+
+		// A single event read back from a trace
+		struct TraceEvent
+		{
+			TraceEventE m_kind;
+			uint32_t m_address;				// TE_INPUT where the bytes go, TE_RESULT the instruction
+			uint32_t m_stackSize;			// TE_IMAGE
+			uint32_t m_origin;				// TE_IMAGE
+			std::vector<uint8_t> m_data;	// TE_IMAGE code, TE_INPUT bytes
+			uint32_t m_registers[R_COUNT];	// TE_START values, TE_RESULT differences from before the instruction
+			bool m_finished;				// TE_RESULT, the instruction finished the guest
+		};
+
+		/*
+		 *	Streams a trace to a file. Events are encoded into a buffer on the
+		 *	calling thread, varints with addresses and registers stored as the
+		 *	difference from what came before, and whole buffers are written out
+		 *	on a background thread
+		 */
+		class TraceWriter
+		{
+		public:
+			// Creates the trace file, throws std::runtime_error if it can not be
+			TraceWriter(const char* path, const size_t blockSize);
+
+			TraceWriter(const TraceWriter&) = delete;
+			TraceWriter& operator=(const TraceWriter&) = delete;
+
+			void WriteImage(const uint32_t stackSize, const uint32_t origin, const uint8_t* pCode, const size_t size);
+			void WriteInput(const uint32_t address, const uint8_t* pData, const size_t size);
+			void WriteStart(const uint32_t* pRegisters);
+			// pBefore and pAfter are the register file on either side of the instruction at address
+			void WriteResult(const uint32_t address, const uint32_t* pBefore, const uint32_t* pAfter, const bool finished);
+
+			// Writes out everything left and ends the trace. Throws std::runtime_error if any of it could not be written
+			void Close();
+
+			~TraceWriter();
+		private:
+			// bytes buffered before they are handed to the background thread
+			static constexpr size_t FLUSH_SIZE = 0x10000;
+
+			void Put(const uint8_t data);
+			void PutVarint(uint64_t data);
+			void PutSigned(const int64_t data);
+			void PutBytes(const uint8_t* pData, const size_t size);
+
+			// Hands the buffer to the background thread once it is big enough, or always when forced
+			void Flush(const bool force);
+
+			// Writes buffers until the trace is closed
+			void WriterMain();
+
+			std::ofstream m_out;
+			std::vector<uint8_t> m_buffer;
+			uint32_t m_lastAddress;
+
+			std::mutex m_mutex;
+			std::condition_variable m_condition;
+			std::deque<std::vector<uint8_t>> m_pending;
+			bool m_closing;
+			bool m_failed;
+			std::thread m_thread;
+		};
+
+		// Reads a trace back one event at a time
+		class TraceReader
+		{
+		public:
+			// Opens a trace, throws std::runtime_error if it is not one
+			TraceReader(const char* path);
+
+			// Returns the size of memory the trace was recorded with
+			size_t GetBlockSize() const;
+
+			// Reads the next event, TE_END once the trace is over. Throws std::runtime_error if it is cut short
+			void Read(TraceEvent& event);
+		private:
+			uint8_t Get();
+			uint64_t GetVarint();
+			int64_t GetSigned();
+
+			std::ifstream m_in;
+			size_t m_blockSize;
+			uint32_t m_lastAddress;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+#ifndef BLACKLIGHT_VM_TRANSLATOR_H_
+#define BLACKLIGHT_VM_TRANSLATOR_H_
+
+/*
+Ahead of Time Translator
+10/17/26 22:35
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		/*
+		 *	Translates an image into a C++ source file ahead of time, for the
+		 *	host compiler to optimize along with everything else. The code
+		 *	reached from the origin, along with whatever the linear sweep finds,
+		 *	becomes one function with a label for every basic block and a goto
+		 *	for every direct branch. JMP, BR and CALL through a register and
+		 *	RET go through a switch over the blocks. The registers live in locals
+		 *	and memory goes through the MemoryController, so every register,
+		 *	flag and byte of memory comes out the same as in the interpreter,
+		 *	which stays the reference to test it against.
+		 *
+		 *	Instructions are counted a block at a time. CX, TRAP, instructions
+		 *	naming R_PRG, and anything that does not decode are left to the
+		 *	CPU, as is everything after a store that writes over translated
+		 *	code, which detaches it. The file defines a NativeImage that is
+		 *	handed to CPU::SetNativeImage
+		 */
+		class Translator
+		{
+		public:
+			struct Stats
+			{
+				// instructions translated, the basic blocks they make up and the instructions left to the CPU
+				size_t m_instructions;
+				size_t m_blocks;
+				size_t m_exits;
+			};
+
+			Translator();
+
+			// Returns a C++ source file defining `extern const Blacklight::VM::NativeImage name` for an image.
+			// Throws std::runtime_error when it is too short for its header or name is not an identifier
+			std::string Translate(const uint8_t* pImage, const size_t size, const std::string& name);
+
+			// Returns the statistics for the last image translated
+			const Stats& GetStats() const;
+		private:
+			Stats m_stats;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#ifndef BLACKLIGHT_VM_VERIFIER_H_
+#define BLACKLIGHT_VM_VERIFIER_H_
+
+/*
+Image Verifier
+10/17/26 22:10
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		// An instruction the Verifier reached but could not prove, and why
+		struct VerifierIssue
+		{
+			uint32_t m_address;
+			std::string m_reason;
+		};
+
+		// A run of proven instructions laid end to end, [m_begin, m_end)
+		struct VerifiedRegion
+		{
+			uint32_t m_begin;
+			uint32_t m_end;
+		};
+
+		/*
+		 *	Proves code safe to run without checking each instruction. The code
+		 *	is decoded from its origin along every fall through and direct BR,
+		 *	JMP and CALL target, with the decoder the cores use. An instruction
+		 *	is proven when it lies wholly inside the image, starts on no other
+		 *	instruction, loads and stores to a fixed address only inside of
+		 *	memory and never into the code, and every instruction it goes on to
+		 *	is proven as well. Every register nibble names a register, so there
+		 *	is nothing to check there.
+		 *
+		 *	Proven code therefore only leaves itself through JMP, BR, CALL or
+		 *	RET on a register, CX and TRAP, or a store through a register
+		 *	landing on code, which is where DM_VERIFIED goes back to checking.
+		 *	Code only reached that way is not proven
+		 */
+		class Verifier
+		{
+		public:
+			struct Stats
+			{
+				// instructions reached from the origin, and how many of them were proven
+				size_t m_instructions;
+				size_t m_verified;
+				size_t m_regions;
+			};
+
+			Verifier();
+
+			// Verifies size bytes of code that are loaded at origin in memorySize bytes of guest memory
+			void Verify(const uint8_t* pCode, const uint32_t origin, const size_t size, const size_t memorySize);
+			// Verifies an image as it would be loaded into memorySize bytes of guest memory. Throws
+			// std::runtime_error when it is too short for its header
+			void VerifyImage(const uint8_t* pImage, const size_t size, const size_t memorySize);
+
+			// Takes the proof for size bytes of code at origin from an earlier Verify of the same code, see
+			// ImageCache. pMap is what GetMap returned, the rest what the other getters did
+			void Restore(const uint32_t origin, const uint8_t* pMap, const size_t size, std::vector<VerifiedRegion> regions, std::vector<VerifierIssue> issues, const Stats& stats);
+
+			// Returns whether a proven instruction starts at an address
+			bool IsVerified(const uint32_t address) const
+			{
+				uint32_t offset = address - m_origin;
+
+				return offset < m_map.size() && m_map[offset] != 0;
+			}
+
+			// Returns a byte for every byte of the code from its origin, set where a proven instruction starts
+			const uint8_t* GetMap() const
+			{
+				return m_map.data();
+			}
+
+			// Takes back the proof for every instruction that may have decoded a byte in [low, high], the same
+			// slots DecodeCache::Invalidate throws away
+			void Invalidate(const uint32_t low, const uint32_t high);
+
+			// Returns the runs of proven instructions and the instructions that were not, from the last Verify
+			const std::vector<VerifiedRegion>& GetRegions() const;
+			const std::vector<VerifierIssue>& GetIssues() const;
+			const Stats& GetStats() const;
+		private:
+			uint32_t m_origin;
+			std::vector<uint8_t> m_map;
+
+			std::vector<VerifiedRegion> m_regions;
+			std::vector<VerifierIssue> m_issues;
+			Stats m_stats;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
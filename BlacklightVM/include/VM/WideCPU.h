@@ -0,0 +1,198 @@
+#ifndef BLACKLIGHT_VM_WIDECPU_H_
+#define BLACKLIGHT_VM_WIDECPU_H_
+
+/*
+Wide CPU
+10/17/26 23:45
+*/
+
+#include <VM/Arch.h>
+#include <VM/CPU.h>
+#include <VM/MemoryController.h>
+#include <VM/SharedImage.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Blacklight
+{
+	namespace VM
+	{
+		using WideRegister = uint64_t;
+
+		// Pre-decoded operations of a WideCPU. Like MicroOpE, each opcode is split up by its size bits, with a
+		// qword form for when none of them are set
+		enum WideOpE : uint8_t
+		{
+			WOP_UNDECODED,	// slot has not been decoded yet (or was thrown away)
+			WOP_INTERP,		// CX and TRAP, run by WideCPU::Interpret
+			WOP_LD8_ABS,
+			WOP_LD16_ABS,
+			WOP_LD32_ABS,
+			WOP_LD64_ABS,
+			WOP_LD8,
+			WOP_LD16,
+			WOP_LD32,
+			WOP_LD64,
+			WOP_LDV_IMM,
+			WOP_LDV8,
+			WOP_LDV16,
+			WOP_LDV32,
+			WOP_LDV64,
+			WOP_ST8_ABS,
+			WOP_ST16_ABS,
+			WOP_ST32_ABS,
+			WOP_ST64_ABS,
+			WOP_ST8,
+			WOP_ST16,
+			WOP_ST32,
+			WOP_ST64,
+			WOP_PUSH_IMM,
+			WOP_PUSH,
+			WOP_POP,
+			WOP_ADD_IMM,
+			WOP_ADD8,
+			WOP_ADD16,
+			WOP_ADD32,
+			WOP_ADD64,
+			WOP_SUB_IMM,
+			WOP_SUB8,
+			WOP_SUB16,
+			WOP_SUB32,
+			WOP_SUB64,
+			WOP_AND_IMM,
+			WOP_AND8,
+			WOP_AND16,
+			WOP_AND32,
+			WOP_AND64,
+			WOP_NOT,
+			WOP_CMP_IMM,
+			WOP_CMP8,
+			WOP_CMP16,
+			WOP_CMP32,
+			WOP_CMP64,
+			WOP_BR_IMM,
+			WOP_BR,
+			WOP_JMP_IMM,
+			WOP_JMP,
+			WOP_CALL_IMM,
+			WOP_CALL,
+			WOP_RET,
+			WOP_COUNT
+		};
+
+		// A single pre-decoded wide instruction
+		struct WideOp
+		{
+			WideOpE m_kind;
+			uint8_t m_dst;		// resolved destination register, or the condition mask for BR
+			uint8_t m_src;		// resolved source register
+			uint8_t m_length;	// instruction length in bytes
+			uint64_t m_imm;		// sign-extended immediate, absolute address or absolute branch target
+		};
+
+		/*
+		 *	A CPU with 64-bit registers and addresses, for guests whose data
+		 *	does not fit in 4 GiB. Memory is a MemoryController of any size the
+		 *	host can reserve: MM_FLAT reserves the whole of it and the host only
+		 *	backs the pages that are touched, MM_PAGED allocates a page the first
+		 *	time it is written, so either holds multi-GiB data sets at the cost
+		 *	of what the guest uses.
+		 *
+		 *	Instructions are encoded as they are for a CPU. An instruction
+		 *	without any of the b, w and d size bits works on the whole register,
+		 *	a qword: LD and ST move one, LDV, ADD, SUB, AND and CMP take the
+		 *	whole source register, or an 8-byte immediate. Sized sources are
+		 *	extended the way a CPU extends them to 32 bits, only to 64. PUSH,
+		 *	POP, CALL and RET move qwords. Addresses relative to the next
+		 *	instruction stay 32-bit offsets, which reach across any image, and
+		 *	images load below 4 GiB as they do on a CPU. Data past that is
+		 *	reached through registers.
+		 *
+		 *	The traps are putc, puts, getchar and halt along with the extended
+		 *	page, where counts and addresses are 64-bit and cas and fetchadd
+		 *	work on the low dword of their registers. CX, sockets and threads
+		 *	throw std::runtime_error. The CPU and its cores are left at 32 bits,
+		 *	so running narrow guests costs nothing for this
+		 */
+		class WideCPU
+		{
+		public:
+			// longest encoding, LDV with a qword immediate
+			static constexpr size_t MAX_LENGTH = 10;
+
+			WideCPU(const size_t blockSize, const MemoryMode memoryMode = MM_FLAT);
+
+			WideCPU(const WideCPU&) = delete;
+			WideCPU& operator=(const WideCPU&) = delete;
+
+			// Returns the CPU's MemoryController
+			MemoryController& GetMemoryController();
+			// Returns the CPU's registers
+			WideRegister& GetRegister(const uint32_t reg);
+
+			// Notifies the CPU that it should finish executing
+			void NotifyFinished();
+			// Returns whether the CPU has finished executing
+			bool IsFinished() const;
+
+			// Returns how many instructions the CPU has run across every call to Run
+			uint64_t GetInstructionCount() const;
+
+			// Loads an file image into virtual memory, mapping it copy-on-write where the host can
+			void LoadImage(const char* path);
+			// Maps an image that is shared with other CPUs into virtual memory copy-on-write
+			void LoadImage(const SharedImage& image);
+			// Loads an image from memory into virtual memory
+			void LoadImage(const uint8_t* buf, size_t size);
+
+			// Writes bytes from the host into guest memory anywhere in it, for data sets past what an image holds
+			void WriteInput(const uint64_t address, const uint8_t* pData, const size_t size);
+
+			// Runs the image that is loaded until it finishes
+			void Run();
+
+			// Runs at most maxInstructions of the image that is loaded, returns how many ran. Stops
+			// early when it finishes, and can be called again to carry on where it stopped
+			uint64_t Run(const uint64_t maxInstructions);
+
+			// Decodes one instruction from its bytes, limited to available bytes. The length it returns is
+			// more than available when the instruction does not fit in them
+			static WideOp Decode(const uint8_t* code, const uint64_t address, const size_t available);
+		private:
+			// Sets up the registers, code watch and slots for an image loaded at origin
+			void PrepareImage(const uint32_t stackSize, const uint32_t origin, const size_t size);
+
+			// Decodes the instruction at prg into its slot, or into m_uncached when it is outside of the image or
+			// runs off the end of it, which is then decoded every time it runs. Throws std::runtime_error if it is
+			// not all in memory
+			const WideOp& DecodeAt(const uint64_t prg);
+
+			// Runs a CX or TRAP, along with the extended opcode page TRAP escapes to
+			void Interpret();
+
+			// Throws away decoded instructions that the guest wrote over
+			void SyncDecodeCache()
+			{
+				if (m_memory.HasCodeWrite() == true)
+					InvalidateCodeWrite();
+			}
+			void InvalidateCodeWrite();
+
+			bool m_finished;
+
+			MemoryController m_memory;
+			WideRegister m_registers[R_COUNT];
+			uint64_t m_instructionCount;
+
+			// one slot per byte of the image, like a DecodeCache
+			uint64_t m_imageOrigin;
+			std::vector<WideOp> m_ops;
+			// the last instruction decoded outside of the slots
+			WideOp m_uncached;
+		};
+	}
+}
+
+#endif
\ No newline at end of file
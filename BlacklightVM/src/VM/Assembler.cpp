@@ -0,0 +1,894 @@
+#include <VM/Assembler.h>
+#include <VM/CPU.h>
+#include <VM/InstructionGeneration/InstructionGeneration.h>
+
+#include <cctype>
+#include <cstdlib>
+#include <initializer_list>
+#include <stdexcept>
+#include <utility>
+
+using Blacklight::VM::Assembler;
+
+using namespace Blacklight::VM;
+using namespace Blacklight::VM::InstructionGeneration;
+
+namespace
+{
+	const char* const REGISTER_NAMES[R_COUNT] =
+	{
+		"a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "sf", "sb", "prg", "cnd"
+	};
+
+	const std::pair<const char*, TrapCode> TRAP_NAMES[] =
+	{
+		{ "putc", TC_PUTC },
+		{ "puts", TC_PUTS },
+		{ "getchar", TC_GETCHAR },
+		{ "socket", TC_SOCKET },
+		{ "listen", TC_LISTEN },
+		{ "bind", TC_BIND },
+		{ "accept", TC_ACCEPT },
+		{ "select", TC_SELECT },
+		{ "recv", TC_RECV },
+		{ "send", TC_SEND },
+		{ "shutdown", TC_SHUTDOWN },
+		{ "halt", TC_HALT },
+		{ "close", TC_CLOSE },
+		{ "spawn", TC_SPAWN },
+		{ "join", TC_JOIN }
+	};
+
+	const std::pair<const char*, ExtendedOpcodeE> EXTENDED_NAMES[] =
+	{
+		{ "memcpy", XOP_MEMCPY },
+		{ "memset", XOP_MEMSET },
+		{ "memcmp", XOP_MEMCMP },
+		{ "memchr", XOP_MEMCHR },
+		{ "checksum", XOP_CHECKSUM },
+		{ "cas", XOP_CAS },
+		{ "fetchadd", XOP_FETCHADD },
+		{ "fence", XOP_FENCE }
+	};
+
+	enum OperandKindE
+	{
+		OK_REGISTER,	// a
+		OK_VALUE,		// 5, label + 4
+		OK_INDIRECT,	// [a]
+		OK_MEMORY		// [label]
+	};
+
+	struct Operand
+	{
+		OperandKindE m_kind;
+		uint8_t m_register;
+		// a value is m_symbol's address plus m_value, or just m_value without a symbol
+		std::string m_symbol;
+		int64_t m_value;
+	};
+
+	bool IsIdentifierStart(const char c)
+	{
+		return std::isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '.' || c == '$';
+	}
+
+	bool IsIdentifier(const char c)
+	{
+		return IsIdentifierStart(c) || std::isdigit(static_cast<unsigned char>(c));
+	}
+
+	std::string Trim(const std::string& text)
+	{
+		size_t begin = text.find_first_not_of(" \t\r");
+		if (begin == std::string::npos)
+			return std::string();
+
+		size_t end = text.find_last_not_of(" \t\r");
+		return text.substr(begin, end - begin + 1);
+	}
+
+	int FindRegister(const std::string& name)
+	{
+		for (int i = 0; i < R_COUNT; ++i)
+		{
+			if (name == REGISTER_NAMES[i])
+				return i;
+		}
+
+		return -1;
+	}
+
+	// Returns the smallest size that holds an immediate once it is sign extended to 32 bits
+	Size GetImmediateSize(const int64_t value)
+	{
+		int32_t extended = static_cast<int32_t>(static_cast<uint32_t>(value));
+
+		if (extended >= INT8_MIN && extended <= INT8_MAX)
+			return SZ_BYTE;
+		if (extended >= INT16_MIN && extended <= INT16_MAX)
+			return SZ_WORD;
+
+		return SZ_DWORD;
+	}
+
+	// Assembles a single object, a line at a time
+	class Assembly
+	{
+	public:
+		Assembly(const std::string& name) :
+			m_section(SC_TEXT),
+			m_line(0)
+		{
+			m_object.m_name = name;
+		}
+
+		Object Run(const std::string& source)
+		{
+			size_t begin = 0;
+			while (begin <= source.size())
+			{
+				size_t end = source.find('\n', begin);
+				if (end == std::string::npos)
+					end = source.size();
+
+				++m_line;
+				Line(source.substr(begin, end - begin));
+
+				begin = end + 1;
+			}
+
+			for (const std::string& name : m_globals)
+			{
+				auto it = m_object.m_symbols.find(name);
+				if (it == m_object.m_symbols.end())
+					throw std::runtime_error(m_object.m_name + ": .global " + name + " is never defined");
+
+				it->second.m_global = true;
+			}
+
+			return std::move(m_object);
+		}
+	private:
+		[[noreturn]] void Error(const std::string& message) const
+		{
+			throw std::runtime_error(m_object.m_name + ":" + std::to_string(m_line) + ": " + message);
+		}
+
+		void Line(const std::string& raw)
+		{
+			// the comment starts at the first ';' outside of quotes
+			std::string text;
+			bool quoted = false;
+			for (size_t i = 0; i < raw.size(); ++i)
+			{
+				if (raw[i] == '"' && (i == 0 || raw[i - 1] != '\\'))
+					quoted = !quoted;
+				else if (raw[i] == ';' && quoted == false)
+					break;
+
+				text += raw[i];
+			}
+
+			text = Trim(text);
+
+			// a label is an identifier followed by a colon
+			size_t length = 0;
+			while (length < text.size() && IsIdentifier(text[length]))
+				++length;
+
+			if (length != 0 &&
+				length < text.size() &&
+				text[length] == ':' &&
+				IsIdentifierStart(text[0]))
+			{
+				Label(text.substr(0, length));
+				text = Trim(text.substr(length + 1));
+			}
+
+			if (text.empty() == true)
+				return;
+
+			size_t split = text.find_first_of(" \t");
+			std::string mnemonic = text.substr(0, split);
+			std::vector<std::string> operands;
+			if (split != std::string::npos)
+				operands = SplitOperands(text.substr(split + 1));
+
+			for (char& c : mnemonic)
+				c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+
+			if (mnemonic[0] == '.')
+				Directive(mnemonic, operands);
+			else
+				Instruction(mnemonic, operands);
+		}
+
+		std::vector<std::string> SplitOperands(const std::string& text) const
+		{
+			std::vector<std::string> operands;
+			std::string operand;
+			bool quoted = false;
+
+			for (size_t i = 0; i < text.size(); ++i)
+			{
+				if (text[i] == '"' && (i == 0 || text[i - 1] != '\\'))
+					quoted = !quoted;
+
+				if (text[i] == ',' && quoted == false)
+				{
+					operands.push_back(Trim(operand));
+					operand.clear();
+					continue;
+				}
+
+				operand += text[i];
+			}
+
+			operands.push_back(Trim(operand));
+			for (const std::string& o : operands)
+			{
+				if (o.empty() == true)
+					Error("Empty operand");
+			}
+
+			return operands;
+		}
+
+		void Label(const std::string& name)
+		{
+			if (FindRegister(name) != -1)
+				Error("A register can not be a label: " + name);
+			if (m_object.m_symbols.count(name) != 0 ||
+				m_constants.count(name) != 0)
+				Error("Symbol defined twice: " + name);
+
+			Fragment& fragment = Data();
+			m_object.m_symbols[name] = { m_section, m_object.m_sections[m_section].size() - 1, fragment.m_bytes.size(), false };
+		}
+
+		// Returns the data fragment at the end of the current section, starting one if there is none
+		Fragment& Data()
+		{
+			std::vector<Fragment>& fragments = m_object.m_sections[m_section];
+			if (fragments.empty() == true ||
+				fragments.back().m_kind != FK_DATA)
+			{
+				Fragment fragment = {};
+				fragment.m_kind = FK_DATA;
+				fragment.m_line = m_line;
+				fragments.push_back(fragment);
+			}
+
+			return fragments.back();
+		}
+
+		void Emit(const uint8_t data)
+		{
+			Data().m_bytes.push_back(data);
+		}
+
+		void Emit(const uint32_t data, const size_t size)
+		{
+			for (size_t i = 0; i < size; ++i)
+				Emit(static_cast<uint8_t>(data >> (i * 8)));
+		}
+
+		// Emits a dword that holds a value's address, or its distance from the end of the instruction
+		void EmitAddress(const Operand& value, const bool relative)
+		{
+			Fragment& fragment = Data();
+
+			if (value.m_symbol.empty() == true &&
+				relative == false)
+			{
+				Emit(static_cast<uint32_t>(value.m_value), 4);
+				return;
+			}
+
+			Fixup fixup;
+			fixup.m_offset = fragment.m_bytes.size();
+			fixup.m_end = fragment.m_bytes.size() + 4;
+			fixup.m_relative = relative;
+			fixup.m_symbol = value.m_symbol;
+			fixup.m_addend = static_cast<int32_t>(value.m_value);
+			fixup.m_line = m_line;
+			fragment.m_fixups.push_back(fixup);
+
+			Emit(0, 4);
+		}
+
+		// Emits a qword that holds a value. Images load below 4 GiB, so an address only fills the low dword
+		void EmitQword(const Operand& value)
+		{
+			if (value.m_symbol.empty() == false)
+			{
+				EmitAddress(value, false);
+				Emit(0, 4);
+				return;
+			}
+
+			Emit(static_cast<uint32_t>(value.m_value), 4);
+			Emit(static_cast<uint32_t>(static_cast<uint64_t>(value.m_value) >> 32), 4);
+		}
+
+		// Parses an operand, whose value can take all 64 bits when it is wide
+		Operand ParseOperand(const std::string& text, const bool wide = false) const
+		{
+			Operand operand = {};
+
+			if (text.front() == '[')
+			{
+				if (text.back() != ']')
+					Error("Missing ]: " + text);
+
+				operand = ParseOperand(Trim(text.substr(1, text.size() - 2)), wide);
+				if (operand.m_kind == OK_REGISTER)
+					operand.m_kind = OK_INDIRECT;
+				else if (operand.m_kind == OK_VALUE)
+					operand.m_kind = OK_MEMORY;
+				else
+					Error("Nested brackets: " + text);
+
+				return operand;
+			}
+
+			int reg = FindRegister(text);
+			if (reg != -1)
+			{
+				operand.m_kind = OK_REGISTER;
+				operand.m_register = static_cast<uint8_t>(reg);
+				return operand;
+			}
+
+			operand.m_kind = OK_VALUE;
+			ParseValue(text, operand, wide);
+
+			return operand;
+		}
+
+		// Parses terms added and subtracted together, at most one of them a symbol that is added
+		void ParseValue(const std::string& text, Operand& operand, const bool wide) const
+		{
+			size_t i = 0;
+			bool negative = false;
+
+			for (;;)
+			{
+				while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i])))
+					++i;
+
+				if (i < text.size() && (text[i] == '-' || text[i] == '+'))
+				{
+					negative = text[i] == '-';
+					++i;
+					while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i])))
+						++i;
+				}
+
+				if (i >= text.size())
+					Error("Missing value: " + text);
+
+				int64_t term;
+				if (std::isdigit(static_cast<unsigned char>(text[i])))
+				{
+					char* pEnd;
+					term = static_cast<int64_t>(std::strtoull(text.c_str() + i, &pEnd, 0));
+					i = pEnd - text.c_str();
+				}
+				else if (text[i] == '\'' &&
+					i + 2 < text.size() &&
+					text[i + 2] == '\'')
+				{
+					term = static_cast<unsigned char>(text[i + 1]);
+					i += 3;
+				}
+				else if (IsIdentifierStart(text[i]))
+				{
+					size_t begin = i;
+					while (i < text.size() && IsIdentifier(text[i]))
+						++i;
+
+					std::string name = text.substr(begin, i - begin);
+					auto it = m_constants.find(name);
+					if (it != m_constants.end())
+						term = it->second;
+					else
+					{
+						if (FindRegister(name) != -1)
+							Error("A register can not be part of a value: " + text);
+						if (operand.m_symbol.empty() == false ||
+							negative == true)
+							Error("A value can only add a single symbol: " + text);
+
+						operand.m_symbol = name;
+						term = 0;
+					}
+				}
+				else
+					Error("Bad value: " + text);
+
+				operand.m_value += negative == true ? -term : term;
+				negative = false;
+
+				while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i])))
+					++i;
+				if (i >= text.size())
+					break;
+				if (text[i] != '+' && text[i] != '-')
+					Error("Bad value: " + text);
+			}
+
+			if (wide == false &&
+				(operand.m_value < INT32_MIN ||
+				operand.m_value > UINT32_MAX))
+				Error("Value does not fit in 32 bits: " + text);
+		}
+
+		// Returns a value that has to be known while assembling
+		int64_t ParseNumber(const std::string& text) const
+		{
+			Operand operand = ParseOperand(text);
+			if (operand.m_kind != OK_VALUE ||
+				operand.m_symbol.empty() == false)
+				Error("Expected a number: " + text);
+
+			return operand.m_value;
+		}
+
+		void Expect(const std::vector<std::string>& operands, const size_t count, const std::string& mnemonic) const
+		{
+			if (operands.size() != count)
+				Error(mnemonic + " takes " + std::to_string(count) + " operand" + (count == 1 ? "" : "s"));
+		}
+
+		void Directive(const std::string& directive, const std::vector<std::string>& operands)
+		{
+			if (directive == ".text" || directive == ".data")
+			{
+				Expect(operands, 0, directive);
+				m_section = directive == ".text" ? SC_TEXT : SC_DATA;
+			}
+			else if (directive == ".global")
+			{
+				if (operands.empty() == true)
+					Error(".global takes at least one symbol");
+
+				m_globals.insert(m_globals.end(), operands.begin(), operands.end());
+			}
+			else if (directive == ".equ")
+			{
+				Expect(operands, 2, directive);
+				if (IsIdentifierStart(operands[0][0]) == false ||
+					FindRegister(operands[0]) != -1 ||
+					m_object.m_symbols.count(operands[0]) != 0 ||
+					m_constants.count(operands[0]) != 0)
+					Error("Bad or duplicate constant: " + operands[0]);
+
+				m_constants[operands[0]] = ParseNumber(operands[1]);
+			}
+			else if (directive == ".byte" || directive == ".word")
+			{
+				size_t size = directive == ".byte" ? 1 : 2;
+				for (const std::string& operand : operands)
+				{
+					int64_t value = ParseNumber(operand);
+					if (value < -(INT64_C(1) << (size * 8 - 1)) ||
+						value >= (INT64_C(1) << (size * 8)))
+						Error("Value does not fit: " + operand);
+
+					Emit(static_cast<uint32_t>(value), size);
+				}
+			}
+			else if (directive == ".dword")
+			{
+				for (const std::string& operand : operands)
+				{
+					Operand value = ParseOperand(operand);
+					if (value.m_kind != OK_VALUE)
+						Error("Expected a value: " + operand);
+
+					EmitAddress(value, false);
+				}
+			}
+			else if (directive == ".qword")
+			{
+				for (const std::string& operand : operands)
+				{
+					Operand value = ParseOperand(operand, true);
+					if (value.m_kind != OK_VALUE)
+						Error("Expected a value: " + operand);
+
+					EmitQword(value);
+				}
+			}
+			else if (directive == ".ascii" || directive == ".asciz")
+			{
+				Expect(operands, 1, directive);
+				String(operands[0]);
+				if (directive == ".asciz")
+					Emit(static_cast<uint8_t>(0));
+			}
+			else if (directive == ".space")
+			{
+				if (operands.empty() == true || operands.size() > 2)
+					Error(".space takes a size and an optional fill byte");
+
+				int64_t size = ParseNumber(operands[0]);
+				int64_t fill = operands.size() == 2 ? ParseNumber(operands[1]) : 0;
+				if (size < 0)
+					Error("Negative size: " + operands[0]);
+
+				for (int64_t i = 0; i < size; ++i)
+					Emit(static_cast<uint8_t>(fill));
+			}
+			else if (directive == ".align")
+			{
+				Expect(operands, 1, directive);
+
+				int64_t alignment = ParseNumber(operands[0]);
+				if (alignment <= 0 ||
+					alignment > 0x10000 ||
+					(alignment & (alignment - 1)) != 0)
+					Error("Alignment has to be a power of two up to 0x10000: " + operands[0]);
+
+				Fragment fragment = {};
+				fragment.m_kind = FK_ALIGN;
+				fragment.m_alignment = static_cast<uint32_t>(alignment);
+				fragment.m_line = m_line;
+				m_object.m_sections[m_section].push_back(fragment);
+			}
+			else
+				Error("Unknown directive: " + directive);
+		}
+
+		void String(const std::string& text)
+		{
+			if (text.size() < 2 ||
+				text.front() != '"' ||
+				text.back() != '"')
+				Error("Expected a quoted string: " + text);
+
+			for (size_t i = 1; i + 1 < text.size(); ++i)
+			{
+				char c = text[i];
+				if (c == '\\' && i + 2 < text.size())
+				{
+					switch (text[++i])
+					{
+					case 'n':
+						c = '\n';
+						break;
+					case 'r':
+						c = '\r';
+						break;
+					case 't':
+						c = '\t';
+						break;
+					case '0':
+						c = '\0';
+						break;
+					default:
+						c = text[i];
+						break;
+					}
+				}
+
+				Emit(static_cast<uint8_t>(c));
+			}
+		}
+
+		void Instruction(const std::string& mnemonic, const std::vector<std::string>& operands)
+		{
+			std::string name = mnemonic;
+			std::string suffix;
+
+			size_t dot = mnemonic.find('.');
+			if (dot != std::string::npos)
+			{
+				name = mnemonic.substr(0, dot);
+				suffix = mnemonic.substr(dot + 1);
+			}
+
+			// sizes default to a dword for memory and registers and to the smallest that fits for immediates
+			bool sized = false;
+			Size size = SZ_DWORD;
+			if (name != "br" && name != "cx" && suffix.empty() == false)
+			{
+				sized = true;
+				if (suffix == "b")
+					size = SZ_BYTE;
+				else if (suffix == "w")
+					size = SZ_WORD;
+				else if (suffix == "d")
+					size = SZ_DWORD;
+				else if (suffix == "q")
+					size = SZ_QWORD;
+				else
+					Error("Unknown size: " + mnemonic);
+			}
+
+			// only a qword immediate holds a value past 32 bits, memory operands are still addresses in the image
+			bool wide = size == SZ_QWORD &&
+				(name == "ldv" || name == "add" || name == "sub" || name == "and" || name == "cmp");
+
+			std::vector<Operand> parsed;
+			for (const std::string& operand : operands)
+				parsed.push_back(ParseOperand(operand, wide));
+
+			if (name == "ld")
+			{
+				Expect(operands, 2, name);
+				if (parsed[0].m_kind != OK_REGISTER)
+					Error("ld loads into a register");
+
+				if (parsed[1].m_kind == OK_INDIRECT)
+					Emit({ LD(false, size), Reg(static_cast<RegisterE>(parsed[0].m_register), static_cast<RegisterE>(parsed[1].m_register)) });
+				else if (parsed[1].m_kind == OK_MEMORY)
+				{
+					Emit({ LD(true, size), Reg(static_cast<RegisterE>(parsed[0].m_register)) });
+					EmitAddress(parsed[1], true);
+				}
+				else
+					Error("ld loads from [register] or [address]");
+			}
+			else if (name == "st")
+			{
+				Expect(operands, 2, name);
+				if (parsed[1].m_kind != OK_REGISTER)
+					Error("st stores a register");
+
+				RegisterE src = static_cast<RegisterE>(parsed[1].m_register);
+				if (parsed[0].m_kind == OK_INDIRECT)
+					Emit({ ST(false, size), Reg(static_cast<RegisterE>(parsed[0].m_register), src) });
+				else if (parsed[0].m_kind == OK_MEMORY)
+				{
+					Emit({ ST(true, size), Reg(R_A, src) });
+					EmitAddress(parsed[0], true);
+				}
+				else
+					Error("st stores to [register] or [address]");
+			}
+			else if (name == "ldv" || name == "add" || name == "sub" || name == "and" || name == "cmp")
+			{
+				Expect(operands, 2, name);
+				if (parsed[0].m_kind != OK_REGISTER)
+					Error(name + " takes a register first");
+
+				RegisterE dst = static_cast<RegisterE>(parsed[0].m_register);
+				bool imm = parsed[1].m_kind == OK_VALUE;
+				if (imm == false &&
+					parsed[1].m_kind != OK_REGISTER)
+					Error(name + " takes a register or an immediate second");
+
+				// an address is only known once linked, so it takes a dword
+				if (imm == true && sized == false)
+					size = parsed[1].m_symbol.empty() == true ? GetImmediateSize(parsed[1].m_value) : SZ_DWORD;
+				if (imm == true && size != SZ_DWORD && size != SZ_QWORD && parsed[1].m_symbol.empty() == false)
+					Error("An address needs a dword: " + operands[1]);
+
+				uint8_t opcode;
+				if (name == "ldv")
+					opcode = LDV(imm, size);
+				else if (name == "add")
+					opcode = ADD(imm, size);
+				else if (name == "sub")
+					opcode = SUB(imm, size);
+				else if (name == "and")
+					opcode = AND(imm, size);
+				else
+					opcode = CMP(imm, size);
+
+				if (imm == false)
+				{
+					Emit({ opcode, Reg(dst, static_cast<RegisterE>(parsed[1].m_register)) });
+					return;
+				}
+
+				Emit({ opcode, Reg(dst) });
+				if (size == SZ_DWORD)
+					EmitAddress(parsed[1], false);
+				else if (size == SZ_QWORD)
+					EmitQword(parsed[1]);
+				else
+				{
+					size_t bytes = size == SZ_BYTE ? 1 : 2;
+					// a size that was picked holds the value once it is sign extended
+					int64_t value = parsed[1].m_value;
+					if (sized == false)
+						value = static_cast<int32_t>(static_cast<uint32_t>(value));
+					if (value < -(INT64_C(1) << (bytes * 8 - 1)) ||
+						value >= (INT64_C(1) << (bytes * 8)))
+						Error("Immediate does not fit: " + operands[1]);
+
+					Emit(static_cast<uint32_t>(value), bytes);
+				}
+			}
+			else if (name == "not" || name == "pop")
+			{
+				Expect(operands, 1, name);
+				if (parsed[0].m_kind != OK_REGISTER || sized == true)
+					Error(name + " takes a register");
+
+				Emit({ name == "not" ? NOT() : POP(), Reg(static_cast<RegisterE>(parsed[0].m_register)) });
+			}
+			else if (name == "push")
+			{
+				Expect(operands, 1, name);
+				if (sized == true)
+					Error("push always pushes a dword");
+
+				if (parsed[0].m_kind == OK_REGISTER)
+					Emit({ PUSH(false), Reg(R_A, static_cast<RegisterE>(parsed[0].m_register)) });
+				else if (parsed[0].m_kind == OK_VALUE)
+				{
+					Emit(PUSH(true));
+					EmitAddress(parsed[0], false);
+				}
+				else
+					Error("push takes a register or an immediate");
+			}
+			else if (name == "br")
+			{
+				Expect(operands, 1, name);
+
+				int flags = 0;
+				for (char c : suffix)
+				{
+					if (c == 'p')
+						flags |= F_P;
+					else if (c == 'e')
+						flags |= F_E;
+					else if (c == 'n')
+						flags |= F_N;
+					else
+						Error("br takes the flags p, e and n: " + mnemonic);
+				}
+				if (flags == 0)
+					Error("br needs at least one flag, br.e for example");
+
+				// the opcode keeps the flags in the bits JMP keeps its size in, so only the dword form exists
+				if (parsed[0].m_kind == OK_REGISTER)
+					Emit({ BR(false, flags), Reg(R_A, static_cast<RegisterE>(parsed[0].m_register)) });
+				else if (parsed[0].m_kind == OK_VALUE)
+				{
+					Emit(BR(true, flags));
+					EmitAddress(parsed[0], true);
+				}
+				else
+					Error("br takes a register or an address");
+			}
+			else if (name == "jmp" || name == "call")
+			{
+				Expect(operands, 1, name);
+				if (sized == true)
+					Error(name + " is sized by the linker");
+
+				if (parsed[0].m_kind == OK_REGISTER)
+				{
+					Emit({ name == "jmp" ? JMP(false) : CALL(false), Reg(R_A, static_cast<RegisterE>(parsed[0].m_register)) });
+					return;
+				}
+				if (parsed[0].m_kind != OK_VALUE)
+					Error(name + " takes a register or an address");
+
+				Fragment fragment = {};
+				fragment.m_kind = FK_BRANCH;
+				fragment.m_opcode = name == "jmp" ? OP_JMP : OP_CALL;
+				fragment.m_symbol = parsed[0].m_symbol;
+				fragment.m_addend = static_cast<int32_t>(parsed[0].m_value);
+				fragment.m_line = m_line;
+				m_object.m_sections[m_section].push_back(fragment);
+			}
+			else if (name == "ret")
+			{
+				Expect(operands, 0, name);
+				Emit(RET());
+			}
+			else if (name == "cx")
+			{
+				Expect(operands, 1, name);
+
+				Convention convention = CNV_CDECL;
+				if (suffix == "stdcall")
+					convention = CNV_STDCALL;
+				else if (suffix == "fastcall")
+					convention = CNV_FASTCALL;
+				else if (suffix.empty() == false && suffix != "cdecl")
+					Error("Unknown calling convention: " + mnemonic);
+
+				int64_t index = ParseNumber(operands[0]);
+				if (index < 0 || index > 0xFF)
+					Error("Bad call table index: " + operands[0]);
+
+				Emit({ CX(convention), static_cast<uint8_t>(index) });
+			}
+			else if (name == "trap")
+			{
+				Expect(operands, 1, name);
+				if (sized == true)
+					Error("trap takes no size");
+
+				int64_t code = -1;
+				for (const auto& trap : TRAP_NAMES)
+				{
+					if (operands[0] == trap.first)
+						code = trap.second;
+				}
+				if (code == -1)
+					code = ParseNumber(operands[0]);
+				if (code < 0 || code > 0xFF)
+					Error("Bad trap code: " + operands[0]);
+
+				Emit({ TRAP(), static_cast<uint8_t>(code) });
+			}
+			else if (IsExtended(name) == true)
+			{
+				ExtendedOpcodeE xop = XOP_COUNT;
+				for (const auto& extended : EXTENDED_NAMES)
+				{
+					if (name == extended.first)
+						xop = extended.second;
+				}
+
+				// a fence has registers in its encoding but no use for them
+				if (xop == XOP_FENCE)
+				{
+					Expect(operands, 0, name);
+					if (sized == true)
+						Error(name + " takes no size");
+
+					Emit({ XOP(), static_cast<uint8_t>(xop), Reg(R_A, R_A), Reg(R_A) });
+					return;
+				}
+
+				Expect(operands, 3, name);
+				if (sized == true)
+					Error(name + " takes no size");
+
+				for (const Operand& operand : parsed)
+				{
+					if (operand.m_kind != OK_REGISTER)
+						Error(name + " takes three registers, dst, src and count");
+				}
+
+				Emit({ XOP(), static_cast<uint8_t>(xop),
+					Reg(static_cast<RegisterE>(parsed[0].m_register), static_cast<RegisterE>(parsed[1].m_register)),
+					Reg(static_cast<RegisterE>(parsed[2].m_register)) });
+			}
+			else
+				Error("Unknown instruction: " + mnemonic);
+		}
+
+		static bool IsExtended(const std::string& name)
+		{
+			for (const auto& extended : EXTENDED_NAMES)
+			{
+				if (name == extended.first)
+					return true;
+			}
+
+			return false;
+		}
+
+		void Emit(std::initializer_list<uint8_t> data)
+		{
+			for (uint8_t byte : data)
+				Emit(byte);
+		}
+
+		Object m_object;
+		SectionE m_section;
+		size_t m_line;
+
+		std::map<std::string, int64_t> m_constants;
+		std::vector<std::string> m_globals;
+	};
+}
+
+Object Assembler::Assemble(const std::string& source, const std::string& name)
+{
+	Assembly assembly(name);
+
+	return assembly.Run(source);
+}
\ No newline at end of file
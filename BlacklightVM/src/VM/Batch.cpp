@@ -0,0 +1,740 @@
+#include <VM/Batch.h>
+#include <VM/Bits.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if __AVX2__
+#include <immintrin.h>
+#define BLACKLIGHT_VM_AVX2 1
+#else
+#define BLACKLIGHT_VM_AVX2 0
+#endif
+
+#if BLACKLIGHT_VM_AVX2 == 0 && (_M_X64 || __x86_64__ || __SSE2__)
+#include <emmintrin.h>
+#define BLACKLIGHT_VM_SSE2 1
+#else
+#define BLACKLIGHT_VM_SSE2 0
+#endif
+
+using Blacklight::VM::Batch;
+
+using namespace Blacklight::VM;
+
+namespace
+{
+	// Vectors of 32 bit lanes, masks being all ones in the lanes they select
+#if BLACKLIGHT_VM_AVX2
+	typedef __m256i Vector;
+	const size_t WIDTH = 8;
+
+	Vector Load(const uint32_t* p) { return _mm256_load_si256(reinterpret_cast<const __m256i*>(p)); }
+	void Store(uint32_t* p, const Vector v) { _mm256_store_si256(reinterpret_cast<__m256i*>(p), v); }
+	Vector Set(const uint32_t value) { return _mm256_set1_epi32(static_cast<int>(value)); }
+	Vector AddLanes(const Vector a, const Vector b) { return _mm256_add_epi32(a, b); }
+	Vector SubLanes(const Vector a, const Vector b) { return _mm256_sub_epi32(a, b); }
+	Vector And(const Vector a, const Vector b) { return _mm256_and_si256(a, b); }
+	Vector AndNot(const Vector a, const Vector b) { return _mm256_andnot_si256(a, b); }
+	Vector Or(const Vector a, const Vector b) { return _mm256_or_si256(a, b); }
+	Vector Xor(const Vector a, const Vector b) { return _mm256_xor_si256(a, b); }
+	Vector Equal(const Vector a, const Vector b) { return _mm256_cmpeq_epi32(a, b); }
+	Vector SignedAbove(const Vector a, const Vector b) { return _mm256_cmpgt_epi32(a, b); }
+	Vector Select(const Vector mask, const Vector a, const Vector b) { return _mm256_blendv_epi8(a, b, mask); }
+	Vector Extend8(const Vector v) { return _mm256_srai_epi32(_mm256_slli_epi32(v, 24), 24); }
+	Vector Extend16(const Vector v) { return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16); }
+	uint32_t Bits(const Vector mask) { return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(mask))); }
+#elif BLACKLIGHT_VM_SSE2
+	typedef __m128i Vector;
+	const size_t WIDTH = 4;
+
+	Vector Load(const uint32_t* p) { return _mm_load_si128(reinterpret_cast<const __m128i*>(p)); }
+	void Store(uint32_t* p, const Vector v) { _mm_store_si128(reinterpret_cast<__m128i*>(p), v); }
+	Vector Set(const uint32_t value) { return _mm_set1_epi32(static_cast<int>(value)); }
+	Vector AddLanes(const Vector a, const Vector b) { return _mm_add_epi32(a, b); }
+	Vector SubLanes(const Vector a, const Vector b) { return _mm_sub_epi32(a, b); }
+	Vector And(const Vector a, const Vector b) { return _mm_and_si128(a, b); }
+	Vector AndNot(const Vector a, const Vector b) { return _mm_andnot_si128(a, b); }
+	Vector Or(const Vector a, const Vector b) { return _mm_or_si128(a, b); }
+	Vector Xor(const Vector a, const Vector b) { return _mm_xor_si128(a, b); }
+	Vector Equal(const Vector a, const Vector b) { return _mm_cmpeq_epi32(a, b); }
+	Vector SignedAbove(const Vector a, const Vector b) { return _mm_cmpgt_epi32(a, b); }
+	Vector Select(const Vector mask, const Vector a, const Vector b) { return _mm_or_si128(_mm_andnot_si128(mask, a), _mm_and_si128(mask, b)); }
+	Vector Extend8(const Vector v) { return _mm_srai_epi32(_mm_slli_epi32(v, 24), 24); }
+	Vector Extend16(const Vector v) { return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16); }
+	uint32_t Bits(const Vector mask) { return static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(mask))); }
+#else
+	typedef uint32_t Vector;
+	const size_t WIDTH = 1;
+
+	Vector Load(const uint32_t* p) { return *p; }
+	void Store(uint32_t* p, const Vector v) { *p = v; }
+	Vector Set(const uint32_t value) { return value; }
+	Vector AddLanes(const Vector a, const Vector b) { return a + b; }
+	Vector SubLanes(const Vector a, const Vector b) { return a - b; }
+	Vector And(const Vector a, const Vector b) { return a & b; }
+	Vector AndNot(const Vector a, const Vector b) { return ~a & b; }
+	Vector Or(const Vector a, const Vector b) { return a | b; }
+	Vector Xor(const Vector a, const Vector b) { return a ^ b; }
+	Vector Equal(const Vector a, const Vector b) { return a == b ? UINT32_MAX : 0; }
+	Vector SignedAbove(const Vector a, const Vector b) { return static_cast<int32_t>(a) > static_cast<int32_t>(b) ? UINT32_MAX : 0; }
+	Vector Select(const Vector mask, const Vector a, const Vector b) { return (a & ~mask) | (b & mask); }
+	Vector Extend8(const Vector v) { return static_cast<uint32_t>(static_cast<int8_t>(v)); }
+	Vector Extend16(const Vector v) { return static_cast<uint32_t>(static_cast<int16_t>(v)); }
+	uint32_t Bits(const Vector mask) { return mask & 1; }
+#endif
+
+	static_assert(Batch::MAX_LANES % WIDTH == 0, "Lanes do not fill whole vectors");
+
+	// Returns a mask of the lanes where a is above b, unsigned
+	Vector Above(const Vector a, const Vector b)
+	{
+		const Vector bias = Set(0x80000000u);
+
+		return SignedAbove(Xor(a, bias), Xor(b, bias));
+	}
+
+	// Returns whether an access of size bytes at an address lies inside of memory
+	bool InMemory(const size_t blockSize, const uint32_t address, const size_t size)
+	{
+		return static_cast<uint64_t>(address) + size <= blockSize;
+	}
+
+	// Sets dst to f(dst, src) in every lane, or only in the masked ones
+	template<typename F>
+	void Apply(uint32_t (*rows)[Batch::MAX_LANES], const MicroOp& op, const uint32_t* pMasks, const size_t chunks, const bool masked, F f)
+	{
+		for (size_t c = 0; c < chunks; ++c)
+		{
+			size_t i = c * WIDTH;
+
+			Vector dst = Load(rows[op.m_dst] + i);
+			Vector value = f(dst, Load(rows[op.m_src] + i));
+			if (masked == true)
+				value = Select(Load(pMasks + i), dst, value);
+
+			Store(rows[op.m_dst] + i, value);
+		}
+	}
+}
+
+Batch::Batch() :
+	m_chunks(0),
+	m_live(0),
+	m_registers(),
+	m_liveMask(),
+	m_masks(),
+	m_converged(false),
+	m_pc(0),
+	m_convergedSteps(0),
+	m_origin(0),
+	m_size(0),
+	m_stats()
+{
+}
+
+size_t Batch::Add(CPU* pCPU)
+{
+	if (m_lanes.size() == MAX_LANES)
+		throw std::runtime_error("Batch is full");
+	if (pCPU->IsFinished() == true)
+		throw std::runtime_error("CPU has already finished");
+
+	uint32_t origin = pCPU->GetImageOrigin();
+	size_t size = pCPU->GetImageSize();
+
+	std::vector<uint8_t> code(size + MemoryController::FETCH_SIZE, 0);
+	pCPU->GetMemoryController().ReadBlock(origin, code.data(), size);
+
+	// every lane decodes from the first lane's image
+	if (m_lanes.empty() == true)
+	{
+		m_origin = origin;
+		m_size = size;
+		m_code = std::move(code);
+		m_ops.assign(size, MicroOp());
+	}
+	else if (origin != m_origin ||
+		size != m_size ||
+		memcmp(code.data(), m_code.data(), size) != 0)
+		throw std::runtime_error("CPU does not have the image of the first lane loaded");
+
+	// the new lane may not be where the others are
+	Diverge();
+
+	size_t lane = m_lanes.size();
+	m_lanes.push_back({ pCPU, &pCPU->GetMemoryController(), pCPU->GetMemoryController().GetBlockSize(), 0, m_convergedSteps, false, false, false });
+
+	for (uint32_t reg = 0; reg < R_COUNT; ++reg)
+		m_registers[reg][lane] = pCPU->GetRegister(reg);
+
+	m_live |= 1u << lane;
+	m_liveMask[lane] = UINT32_MAX;
+	m_chunks = (m_lanes.size() + WIDTH - 1) / WIDTH;
+
+	return lane;
+}
+
+void Batch::Run()
+{
+	while (m_live != 0)
+	{
+		uint32_t pc;
+		uint32_t active;
+
+		if (m_converged == true)
+		{
+			pc = m_pc;
+			active = m_live;
+		}
+		else
+		{
+			// the lane furthest behind goes first, so that the others wait for it where their paths meet
+			pc = UINT32_MAX;
+			for (uint32_t bits = m_live; bits != 0; bits &= bits - 1)
+			{
+				uint32_t address = m_registers[R_PRG][GetLowestBit(bits)];
+				if (address < pc)
+					pc = address;
+			}
+
+			active = MaskLanes(pc);
+			if (active == m_live)
+			{
+				m_converged = true;
+				m_pc = pc;
+			}
+		}
+
+		Step(pc, active);
+	}
+
+	// lanes that left the batch carry on by themselves
+	for (Lane& lane : m_lanes)
+	{
+		if (lane.m_ejected == false ||
+			lane.m_finished == true ||
+			lane.m_faulted == true)
+			continue;
+
+		try
+		{
+			lane.m_pCPU->Run();
+			lane.m_finished = true;
+		}
+		catch (const std::exception&)
+		{
+			lane.m_faulted = true;
+		}
+	}
+}
+
+const Batch::Stats& Batch::GetStats() const
+{
+	return m_stats;
+}
+
+Batch::LaneStats Batch::GetLaneStats(const size_t lane) const
+{
+	const Lane& l = m_lanes.at(lane);
+
+	// a lane still in the batch has yet to catch up on the steps it took with the rest
+	uint64_t instructions = l.m_instructions;
+	if ((m_live & (1u << lane)) != 0)
+		instructions += m_convergedSteps - l.m_convergedBase;
+
+	return { instructions, l.m_finished, l.m_faulted, l.m_ejected };
+}
+
+const MicroOp* Batch::Fetch(const uint32_t address)
+{
+	uint32_t offset = address - m_origin;
+	if (offset >= m_size)
+		return nullptr;
+
+	MicroOp& op = m_ops[offset];
+	if (op.m_kind == UOP_UNDECODED)
+		op = DecodeCache::Decode(&m_code[offset], address, m_size - offset);
+
+	return &op;
+}
+
+void Batch::Step(const uint32_t pc, const uint32_t active)
+{
+	++m_stats.m_steps;
+	if (m_converged == false)
+		++m_stats.m_divergentSteps;
+
+	const bool masked = m_converged == false;
+	uint32_t targets[MAX_LANES];
+
+	// CX, TRAP, code outside of the image and instructions naming R_PRG are for each lane's CPU
+	const MicroOp* pOp = Fetch(pc);
+	if (pOp == nullptr ||
+		pOp->m_kind == UOP_INTERP)
+	{
+		uint32_t stepped = 0;
+		for (uint32_t bits = active; bits != 0; bits &= bits - 1)
+		{
+			uint32_t lane = GetLowestBit(bits);
+			if (StepScalar(lane, pc, targets[lane]) == true)
+				stepped |= 1u << lane;
+		}
+
+		Branch(stepped, targets);
+		return;
+	}
+
+	const MicroOp& op = *pOp;
+	const uint32_t next = pc + op.m_length;
+	const Vector imm = Set(op.m_imm);
+
+	switch (op.m_kind)
+	{
+	case UOP_NOP:
+		break;
+	case UOP_LDV_IMM:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [imm](Vector, Vector) { return imm; });
+		break;
+	case UOP_LDV8:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector, Vector src) { return And(src, Set(0xFF)); });
+		break;
+	case UOP_LDV16:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector, Vector src) { return And(src, Set(0xFFFF)); });
+		break;
+	case UOP_LDV32:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector, Vector src) { return src; });
+		break;
+	case UOP_ADD_IMM:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [imm](Vector dst, Vector) { return AddLanes(dst, imm); });
+		break;
+	case UOP_ADD8:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector dst, Vector src) { return AddLanes(dst, Extend8(src)); });
+		break;
+	case UOP_ADD16:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector dst, Vector src) { return AddLanes(dst, Extend16(src)); });
+		break;
+	case UOP_ADD32:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector dst, Vector src) { return AddLanes(dst, src); });
+		break;
+	case UOP_SUB_IMM:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [imm](Vector dst, Vector) { return SubLanes(dst, imm); });
+		break;
+	case UOP_SUB8:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector dst, Vector src) { return SubLanes(dst, Extend8(src)); });
+		break;
+	case UOP_SUB16:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector dst, Vector src) { return SubLanes(dst, Extend16(src)); });
+		break;
+	case UOP_SUB32:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector dst, Vector src) { return SubLanes(dst, src); });
+		break;
+	case UOP_AND_IMM:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [imm](Vector dst, Vector) { return And(dst, imm); });
+		break;
+	case UOP_AND8:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector dst, Vector src) { return And(dst, And(src, Set(0xFF))); });
+		break;
+	case UOP_AND16:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector dst, Vector src) { return And(dst, And(src, Set(0xFFFF))); });
+		break;
+	case UOP_AND32:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector dst, Vector src) { return And(dst, src); });
+		break;
+	case UOP_NOT:
+		Apply(m_registers, op, m_masks, m_chunks, masked, [](Vector dst, Vector) { return Xor(dst, Set(UINT32_MAX)); });
+		break;
+	case UOP_CMP_IMM:
+	case UOP_CMP8:
+	case UOP_CMP16:
+	case UOP_CMP32:
+		for (size_t c = 0; c < m_chunks; ++c)
+		{
+			size_t i = c * WIDTH;
+
+			// the flags are cleared before either side is read, as CPU::Compare does
+			Vector cnd = Load(m_registers[R_CND] + i);
+			Vector cleared = AndNot(Set(F_P | F_E | F_N), cnd);
+
+			Vector dst = op.m_dst == R_CND ? cleared : Load(m_registers[op.m_dst] + i);
+			Vector src = imm;
+			if (op.m_kind != UOP_CMP_IMM)
+			{
+				src = op.m_src == R_CND ? cleared : Load(m_registers[op.m_src] + i);
+				if (op.m_kind == UOP_CMP8)
+					src = And(src, Set(0xFF));
+				else if (op.m_kind == UOP_CMP16)
+					src = And(src, Set(0xFFFF));
+			}
+
+			Vector above = Above(src, dst);
+			Vector equal = Equal(src, dst);
+			Vector flags = Or(And(above, Set(F_P)), Or(And(equal, Set(F_E)), AndNot(Or(above, equal), Set(F_N))));
+
+			Vector value = Or(cleared, flags);
+			if (masked == true)
+				value = Select(Load(m_masks + i), cnd, value);
+
+			Store(m_registers[R_CND] + i, value);
+		}
+		break;
+	case UOP_BR_IMM:
+	{
+		uint32_t skipped = 0;
+		for (size_t c = 0; c < m_chunks; ++c)
+			skipped |= Bits(Equal(And(Load(m_registers[R_CND] + c * WIDTH), Set(op.m_dst)), Set(0))) << (c * WIDTH);
+
+		Count(active);
+
+		uint32_t taken = active & ~skipped;
+		if (taken == active)
+			Jump(op.m_imm);
+		else if (taken == 0)
+			Jump(next);
+		else
+		{
+			for (uint32_t bits = active; bits != 0; bits &= bits - 1)
+			{
+				uint32_t lane = GetLowestBit(bits);
+				targets[lane] = (taken & (1u << lane)) != 0 ? op.m_imm : next;
+			}
+
+			Branch(active, targets);
+		}
+
+		return;
+	}
+	case UOP_BR:
+	case UOP_JMP:
+		for (uint32_t bits = active; bits != 0; bits &= bits - 1)
+		{
+			uint32_t lane = GetLowestBit(bits);
+
+			if (op.m_kind == UOP_JMP ||
+				(m_registers[R_CND][lane] & op.m_dst) != 0)
+				targets[lane] = m_registers[op.m_src][lane];
+			else
+				targets[lane] = next;
+		}
+
+		Count(active);
+		Branch(active, targets);
+		return;
+	case UOP_JMP_IMM:
+		Count(active);
+		Jump(op.m_imm);
+		return;
+	default:
+	{
+		// loads, stores, the stack and calls go through each lane's memory
+		uint32_t ran = 0;
+		uint32_t moved = 0;
+		for (uint32_t bits = active; bits != 0; bits &= bits - 1)
+		{
+			uint32_t lane = GetLowestBit(bits);
+			uint64_t writes = m_lanes[lane].m_pMemory->GetCodeWriteCount();
+
+			if (StepLane(op, lane, pc, targets[lane]) == false)
+			{
+				// the lane's CPU faults or wraps the access as it would have
+				if (StepScalar(lane, pc, targets[lane]) == true)
+					moved |= 1u << lane;
+			}
+			else if (m_lanes[lane].m_pMemory->GetCodeWriteCount() != writes)
+			{
+				// its code is no longer the code the others run
+				++m_lanes[lane].m_instructions;
+				Eject(lane, targets[lane]);
+			}
+			else
+			{
+				ran |= 1u << lane;
+				moved |= 1u << lane;
+			}
+		}
+
+		Count(ran);
+		Branch(moved, targets);
+		return;
+	}
+	}
+
+	Count(active);
+	Jump(next);
+}
+
+bool Batch::StepLane(const MicroOp& op, const size_t lane, const uint32_t pc, uint32_t& target)
+{
+	const Lane& l = m_lanes[lane];
+	MemoryController& mc = *l.m_pMemory;
+	auto r = [this, lane](const uint8_t reg) -> uint32_t& { return m_registers[reg][lane]; };
+
+	uint32_t address;
+	target = pc + op.m_length;
+
+	switch (op.m_kind)
+	{
+	case UOP_LD8_ABS:
+		if (InMemory(l.m_blockSize, op.m_imm, sizeof(uint8_t)) == false)
+			return false;
+		r(op.m_dst) = mc.Read8(op.m_imm);
+		break;
+	case UOP_LD16_ABS:
+		if (InMemory(l.m_blockSize, op.m_imm, sizeof(uint16_t)) == false)
+			return false;
+		r(op.m_dst) = mc.Read16(op.m_imm);
+		break;
+	case UOP_LD32_ABS:
+		if (InMemory(l.m_blockSize, op.m_imm, sizeof(uint32_t)) == false)
+			return false;
+		r(op.m_dst) = mc.Read32(op.m_imm);
+		break;
+	case UOP_LD8:
+		address = r(op.m_src);
+		if (InMemory(l.m_blockSize, address, sizeof(uint8_t)) == false)
+			return false;
+		r(op.m_dst) = mc.Read8(address);
+		break;
+	case UOP_LD16:
+		address = r(op.m_src);
+		if (InMemory(l.m_blockSize, address, sizeof(uint16_t)) == false)
+			return false;
+		r(op.m_dst) = mc.Read16(address);
+		break;
+	case UOP_LD32:
+		address = r(op.m_src);
+		if (InMemory(l.m_blockSize, address, sizeof(uint32_t)) == false)
+			return false;
+		r(op.m_dst) = mc.Read32(address);
+		break;
+	case UOP_ST8_ABS:
+		if (InMemory(l.m_blockSize, op.m_imm, sizeof(uint8_t)) == false)
+			return false;
+		mc.Write8(op.m_imm, static_cast<uint8_t>(r(op.m_src)));
+		break;
+	case UOP_ST16_ABS:
+		if (InMemory(l.m_blockSize, op.m_imm, sizeof(uint16_t)) == false)
+			return false;
+		mc.Write16(op.m_imm, static_cast<uint16_t>(r(op.m_src)));
+		break;
+	case UOP_ST32_ABS:
+		if (InMemory(l.m_blockSize, op.m_imm, sizeof(uint32_t)) == false)
+			return false;
+		mc.Write32(op.m_imm, r(op.m_src));
+		break;
+	case UOP_ST8:
+		address = r(op.m_dst);
+		if (InMemory(l.m_blockSize, address, sizeof(uint8_t)) == false)
+			return false;
+		mc.Write8(address, static_cast<uint8_t>(r(op.m_src)));
+		break;
+	case UOP_ST16:
+		address = r(op.m_dst);
+		if (InMemory(l.m_blockSize, address, sizeof(uint16_t)) == false)
+			return false;
+		mc.Write16(address, static_cast<uint16_t>(r(op.m_src)));
+		break;
+	case UOP_ST32:
+		address = r(op.m_dst);
+		if (InMemory(l.m_blockSize, address, sizeof(uint32_t)) == false)
+			return false;
+		mc.Write32(address, r(op.m_src));
+		break;
+	case UOP_PUSH_IMM:
+	case UOP_PUSH:
+	case UOP_CALL_IMM:
+	case UOP_CALL:
+		// the source is read once the stack has moved, as in the cores
+		address = r(R_SF) - sizeof(uint32_t);
+		if (InMemory(l.m_blockSize, address, sizeof(uint32_t)) == false)
+			return false;
+		r(R_SF) = address;
+
+		if (op.m_kind == UOP_PUSH_IMM)
+			mc.Write32(address, op.m_imm);
+		else if (op.m_kind == UOP_PUSH)
+			mc.Write32(address, r(op.m_src));
+		else
+		{
+			mc.Write32(address, target);
+			target = op.m_kind == UOP_CALL_IMM ? op.m_imm : r(op.m_src);
+		}
+		break;
+	case UOP_POP:
+		address = r(R_SF);
+		if (InMemory(l.m_blockSize, address, sizeof(uint32_t)) == false)
+			return false;
+		r(op.m_dst) = mc.Read32(address);
+		r(R_SF) += sizeof(uint32_t);
+		break;
+	case UOP_RET:
+		address = r(R_SF);
+		if (InMemory(l.m_blockSize, address, sizeof(uint32_t)) == false)
+			return false;
+		target = mc.Read32(address);
+		r(R_SF) += sizeof(uint32_t);
+		break;
+	default:
+		throw std::runtime_error("Batch can not run micro-op " + std::to_string(op.m_kind));
+	}
+
+	return true;
+}
+
+bool Batch::StepScalar(const size_t lane, const uint32_t pc, uint32_t& target)
+{
+	Lane& l = m_lanes[lane];
+	CPU& cpu = *l.m_pCPU;
+
+	for (uint32_t reg = 0; reg < R_COUNT; ++reg)
+		cpu.GetRegister(reg) = m_registers[reg][lane];
+	cpu.GetRegister(R_PRG) = pc;
+
+	// the CPU takes code writes as it makes them, so they are told apart by the count
+	uint64_t writes = l.m_pMemory->GetCodeWriteCount();
+
+	++m_stats.m_scalarSteps;
+
+	try
+	{
+		cpu.Run(1);
+	}
+	catch (const std::exception&)
+	{
+		l.m_faulted = true;
+		Retire(lane);
+
+		return false;
+	}
+
+	if (cpu.IsFinished() == true)
+	{
+		l.m_finished = true;
+		Retire(lane);
+
+		return false;
+	}
+
+	// a trap that would block waits on the lane's own CPU, and written code is no longer shared
+	if (cpu.IsSuspended() == true ||
+		l.m_pMemory->GetCodeWriteCount() != writes)
+	{
+		l.m_ejected = true;
+		Retire(lane);
+
+		return false;
+	}
+
+	for (uint32_t reg = 0; reg < R_COUNT; ++reg)
+		m_registers[reg][lane] = cpu.GetRegister(reg);
+
+	target = m_registers[R_PRG][lane];
+
+	return true;
+}
+
+void Batch::Jump(const uint32_t target)
+{
+	if (m_converged == true)
+	{
+		m_pc = target;
+		return;
+	}
+
+	for (size_t c = 0; c < m_chunks; ++c)
+	{
+		size_t i = c * WIDTH;
+		Store(m_registers[R_PRG] + i, Select(Load(m_masks + i), Load(m_registers[R_PRG] + i), Set(target)));
+	}
+}
+
+void Batch::Branch(const uint32_t active, const uint32_t* pTargets)
+{
+	if (active == 0)
+		return;
+
+	uint32_t target = pTargets[GetLowestBit(active)];
+	bool same = true;
+	for (uint32_t bits = active; bits != 0; bits &= bits - 1)
+		same &= pTargets[GetLowestBit(bits)] == target;
+
+	if (same == true &&
+		m_converged == true &&
+		active == m_live)
+	{
+		m_pc = target;
+		return;
+	}
+
+	Diverge();
+
+	for (uint32_t bits = active; bits != 0; bits &= bits - 1)
+	{
+		uint32_t lane = GetLowestBit(bits);
+		m_registers[R_PRG][lane] = pTargets[lane];
+	}
+}
+
+void Batch::Diverge()
+{
+	if (m_converged == false)
+		return;
+
+	for (uint32_t bits = m_live; bits != 0; bits &= bits - 1)
+		m_registers[R_PRG][GetLowestBit(bits)] = m_pc;
+
+	m_converged = false;
+}
+
+uint32_t Batch::MaskLanes(const uint32_t pc)
+{
+	uint32_t active = 0;
+
+	for (size_t c = 0; c < m_chunks; ++c)
+	{
+		size_t i = c * WIDTH;
+
+		Vector mask = And(Equal(Load(m_registers[R_PRG] + i), Set(pc)), Load(m_liveMask + i));
+		Store(m_masks + i, mask);
+
+		active |= Bits(mask) << i;
+	}
+
+	return active;
+}
+
+void Batch::Count(const uint32_t lanes)
+{
+	if (m_converged == true &&
+		lanes == m_live)
+	{
+		++m_convergedSteps;
+		return;
+	}
+
+	for (uint32_t bits = lanes; bits != 0; bits &= bits - 1)
+		++m_lanes[GetLowestBit(bits)].m_instructions;
+}
+
+void Batch::Retire(const size_t lane)
+{
+	Lane& l = m_lanes[lane];
+	l.m_instructions += m_convergedSteps - l.m_convergedBase;
+
+	m_live &= ~(1u << lane);
+	m_liveMask[lane] = 0;
+}
+
+void Batch::Eject(const size_t lane, const uint32_t pc)
+{
+	Lane& l = m_lanes[lane];
+	CPU& cpu = *l.m_pCPU;
+
+	for (uint32_t reg = 0; reg < R_COUNT; ++reg)
+		cpu.GetRegister(reg) = m_registers[reg][lane];
+	cpu.GetRegister(R_PRG) = pc;
+
+	l.m_ejected = true;
+	Retire(lane);
+}
\ No newline at end of file
@@ -1,117 +1,19 @@
 #include <VM/CPU.h>
 #include <VM/InstructionGeneration/InstructionGeneration.h>
+#include <VM/ThreadGroup.h>
 
-#include <array>
+#include <cassert>
+#include <cstdio>
 #include <cstring>
-#include <fstream>
 #include <stdexcept>
-#include <streambuf>
+#include <utility>
 #include <vector>
 
 using Blacklight::VM::CPU;
 using Blacklight::VM::MemoryController;
+using Blacklight::VM::MicroOp;
 using Blacklight::VM::Register;
 
-int CallFastcall(void* fn, uint32_t args[], size_t argc)
-{
-#if _WIN32 && !_WIN64
-	// first 2 in ecx/edx and rest on stack in reverse order. callee cleanup
-	int res;
-	__asm
-	{
-		cmp argc, 0
-		je END
-		push esi
-		push edi
-		push ebx
-		mov esi, argc
-		mov edi, args
-		mov ecx, [edi]
-		dec esi
-		cmp esi, 0
-		je END
-		add edi, 4
-		mov edx, [edi]
-		dec esi
-		cmp esi, 0
-		je END
-		add edi, 4
-	LOOP:
-		dec esi
-		mov ebx, [edi + esi * 4]
-		push ebx
-		cmp esi, 0
-		jne LOOP
-	END:
-		call fn
-		pop ebx
-		pop edi
-		pop esi
-		mov res, eax
-	}
-	return res;
-#else
-	return 0;
-#endif
-}
-
-int CallStdcall(void* fn, uint32_t args[], size_t argc)
-{
-#if _WIN32 && !_WIN64
-	// args on stack in reverse order. callee cleanup
-	int res;
-	__asm
-	{
-		cmp argc, 0
-		je END
-		mov eax, argc
-		mov ecx, args
-	LOOP:
-		dec eax
-		mov edx, [ecx + eax * 4]
-		push edx
-		cmp eax, 0
-		jne LOOP
-	END:
-		call fn
-		mov res, eax
-	}
-	return res;
-#else
-	return 0;
-#endif
-}
-
-int CallCdecl(void* fn, uint32_t args[], size_t argc)
-{
-#if _WIN32 && !_WIN64
-	// args on stack in reverse order. caller cleanup
-	int res;
-	__asm
-	{
-		cmp argc, 0
-		je END
-		mov eax, argc
-		mov ecx, args
-	LOOP:
-		dec eax
-		mov edx, [ecx + eax * 4]
-		push edx
-		cmp eax, 0
-		jne LOOP
-	END:
-		call fn
-		mov ecx, argc
-		imul ecx, 4
-		add esp, ecx
-		mov res, eax
-	}
-	return res;
-#else
-	return 0;
-#endif
-}
-
 uint32_t SignExtend(uint32_t val, size_t bytes)
 {
 	if ((val >> (bytes - 1)) & 0x1) //negative
@@ -120,8 +22,16 @@ uint32_t SignExtend(uint32_t val, size_t bytes)
 		return val;
 }
 
-CPU::CPU(const size_t blockSize) :
+CPU::CPU(const size_t blockSize, const DispatchMode mode, const MemoryMode memoryMode) :
+	CPU(blockSize, mode, memoryMode, nullptr)
+{
+}
+
+CPU::CPU(const size_t blockSize, const DispatchMode mode, const MemoryMode memoryMode, MemoryController* pSharedMemory) :
+	m_mode(mode),
 	m_finished(false),
+	m_suspended(false),
+	m_joining(false),
 	m_instructions{
 		{[](CPU* pCPU, const uint8_t opcode)
 {
@@ -130,7 +40,7 @@ CPU::CPU(const size_t blockSize) :
 
 	// program counter must be updated by each instruction
 	uint8_t inst = opcode & 0xF;
-	uint8_t reg = *(mc.GetRawMemory() + prg + 1);
+	uint8_t reg = *(mc.Fetch(prg) + 1);
 
 	bool imm = (inst >> 3) & 0x1;
 	bool b = (inst >> 2) & 0x1;
@@ -141,7 +51,7 @@ CPU::CPU(const size_t blockSize) :
 	
 	if (imm)
 	{		
-		int32_t offset = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 2);
+		int32_t offset = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 2);
 
 		prg += 6;
 
@@ -173,7 +83,7 @@ CPU::CPU(const size_t blockSize) :
 
 	// program counter must be updated by each instruction
 	uint8_t inst = opcode & 0xF;
-	uint8_t reg = *(mc.GetRawMemory() + prg + 1);
+	uint8_t reg = *(mc.Fetch(prg) + 1);
 
 	bool imm = (inst >> 3) & 0x1;
 	bool b = (inst >> 2) & 0x1;
@@ -185,19 +95,19 @@ CPU::CPU(const size_t blockSize) :
 	{
 		if (b)
 		{
-			int8_t data = *reinterpret_cast<int8_t*>(mc.GetRawMemory() + prg + 2);
+			int8_t data = *reinterpret_cast<const int8_t*>(mc.Fetch(prg) + 2);
 			prg += 3;
 			pCPU->GetRegister(dst) = data;
 		}
 		else if (w)
 		{
-			int16_t data = *reinterpret_cast<int16_t*>(mc.GetRawMemory() + prg + 2);
+			int16_t data = *reinterpret_cast<const int16_t*>(mc.Fetch(prg) + 2);
 			prg += 4;
 			pCPU->GetRegister(dst) = data;
 		}
 		else
 		{
-			int32_t data = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 2);
+			int32_t data = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 2);
 			prg += 6;
 			pCPU->GetRegister(dst) = data;
 		}
@@ -223,7 +133,7 @@ CPU::CPU(const size_t blockSize) :
 
 	// program counter must be updated by each instruction
 	uint8_t inst = opcode & 0xF;
-	uint8_t reg = *(mc.GetRawMemory() + prg + 1);
+	uint8_t reg = *(mc.Fetch(prg) + 1);
 
 	bool imm = (inst >> 3) & 0x1;
 	bool b = (inst >> 2) & 0x1;
@@ -234,7 +144,7 @@ CPU::CPU(const size_t blockSize) :
 
 	if (imm)
 	{
-		int32_t offset = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 2);
+		int32_t offset = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 2);
 
 		prg += 6;
 
@@ -269,7 +179,7 @@ CPU::CPU(const size_t blockSize) :
 
 	if (imm)
 	{
-		int32_t data = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 1);
+		int32_t data = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 1);
 		
 		prg += 5;
 		
@@ -277,7 +187,7 @@ CPU::CPU(const size_t blockSize) :
 	}
 	else
 	{
-		uint8_t src = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 1) & 0xF;
+		uint8_t src = *(mc.Fetch(prg) + 1) & 0xF;
 		
 		prg += 2;
 
@@ -290,7 +200,7 @@ CPU::CPU(const size_t blockSize) :
 	Register& prg = pCPU->GetRegister(R_PRG);
 	Register& sf = pCPU->GetRegister(R_SF);
 
-	uint8_t reg = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 1);
+	uint8_t reg = *(mc.Fetch(prg) + 1);
 	uint8_t dst = (reg >> 4) & 0xF;
 
 	pCPU->GetRegister(dst) = mc.Read32(sf);
@@ -305,7 +215,7 @@ CPU::CPU(const size_t blockSize) :
 
 	// program counter must be updated by each instruction
 	uint8_t inst = opcode & 0xF;
-	uint8_t reg = *(mc.GetRawMemory() + prg + 1);
+	uint8_t reg = *(mc.Fetch(prg) + 1);
 
 	bool imm = (inst >> 3) & 0x1;
 	bool b = (inst >> 2) & 0x1;
@@ -317,19 +227,19 @@ CPU::CPU(const size_t blockSize) :
 	{
 		if (b)
 		{
-			int8_t data = *reinterpret_cast<int8_t*>(mc.GetRawMemory() + prg + 2);
+			int8_t data = *reinterpret_cast<const int8_t*>(mc.Fetch(prg) + 2);
 			prg += 3;
 			pCPU->GetRegister(dst) += data;
 		}
 		else if (w)
 		{
-			int16_t data = *reinterpret_cast<int16_t*>(mc.GetRawMemory() + prg + 2);
+			int16_t data = *reinterpret_cast<const int16_t*>(mc.Fetch(prg) + 2);
 			prg += 4;
 			pCPU->GetRegister(dst) += data;
 		}
 		else
 		{
-			int32_t data = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 2);
+			int32_t data = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 2);
 			prg += 6;
 			pCPU->GetRegister(dst) += data;
 		}
@@ -355,7 +265,7 @@ CPU::CPU(const size_t blockSize) :
 
 	// program counter must be updated by each instruction
 	uint8_t inst = opcode & 0xF;
-	uint8_t reg = *(mc.GetRawMemory() + prg + 1);
+	uint8_t reg = *(mc.Fetch(prg) + 1);
 
 	bool imm = (inst >> 3) & 0x1;
 	bool b = (inst >> 2) & 0x1;
@@ -367,19 +277,19 @@ CPU::CPU(const size_t blockSize) :
 	{
 		if (b)
 		{
-			int8_t data = *reinterpret_cast<int8_t*>(mc.GetRawMemory() + prg + 2);
+			int8_t data = *reinterpret_cast<const int8_t*>(mc.Fetch(prg) + 2);
 			prg += 3;
 			pCPU->GetRegister(dst) -= data;
 		}
 		else if (w)
 		{
-			int16_t data = *reinterpret_cast<int16_t*>(mc.GetRawMemory() + prg + 2);
+			int16_t data = *reinterpret_cast<const int16_t*>(mc.Fetch(prg) + 2);
 			prg += 4;
 			pCPU->GetRegister(dst) -= data;
 		}
 		else
 		{
-			int32_t data = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 2);
+			int32_t data = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 2);
 			prg += 6;
 			pCPU->GetRegister(dst) -= data;
 		}
@@ -405,7 +315,7 @@ CPU::CPU(const size_t blockSize) :
 
 	// program counter must be updated by each instruction
 	uint8_t inst = opcode & 0xF;
-	uint8_t reg = *(mc.GetRawMemory() + prg + 1);
+	uint8_t reg = *(mc.Fetch(prg) + 1);
 
 	bool imm = (inst >> 3) & 0x1;
 	bool b = (inst >> 2) & 0x1;
@@ -417,19 +327,19 @@ CPU::CPU(const size_t blockSize) :
 	{
 		if (b)
 		{
-			int8_t data = *reinterpret_cast<int8_t*>(mc.GetRawMemory() + prg + 2);
+			int8_t data = *reinterpret_cast<const int8_t*>(mc.Fetch(prg) + 2);
 			prg += 3;
 			pCPU->GetRegister(dst) &= data;
 		}
 		else if (w)
 		{
-			int16_t data = *reinterpret_cast<int16_t*>(mc.GetRawMemory() + prg + 2);
+			int16_t data = *reinterpret_cast<const int16_t*>(mc.Fetch(prg) + 2);
 			prg += 4;
 			pCPU->GetRegister(dst) &= data;
 		}
 		else
 		{
-			int32_t data = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 2);
+			int32_t data = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 2);
 			prg += 6;
 			pCPU->GetRegister(dst) &= data;
 		}
@@ -453,11 +363,11 @@ CPU::CPU(const size_t blockSize) :
 	MemoryController& mc = pCPU->GetMemoryController();
 	Register& prg = pCPU->GetRegister(R_PRG);
 
-	prg += 2;
-
-	uint8_t reg = *(mc.GetRawMemory() + prg + 1);
+	uint8_t reg = *(mc.Fetch(prg) + 1);
 	uint8_t dst = (reg >> 4) & 0xF;
 
+	prg += 2;
+
 	pCPU->GetRegister(dst) = ~pCPU->GetRegister(dst);
 }},	// OP_NOT
 		{[](CPU* pCPU, const uint8_t opcode)
@@ -466,11 +376,11 @@ CPU::CPU(const size_t blockSize) :
 	Register& cnd = pCPU->GetRegister(R_CND);
 	Register& prg = pCPU->GetRegister(R_PRG);
 
-	cnd &= ~(F_P | F_E);
+	cnd = ClearFlags(cnd);
 
 	// program counter must be updated by each instruction
 	uint8_t inst = opcode & 0xF;
-	uint8_t reg = *(mc.GetRawMemory() + prg + 1);
+	uint8_t reg = *(mc.Fetch(prg) + 1);
 
 	bool imm = (inst >> 3) & 0x1;
 	bool b = (inst >> 2) & 0x1;
@@ -485,17 +395,17 @@ CPU::CPU(const size_t blockSize) :
 	{
 		if (b)
 		{
-			src = *reinterpret_cast<int8_t*>(mc.GetRawMemory() + prg + 2);
+			src = *reinterpret_cast<const int8_t*>(mc.Fetch(prg) + 2);
 			prg += 3;
 		}
 		else if (w)
 		{
-			src = *reinterpret_cast<int16_t*>(mc.GetRawMemory() + prg + 2);
+			src = *reinterpret_cast<const int16_t*>(mc.Fetch(prg) + 2);
 			prg += 4;
 		}
 		else
 		{
-			src = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 2);
+			src = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 2);
 			prg += 6;
 		}
 	}
@@ -510,12 +420,7 @@ CPU::CPU(const size_t blockSize) :
 			src = pCPU->GetRegister(srcr);
 	}
 
-	if (src > dst)
-		cnd |= F_P;
-	else if (src == dst)
-		cnd |= F_E;
-	else
-		cnd |= F_N;
+	cnd |= CompareFlag(dst, src);
 }},	// OP_CMP
 		{[](CPU* pCPU, const uint8_t opcode)
 {
@@ -537,15 +442,15 @@ CPU::CPU(const size_t blockSize) :
 	{
 		if (imm)
 		{
-			int32_t offset = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 1);
+			int32_t offset = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 1);
 
 			prg += 5;
 			prg += offset;
 		}
 		else
 		{
-			uint8_t reg = *(mc.GetRawMemory() + prg + 1);
-			bool src = reg & 0xF;
+			uint8_t reg = *(mc.Fetch(prg) + 1);
+			uint8_t src = reg & 0xF;
 
 			prg = pCPU->GetRegister(src);
 		}
@@ -575,17 +480,17 @@ CPU::CPU(const size_t blockSize) :
 		int32_t offset;
 		if (b)
 		{
-			offset = SignExtend(*reinterpret_cast<int8_t*>(mc.GetRawMemory() + prg + 1), 8);
+			offset = SignExtend(*reinterpret_cast<const int8_t*>(mc.Fetch(prg) + 1), 8);
 			prg += 2;
 		}
 		else if (w)
 		{
-			offset = SignExtend(*reinterpret_cast<int16_t*>(mc.GetRawMemory() + prg + 1), 16);
+			offset = SignExtend(*reinterpret_cast<const int16_t*>(mc.Fetch(prg) + 1), 16);
 			prg += 3;
 		}
 		else
 		{
-			offset = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 1);
+			offset = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 1);
 			prg += 5;
 		}
 
@@ -593,8 +498,8 @@ CPU::CPU(const size_t blockSize) :
 	}
 	else
 	{
-		uint8_t reg = *(mc.GetRawMemory() + prg + 1);
-		bool src = reg & 0xF;
+		uint8_t reg = *(mc.Fetch(prg) + 1);
+		uint8_t src = reg & 0xF;
 
 		prg = pCPU->GetRegister(src);
 	}
@@ -619,17 +524,17 @@ CPU::CPU(const size_t blockSize) :
 		int32_t offset;
 		if (b)
 		{
-			offset = SignExtend(*reinterpret_cast<int8_t*>(mc.GetRawMemory() + prg + 1), 8);
+			offset = SignExtend(*reinterpret_cast<const int8_t*>(mc.Fetch(prg) + 1), 8);
 			prg += 2;
 		}
 		else if (w)
 		{
-			offset = SignExtend(*reinterpret_cast<int16_t*>(mc.GetRawMemory() + prg + 1), 16);
+			offset = SignExtend(*reinterpret_cast<const int16_t*>(mc.Fetch(prg) + 1), 16);
 			prg += 3;
 		}
 		else
 		{
-			offset = *reinterpret_cast<int32_t*>(mc.GetRawMemory() + prg + 1);
+			offset = *reinterpret_cast<const int32_t*>(mc.Fetch(prg) + 1);
 			prg += 5;
 		}
 
@@ -638,8 +543,8 @@ CPU::CPU(const size_t blockSize) :
 	}
 	else
 	{
-		uint8_t reg = *(mc.GetRawMemory() + prg + 1);
-		bool src = reg & 0xF;
+		uint8_t reg = *(mc.Fetch(prg) + 1);
+		uint8_t src = reg & 0xF;
 
 		prg += 2;
 
@@ -658,39 +563,13 @@ CPU::CPU(const size_t blockSize) :
 }},	// OP_RET
 		{[](CPU* pCPU, const uint8_t opcode)
 {
-	// no support for x64 calls
-	if (sizeof(void*) == 8)
-		throw std::runtime_error("64-bit function calls are not supported");
-
 	MemoryController& mc = pCPU->GetMemoryController();
 	Register& prg = pCPU->GetRegister(R_PRG);
 
-	uint8_t inst = opcode & 0xF;
-
-	bool F = inst & InstructionGeneration::CNV_FASTCALL;
-	bool S = inst & InstructionGeneration::CNV_STDCALL;
-
-	uint8_t index = *(mc.GetRawMemory() + prg + 1);
-
-	uint32_t fn = mc.Read32(pCPU->GetRegister(R_SB) + (index * 4));
+	// the calling convention in the opcode is left over from the x86 shims, the thunk already knows the signature
+	uint8_t index = *(mc.Fetch(prg) + 1);
 
-	uint32_t argc = pCPU->GetRegister(R_L);
-	std::array<uint32_t, 11> args;
-	for (size_t i = 0; i < argc; ++i)
-		args[i] = pCPU->GetRegister(i);
-
-	if (F)
-	{
-		pCPU->GetRegister(R_A) = CallFastcall(reinterpret_cast<void*>(fn), args.data(), argc);
-	}
-	else if (S)
-	{
-		pCPU->GetRegister(R_A) = CallStdcall(reinterpret_cast<void*>(fn), args.data(), argc);
-	}
-	else
-	{
-		pCPU->GetRegister(R_A) = CallCdecl(reinterpret_cast<void*>(fn), args.data(), argc);
-	}
+	pCPU->m_hostFunctions.Call(index, *pCPU, pCPU->m_registers);
 
 	prg += 2;
 }},	// OP_CX
@@ -698,21 +577,103 @@ CPU::CPU(const size_t blockSize) :
 {
 	MemoryController& mc = pCPU->GetMemoryController();
 	Register& prg = pCPU->GetRegister(R_PRG);
+	Register& a = pCPU->GetRegister(R_A);
+
+	// the immediate bit escapes to the extended opcode page
+	if ((opcode & 0x8) != 0)
+	{
+		ExtendedInstruction(pCPU, opcode);
+		return;
+	}
 	
-	uint8_t tc = *(mc.GetRawMemory() + prg + 1);
+	uint8_t tc = *(mc.Fetch(prg) + 1);
 
-	if (tc == TC_HALT)
+	switch (tc)
+	{
+	case TC_PUTC:
+		putchar(static_cast<int>(a));
+		break;
+	case TC_PUTS:
+	{
+		// up to the terminator or the end of memory
+		uint32_t length = 0;
+		while (a + length < mc.GetBlockSize() &&
+			mc.Read8(a + length) != 0)
+			putchar(mc.Read8(a + length++));
+
+		a = length;
+		break;
+	}
+	case TC_GETCHAR:
+		a = static_cast<Register>(getchar());
+		break;
+	case TC_HALT:
 		pCPU->NotifyFinished();
+		return;
+	case TC_SPAWN:
+		// -1 when there is no group to run it in, or it is full
+		a = pCPU->m_pThreadGroup != nullptr ? pCPU->m_pThreadGroup->Spawn(*pCPU, a, pCPU->GetRegister(R_B), pCPU->GetRegister(R_C)) : UINT32_MAX;
+		break;
+	case TC_JOIN:
+		if (pCPU->m_pThreadGroup == nullptr)
+			throw std::runtime_error("Joined a thread that was never spawned");
+
+		// waited for like a socket trap that would block
+		if (pCPU->m_pThreadGroup->Join(*pCPU, a, a) == false)
+		{
+			pCPU->m_suspended = true;
+			pCPU->m_finished = true;
+			pCPU->m_joining = true;
+			return;
+		}
+		break;
+	default:
+		// a socket trap that would block is run again once what it waits for is ready
+		if (pCPU->m_sockets.Trap(*pCPU, tc) == false)
+		{
+			pCPU->m_suspended = true;
+			pCPU->m_finished = true;
+			return;
+		}
+		break;
+	}
+
+	prg += 2;
 }}	// OP_TRAP
 	},
-	m_memory(blockSize)
+	m_memory(blockSize, memoryMode, pSharedMemory),
+	m_registers(),
+	m_instructionCount(0),
+	m_imageOrigin(0),
+	m_imageSize(0),
+	m_pProfiler(nullptr),
+	m_pNativeImage(nullptr),
+	m_pImageCache(nullptr),
+	m_pThreadGroup(nullptr),
+	m_threadId(0),
+	m_traceInstructions{ TraceInstruction, TraceInstruction },
+	m_traceStarted(false)
 {
 	enum { PRG_START = 0x2000 };
 
+	// ensure we don't make more memory than the registers can address, a WideCPU reaches further
+	assert(blockSize < UINT32_MAX);
+
 	m_registers[R_PRG] = PRG_START;
 	m_registers[R_SB] = 0x1000;
 	m_registers[R_SF] = 0x1000;
 	m_registers[R_CND] = 0;
+
+#if BLACKLIGHT_VM_JIT
+	if (m_mode == DM_JIT &&
+		memoryMode == MM_FLAT)
+		m_pJit.reset(new JIT());
+#endif
+}
+
+Blacklight::VM::DispatchMode CPU::GetDispatchMode() const
+{
+	return m_mode;
 }
 
 MemoryController& CPU::GetMemoryController()
@@ -725,20 +686,307 @@ Register& CPU::GetRegister(const uint32_t reg)
 	return m_registers[reg];
 }
 
+uint32_t CPU::GetImageOrigin() const
+{
+	return m_imageOrigin;
+}
+
+size_t CPU::GetImageSize() const
+{
+	return m_imageSize;
+}
+
+void CPU::SetProfiler(Profiler* pProfiler)
+{
+	m_pProfiler = pProfiler;
+}
+
+void CPU::SetImageCache(ImageCache* pCache)
+{
+	m_pImageCache = pCache;
+}
+
+void CPU::SetNativeImage(const NativeImage* pImage)
+{
+	// writes made while the whole image was watched are dealt with before the watch narrows
+	SyncDecodeCache();
+
+	if (pImage == nullptr)
+	{
+		if (m_pNativeImage != nullptr)
+		{
+			m_pNativeImage = nullptr;
+			PrepareCode(m_imageOrigin, m_imageSize);
+		}
+
+		return;
+	}
+
+	if (pImage->m_begin - m_imageOrigin > m_imageSize ||
+		pImage->m_size > m_imageSize - (pImage->m_begin - m_imageOrigin))
+		throw std::runtime_error("Native image was translated from a different image");
+
+	std::vector<uint8_t> code(pImage->m_size);
+	m_memory.ReadBlock(pImage->m_begin, code.data(), code.size());
+	if (HashNativeCode(code.data(), code.size()) != pImage->m_hash)
+		throw std::runtime_error("Native image was translated from different code");
+
+	m_pNativeImage = pImage;
+	m_memory.WatchCode(pImage->m_begin, pImage->m_size);
+}
+
+void CPU::WriteInput(const uint32_t address, const uint8_t* pData, const size_t size)
+{
+	m_memory.WriteBlock(address, pData, size);
+
+	if (m_pTraceWriter != nullptr)
+		m_pTraceWriter->WriteInput(address, pData, size);
+}
+
+void CPU::StartRecording(const char* path)
+{
+	if (m_pTraceWriter != nullptr ||
+		m_pTraceReader != nullptr)
+		throw std::runtime_error("A trace is already running");
+
+	m_pTraceWriter.reset(new TraceWriter(path, m_memory.GetBlockSize()));
+	m_traceStarted = false;
+
+	SwapTraceInstructions();
+}
+
+void CPU::StopRecording()
+{
+	if (m_pTraceWriter == nullptr)
+		return;
+
+	SwapTraceInstructions();
+
+	// the writer is gone either way, Close only reports what went wrong
+	std::unique_ptr<TraceWriter> pWriter = std::move(m_pTraceWriter);
+	pWriter->Close();
+}
+
+void CPU::StartReplay(const char* path)
+{
+	if (m_pTraceWriter != nullptr ||
+		m_pTraceReader != nullptr)
+		throw std::runtime_error("A trace is already running");
+
+	std::unique_ptr<TraceReader> pReader(new TraceReader(path));
+	if (pReader->GetBlockSize() != m_memory.GetBlockSize())
+		throw std::runtime_error("Trace was recorded with a different block size");
+
+	TraceEvent& event = m_traceEvent;
+
+	pReader->Read(event);
+	if (event.m_kind != TE_IMAGE)
+		throw std::runtime_error("Trace does not start with an image");
+
+	m_memory.WriteBlock(event.m_origin, event.m_data.data(), event.m_data.size());
+	PrepareImage(event.m_stackSize, event.m_origin, event.m_data.size());
+
+	// then whatever the host did before the guest started running
+	for (pReader->Read(event); event.m_kind == TE_INPUT; pReader->Read(event))
+		WriteInput(event.m_address, event.m_data.data(), event.m_data.size());
+
+	if (event.m_kind == TE_START)
+		memcpy(m_registers, event.m_registers, sizeof(m_registers));
+	else if (event.m_kind != TE_END)
+		throw std::runtime_error("Corrupt trace");
+
+	m_pTraceReader = std::move(pReader);
+
+	SwapTraceInstructions();
+}
+
+void CPU::SwapTraceInstructions()
+{
+	std::swap(m_instructions[OP_CX], m_traceInstructions[0]);
+	std::swap(m_instructions[OP_TRAP], m_traceInstructions[1]);
+}
+
+void CPU::TraceInstruction(CPU* pCPU, const uint8_t opcode)
+{
+	Register* r = pCPU->m_registers;
+	uint32_t address = r[R_PRG];
+
+	if (((opcode >> 4) & 0xF) == OP_TRAP &&
+		(opcode & 0x8) != 0)
+	{
+		ExtendedInstruction(pCPU, opcode);
+		return;
+	}
+
+	if (pCPU->m_pTraceWriter != nullptr)
+	{
+		Register before[R_COUNT];
+		memcpy(before, r, sizeof(before));
+		bool finished = pCPU->m_finished;
+
+		unsigned char inst = (opcode >> 4) & 0xF;
+		pCPU->m_traceInstructions[inst == OP_CX ? 0 : 1](pCPU, opcode);
+
+		// nothing happened yet, it is recorded once it is retried and goes through
+		if (pCPU->m_suspended == true)
+			return;
+
+		pCPU->m_pTraceWriter->WriteResult(address, before, r, pCPU->m_finished == true && finished == false);
+		return;
+	}
+
+	// anything the host wrote while running the instruction comes first
+	TraceEvent& event = pCPU->m_traceEvent;
+	for (pCPU->m_pTraceReader->Read(event); event.m_kind == TE_INPUT; pCPU->m_pTraceReader->Read(event))
+		pCPU->WriteInput(event.m_address, event.m_data.data(), event.m_data.size());
+
+	if (event.m_kind == TE_END)
+		throw std::runtime_error("Trace ended before the guest did");
+	if (event.m_kind != TE_RESULT ||
+		event.m_address != address)
+		throw std::runtime_error("Replay strayed from the trace");
+
+	for (size_t i = 0; i < R_COUNT; ++i)
+		r[i] += event.m_registers[i];
+
+	if (event.m_finished == true)
+		pCPU->NotifyFinished();
+}
+
+void CPU::ExtendedInstruction(CPU* pCPU, const uint8_t)
+{
+	RunExtended(pCPU->GetMemoryController(), pCPU->m_registers);
+}
+
+std::shared_ptr<const Blacklight::VM::CPUSnapshot> CPU::TakeSnapshot()
+{
+	std::shared_ptr<CPUSnapshot> pSnapshot(new CPUSnapshot());
+
+	memcpy(pSnapshot->m_registers, m_registers, sizeof(m_registers));
+	pSnapshot->m_finished = IsFinished();
+	pSnapshot->m_origin = m_imageOrigin;
+	pSnapshot->m_size = m_imageSize;
+	pSnapshot->m_pMemory = m_memory.TakeSnapshot();
+
+	return pSnapshot;
+}
+
+void CPU::Restore(const std::shared_ptr<const CPUSnapshot>& pSnapshot)
+{
+	const CPUSnapshot& snapshot = *pSnapshot;
+
+	m_memory.Restore(snapshot.m_pMemory);
+
+	memcpy(m_registers, snapshot.m_registers, sizeof(m_registers));
+	m_finished = snapshot.m_finished;
+	m_suspended = false;
+	m_joining = false;
+
+	// code that was written since comes back through the code watch, a different image starts over
+	if (snapshot.m_origin != m_imageOrigin ||
+		snapshot.m_size != m_imageSize)
+		PrepareCode(snapshot.m_origin, snapshot.m_size);
+	else
+		SyncDecodeCache();
+}
+
+std::unique_ptr<CPU> CPU::Fork(const std::shared_ptr<const CPUSnapshot>& pSnapshot) const
+{
+	std::unique_ptr<CPU> pCPU(new CPU(m_memory.GetBlockSize(), m_mode, m_memory.GetMemoryMode()));
+	pCPU->m_hostFunctions = m_hostFunctions;
+	pCPU->m_pImageCache = m_pImageCache;
+
+	pCPU->Restore(pSnapshot);
+	if (m_pNativeImage != nullptr)
+		pCPU->SetNativeImage(m_pNativeImage);
+
+	return pCPU;
+}
+
+std::unique_ptr<CPU> CPU::Fork()
+{
+	return Fork(TakeSnapshot());
+}
+
+std::unique_ptr<CPU> CPU::Spawn(const uint32_t entry, const uint32_t stack, const Register argument)
+{
+	if (m_memory.GetMemoryMode() != MM_FLAT)
+		throw std::runtime_error("Threads need MM_FLAT memory");
+
+	std::unique_ptr<CPU> pCPU(new CPU(m_memory.GetBlockSize(), m_mode, MM_FLAT, &m_memory));
+	pCPU->m_hostFunctions = m_hostFunctions;
+	pCPU->m_pImageCache = m_pImageCache;
+	pCPU->m_imageOrigin = m_imageOrigin;
+	pCPU->m_imageSize = m_imageSize;
+
+	// watching before catching up means any code written from then on is thrown away by the new thread too
+	pCPU->m_memory.WatchCode(m_imageOrigin, m_imageSize);
+	SyncDecodeCache();
+
+	pCPU->m_decodeCache.Copy(m_decodeCache);
+	pCPU->m_verifier = m_verifier;
+	if (pCPU->m_pJit != nullptr)
+		pCPU->m_pJit->Reset(m_imageOrigin, m_imageSize);
+	if (m_pNativeImage != nullptr)
+		pCPU->SetNativeImage(m_pNativeImage);
+
+	pCPU->m_registers[R_PRG] = entry;
+	pCPU->m_registers[R_SB] = stack;
+	pCPU->m_registers[R_SF] = stack;
+	pCPU->m_registers[R_A] = argument;
+
+	return pCPU;
+}
+
+const Blacklight::VM::Verifier& CPU::GetVerifier() const
+{
+	return m_verifier;
+}
+
+const Blacklight::VM::FusionStats& CPU::GetFusionStats() const
+{
+	return m_decodeCache.GetFusionStats();
+}
+
 void CPU::NotifyFinished()
 {
 	m_finished = true;
 }
 
+bool CPU::IsFinished() const
+{
+	return m_finished == true &&
+		m_suspended == false;
+}
+
+bool CPU::IsSuspended() const
+{
+	return m_suspended;
+}
+
+const Blacklight::VM::SocketTable& CPU::GetSocketTable() const
+{
+	return m_sockets;
+}
+
+uint64_t CPU::GetInstructionCount() const
+{
+	return m_instructionCount;
+}
+
 void CPU::LoadImage(const char* path)
 {
-	std::ifstream in(path, std::ios_base::binary);
+	SharedImage image(path);
+
+	LoadImage(image);
+}
 
-	std::vector<char> data(
-		(std::istreambuf_iterator<char>(in)),
-		std::istreambuf_iterator<char>());
+void CPU::LoadImage(const SharedImage& image)
+{
+	// map the code rather than copy it
+	m_memory.MapImage(image);
 
-	LoadImage(reinterpret_cast<uint8_t*>(data.data()), data.size());
+	PrepareImage(image.GetStackSize(), image.GetOrigin(), image.GetCodeSize());
 }
 
 void CPU::LoadImage(const uint8_t* buf, size_t size)
@@ -746,24 +994,669 @@ void CPU::LoadImage(const uint8_t* buf, size_t size)
 	uint32_t stackSize = reinterpret_cast<const uint32_t*>(buf)[0];
 	uint32_t origin = reinterpret_cast<const uint32_t*>(buf)[1];
 
+	// copy the memory
+	m_memory.WriteBlock(origin, buf + 8, size - 8);
+
+	PrepareImage(stackSize, origin, size - 8);
+}
+
+void CPU::PrepareImage(const uint32_t stackSize, const uint32_t origin, const size_t size, const bool decoded)
+{
 	// set stack base and program counter
 	m_registers[R_SB] = stackSize;
 	m_registers[R_SF] = stackSize;
 	m_registers[R_PRG] = origin;
 
-	// copy the memory
-	memcpy(m_memory.GetRawMemory() + origin, buf + 8, size - 8);
+	PrepareCode(origin, size, decoded);
+
+	if (m_pTraceWriter != nullptr)
+	{
+		std::vector<uint8_t> code(size);
+		m_memory.ReadBlock(origin, code.data(), size);
+
+		m_pTraceWriter->WriteImage(stackSize, origin, code.data(), size);
+	}
+}
+
+void CPU::PrepareCode(const uint32_t origin, const size_t size, const bool decoded)
+{
+	m_imageOrigin = origin;
+	m_imageSize = size;
+	m_pNativeImage = nullptr;
+
+	// decode the image up front and watch it for self-modification
+	m_memory.WatchCode(origin, size);
+	if (m_mode != DM_TABLE &&
+		m_pImageCache == nullptr)
+		DecodeCode(origin, size, decoded);
+	else if (m_mode != DM_TABLE)
+	{
+		std::vector<uint8_t> code(size);
+		m_memory.ReadBlock(origin, code.data(), size);
+
+		// an image that was loaded before is taken as it was decoded then
+		Verifier* pVerifier = m_mode == DM_VERIFIED ? &m_verifier : nullptr;
+		if (m_pImageCache->Load(code.data(), origin, size, m_memory.GetBlockSize(), m_decodeCache, pVerifier) == false)
+		{
+			DecodeCode(origin, size, decoded);
+			m_pImageCache->Store(code.data(), origin, size, m_memory.GetBlockSize(), m_decodeCache, pVerifier);
+		}
+	}
+	if (m_pJit != nullptr)
+		m_pJit->Reset(origin, size);
+}
+
+void CPU::DecodeCode(const uint32_t origin, const size_t size, const bool decoded)
+{
+	if (decoded == false)
+		m_decodeCache.Build(m_memory, origin, size);
+	if (m_mode != DM_VERIFIED)
+		return;
+
+	std::vector<uint8_t> code(size);
+	m_memory.ReadBlock(origin, code.data(), size);
+
+	m_verifier.Verify(code.data(), origin, size, m_memory.GetBlockSize());
+
+	// the core never decodes lazily, so proven instructions off the linear sweep are decoded now
+	for (size_t offset = 0; offset < size; ++offset)
+	{
+		if (m_verifier.GetMap()[offset] != 0 &&
+			m_decodeCache.GetOps()[offset].m_kind == UOP_UNDECODED)
+			m_decodeCache.DecodeAt(m_memory, static_cast<uint32_t>(origin + offset));
+	}
 }
 
 void CPU::Run()
 {
+	while (IsFinished() == false)
+	{
+		// nothing else would run in the meantime, so wait here for whatever the trap is waiting for
+		if (m_suspended == true &&
+			m_joining == true)
+			m_pThreadGroup->Wait(m_registers[R_A]);
+		else if (m_suspended == true)
+			m_sockets.Wait();
+
+		Run(UINT64_MAX);
+	}
+}
+
+uint64_t CPU::Run(const uint64_t maxInstructions)
+{
+	if (m_pThreadGroup == nullptr)
+		return RunSlice(maxInstructions);
+
+	// the threads joining this one are told when it finishes, and a fault finishes it for good
+	uint64_t count;
+	try
+	{
+		count = RunSlice(maxInstructions);
+	}
+	catch (...)
+	{
+		m_finished = true;
+		m_suspended = false;
+		m_pThreadGroup->Finish(m_threadId, m_registers[R_A], true);
+		throw;
+	}
+
+	if (IsFinished() == true)
+		m_pThreadGroup->Finish(m_threadId, m_registers[R_A], false);
+
+	return count;
+}
+
+uint64_t CPU::RunSlice(const uint64_t maxInstructions)
+{
+	// a suspended trap is retried
+	if (m_suspended == true)
+	{
+		m_suspended = false;
+		m_finished = false;
+		m_joining = false;
+	}
+
+	// a guest access outside of memory faults in a guard region and comes back here. siglongjmp skips the
+	// destructors of everything between the fault and here, so nothing that holds a lock or owns memory may be
+	// live while guest memory is touched from inside the trap
+	MemoryController::FaultTrap trap(&m_memory);
+#if __linux__
+	if (sigsetjmp(trap.m_jump, 0) != 0)
+	{
+		m_finished = true;
+		throw std::runtime_error("Memory access outside of guest memory");
+	}
+#endif
+
+	// the host may have set up registers of its own since the image was loaded
+	if (m_pTraceWriter != nullptr &&
+		m_traceStarted == false)
+	{
+		m_pTraceWriter->WriteStart(m_registers);
+		m_traceStarted = true;
+	}
+
+	// the host may have written code since it last ran, as a Batch does for a lane it gives back
+	SyncDecodeCache();
+
+	uint64_t count;
+
+	// the profiler has its own core so that the others never check for it
+	if (m_pProfiler != nullptr)
+	{
+		count = RunProfiled(maxInstructions);
+		if (m_suspended == true)
+			--count;
+		m_instructionCount += count;
+
+		return count;
+	}
+
+	count = 0;
+	if (m_pNativeImage != nullptr)
+		count = RunNative(maxInstructions);
+
+	// a write into translated code detaches it, leaving the rest to the dispatch mode's core
+	if (m_pNativeImage == nullptr)
+	{
+		switch (m_mode)
+		{
+		case DM_TABLE:
+			count += RunTable(maxInstructions - count);
+			break;
+		case DM_THREADED:
+			count += RunThreaded(maxInstructions - count);
+			break;
+		case DM_JIT:
+			count += RunJIT(maxInstructions - count);
+			break;
+		case DM_VERIFIED:
+			count += RunVerified(maxInstructions - count);
+			break;
+		default:
+			count += RunDecoded(maxInstructions - count);
+			break;
+		}
+	}
+
+	// a trap that has to be tried again is counted once it goes through, not every time it is tried
+	if (m_suspended == true)
+		--count;
+
+	m_instructionCount += count;
+
+	return count;
+}
+
+uint64_t CPU::RunTable(const uint64_t maxInstructions)
+{
+	uint64_t count = 0;
+
+	for (; m_finished == false && count < maxInstructions; ++count)
+	{
+		uint8_t opcode = m_memory.Read8(m_registers[R_PRG]);
+		unsigned char inst = (opcode >> 4) & 0xF;
+
+		m_instructions[inst](this, opcode);
+	}
+
+	return count;
+}
+
+uint64_t CPU::RunNative(const uint64_t maxInstructions)
+{
+	NativeContext context = { m_registers, &m_memory, maxInstructions };
+
+	while (m_finished == false &&
+		context.m_budget > 0 &&
+		m_pNativeImage != nullptr)
+	{
+		uint64_t budget = context.m_budget;
+		m_pNativeImage->m_pRun(context);
+
+		// a write into the translated code detaches the image
+		SyncDecodeCache();
+
+		// it stopped on something it was not translated for, which the instruction table runs
+		if (context.m_budget == budget &&
+			m_pNativeImage != nullptr)
+		{
+			uint8_t opcode = m_memory.Read8(m_registers[R_PRG]);
+			m_instructions[(opcode >> 4) & 0xF](this, opcode);
+			--context.m_budget;
+
+			SyncDecodeCache();
+		}
+	}
+
+	return maxInstructions - context.m_budget;
+}
+
+uint64_t CPU::RunDecoded(const uint64_t maxInstructions)
+{
+	Register* r = m_registers;
+	Register& prg = m_registers[R_PRG];
+	Register& sf = m_registers[R_SF];
+	Register& cnd = m_registers[R_CND];
+
+	FusionStats& fusionStats = m_decodeCache.GetFusionStats();
+
+	uint64_t budget = maxInstructions;
+
+	while (m_finished == false &&
+		budget > 0)
+	{
+		const MicroOp* pOp = m_decodeCache.Lookup(prg);
+
+		--budget;
+
+		// code outside of the image is decoded every time through the instruction table
+		if (pOp == nullptr)
+		{
+			uint8_t opcode = m_memory.Read8(prg);
+			unsigned char inst = (opcode >> 4) & 0xF;
+
+			m_instructions[inst](this, opcode);
+
+			SyncDecodeCache();
+			continue;
+		}
+
+		const MicroOp& op = *pOp;
+
+		// each micro-op must update the program counter like the instruction it came from
+		switch (op.m_kind)
+		{
+		case UOP_UNDECODED:
+			// decoding does not use up the budget
+			m_decodeCache.DecodeAt(m_memory, prg);
+			++budget;
+			break;
+		case UOP_INTERP:
+		{
+			uint8_t opcode = m_memory.Read8(prg);
+			unsigned char inst = (opcode >> 4) & 0xF;
+
+			m_instructions[inst](this, opcode);
+
+			SyncDecodeCache();
+			break;
+		}
+		case UOP_NOP:
+			prg += op.m_length;
+			break;
+		case UOP_LD8_ABS:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read8(op.m_imm);
+			break;
+		case UOP_LD16_ABS:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read16(op.m_imm);
+			break;
+		case UOP_LD32_ABS:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read32(op.m_imm);
+			break;
+		case UOP_LD8:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read8(r[op.m_src]);
+			break;
+		case UOP_LD16:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read16(r[op.m_src]);
+			break;
+		case UOP_LD32:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read32(r[op.m_src]);
+			break;
+		case UOP_LDV_IMM:
+			prg += op.m_length;
+			r[op.m_dst] = op.m_imm;
+			break;
+		case UOP_LDV8:
+			prg += op.m_length;
+			r[op.m_dst] = static_cast<uint8_t>(r[op.m_src]);
+			break;
+		case UOP_LDV16:
+			prg += op.m_length;
+			r[op.m_dst] = static_cast<uint16_t>(r[op.m_src]);
+			break;
+		case UOP_LDV32:
+			prg += op.m_length;
+			r[op.m_dst] = r[op.m_src];
+			break;
+		case UOP_ST8_ABS:
+			prg += op.m_length;
+			m_memory.Write8(op.m_imm, r[op.m_src]);
+			SyncDecodeCache();
+			break;
+		case UOP_ST16_ABS:
+			prg += op.m_length;
+			m_memory.Write16(op.m_imm, r[op.m_src]);
+			SyncDecodeCache();
+			break;
+		case UOP_ST32_ABS:
+			prg += op.m_length;
+			m_memory.Write32(op.m_imm, r[op.m_src]);
+			SyncDecodeCache();
+			break;
+		case UOP_ST8:
+			prg += op.m_length;
+			m_memory.Write8(r[op.m_dst], r[op.m_src]);
+			SyncDecodeCache();
+			break;
+		case UOP_ST16:
+			prg += op.m_length;
+			m_memory.Write16(r[op.m_dst], r[op.m_src]);
+			SyncDecodeCache();
+			break;
+		case UOP_ST32:
+			prg += op.m_length;
+			m_memory.Write32(r[op.m_dst], r[op.m_src]);
+			SyncDecodeCache();
+			break;
+		case UOP_PUSH_IMM:
+			sf -= sizeof(int);
+			prg += op.m_length;
+			m_memory.Write32(sf, op.m_imm);
+			SyncDecodeCache();
+			break;
+		case UOP_PUSH:
+			sf -= sizeof(int);
+			prg += op.m_length;
+			m_memory.Write32(sf, r[op.m_src]);
+			SyncDecodeCache();
+			break;
+		case UOP_POP:
+			r[op.m_dst] = m_memory.Read32(sf);
+			sf += sizeof(int);
+			prg += op.m_length;
+			break;
+		case UOP_ADD_IMM:
+			prg += op.m_length;
+			r[op.m_dst] += op.m_imm;
+			break;
+		case UOP_ADD8:
+			prg += op.m_length;
+			r[op.m_dst] += static_cast<int8_t>(r[op.m_src]);
+			break;
+		case UOP_ADD16:
+			prg += op.m_length;
+			r[op.m_dst] += static_cast<int16_t>(r[op.m_src]);
+			break;
+		case UOP_ADD32:
+			prg += op.m_length;
+			r[op.m_dst] += r[op.m_src];
+			break;
+		case UOP_SUB_IMM:
+			prg += op.m_length;
+			r[op.m_dst] -= op.m_imm;
+			break;
+		case UOP_SUB8:
+			prg += op.m_length;
+			r[op.m_dst] -= static_cast<int8_t>(r[op.m_src]);
+			break;
+		case UOP_SUB16:
+			prg += op.m_length;
+			r[op.m_dst] -= static_cast<int16_t>(r[op.m_src]);
+			break;
+		case UOP_SUB32:
+			prg += op.m_length;
+			r[op.m_dst] -= r[op.m_src];
+			break;
+		case UOP_AND_IMM:
+			prg += op.m_length;
+			r[op.m_dst] &= op.m_imm;
+			break;
+		case UOP_AND8:
+			prg += op.m_length;
+			r[op.m_dst] &= static_cast<uint8_t>(r[op.m_src]);
+			break;
+		case UOP_AND16:
+			prg += op.m_length;
+			r[op.m_dst] &= static_cast<uint16_t>(r[op.m_src]);
+			break;
+		case UOP_AND32:
+			prg += op.m_length;
+			r[op.m_dst] &= r[op.m_src];
+			break;
+		case UOP_NOT:
+			prg += op.m_length;
+			r[op.m_dst] = ~r[op.m_dst];
+			break;
+		case UOP_CMP_IMM:
+		case UOP_CMP8:
+		case UOP_CMP16:
+		case UOP_CMP32:
+			Compare(r, op, op.m_kind - UOP_CMP_IMM);
+			prg += op.m_length;
+			break;
+		case UOP_BR_IMM:
+			if (cnd & op.m_dst)
+				prg = op.m_imm;
+			else
+				prg += op.m_length;
+			break;
+		case UOP_BR:
+			if (cnd & op.m_dst)
+				prg = r[op.m_src];
+			else
+				prg += op.m_length;
+			break;
+		case UOP_JMP_IMM:
+			prg = op.m_imm;
+			break;
+		case UOP_JMP:
+			prg = r[op.m_src];
+			break;
+		case UOP_CALL_IMM:
+			sf -= sizeof(int);
+			prg += op.m_length;
+			m_memory.Write32(sf, prg);
+			prg = op.m_imm;
+			SyncDecodeCache();
+			break;
+		case UOP_CALL:
+			sf -= sizeof(int);
+			prg += op.m_length;
+			m_memory.Write32(sf, prg);
+			prg = r[op.m_src];
+			SyncDecodeCache();
+			break;
+		case UOP_RET:
+			prg = m_memory.Read32(sf);
+			sf += sizeof(int);
+			break;
+		case UOP_CMP_IMM_BR:
+		case UOP_CMP8_BR:
+		case UOP_CMP16_BR:
+		case UOP_CMP32_BR:
+		{
+			const MicroOp& br = pOp[op.m_length];
+
+			Compare(r, op, op.m_kind - UOP_CMP_IMM_BR);
+			prg += op.m_length;
+
+			// the BR does not fit in the budget
+			if (budget == 0)
+				break;
+
+			if (cnd & br.m_dst)
+				prg = br.m_imm;
+			else
+				prg += br.m_length;
+
+			++fusionStats.m_executed[FUSION_CMP_BR];
+			--budget;
+			break;
+		}
+		case UOP_LDV_ADD:
+		case UOP_LDV_SUB:
+		{
+			const MicroOp& alu = pOp[op.m_length];
+
+			prg += op.m_length;
+			r[op.m_dst] = op.m_imm;
+
+			if (budget == 0)
+				break;
+
+			prg += alu.m_length;
+			if (op.m_kind == UOP_LDV_ADD)
+				r[alu.m_dst] += r[alu.m_src];
+			else
+				r[alu.m_dst] -= r[alu.m_src];
+
+			++fusionStats.m_executed[FUSION_LDV_ALU];
+			--budget;
+			break;
+		}
+		case UOP_PUSH_IMM_CALL:
+		case UOP_PUSH_CALL:
+		{
+			const MicroOp& call = pOp[op.m_length];
+
+			sf -= sizeof(int);
+			prg += op.m_length;
+			m_memory.Write32(sf, op.m_kind == UOP_PUSH_IMM_CALL ? op.m_imm : r[op.m_src]);
+
+			// the push rewrote code, which may have been the CALL
+			if (m_memory.HasCodeWrite() == true)
+			{
+				InvalidateCodeWrite();
+				break;
+			}
+
+			if (budget == 0)
+				break;
+
+			sf -= sizeof(int);
+			m_memory.Write32(sf, prg + call.m_length);
+			prg = call.m_imm;
+			SyncDecodeCache();
+
+			++fusionStats.m_executed[FUSION_PUSH_CALL];
+			--budget;
+			break;
+		}
+		default:
+			throw std::runtime_error("Invalid micro-op");
+		}
+	}
+
+	return maxInstructions - budget;
+}
+
+uint64_t CPU::RunJIT(const uint64_t maxInstructions)
+{
+#if BLACKLIGHT_VM_JIT
+	// translated code addresses flat memory directly
+	if (m_pJit == nullptr)
+		return RunThreaded(maxInstructions);
+
 	uint8_t* rawMem = m_memory.GetRawMemory();
+	uint8_t* pDirty = m_memory.GetDirtyMap();
+	Register& prg = m_registers[R_PRG];
 
-	while (m_finished == false)
+	uint64_t budget = maxInstructions;
+	uintptr_t exit = JIT::EXIT_DISPATCH;
+
+	while (m_finished == false &&
+		budget > 0)
 	{
-		uint8_t opcode = *(rawMem + m_registers[R_PRG]);
+		// the end of the budget may not fit a whole block, so it is left to the instruction table
+		void* pBlock = nullptr;
+		if (budget >= JIT::MAX_BLOCK_OPS)
+			pBlock = m_pJit->GetBlock(m_decodeCache, m_memory, prg, exit);
+
+		if (pBlock != nullptr)
+		{
+			exit = m_pJit->Enter(m_registers, rawMem, pDirty, pBlock, budget);
+
+			// translated code does not go through the MemoryController, so other threads hear of it from here
+			if (exit == JIT::EXIT_CODE_WRITE)
+			{
+				uint32_t low, high;
+				m_pJit->GetCodeWrite(low, high);
+
+				if (m_memory.IsShared() == true)
+					m_memory.ReportCodeWrite(low, high - low + 1);
+				InvalidateCode(low, high);
+			}
+			continue;
+		}
+
+		// CX, TRAP and code outside of the image go through the instruction table
+		uint8_t opcode = m_memory.Read8(prg);
 		unsigned char inst = (opcode >> 4) & 0xF;
 
 		m_instructions[inst](this, opcode);
+
+		SyncDecodeCache();
+		exit = JIT::EXIT_DISPATCH;
+		--budget;
 	}
+
+	return maxInstructions - budget;
+#else
+	return RunThreaded(maxInstructions);
+#endif
+}
+
+uint64_t CPU::RunProfiled(const uint64_t maxInstructions)
+{
+	Profiler& profiler = *m_pProfiler;
+	Register& prg = m_registers[R_PRG];
+
+	profiler.Start(prg);
+
+	uint64_t count = 0;
+
+	for (; m_finished == false && count < maxInstructions; ++count)
+	{
+		uint8_t opcode = m_memory.Read8(prg);
+		unsigned char inst = (opcode >> 4) & 0xF;
+
+		profiler.RecordInstruction(opcode, prg);
+
+		// the flag bits of a BR line up with the flags it tests
+		if (inst == OP_BR)
+			profiler.RecordBranch((m_registers[R_CND] & opcode & (F_P | F_E | F_N)) != 0);
+
+		m_instructions[inst](this, opcode);
+
+		if (inst == OP_CALL)
+			profiler.RecordCall(prg);
+		else if (inst == OP_RET)
+			profiler.RecordReturn();
+
+		// the other cores carry on from here, so their caches have to stay in sync
+		SyncDecodeCache();
+	}
+
+	return count;
+}
+
+void CPU::InvalidateCodeWrite()
+{
+	uintptr_t low, high;
+	m_memory.TakeCodeWrite(low, high);
+
+	InvalidateCode(static_cast<uint32_t>(low), static_cast<uint32_t>(high));
+}
+
+void CPU::InvalidateCode(const uint32_t low, const uint32_t high)
+{
+	// the translated code no longer matches, and nothing else was watched or kept in step while it ran
+	if (m_pNativeImage != nullptr)
+	{
+		PrepareCode(m_imageOrigin, m_imageSize);
+		return;
+	}
+
+	m_decodeCache.Invalidate(low, high);
+	m_verifier.Invalidate(low, high);
+	if (m_pJit != nullptr)
+		m_pJit->Invalidate(low, high);
 }
\ No newline at end of file
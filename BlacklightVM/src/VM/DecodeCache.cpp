@@ -0,0 +1,317 @@
+#include <VM/DecodeCache.h>
+#include <VM/Arch.h>
+#include <VM/Encoding.h>
+
+#include <algorithm>
+#include <utility>
+
+using Blacklight::VM::DecodeCache;
+using Blacklight::VM::MicroOp;
+
+namespace
+{
+	// picks the 8/16/32 variant of a kind from the b/w bits
+	Blacklight::VM::MicroOpE BySize(const Blacklight::VM::MicroOpE kind8, const bool b, const bool w)
+	{
+		return static_cast<Blacklight::VM::MicroOpE>(kind8 + (b ? 0 : (w ? 1 : 2)));
+	}
+}
+
+DecodeCache::DecodeCache() : m_begin(0), m_pOps(nullptr), m_size(0), m_sweep(0), m_fuse(0), m_fusionStats() {}
+
+void DecodeCache::Build(const MemoryController& mc, const uint32_t address, const size_t size)
+{
+	Begin(address, size);
+	Extend(mc, size);
+}
+
+void DecodeCache::Begin(const uint32_t address, const size_t size)
+{
+	m_begin = address;
+	m_ops.assign(size, MicroOp{ UOP_UNDECODED, 0, 0, 0, 0 });
+	m_pOps = m_ops.data();
+	m_size = size;
+	m_pStorage.reset();
+
+	m_sweep = 0;
+	m_fuse = 0;
+	m_fusionStats = FusionStats();
+}
+
+void DecodeCache::Extend(const MemoryController& mc, const size_t available)
+{
+	// linear sweep, anything it misses is decoded the first time it is reached. An instruction is only
+	// decoded once every byte it may cover has arrived, or the rest of the range has
+	while (m_sweep < m_size &&
+		(available >= m_size || m_sweep + MAX_LENGTH <= available))
+	{
+		DecodeAt(mc, static_cast<uint32_t>(m_begin + m_sweep));
+		m_sweep += m_pOps[m_sweep].m_length;
+	}
+
+	// fuse pairs along the same sweep, once both halves are decoded. The second instruction keeps its
+	// own slot for anything that branches straight to it
+	while (m_fuse < m_sweep)
+	{
+		MicroOp& first = m_pOps[m_fuse];
+
+		if (m_fuse + first.m_length >= m_size)
+		{
+			m_fuse = m_size;
+			break;
+		}
+		if (m_fuse + first.m_length >= m_sweep)
+			break;
+
+		MicroOpE kind = Fuse(first, m_pOps[m_fuse + first.m_length]);
+		m_fuse += first.m_length;
+		if (kind == UOP_UNDECODED)
+			continue;
+
+		first.m_kind = kind;
+		++m_fusionStats.m_formed[GetFusion(kind)];
+	}
+}
+
+void DecodeCache::Adopt(const uint32_t address, MicroOp* pOps, const size_t size, const FusionStats& fusionStats, std::shared_ptr<void> pStorage)
+{
+	m_begin = address;
+	m_ops.clear();
+	m_ops.shrink_to_fit();
+	m_pOps = pOps;
+	m_size = size;
+	m_pStorage = std::move(pStorage);
+	m_sweep = size;
+	m_fuse = size;
+
+	// they have not run here yet
+	m_fusionStats = fusionStats;
+	for (uint64_t& executed : m_fusionStats.m_executed)
+		executed = 0;
+}
+
+void DecodeCache::Copy(const DecodeCache& other)
+{
+	m_begin = other.m_begin;
+	m_ops.assign(other.m_pOps, other.m_pOps + other.m_size);
+	m_pOps = m_ops.data();
+	m_size = other.m_size;
+	m_pStorage.reset();
+	m_sweep = other.m_sweep;
+	m_fuse = other.m_fuse;
+
+	m_fusionStats = other.m_fusionStats;
+	for (uint64_t& executed : m_fusionStats.m_executed)
+		executed = 0;
+}
+
+void DecodeCache::DecodeAt(const MemoryController& mc, const uint32_t address)
+{
+	uint32_t offset = address - m_begin;
+
+	m_pOps[offset] = Decode(mc.Fetch(address), address, m_size - offset);
+}
+
+void DecodeCache::Invalidate(const uint32_t low, const uint32_t high)
+{
+	// any slot starting up to MAX_SPAN - 1 bytes before the write may depend on it. The range is clamped to
+	// the cached one before any offset is taken, as a write can be reported on either side of it
+	uint64_t begin = m_begin;
+	uint64_t end = begin + m_size;
+	uint64_t from = std::max<uint64_t>(low >= MAX_SPAN - 1 ? low - (MAX_SPAN - 1) : 0, begin);
+	uint64_t to = std::min<uint64_t>(static_cast<uint64_t>(high) + 1, end);
+
+	for (uint64_t address = from; address < to; ++address)
+		m_pOps[address - begin].m_kind = UOP_UNDECODED;
+}
+
+Blacklight::VM::MicroOpE DecodeCache::GetUnfusedKind(const MicroOpE kind)
+{
+	switch (kind)
+	{
+	case UOP_CMP_IMM_BR:
+		return UOP_CMP_IMM;
+	case UOP_CMP8_BR:
+		return UOP_CMP8;
+	case UOP_CMP16_BR:
+		return UOP_CMP16;
+	case UOP_CMP32_BR:
+		return UOP_CMP32;
+	case UOP_LDV_ADD:
+	case UOP_LDV_SUB:
+		return UOP_LDV_IMM;
+	case UOP_PUSH_IMM_CALL:
+		return UOP_PUSH_IMM;
+	case UOP_PUSH_CALL:
+		return UOP_PUSH;
+	default:
+		return kind;
+	}
+}
+
+Blacklight::VM::FusionE DecodeCache::GetFusion(const MicroOpE kind)
+{
+	switch (kind)
+	{
+	case UOP_CMP_IMM_BR:
+	case UOP_CMP8_BR:
+	case UOP_CMP16_BR:
+	case UOP_CMP32_BR:
+		return FUSION_CMP_BR;
+	case UOP_LDV_ADD:
+	case UOP_LDV_SUB:
+		return FUSION_LDV_ALU;
+	case UOP_PUSH_IMM_CALL:
+	case UOP_PUSH_CALL:
+		return FUSION_PUSH_CALL;
+	default:
+		return FUSION_COUNT;
+	}
+}
+
+const char* DecodeCache::GetFusionName(const FusionE fusion)
+{
+	switch (fusion)
+	{
+	case FUSION_CMP_BR:
+		return "CMP+BR";
+	case FUSION_LDV_ALU:
+		return "LDV+ADD/SUB";
+	case FUSION_PUSH_CALL:
+		return "PUSH+CALL";
+	default:
+		return "?";
+	}
+}
+
+Blacklight::VM::MicroOpE DecodeCache::Fuse(const MicroOp& first, const MicroOp& second)
+{
+	switch (first.m_kind)
+	{
+	case UOP_CMP_IMM:
+	case UOP_CMP8:
+	case UOP_CMP16:
+	case UOP_CMP32:
+		if (second.m_kind == UOP_BR_IMM)
+			return static_cast<MicroOpE>(UOP_CMP_IMM_BR + (first.m_kind - UOP_CMP_IMM));
+		break;
+	case UOP_LDV_IMM:
+		if (second.m_kind == UOP_ADD32)
+			return UOP_LDV_ADD;
+		if (second.m_kind == UOP_SUB32)
+			return UOP_LDV_SUB;
+		break;
+	case UOP_PUSH_IMM:
+	case UOP_PUSH:
+		if (second.m_kind == UOP_CALL_IMM)
+			return first.m_kind == UOP_PUSH_IMM ? UOP_PUSH_IMM_CALL : UOP_PUSH_CALL;
+		break;
+	default:
+		break;
+	}
+
+	return UOP_UNDECODED;
+}
+
+MicroOp DecodeCache::Decode(const uint8_t* code, const uint32_t address, const size_t available)
+{
+	Encoding encoding = Split(code, available, false);
+	bool imm = encoding.m_imm;
+	bool b = encoding.m_b;
+	bool w = encoding.m_w;
+
+	MicroOp op{ UOP_INTERP, encoding.m_dst, encoding.m_src, encoding.m_length, 0 };
+	bool relative = false;
+
+	switch (encoding.m_op)
+	{
+	case OP_LD:
+		if (imm)
+			op.m_kind = (b || w || encoding.m_d) ? BySize(UOP_LD8_ABS, b, w) : UOP_NOP;
+		else
+			op.m_kind = (b || w || encoding.m_d) ? BySize(UOP_LD8, b, w) : UOP_NOP;
+		relative = imm;
+		break;
+	case OP_LDV:
+		op.m_kind = imm ? UOP_LDV_IMM : BySize(UOP_LDV8, b, w);
+		break;
+	case OP_ST:
+		op.m_kind = imm ? BySize(UOP_ST8_ABS, b, w) : BySize(UOP_ST8, b, w);
+		relative = imm;
+		break;
+	case OP_PUSH:
+		op.m_kind = imm ? UOP_PUSH_IMM : UOP_PUSH;
+		break;
+	case OP_POP:
+		op.m_kind = UOP_POP;
+		break;
+	case OP_ADD:
+		op.m_kind = imm ? UOP_ADD_IMM : BySize(UOP_ADD8, b, w);
+		break;
+	case OP_SUB:
+		op.m_kind = imm ? UOP_SUB_IMM : BySize(UOP_SUB8, b, w);
+		break;
+	case OP_AND:
+		op.m_kind = imm ? UOP_AND_IMM : BySize(UOP_AND8, b, w);
+		break;
+	case OP_NOT:
+		op.m_kind = UOP_NOT;
+		break;
+	case OP_CMP:
+		op.m_kind = imm ? UOP_CMP_IMM : BySize(UOP_CMP8, b, w);
+		break;
+	case OP_BR:
+		// the P/E/N bits line up with the flags in R_CND
+		op.m_kind = imm ? UOP_BR_IMM : UOP_BR;
+		op.m_dst = encoding.m_low & 0x7;
+		relative = imm;
+		break;
+	case OP_JMP:
+		op.m_kind = imm ? UOP_JMP_IMM : UOP_JMP;
+		relative = imm;
+		break;
+	case OP_CALL:
+		op.m_kind = imm ? UOP_CALL_IMM : UOP_CALL;
+		relative = imm;
+		break;
+	case OP_RET:
+		op.m_kind = UOP_RET;
+		break;
+	default:
+		// CX and TRAP stay with the instruction table, along with the extended page TRAP escapes to
+		op.m_kind = UOP_INTERP;
+		break;
+	}
+
+	// addresses and branch targets are relative to the next instruction
+	if (encoding.m_immLength != 0 &&
+		available >= op.m_length)
+		op.m_imm = ReadImmediate<uint32_t>(code, encoding) + (relative == true ? address + op.m_length : 0);
+
+	// an instruction running off the end of the image is left to the instruction table
+	if (available < op.m_length)
+	{
+		op.m_kind = UOP_INTERP;
+		op.m_length = 1;
+	}
+
+	// so are instructions naming the program counter as an operand, which lets
+	// the cores keep it outside of the register file
+	switch (op.m_kind)
+	{
+	case UOP_INTERP:
+	case UOP_NOP:
+	case UOP_PUSH_IMM:
+	case UOP_BR_IMM:
+	case UOP_JMP_IMM:
+	case UOP_CALL_IMM:
+	case UOP_RET:
+		break;
+	default:
+		if (op.m_dst == R_PRG || op.m_src == R_PRG)
+			op.m_kind = UOP_INTERP;
+		break;
+	}
+
+	return op;
+}
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include <VM/EventLoop.h>
+
+#include <cerrno>
+#include <exception>
+#include <stdexcept>
+
+#if __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+using Blacklight::VM::EventLoop;
+
+namespace
+{
+	// sockets reported at once
+	constexpr int EVENT_COUNT = 64;
+}
+
+EventLoop::EventLoop(const uint64_t quantum) :
+	m_quantum(quantum),
+	m_epoll(-1),
+	m_unfinished(0)
+{
+#if __linux__
+	m_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epoll == -1)
+		throw std::runtime_error("Could not create epoll instance");
+#endif
+}
+
+size_t EventLoop::Add(CPU* pCPU)
+{
+	size_t id = m_instances.size();
+	m_instances.push_back({ pCPU, 0, false, 0, 0, false, false });
+
+	m_ready.push_back(id);
+	++m_unfinished;
+
+	return id;
+}
+
+void EventLoop::Run()
+{
+	while (m_unfinished != 0)
+	{
+		// only sleep when nothing is ready to run
+		int timeout = 0;
+		if (m_ready.empty() == true)
+		{
+			timeout = -1;
+			if (m_timers.empty() == false)
+			{
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(m_timers.top().first - Clock::now()).count();
+				timeout = static_cast<int>(left < 0 ? 0 : left + 1);
+			}
+		}
+
+		Poll(timeout);
+
+		// one turn for everything ready now, anything that comes back goes in the next round
+		for (size_t count = m_ready.size(); count != 0; --count)
+		{
+			size_t id = m_ready.front();
+			m_ready.pop_front();
+
+			Instance& instance = m_instances[id];
+			CPU& cpu = *instance.m_pCPU;
+
+			// a CPU that throws is dropped rather than taking the loop down with it
+			try
+			{
+				instance.m_instructions += cpu.Run(m_quantum);
+			}
+			catch (const std::exception&)
+			{
+				instance.m_faulted = true;
+			}
+
+			if (cpu.IsSuspended() == true &&
+				instance.m_faulted == false)
+			{
+				Park(id);
+				continue;
+			}
+
+			if (cpu.IsFinished() == false &&
+				instance.m_faulted == false)
+			{
+				m_ready.push_back(id);
+				continue;
+			}
+
+			instance.m_finished = true;
+			--m_unfinished;
+		}
+	}
+}
+
+EventLoop::InstanceStats EventLoop::GetInstanceStats(const size_t id) const
+{
+	const Instance& instance = m_instances.at(id);
+
+	return { instance.m_instructions, instance.m_suspensions, instance.m_finished, instance.m_faulted };
+}
+
+EventLoop::~EventLoop()
+{
+#if __linux__
+	if (m_epoll != -1)
+		close(m_epoll);
+#endif
+}
+
+void EventLoop::Park(const size_t id)
+{
+	Instance& instance = m_instances[id];
+	const SocketTable& sockets = instance.m_pCPU->GetSocketTable();
+
+	instance.m_parked = true;
+	++instance.m_suspensions;
+
+	Waiter waiter(id, instance.m_generation);
+
+#if __linux__
+	for (const SocketWait& wait : sockets.GetWait())
+	{
+		// one shot, so a socket nobody waits on any more stays quiet
+		epoll_event event = {};
+		event.events = wait.m_events | EPOLLONESHOT;
+		event.data.fd = wait.m_fd;
+
+		// sockets stay registered between waits, closing them is what takes them out
+		if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, wait.m_fd, &event) == -1 &&
+			(errno != ENOENT ||
+				epoll_ctl(m_epoll, EPOLL_CTL_ADD, wait.m_fd, &event) == -1))
+		{
+			// the trap finds out what is wrong with it for itself
+			Wake(waiter);
+			return;
+		}
+
+		m_waiting[wait.m_fd] = waiter;
+	}
+
+	int timeout = sockets.GetWaitTimeout();
+	if (timeout >= 0)
+		m_timers.push({ Clock::now() + std::chrono::milliseconds(timeout), waiter });
+	else if (sockets.GetWait().empty() == true)
+		Wake(waiter);
+#else
+	Wake(waiter);
+#endif
+}
+
+void EventLoop::Wake(const Waiter& waiter)
+{
+	Instance& instance = m_instances[waiter.first];
+
+	if (instance.m_parked == false ||
+		instance.m_generation != waiter.second)
+		return;
+
+	instance.m_parked = false;
+	++instance.m_generation;
+
+	m_ready.push_back(waiter.first);
+}
+
+void EventLoop::Poll(const int timeout)
+{
+#if __linux__
+	epoll_event events[EVENT_COUNT];
+
+	int count = epoll_wait(m_epoll, events, EVENT_COUNT, timeout);
+	for (int i = 0; i < count; ++i)
+	{
+		auto it = m_waiting.find(events[i].data.fd);
+		if (it == m_waiting.end())
+			continue;
+
+		Waiter waiter = it->second;
+		m_waiting.erase(it);
+
+		Wake(waiter);
+	}
+#endif
+
+	Clock::time_point now = Clock::now();
+	while (m_timers.empty() == false &&
+		m_timers.top().first <= now)
+	{
+		Waiter waiter = m_timers.top().second;
+		m_timers.pop();
+
+		Wake(waiter);
+	}
+}
\ No newline at end of file
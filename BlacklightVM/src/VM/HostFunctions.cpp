@@ -0,0 +1,30 @@
+#include <VM/HostFunctions.h>
+
+#include <stdexcept>
+#include <string>
+
+using Blacklight::VM::HostFunctionTable;
+
+HostFunctionTable::HostFunctionTable()
+{
+}
+
+size_t HostFunctionTable::GetCount() const
+{
+	return m_functions.size();
+}
+
+uint8_t HostFunctionTable::Insert(const Thunk thunk, const std::shared_ptr<void>& pOwner)
+{
+	if (m_functions.size() >= MAX_FUNCTIONS)
+		throw std::runtime_error("Host function table is full");
+
+	m_functions.push_back({ thunk, pOwner.get(), pOwner });
+
+	return static_cast<uint8_t>(m_functions.size() - 1);
+}
+
+void HostFunctionTable::ThrowMissing(const uint8_t index)
+{
+	throw std::runtime_error("No host function at index " + std::to_string(index));
+}
\ No newline at end of file
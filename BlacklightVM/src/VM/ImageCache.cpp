@@ -0,0 +1,371 @@
+#include <VM/ImageCache.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using Blacklight::VM::ImageCache;
+using Blacklight::VM::DecodeCache;
+using Blacklight::VM::Verifier;
+using Blacklight::VM::MicroOp;
+using Blacklight::VM::FusionStats;
+using Blacklight::VM::VerifiedRegion;
+using Blacklight::VM::VerifierIssue;
+
+namespace
+{
+	constexpr char MAGIC[4] = { 'B', 'L', 'V', 'C' };
+	constexpr uint32_t VERSION = 1;
+
+	// the slots start on a cache line
+	constexpr size_t OPS_ALIGNMENT = 64;
+
+	// Starts every file, the rest of the layout follows from it:
+	//	the slots				m_size MicroOps from the first OPS_ALIGNMENT boundary past the header
+	//	the code				m_size bytes, compared on load so that a hash collision can never pass
+	//	the proof				m_size bytes of Verifier::GetMap, only when m_verified
+	//	the regions				m_regionCount VerifiedRegions from the next 8 byte boundary
+	//	the issues				m_issueCount of an address, a length and that many bytes of reason
+	struct FileHeader
+	{
+		char m_magic[4];
+		uint32_t m_version;
+		// sizeof(MicroOp) and UOP_COUNT of the build that wrote it
+		uint32_t m_opSize;
+		uint32_t m_opKinds;
+		uint64_t m_key;
+		uint32_t m_origin;
+		uint32_t m_verified;
+		uint64_t m_size;
+		uint64_t m_memorySize;
+		uint64_t m_fileSize;
+
+		uint64_t m_formed[Blacklight::VM::FUSION_COUNT];
+
+		// Verifier::Stats
+		uint64_t m_instructions;
+		uint64_t m_verifiedInstructions;
+		uint64_t m_regions;
+		uint64_t m_regionCount;
+		uint64_t m_issueCount;
+	};
+
+	size_t Align(const size_t offset, const size_t alignment)
+	{
+		return (offset + alignment - 1) & ~(alignment - 1);
+	}
+
+	// Returns where the parts of a file for size bytes of code start
+	struct Layout
+	{
+		size_t m_ops;
+		size_t m_code;
+		size_t m_map;
+		size_t m_regions;
+		size_t m_issues;
+	};
+	Layout GetLayout(const size_t size, const bool verified, const size_t regionCount)
+	{
+		Layout layout;
+		layout.m_ops = Align(sizeof(FileHeader), OPS_ALIGNMENT);
+		layout.m_code = layout.m_ops + size * sizeof(MicroOp);
+		layout.m_map = layout.m_code + size;
+		layout.m_regions = Align(layout.m_map + (verified == true ? size : 0), sizeof(uint64_t));
+		layout.m_issues = layout.m_regions + regionCount * sizeof(VerifiedRegion);
+
+		return layout;
+	}
+
+	// 64 bit FNV-1a, carried on from hash
+	uint64_t Hash(uint64_t hash, const void* pData, const size_t size)
+	{
+		const uint8_t* pBytes = static_cast<const uint8_t*>(pData);
+		for (size_t i = 0; i < size; ++i)
+		{
+			hash ^= pBytes[i];
+			hash *= 0x100000001B3ull;
+		}
+
+		return hash;
+	}
+
+	// Returns the key a file is named after, which covers everything the slots depend on
+	uint64_t GetKey(const uint8_t* pCode, const uint32_t origin, const size_t size, const size_t memorySize, const bool verified)
+	{
+		uint64_t fields[] = {
+			VERSION,
+			sizeof(MicroOp),
+			Blacklight::VM::UOP_COUNT,
+			origin,
+			size,
+			memorySize,
+			verified == true ? 1u : 0u
+		};
+
+		return Hash(Hash(0xCBF29CE484222325ull, fields, sizeof(fields)), pCode, size);
+	}
+
+	// Returns the name of the file for a key
+	std::string GetFileName(const uint64_t key)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.blc", static_cast<unsigned long long>(key));
+
+		return name;
+	}
+
+	// Reads a whole file into memory that stays alive as long as the pointer, nullptr if it can not be read
+	std::shared_ptr<void> ReadFile(const std::string& path, size_t& size)
+	{
+#if __linux__
+		int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (file == -1)
+			return nullptr;
+
+		struct stat info;
+		if (fstat(file, &info) == -1 ||
+			info.st_size < static_cast<off_t>(sizeof(FileHeader)))
+		{
+			close(file);
+			return nullptr;
+		}
+
+		// private, so that the slots a CPU throws away or decodes stay its own
+		size = static_cast<size_t>(info.st_size);
+		void* pData = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+		close(file);
+
+		if (pData == MAP_FAILED)
+			return nullptr;
+
+		return std::shared_ptr<void>(pData, [size](void* p) { munmap(p, size); });
+#else
+		std::ifstream in(path, std::ios_base::binary | std::ios_base::ate);
+		if (in.is_open() == false)
+			return nullptr;
+
+		size = static_cast<size_t>(in.tellg());
+		if (size < sizeof(FileHeader))
+			return nullptr;
+
+		// 8 byte words keep the slots aligned
+		std::shared_ptr<std::vector<uint64_t>> pData(new std::vector<uint64_t>((size + sizeof(uint64_t) - 1) / sizeof(uint64_t)));
+
+		in.seekg(0);
+		in.read(reinterpret_cast<char*>(pData->data()), static_cast<std::streamsize>(size));
+		if (in.good() == false)
+			return nullptr;
+
+		return std::shared_ptr<void>(pData, pData->data());
+#endif
+	}
+}
+
+ImageCache::ImageCache(const char* directory) :
+	m_directory(directory),
+	m_hits(0),
+	m_misses(0),
+	m_stores(0)
+{
+}
+
+bool ImageCache::Load(const uint8_t* pCode, const uint32_t origin, const size_t size, const size_t memorySize, DecodeCache& cache, Verifier* pVerifier)
+{
+	const bool verified = pVerifier != nullptr;
+	const uint64_t key = GetKey(pCode, origin, size, memorySize, verified);
+
+	size_t fileSize = 0;
+	std::shared_ptr<void> pFile = ReadFile(m_directory + "/" + GetFileName(key), fileSize);
+	if (pFile == nullptr)
+	{
+		++m_misses;
+		return false;
+	}
+
+	uint8_t* pData = static_cast<uint8_t*>(pFile.get());
+	const FileHeader& header = *reinterpret_cast<const FileHeader*>(pData);
+
+	// anything written by another build, for other code or cut short is a miss, and is written over
+	Layout layout = GetLayout(size, verified, static_cast<size_t>(header.m_regionCount));
+	if (memcmp(header.m_magic, MAGIC, sizeof(MAGIC)) != 0 ||
+		header.m_version != VERSION ||
+		header.m_opSize != sizeof(MicroOp) ||
+		header.m_opKinds != UOP_COUNT ||
+		header.m_key != key ||
+		header.m_origin != origin ||
+		header.m_verified != (verified == true ? 1u : 0u) ||
+		header.m_size != size ||
+		header.m_memorySize != memorySize ||
+		header.m_fileSize != fileSize ||
+		header.m_regionCount > fileSize / sizeof(VerifiedRegion) ||
+		layout.m_issues > fileSize ||
+		memcmp(pData + layout.m_code, pCode, size) != 0)
+	{
+		++m_misses;
+		return false;
+	}
+
+	if (verified == true)
+	{
+		std::vector<VerifiedRegion> regions(static_cast<size_t>(header.m_regionCount));
+		if (regions.empty() == false)
+			memcpy(regions.data(), pData + layout.m_regions, regions.size() * sizeof(VerifiedRegion));
+
+		std::vector<VerifierIssue> issues;
+		size_t offset = layout.m_issues;
+		for (uint64_t i = 0; i < header.m_issueCount; ++i)
+		{
+			uint32_t fields[2];
+			if (fileSize - offset < sizeof(fields))
+			{
+				++m_misses;
+				return false;
+			}
+
+			memcpy(fields, pData + offset, sizeof(fields));
+			offset += sizeof(fields);
+
+			if (fileSize - offset < fields[1])
+			{
+				++m_misses;
+				return false;
+			}
+
+			issues.push_back({ fields[0], std::string(reinterpret_cast<const char*>(pData + offset), fields[1]) });
+			offset += fields[1];
+		}
+
+		Verifier::Stats stats;
+		stats.m_instructions = static_cast<size_t>(header.m_instructions);
+		stats.m_verified = static_cast<size_t>(header.m_verifiedInstructions);
+		stats.m_regions = static_cast<size_t>(header.m_regions);
+
+		pVerifier->Restore(origin, pData + layout.m_map, size, std::move(regions), std::move(issues), stats);
+	}
+
+	FusionStats fusionStats = {};
+	memcpy(fusionStats.m_formed, header.m_formed, sizeof(fusionStats.m_formed));
+
+	// the slots are used where they lie, the mapping going away along with the last of them
+	cache.Adopt(origin, reinterpret_cast<MicroOp*>(pData + layout.m_ops), size, fusionStats, std::move(pFile));
+
+	++m_hits;
+	return true;
+}
+
+bool ImageCache::Store(const uint8_t* pCode, const uint32_t origin, const size_t size, const size_t memorySize, const DecodeCache& cache, const Verifier* pVerifier)
+{
+	if (cache.GetAddress() != origin ||
+		cache.GetSize() != size)
+		return false;
+
+	const bool verified = pVerifier != nullptr;
+
+	FileHeader header = {};
+	memcpy(header.m_magic, MAGIC, sizeof(MAGIC));
+	header.m_version = VERSION;
+	header.m_opSize = sizeof(MicroOp);
+	header.m_opKinds = UOP_COUNT;
+	header.m_key = GetKey(pCode, origin, size, memorySize, verified);
+	header.m_origin = origin;
+	header.m_verified = verified == true ? 1u : 0u;
+	header.m_size = size;
+	header.m_memorySize = memorySize;
+	memcpy(header.m_formed, cache.GetFusionStats().m_formed, sizeof(header.m_formed));
+
+	// the issues go last, as they are the only part that is not a fixed size
+	std::vector<uint8_t> issues;
+	if (verified == true)
+	{
+		const Verifier::Stats& stats = pVerifier->GetStats();
+		header.m_instructions = stats.m_instructions;
+		header.m_verifiedInstructions = stats.m_verified;
+		header.m_regions = stats.m_regions;
+		header.m_regionCount = pVerifier->GetRegions().size();
+		header.m_issueCount = pVerifier->GetIssues().size();
+
+		for (const VerifierIssue& issue : pVerifier->GetIssues())
+		{
+			uint32_t fields[2] = { issue.m_address, static_cast<uint32_t>(issue.m_reason.size()) };
+
+			issues.insert(issues.end(), reinterpret_cast<const uint8_t*>(fields), reinterpret_cast<const uint8_t*>(fields) + sizeof(fields));
+			issues.insert(issues.end(), issue.m_reason.begin(), issue.m_reason.end());
+		}
+	}
+
+	Layout layout = GetLayout(size, verified, static_cast<size_t>(header.m_regionCount));
+	header.m_fileSize = layout.m_issues + issues.size();
+
+	std::vector<uint8_t> file(static_cast<size_t>(header.m_fileSize), 0);
+	memcpy(file.data(), &header, sizeof(header));
+	if (size != 0)
+	{
+		memcpy(file.data() + layout.m_ops, cache.GetOps(), size * sizeof(MicroOp));
+		memcpy(file.data() + layout.m_code, pCode, size);
+	}
+	if (verified == true)
+	{
+		if (size != 0)
+			memcpy(file.data() + layout.m_map, pVerifier->GetMap(), size);
+		if (pVerifier->GetRegions().empty() == false)
+			memcpy(file.data() + layout.m_regions, pVerifier->GetRegions().data(), pVerifier->GetRegions().size() * sizeof(VerifiedRegion));
+		if (issues.empty() == false)
+			memcpy(file.data() + layout.m_issues, issues.data(), issues.size());
+	}
+
+	// written whole under a name of its own, then renamed into place so that no one ever loads half of it
+	std::string path = m_directory + "/" + GetFileName(header.m_key);
+	std::string temporary = path + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+#if __linux__
+	temporary += "." + std::to_string(getpid());
+#endif
+	temporary += ".tmp";
+
+	{
+		std::ofstream out(temporary, std::ios_base::binary | std::ios_base::trunc);
+		out.write(reinterpret_cast<const char*>(file.data()), static_cast<std::streamsize>(file.size()));
+		out.close();
+
+		if (out.good() == false)
+		{
+			std::remove(temporary.c_str());
+			return false;
+		}
+	}
+
+	if (std::rename(temporary.c_str(), path.c_str()) != 0)
+	{
+		std::remove(temporary.c_str());
+		return false;
+	}
+
+	++m_stores;
+	return true;
+}
+
+std::string ImageCache::GetPath(const uint8_t* pCode, const uint32_t origin, const size_t size, const size_t memorySize, const bool verified) const
+{
+	return m_directory + "/" + GetFileName(GetKey(pCode, origin, size, memorySize, verified));
+}
+
+ImageCache::Stats ImageCache::GetStats() const
+{
+	Stats stats;
+	stats.m_hits = m_hits;
+	stats.m_misses = m_misses;
+	stats.m_stores = m_stores;
+
+	return stats;
+}
\ No newline at end of file
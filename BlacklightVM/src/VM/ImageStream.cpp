@@ -0,0 +1,86 @@
+#include <VM/ImageStream.h>
+
+#include <cstring>
+
+using Blacklight::VM::ImageStream;
+
+ImageStream::ImageStream(CPU* pCPU, const size_t size) :
+	m_pCPU(pCPU),
+	m_size(size),
+	m_received(0),
+	m_window(0),
+	m_header(),
+	m_stackSize(0),
+	m_origin(0)
+{
+	if (size < HEADER_SIZE)
+		throw std::runtime_error("Image is too short for its header");
+}
+
+uint8_t* ImageStream::GetWindow(size_t& size)
+{
+	// the header is held on to until it says where the code goes
+	if (m_received < HEADER_SIZE)
+	{
+		size = HEADER_SIZE - m_received;
+		m_window = size;
+
+		return m_header + m_received;
+	}
+
+	size = m_size - m_received;
+	m_window = size;
+	if (size == 0)
+		return nullptr;
+
+	// the code goes straight to where it runs from, a page at a time in MM_PAGED
+	uint8_t* pWindow = m_pCPU->m_memory.GetWriteSpan(m_origin + (m_received - HEADER_SIZE), size);
+	m_window = size;
+
+	return pWindow;
+}
+
+void ImageStream::Commit(const size_t count)
+{
+	if (count > m_window)
+		throw std::runtime_error("Committed more than the window holds");
+
+	bool header = m_received < HEADER_SIZE;
+	m_received += count;
+	m_window -= count;
+
+	size_t codeSize = m_size - HEADER_SIZE;
+	if (header == true)
+	{
+		if (m_received < HEADER_SIZE)
+			return;
+
+		memcpy(&m_stackSize, m_header, sizeof(m_stackSize));
+		memcpy(&m_origin, m_header + sizeof(m_stackSize), sizeof(m_origin));
+
+		if (static_cast<uint64_t>(m_origin) + codeSize > m_pCPU->m_memory.GetBlockSize())
+			throw std::runtime_error("Image does not fit in memory");
+
+		// whatever was decoded for the image before is gone along with it
+		m_pCPU->m_pNativeImage = nullptr;
+		if (m_pCPU->m_mode != DM_TABLE)
+			m_pCPU->m_decodeCache.Begin(m_origin, codeSize);
+	}
+
+	// decode along behind the bytes as they arrive
+	if (m_pCPU->m_mode != DM_TABLE)
+		m_pCPU->m_decodeCache.Extend(m_pCPU->m_memory, m_received - HEADER_SIZE);
+
+	if (m_received == m_size)
+		m_pCPU->PrepareImage(m_stackSize, m_origin, codeSize, true);
+}
+
+bool ImageStream::IsComplete() const
+{
+	return m_received == m_size;
+}
+
+size_t ImageStream::GetReceived() const
+{
+	return m_received;
+}
\ No newline at end of file
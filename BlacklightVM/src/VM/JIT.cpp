@@ -0,0 +1,734 @@
+#include <VM/JIT.h>
+#include <VM/Arch.h>
+#include <VM/CPU.h>
+
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+using Blacklight::VM::JIT;
+using Blacklight::VM::MemoryController;
+using Blacklight::VM::MicroOp;
+
+#if BLACKLIGHT_VM_JIT
+namespace
+{
+	// host registers by their encoding
+	enum HostRegisterE : uint8_t
+	{
+		H_EAX = 0,
+		H_ECX = 1,
+		H_EDX = 2,
+		H_ESI = 6
+	};
+
+	// raw x86-64 emission. rbx holds the guest register file, r12 guest memory, r13 the context and r14 the dirty page map
+	class Emitter
+	{
+	public:
+		Emitter(uint8_t* pCode, const uint32_t addressMask = UINT32_MAX) : m_pCode(pCode), m_addressMask(addressMask) {}
+
+		uint8_t* Here() const
+		{
+			return m_pCode;
+		}
+
+		void Byte(const uint8_t b)
+		{
+			*m_pCode++ = b;
+		}
+		void Bytes(std::initializer_list<uint8_t> bytes)
+		{
+			for (uint8_t b : bytes)
+				Byte(b);
+		}
+		void Dword(const uint32_t d)
+		{
+			memcpy(m_pCode, &d, sizeof(d));
+			m_pCode += sizeof(d);
+		}
+		void Qword(const uint64_t q)
+		{
+			memcpy(m_pCode, &q, sizeof(q));
+			m_pCode += sizeof(q);
+		}
+
+		// rel32 to a known target
+		void Rel32(const uint8_t* pTarget)
+		{
+			Dword(static_cast<uint32_t>(pTarget - (m_pCode + 4)));
+		}
+		// jmp rel32
+		void Jmp(const uint8_t* pTarget)
+		{
+			Byte(0xE9);
+			Rel32(pTarget);
+		}
+		// jcc rel32 to a known target
+		void Jcc(const uint8_t cc, const uint8_t* pTarget)
+		{
+			Bytes({ 0x0F, static_cast<uint8_t>(0x80 | cc) });
+			Rel32(pTarget);
+		}
+		// jcc rel32 to be patched, returns the rel32
+		uint8_t* JccForward(const uint8_t cc)
+		{
+			Bytes({ 0x0F, static_cast<uint8_t>(0x80 | cc) });
+			Dword(0);
+			return m_pCode - 4;
+		}
+		// points a forward jump at the current position
+		void Bind(uint8_t* pRel32)
+		{
+			uint32_t rel = static_cast<uint32_t>(m_pCode - (pRel32 + 4));
+			memcpy(pRel32, &rel, sizeof(rel));
+		}
+
+		// mov host, [rbx + guest * 4]
+		void LoadGuest(const uint8_t host, const uint8_t guest)
+		{
+			Bytes({ 0x8B, static_cast<uint8_t>(0x43 | (host << 3)), static_cast<uint8_t>(guest * 4) });
+		}
+		// movzx/movsx host, byte/word [rbx + guest * 4]
+		void LoadGuestExtend(const uint8_t opcode, const uint8_t host, const uint8_t guest)
+		{
+			Bytes({ 0x0F, opcode, static_cast<uint8_t>(0x43 | (host << 3)), static_cast<uint8_t>(guest * 4) });
+		}
+		// mov [rbx + guest * 4], host
+		void StoreGuest(const uint8_t guest, const uint8_t host)
+		{
+			Bytes({ 0x89, static_cast<uint8_t>(0x43 | (host << 3)), static_cast<uint8_t>(guest * 4) });
+		}
+		// mov dword [rbx + guest * 4], imm32
+		void StoreGuestImm(const uint8_t guest, const uint32_t imm)
+		{
+			Bytes({ 0xC7, 0x43, static_cast<uint8_t>(guest * 4) });
+			Dword(imm);
+		}
+		// add/and/sub dword [rbx + guest * 4], imm32 by the /digit of opcode 81
+		void AluGuestImm(const uint8_t ext, const uint8_t guest, const uint32_t imm)
+		{
+			Bytes({ 0x81, static_cast<uint8_t>(0x43 | (ext << 3)), static_cast<uint8_t>(guest * 4) });
+			Dword(imm);
+		}
+		// add/and/sub [rbx + guest * 4], host
+		void AluGuestHost(const uint8_t opcode, const uint8_t guest, const uint8_t host)
+		{
+			Bytes({ opcode, static_cast<uint8_t>(0x43 | (host << 3)), static_cast<uint8_t>(guest * 4) });
+		}
+		// mov host, imm32
+		void MovImm(const uint8_t host, const uint32_t imm)
+		{
+			Byte(0xB8 + host);
+			Dword(imm);
+		}
+		// and eax, mask. Keeps eax inside of the reservation so a stray access faults in its guard region
+		void MaskAddress()
+		{
+#if !BLACKLIGHT_VM_UNCHECKED
+			if (m_addressMask == UINT32_MAX)
+				return;
+
+			Byte(0x25);
+			Dword(m_addressMask);
+#endif
+		}
+		// eax = size bytes at [r12 + rax], zero extended
+		void LoadMemory(const uint8_t size)
+		{
+			MaskAddress();
+
+			if (size == 1)
+				Bytes({ 0x41, 0x0F, 0xB6, 0x04, 0x04 });
+			else if (size == 2)
+				Bytes({ 0x41, 0x0F, 0xB7, 0x04, 0x04 });
+			else
+				Bytes({ 0x41, 0x8B, 0x04, 0x04 });
+		}
+		// size bytes at [r12 + rax] = ecx
+		void StoreMemory(const uint8_t size)
+		{
+			MaskAddress();
+
+			if (size == 1)
+				Bytes({ 0x41, 0x88, 0x0C, 0x04 });
+			else if (size == 2)
+				Bytes({ 0x66, 0x41, 0x89, 0x0C, 0x04 });
+			else
+				Bytes({ 0x41, 0x89, 0x0C, 0x04 });
+
+			MarkDirty(size);
+		}
+		// dword [r12 + rax] = imm32
+		void StoreMemoryImm(const uint32_t imm)
+		{
+			MaskAddress();
+
+			Bytes({ 0x41, 0xC7, 0x04, 0x04 });
+			Dword(imm);
+
+			MarkDirty(sizeof(imm));
+		}
+		// marks the pages a store of size bytes at eax touched, using edx
+		void MarkDirty(const uint8_t size)
+		{
+			if (size > 1)
+			{
+				Bytes({ 0x8D, 0x50, static_cast<uint8_t>(size - 1) });	// lea edx, [rax + size - 1]
+				Bytes({ 0xC1, 0xEA, MemoryController::PAGE_SHIFT });	// shr edx, PAGE_SHIFT
+				Bytes({ 0x41, 0xC6, 0x04, 0x16, 0x01 });				// mov byte [r14 + rdx], 1
+			}
+
+			Bytes({ 0x89, 0xC2 });									// mov edx, eax
+			Bytes({ 0xC1, 0xEA, MemoryController::PAGE_SHIFT });	// shr edx, PAGE_SHIFT
+			Bytes({ 0x41, 0xC6, 0x04, 0x16, 0x01 });				// mov byte [r14 + rdx], 1
+		}
+	private:
+		uint8_t* m_pCode;
+		uint32_t m_addressMask;
+	};
+
+	// x86 condition codes
+	enum ConditionE : uint8_t
+	{
+		CC_B = 0x2,
+		CC_AE = 0x3,
+		CC_E = 0x4,
+		CC_NE = 0x5,
+		CC_L = 0xC
+	};
+
+	// size of the access an 8/16/32 micro-op makes, ordered like MicroOpE
+	uint8_t SizeOf(const Blacklight::VM::MicroOpE kind, const Blacklight::VM::MicroOpE kind8)
+	{
+		return static_cast<uint8_t>(1 << (kind - kind8));
+	}
+
+	// a store that hit the image, emitted after the block
+	struct CodeWriteExit
+	{
+		uint8_t* m_pJump;
+		uint32_t m_next;
+		bool m_dynamic;		// the next R_PRG is in esi
+		uint8_t m_size;
+		uint8_t m_index;	// which of the block's instructions the store is
+	};
+}
+#endif
+
+JIT::JIT() :
+#if _WIN32 || _WIN64
+	m_allocator(CHUNK_COUNT, PAGE_EXECUTE_READWRITE, Memory::PoolAllocatorFlags_NOCONSTRUCT),
+#elif __linux__
+	m_allocator(CHUNK_COUNT, PROT_READ | PROT_WRITE | PROT_EXEC, Memory::PoolAllocatorFlags_NOCONSTRUCT),
+#endif
+	m_pCursor(nullptr),
+	m_pLimit(nullptr),
+	m_pEnter(nullptr),
+	m_pExit(nullptr),
+	m_pExitDispatch(nullptr),
+	m_begin(0),
+	m_context{ 0, 0, 0, nullptr }
+{
+	Flush();
+}
+
+void JIT::Reset(const uint32_t address, const size_t size)
+{
+	m_begin = address;
+	m_entries.assign(size, nullptr);
+
+	Flush();
+}
+
+void* JIT::GetBlock(DecodeCache& cache, const MemoryController& mc, const uint32_t address, const uintptr_t exit)
+{
+#if BLACKLIGHT_VM_JIT
+	uint32_t offset = address - m_begin;
+
+	if (offset >= m_entries.size())
+		return nullptr;
+
+	uintptr_t link = exit;
+
+	if (m_entries[offset] == nullptr)
+	{
+		// out of executable memory, start over. The exit that came here went with everything else
+		if (Reserve() == nullptr)
+		{
+			Flush();
+			link = EXIT_DISPATCH;
+		}
+
+		if (Translate(cache, mc, address) == nullptr)
+			return nullptr;
+	}
+
+	if (link >= EXIT_LINK)
+	{
+		Patch(reinterpret_cast<uint8_t*>(link), m_entries[offset]);
+		m_blocks[address].m_links.push_back(reinterpret_cast<uint8_t*>(link));
+	}
+
+	return m_entries[offset];
+#else
+	return nullptr;
+#endif
+}
+
+uintptr_t JIT::Enter(uint32_t* pRegisters, uint8_t* pMemory, uint8_t* pDirty, void* pBlock, uint64_t& budget)
+{
+	using Enter_t = uintptr_t(*)(uint32_t*, uint8_t*, Context*, void*);
+
+	int64_t start = budget > static_cast<uint64_t>(INT64_MAX) ? INT64_MAX : static_cast<int64_t>(budget);
+	m_context.m_budget = start;
+	m_context.m_pDirty = pDirty;
+
+	uintptr_t exit = reinterpret_cast<Enter_t>(m_pEnter)(pRegisters, pMemory, &m_context, pBlock);
+
+	budget -= static_cast<uint64_t>(start - m_context.m_budget);
+
+	return exit;
+}
+
+void JIT::GetCodeWrite(uint32_t& low, uint32_t& high) const
+{
+	low = m_context.m_writeAddress;
+	high = m_context.m_writeAddress + m_context.m_writeSize - 1;
+}
+
+void JIT::Invalidate(const uint32_t low, const uint32_t high)
+{
+	for (auto it = m_blocks.begin(); it != m_blocks.end();)
+	{
+		if (it->first > high ||
+			it->second.m_end <= low)
+		{
+			++it;
+			continue;
+		}
+
+		// send everything that was linked here back through the CPU
+		for (uint8_t* pExit : it->second.m_links)
+			Patch(pExit, nullptr);
+
+		m_entries[it->first - m_begin] = nullptr;
+		it = m_blocks.erase(it);
+	}
+}
+
+void JIT::Flush()
+{
+	for (CodeChunk* pChunk : m_chunks)
+		m_allocator.deallocate(pChunk);
+
+	m_chunks.clear();
+	m_blocks.clear();
+	std::fill(m_entries.begin(), m_entries.end(), nullptr);
+
+	m_pCursor = nullptr;
+	m_pLimit = nullptr;
+
+#if BLACKLIGHT_VM_JIT
+	uint8_t* pStubs = Reserve();
+	if (pStubs == nullptr)
+		throw std::bad_alloc();
+
+	Emitter e(pStubs);
+
+	// uintptr_t Enter(uint32_t* pRegisters, uint8_t* pMemory, Context* pContext, void* pBlock)
+	// saves everything either ABI wants saved, then pins the arguments
+	m_pEnter = e.Here();
+	e.Bytes({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x56, 0x57 });
+#if _WIN64
+	e.Bytes({ 0x48, 0x89, 0xCB });			// mov rbx, rcx
+	e.Bytes({ 0x49, 0x89, 0xD4 });			// mov r12, rdx
+	e.Bytes({ 0x4D, 0x89, 0xC5 });			// mov r13, r8
+	e.Bytes({ 0x4D, 0x8B, 0x75, 0x10 });	// mov r14, [r13 + m_pDirty]
+	e.Bytes({ 0x41, 0xFF, 0xE1 });			// jmp r9
+#else
+	e.Bytes({ 0x48, 0x89, 0xFB });			// mov rbx, rdi
+	e.Bytes({ 0x49, 0x89, 0xF4 });			// mov r12, rsi
+	e.Bytes({ 0x49, 0x89, 0xD5 });			// mov r13, rdx
+	e.Bytes({ 0x4D, 0x8B, 0x75, 0x10 });	// mov r14, [r13 + m_pDirty]
+	e.Bytes({ 0xFF, 0xE1 });				// jmp rcx
+#endif
+
+	// leaves with EXIT_DISPATCH
+	m_pExitDispatch = e.Here();
+	e.Bytes({ 0x31, 0xC0 });				// xor eax, eax
+
+	// leaves with whatever is in rax
+	m_pExit = e.Here();
+	e.Bytes({ 0x5F, 0x5E, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3 });
+
+	m_pCursor = e.Here();
+#endif
+}
+
+uint8_t* JIT::Reserve()
+{
+	if (m_pCursor != nullptr &&
+		static_cast<size_t>(m_pLimit - m_pCursor) >= MAX_BLOCK_SIZE)
+		return m_pCursor;
+
+	CodeChunk* pChunk = m_allocator.allocate();
+	if (pChunk == nullptr)
+		return nullptr;
+
+	m_chunks.push_back(pChunk);
+
+	m_pCursor = pChunk->m_code;
+	m_pLimit = pChunk->m_code + sizeof(pChunk->m_code);
+
+	return m_pCursor;
+}
+
+void JIT::Patch(uint8_t* pExit, const uint8_t* pBlock)
+{
+	// exits are a jmp rel32 followed by their own stub
+	uint32_t rel = pBlock != nullptr ?
+		static_cast<uint32_t>(pBlock - (pExit + 5)) :
+		0;
+
+	memcpy(pExit + 1, &rel, sizeof(rel));
+}
+
+uint8_t* JIT::Translate(DecodeCache& cache, const MemoryController& mc, const uint32_t address)
+{
+#if BLACKLIGHT_VM_JIT
+	const uint32_t count = static_cast<uint32_t>(m_entries.size());
+
+	// the first instruction has to be something we can translate
+	const MicroOp* pOp = cache.Lookup(address);
+	if (pOp == nullptr)
+		return nullptr;
+	if (pOp->m_kind == UOP_UNDECODED)
+		cache.DecodeAt(mc, address);
+	if (pOp->m_kind == UOP_INTERP)
+		return nullptr;
+
+	uint8_t* pCode = Reserve();
+	if (pCode == nullptr)
+		return nullptr;
+
+	Emitter e(pCode, static_cast<uint32_t>(mc.GetAddressMask()));
+	std::vector<CodeWriteExit> codeWrites;
+	size_t i = 0;
+
+	// leaves for a static R_PRG through a jmp that can be linked to its block later
+	auto exitTo = [&](const uint32_t target)
+	{
+		uint8_t* pExit = e.Here();
+
+		e.Byte(0xE9);
+		e.Dword(0);
+		e.StoreGuestImm(R_PRG, target);
+		e.Bytes({ 0x48, 0xB8 });			// mov rax, pExit
+		e.Qword(reinterpret_cast<uintptr_t>(pExit));
+		e.Jmp(m_pExit);
+	};
+
+	// leaves for the R_PRG in eax, going straight to its block if it has one
+	auto exitIndirect = [&]()
+	{
+		e.StoreGuest(R_PRG, H_EAX);
+		e.Byte(0x2D);						// sub eax, m_begin
+		e.Dword(m_begin);
+		e.Byte(0x3D);						// cmp eax, count
+		e.Dword(count);
+		e.Jcc(CC_AE, m_pExitDispatch);
+		e.Bytes({ 0x48, 0xBA });			// mov rdx, m_entries
+		e.Qword(reinterpret_cast<uintptr_t>(m_entries.data()));
+		e.Bytes({ 0x48, 0x8B, 0x14, 0xC2 });	// mov rdx, [rdx + rax * 8]
+		e.Bytes({ 0x48, 0x85, 0xD2 });		// test rdx, rdx
+		e.Jcc(CC_E, m_pExitDispatch);
+		e.Bytes({ 0xFF, 0xE2 });			// jmp rdx
+	};
+
+	// leaves after a store of size bytes at eax overlaps the image
+	auto checkCodeWrite = [&](const uint8_t size, const uint32_t next, const bool dynamic)
+	{
+		e.Bytes({ 0x8D, 0x90 });			// lea edx, [rax + size - 1 - m_begin]
+		e.Dword(size - 1 - m_begin);
+		e.Bytes({ 0x81, 0xFA });			// cmp edx, count + size - 1
+		e.Dword(count + size - 1);
+
+		codeWrites.push_back({ e.JccForward(CC_B), next, dynamic, size, static_cast<uint8_t>(i) });
+	};
+
+	// the block takes all of its instructions from the budget up front, and leaves
+	// before running any of them when there are not enough
+	e.Bytes({ 0x49, 0x83, 0x6D, 0x08, 0x00 });	// sub qword [r13 + m_budget], count
+	uint8_t* pCount = e.Here() - 1;
+	uint8_t* pOverBudget = e.JccForward(CC_L);
+
+	uint32_t prg = address;
+	bool terminated = false;
+
+	for (i = 0; i < MAX_BLOCK_OPS && terminated == false; ++i)
+	{
+		pOp = cache.Lookup(prg);
+
+		// ran off the image, or into something the CPU has to do
+		if (pOp == nullptr)
+			break;
+		if (pOp->m_kind == UOP_UNDECODED)
+			cache.DecodeAt(mc, prg);
+		if (pOp->m_kind == UOP_INTERP)
+			break;
+
+		// superinstructions only save dispatches, which translated code does not have
+		MicroOp op = *pOp;
+		op.m_kind = DecodeCache::GetUnfusedKind(op.m_kind);
+
+		const uint32_t next = prg + op.m_length;
+
+		switch (op.m_kind)
+		{
+		case UOP_NOP:
+			break;
+		case UOP_LD8_ABS:
+		case UOP_LD16_ABS:
+		case UOP_LD32_ABS:
+			e.MovImm(H_EAX, op.m_imm);
+			e.LoadMemory(SizeOf(op.m_kind, UOP_LD8_ABS));
+			e.StoreGuest(op.m_dst, H_EAX);
+			break;
+		case UOP_LD8:
+		case UOP_LD16:
+		case UOP_LD32:
+			e.LoadGuest(H_EAX, op.m_src);
+			e.LoadMemory(SizeOf(op.m_kind, UOP_LD8));
+			e.StoreGuest(op.m_dst, H_EAX);
+			break;
+		case UOP_LDV_IMM:
+			e.StoreGuestImm(op.m_dst, op.m_imm);
+			break;
+		case UOP_LDV8:
+			e.LoadGuestExtend(0xB6, H_EAX, op.m_src);
+			e.StoreGuest(op.m_dst, H_EAX);
+			break;
+		case UOP_LDV16:
+			e.LoadGuestExtend(0xB7, H_EAX, op.m_src);
+			e.StoreGuest(op.m_dst, H_EAX);
+			break;
+		case UOP_LDV32:
+			e.LoadGuest(H_EAX, op.m_src);
+			e.StoreGuest(op.m_dst, H_EAX);
+			break;
+		case UOP_ST8_ABS:
+		case UOP_ST16_ABS:
+		case UOP_ST32_ABS:
+			e.MovImm(H_EAX, op.m_imm);
+			e.LoadGuest(H_ECX, op.m_src);
+			e.StoreMemory(SizeOf(op.m_kind, UOP_ST8_ABS));
+			checkCodeWrite(SizeOf(op.m_kind, UOP_ST8_ABS), next, false);
+			break;
+		case UOP_ST8:
+		case UOP_ST16:
+		case UOP_ST32:
+			e.LoadGuest(H_EAX, op.m_dst);
+			e.LoadGuest(H_ECX, op.m_src);
+			e.StoreMemory(SizeOf(op.m_kind, UOP_ST8));
+			checkCodeWrite(SizeOf(op.m_kind, UOP_ST8), next, false);
+			break;
+		case UOP_PUSH_IMM:
+			e.AluGuestImm(5, R_SF, sizeof(int));
+			e.LoadGuest(H_EAX, R_SF);
+			e.StoreMemoryImm(op.m_imm);
+			checkCodeWrite(sizeof(int), next, false);
+			break;
+		case UOP_PUSH:
+			e.AluGuestImm(5, R_SF, sizeof(int));
+			e.LoadGuest(H_EAX, R_SF);
+			e.LoadGuest(H_ECX, op.m_src);
+			e.StoreMemory(sizeof(int));
+			checkCodeWrite(sizeof(int), next, false);
+			break;
+		case UOP_POP:
+			e.LoadGuest(H_EAX, R_SF);
+			e.LoadMemory(sizeof(int));
+			e.StoreGuest(op.m_dst, H_EAX);
+			e.AluGuestImm(0, R_SF, sizeof(int));
+			break;
+		case UOP_ADD_IMM:
+			e.AluGuestImm(0, op.m_dst, op.m_imm);
+			break;
+		case UOP_ADD8:
+			e.LoadGuestExtend(0xBE, H_EAX, op.m_src);
+			e.AluGuestHost(0x01, op.m_dst, H_EAX);
+			break;
+		case UOP_ADD16:
+			e.LoadGuestExtend(0xBF, H_EAX, op.m_src);
+			e.AluGuestHost(0x01, op.m_dst, H_EAX);
+			break;
+		case UOP_ADD32:
+			e.LoadGuest(H_EAX, op.m_src);
+			e.AluGuestHost(0x01, op.m_dst, H_EAX);
+			break;
+		case UOP_SUB_IMM:
+			e.AluGuestImm(5, op.m_dst, op.m_imm);
+			break;
+		case UOP_SUB8:
+			e.LoadGuestExtend(0xBE, H_EAX, op.m_src);
+			e.AluGuestHost(0x29, op.m_dst, H_EAX);
+			break;
+		case UOP_SUB16:
+			e.LoadGuestExtend(0xBF, H_EAX, op.m_src);
+			e.AluGuestHost(0x29, op.m_dst, H_EAX);
+			break;
+		case UOP_SUB32:
+			e.LoadGuest(H_EAX, op.m_src);
+			e.AluGuestHost(0x29, op.m_dst, H_EAX);
+			break;
+		case UOP_AND_IMM:
+			e.AluGuestImm(4, op.m_dst, op.m_imm);
+			break;
+		case UOP_AND8:
+			e.LoadGuestExtend(0xB6, H_EAX, op.m_src);
+			e.AluGuestHost(0x21, op.m_dst, H_EAX);
+			break;
+		case UOP_AND16:
+			e.LoadGuestExtend(0xB7, H_EAX, op.m_src);
+			e.AluGuestHost(0x21, op.m_dst, H_EAX);
+			break;
+		case UOP_AND32:
+			e.LoadGuest(H_EAX, op.m_src);
+			e.AluGuestHost(0x21, op.m_dst, H_EAX);
+			break;
+		case UOP_NOT:
+			e.Bytes({ 0xF7, 0x53, static_cast<uint8_t>(op.m_dst * 4) });	// not dword [rbx + dst * 4]
+			break;
+		case UOP_CMP_IMM:
+		case UOP_CMP8:
+		case UOP_CMP16:
+		case UOP_CMP32:
+			// clear the flags before reading either operand, like the interpreter
+			e.Bytes({ 0x83, 0x63, R_CND * 4, 0xF8 });	// and dword [rbx + R_CND * 4], ~7
+			e.LoadGuest(H_EAX, op.m_dst);
+			if (op.m_kind == UOP_CMP_IMM)
+				e.MovImm(H_ECX, op.m_imm);
+			else if (op.m_kind == UOP_CMP8)
+				e.LoadGuestExtend(0xB6, H_ECX, op.m_src);
+			else if (op.m_kind == UOP_CMP16)
+				e.LoadGuestExtend(0xB7, H_ECX, op.m_src);
+			else
+				e.LoadGuest(H_ECX, op.m_src);
+			e.MovImm(H_EDX, F_N);
+			e.MovImm(H_ESI, F_E);
+			e.Bytes({ 0x39, 0xC1 });			// cmp ecx, eax
+			e.Bytes({ 0x0F, 0x44, 0xD6 });		// cmove edx, esi
+			e.MovImm(H_ESI, F_P);
+			e.Bytes({ 0x0F, 0x47, 0xD6 });		// cmova edx, esi
+			e.AluGuestHost(0x09, R_CND, H_EDX);
+			break;
+		case UOP_BR_IMM:
+		case UOP_BR:
+		{
+			e.Bytes({ 0xF7, 0x43, R_CND * 4 });	// test dword [rbx + R_CND * 4], mask
+			e.Dword(op.m_dst);
+			uint8_t* pNotTaken = e.JccForward(CC_E);
+			if (op.m_kind == UOP_BR_IMM)
+				exitTo(op.m_imm);
+			else
+			{
+				e.LoadGuest(H_EAX, op.m_src);
+				exitIndirect();
+			}
+			e.Bind(pNotTaken);
+			exitTo(next);
+			terminated = true;
+			break;
+		}
+		case UOP_JMP_IMM:
+			exitTo(op.m_imm);
+			terminated = true;
+			break;
+		case UOP_JMP:
+			e.LoadGuest(H_EAX, op.m_src);
+			exitIndirect();
+			terminated = true;
+			break;
+		case UOP_CALL_IMM:
+			e.AluGuestImm(5, R_SF, sizeof(int));
+			e.LoadGuest(H_EAX, R_SF);
+			e.StoreMemoryImm(next);
+			checkCodeWrite(sizeof(int), op.m_imm, false);
+			exitTo(op.m_imm);
+			terminated = true;
+			break;
+		case UOP_CALL:
+			// the target is read after R_SF moves
+			e.AluGuestImm(5, R_SF, sizeof(int));
+			e.LoadGuest(H_ESI, op.m_src);
+			e.LoadGuest(H_EAX, R_SF);
+			e.StoreMemoryImm(next);
+			checkCodeWrite(sizeof(int), 0, true);
+			e.Bytes({ 0x89, 0xF0 });			// mov eax, esi
+			exitIndirect();
+			terminated = true;
+			break;
+		case UOP_RET:
+			e.LoadGuest(H_EAX, R_SF);
+			e.LoadMemory(sizeof(int));
+			e.AluGuestImm(0, R_SF, sizeof(int));
+			exitIndirect();
+			terminated = true;
+			break;
+		default:
+			throw std::runtime_error("Invalid micro-op");
+		}
+
+		prg = next;
+	}
+
+	// the block ran into something it does not translate, carry on from there
+	if (terminated == false)
+		exitTo(prg);
+
+	const uint8_t instructions = static_cast<uint8_t>(i);
+	*pCount = instructions;
+
+	// leaves for the CPU to run what is left of the budget, giving it back first
+	e.Bind(pOverBudget);
+	e.Bytes({ 0x49, 0x83, 0x45, 0x08, instructions });	// add qword [r13 + m_budget], count
+	e.StoreGuestImm(R_PRG, address);
+	e.MovImm(H_EAX, EXIT_BUDGET);
+	e.Jmp(m_pExit);
+
+	// stores that hit the image leave with where they hit so it can be thrown away
+	for (const CodeWriteExit& codeWrite : codeWrites)
+	{
+		e.Bind(codeWrite.m_pJump);
+
+		// the rest of the block never ran
+		uint8_t unused = static_cast<uint8_t>(instructions - codeWrite.m_index - 1);
+		if (unused != 0)
+			e.Bytes({ 0x49, 0x83, 0x45, 0x08, unused });	// add qword [r13 + m_budget], unused
+
+		if (codeWrite.m_dynamic == true)
+			e.StoreGuest(R_PRG, H_ESI);
+		else
+			e.StoreGuestImm(R_PRG, codeWrite.m_next);
+		e.Bytes({ 0x41, 0x89, 0x45, 0x00 });	// mov [r13 + m_writeAddress], eax
+		e.Bytes({ 0x41, 0xC7, 0x45, 0x04 });	// mov dword [r13 + m_writeSize], size
+		e.Dword(codeWrite.m_size);
+		e.MovImm(H_EAX, EXIT_CODE_WRITE);
+		e.Jmp(m_pExit);
+	}
+
+	m_pCursor = e.Here();
+
+	Block& block = m_blocks[address];
+	block.m_end = prg;
+	block.m_pCode = pCode;
+	block.m_links.clear();
+
+	m_entries[address - m_begin] = pCode;
+
+	return pCode;
+#else
+	return nullptr;
+#endif
+}
\ No newline at end of file
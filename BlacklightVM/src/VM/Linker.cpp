@@ -0,0 +1,252 @@
+#include <VM/Linker.h>
+#include <VM/InstructionGeneration/InstructionGeneration.h>
+
+#include <stdexcept>
+
+using Blacklight::VM::Linker;
+
+using namespace Blacklight::VM;
+using namespace Blacklight::VM::InstructionGeneration;
+
+namespace
+{
+	// where a symbol is, by the fragment it is in once every object's fragments are in one list
+	struct Location
+	{
+		size_t m_placed;
+		size_t m_offset;
+	};
+
+	struct Placed
+	{
+		const Fragment* m_pFragment;
+		// the object the fragment came from, its symbols are looked up there first
+		size_t m_object;
+		uint64_t m_address;
+		size_t m_size;
+	};
+
+	// Returns how many bytes a JMP or CALL needs to go the distance
+	size_t GetBranchSize(const int64_t displacement)
+	{
+		if (displacement >= INT8_MIN && displacement <= INT8_MAX)
+			return 2;
+		if (displacement >= INT16_MIN && displacement <= INT16_MAX)
+			return 3;
+
+		return 5;
+	}
+}
+
+Linker::Linker() :
+	m_stackSize(0x1000),
+	m_origin(0),
+	m_hasOrigin(false),
+	m_stats()
+{
+}
+
+void Linker::Add(const Object& object)
+{
+	m_objects.push_back(object);
+}
+
+void Linker::SetStackSize(const uint32_t stackSize)
+{
+	m_stackSize = stackSize;
+}
+
+void Linker::SetOrigin(const uint32_t origin)
+{
+	m_origin = origin;
+	m_hasOrigin = true;
+}
+
+void Linker::SetEntry(const std::string& entry)
+{
+	m_entry = entry;
+}
+
+std::vector<uint8_t> Linker::Link()
+{
+	m_addresses.clear();
+	m_stats = {};
+
+	if (m_objects.empty() == true)
+		throw std::runtime_error("Nothing to link");
+
+	uint64_t origin = m_hasOrigin == true ? m_origin : static_cast<uint64_t>(m_stackSize) + CALL_TABLE_SIZE;
+
+	// text from every object, then data from every object, behind a jump to the entry if it needs one
+	Fragment entryJump = {};
+	entryJump.m_kind = FK_BRANCH;
+	entryJump.m_opcode = OP_JMP;
+	entryJump.m_symbol = m_entry;
+
+	std::vector<Placed> placed;
+	std::vector<size_t> firstPlaced[SC_COUNT];
+
+	const Object& first = m_objects.front();
+	auto entry = first.m_symbols.find(m_entry);
+	bool entryFirst = entry != first.m_symbols.end() &&
+		entry->second.m_global == true &&
+		entry->second.m_section == SC_TEXT &&
+		entry->second.m_fragment == 0 &&
+		entry->second.m_offset == 0;
+
+	if (m_entry.empty() == false &&
+		entryFirst == false)
+		placed.push_back({ &entryJump, 0, 0, 0 });
+
+	for (int section = 0; section < SC_COUNT; ++section)
+	{
+		for (size_t i = 0; i < m_objects.size(); ++i)
+		{
+			firstPlaced[section].push_back(placed.size());
+
+			for (const Fragment& fragment : m_objects[i].m_sections[section])
+				placed.push_back({ &fragment, i, 0, fragment.m_kind == FK_DATA ? fragment.m_bytes.size() : 0 });
+		}
+	}
+
+	std::map<std::string, Location> globals;
+	for (size_t i = 0; i < m_objects.size(); ++i)
+	{
+		for (const auto& symbol : m_objects[i].m_symbols)
+		{
+			if (symbol.second.m_global == false)
+				continue;
+
+			Location location = { firstPlaced[symbol.second.m_section][i] + symbol.second.m_fragment, symbol.second.m_offset };
+			if (globals.emplace(symbol.first, location).second == false)
+				throw std::runtime_error("Symbol " + symbol.first + " is defined in " +
+					m_objects[placed[globals[symbol.first].m_placed].m_object].m_name + " and " + m_objects[i].m_name);
+		}
+	}
+
+	if (m_entry.empty() == false &&
+		globals.count(m_entry) == 0)
+		throw std::runtime_error("Entry " + m_entry + " is not a global symbol");
+
+	// an object's own labels come before anyone's globals
+	auto resolve = [&](const Placed& from, const std::string& symbol, const int32_t addend, const size_t line) -> int64_t
+	{
+		if (symbol.empty() == true)
+			return static_cast<uint32_t>(addend);
+
+		const Object& object = m_objects[from.m_object];
+		Location location;
+
+		auto local = object.m_symbols.find(symbol);
+		if (local != object.m_symbols.end() &&
+			from.m_pFragment != &entryJump)
+			location = { firstPlaced[local->second.m_section][from.m_object] + local->second.m_fragment, local->second.m_offset };
+		else if (globals.count(symbol) != 0)
+			location = globals[symbol];
+		else
+			throw std::runtime_error(object.m_name + ":" + std::to_string(line) + ": Undefined symbol " + symbol);
+
+		return static_cast<int64_t>(placed[location.m_placed].m_address + location.m_offset) + addend;
+	};
+
+	// branches only ever grow, so this stops once every one of them reaches
+	for (bool grown = true; grown == true;)
+	{
+		grown = false;
+
+		uint64_t address = origin;
+		for (Placed& p : placed)
+		{
+			p.m_address = address;
+			if (p.m_pFragment->m_kind == FK_ALIGN)
+				p.m_size = static_cast<size_t>((p.m_pFragment->m_alignment - address % p.m_pFragment->m_alignment) % p.m_pFragment->m_alignment);
+			else if (p.m_pFragment->m_kind == FK_BRANCH && p.m_size == 0)
+				p.m_size = 2;
+
+			address += p.m_size;
+		}
+
+		if (address > UINT32_MAX)
+			throw std::runtime_error("Image does not fit in 32 bits");
+
+		for (Placed& p : placed)
+		{
+			if (p.m_pFragment->m_kind != FK_BRANCH)
+				continue;
+
+			int64_t target = resolve(p, p.m_pFragment->m_symbol, p.m_pFragment->m_addend, p.m_pFragment->m_line);
+			size_t size = GetBranchSize(target - static_cast<int64_t>(p.m_address + p.m_size));
+			if (size > p.m_size)
+			{
+				p.m_size = size;
+				grown = true;
+			}
+		}
+	}
+
+	std::vector<uint8_t> image;
+	auto put = [&image](const uint32_t data, const size_t size)
+	{
+		for (size_t i = 0; i < size; ++i)
+			image.push_back(static_cast<uint8_t>(data >> (i * 8)));
+	};
+
+	put(m_stackSize, 4);
+	put(static_cast<uint32_t>(origin), 4);
+
+	for (const Placed& p : placed)
+	{
+		const Fragment& fragment = *p.m_pFragment;
+
+		if (fragment.m_kind == FK_ALIGN)
+			image.insert(image.end(), p.m_size, 0);
+		else if (fragment.m_kind == FK_BRANCH)
+		{
+			int64_t target = resolve(p, fragment.m_symbol, fragment.m_addend, fragment.m_line);
+			uint32_t displacement = static_cast<uint32_t>(target - static_cast<int64_t>(p.m_address + p.m_size));
+
+			Size size = p.m_size == 2 ? SZ_BYTE : (p.m_size == 3 ? SZ_WORD : SZ_DWORD);
+			image.push_back(fragment.m_opcode == OP_JMP ? JMP(true, size) : CALL(true, size));
+			put(displacement, p.m_size - 1);
+
+			++(p.m_size == 2 ? m_stats.m_byteBranches : (p.m_size == 3 ? m_stats.m_wordBranches : m_stats.m_dwordBranches));
+		}
+		else
+		{
+			size_t begin = image.size();
+			image.insert(image.end(), fragment.m_bytes.begin(), fragment.m_bytes.end());
+
+			for (const Fixup& fixup : fragment.m_fixups)
+			{
+				int64_t value = resolve(p, fixup.m_symbol, fixup.m_addend, fixup.m_line);
+				if (fixup.m_relative == true)
+					value -= static_cast<int64_t>(p.m_address + fixup.m_end);
+
+				uint32_t data = static_cast<uint32_t>(value);
+				for (size_t i = 0; i < 4; ++i)
+					image[begin + fixup.m_offset + i] = static_cast<uint8_t>(data >> (i * 8));
+			}
+		}
+	}
+
+	m_stats.m_codeSize = image.size() - 8;
+
+	for (const auto& global : globals)
+		m_addresses[global.first] = static_cast<uint32_t>(placed[global.second.m_placed].m_address + global.second.m_offset);
+
+	return image;
+}
+
+uint32_t Linker::GetSymbolAddress(const std::string& name) const
+{
+	auto it = m_addresses.find(name);
+	if (it == m_addresses.end())
+		throw std::runtime_error("No global symbol " + name);
+
+	return it->second;
+}
+
+const Linker::Stats& Linker::GetStats() const
+{
+	return m_stats;
+}
\ No newline at end of file
@@ -1,63 +1,609 @@
 #include <VM/MemoryController.h>
+#include <VM/Bits.h>
+#include <VM/SharedImage.h>
 
-#include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <stdexcept>
 
+#if __linux__
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if _M_X64 || __x86_64__ || __SSE2__
+#include <emmintrin.h>
+#define BLACKLIGHT_VM_SSE2 1
+#else
+#define BLACKLIGHT_VM_SSE2 0
+#endif
+
+#if _MSC_VER
+#include <intrin.h>
+#endif
+
+using Blacklight::VM::GetLowestBit;
 using Blacklight::VM::MemoryController;
+using Blacklight::VM::MemorySnapshot;
 
-MemoryController::MemoryController(const size_t blockSize) :
-	m_blockSize(blockSize)
+namespace
 {
-	// ensure we don't make more memory than we can address
-	assert(blockSize < UINT32_MAX);
+	// what every page reads as until it is written
+	const uint8_t ZERO_PAGE[MemoryController::PAGE_SIZE] = {};
+
+	// the innermost trap armed on this thread
+	thread_local MemoryController::FaultTrap* t_pTrap = nullptr;
+
+#if __linux__
+	struct sigaction g_previousHandler;
+	std::once_flag g_handlerInstalled;
+
+	void HandleFault(int signal, siginfo_t* pInfo, void* pContext)
+	{
+		MemoryController::FaultTrap* pTrap = t_pTrap;
+
+		if (pTrap != nullptr &&
+			pTrap->Catches(reinterpret_cast<uintptr_t>(pInfo->si_addr)))
+			siglongjmp(pTrap->m_jump, 1);
+
+		// not a guest access, so whoever was here first gets it
+		if (g_previousHandler.sa_flags & SA_SIGINFO)
+			g_previousHandler.sa_sigaction(signal, pInfo, pContext);
+		else if (g_previousHandler.sa_handler != SIG_DFL &&
+			g_previousHandler.sa_handler != SIG_IGN)
+			g_previousHandler.sa_handler(signal);
+		else
+			sigaction(signal, &g_previousHandler, nullptr);
+	}
+
+	void InstallFaultHandler()
+	{
+		// deferring the signal would leave it blocked once we jump out of the handler
+		struct sigaction action = {};
+		action.sa_sigaction = HandleFault;
+		action.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+		sigemptyset(&action.sa_mask);
+
+		sigaction(SIGSEGV, &action, &g_previousHandler);
+	}
+#endif
+
+	// Returns the offset of the first byte that differs, size if none do
+	size_t FindDifference(const uint8_t* pA, const uint8_t* pB, const size_t size)
+	{
+		size_t i = 0;
+
+#if BLACKLIGHT_VM_SSE2
+		for (; i + 16 <= size; i += 16)
+		{
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pA + i));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pB + i));
+
+			uint32_t equal = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)));
+			if (equal != 0xFFFF)
+				return i + GetLowestBit(~equal);
+		}
+#endif
+
+		for (; i < size; ++i)
+		{
+			if (pA[i] != pB[i])
+				return i;
+		}
+
+		return size;
+	}
+
+	// Adds up the little endian words in a buffer, a byte left over at the end being the low half of one
+	uint64_t SumWords(const uint8_t* pData, const size_t size)
+	{
+		uint64_t sum = 0;
+		size_t i = 0;
+
+#if BLACKLIGHT_VM_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		while (i + 16 <= size)
+		{
+			// every lane gains at most two words a round, so it can take 0x8000 rounds before it could overflow
+			__m128i lanes = zero;
+			for (size_t round = 0; round < 0x8000 && i + 16 <= size; ++round, i += 16)
+			{
+				__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pData + i));
+
+				lanes = _mm_add_epi32(lanes, _mm_unpacklo_epi16(data, zero));
+				lanes = _mm_add_epi32(lanes, _mm_unpackhi_epi16(data, zero));
+			}
 
-	m_memory = new uint8_t[blockSize];
+			uint32_t parts[4];
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(parts), lanes);
+			sum += static_cast<uint64_t>(parts[0]) + parts[1] + parts[2] + parts[3];
+		}
+#endif
+
+		for (; i + 2 <= size; i += 2)
+			sum += static_cast<uint32_t>(pData[i]) | (static_cast<uint32_t>(pData[i + 1]) << 8);
+		if (i < size)
+			sum += pData[i];
+
+		return sum;
+	}
+
+	// Folds the carries of a ones' complement sum back into its low word
+	uint16_t FoldSum(uint64_t sum)
+	{
+		while ((sum >> 16) != 0)
+			sum = (sum & 0xFFFF) + (sum >> 16);
+
+		return static_cast<uint16_t>(sum);
+	}
+
+	uint16_t SwapBytes(const uint16_t data)
+	{
+		return static_cast<uint16_t>((data >> 8) | (data << 8));
+	}
+
+	// Sequentially consistent dword atomics on guest memory, which is only ever bytes to the host
+	uint32_t AtomicCompareExchange(uint8_t* pData, uint32_t expected, const uint32_t desired)
+	{
+#if _MSC_VER
+		return static_cast<uint32_t>(_InterlockedCompareExchange(reinterpret_cast<volatile long*>(pData),
+			static_cast<long>(desired), static_cast<long>(expected)));
+#else
+		__atomic_compare_exchange_n(reinterpret_cast<uint32_t*>(pData), &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+		return expected;
+#endif
+	}
+	uint32_t AtomicFetchAdd(uint8_t* pData, const uint32_t value)
+	{
+#if _MSC_VER
+		return static_cast<uint32_t>(_InterlockedExchangeAdd(reinterpret_cast<volatile long*>(pData), static_cast<long>(value)));
+#else
+		return __atomic_fetch_add(reinterpret_cast<uint32_t*>(pData), value, __ATOMIC_SEQ_CST);
+#endif
+	}
 }
 
-const uint8_t MemoryController::Read8(const uintptr_t address) const
+MemoryController::MemoryController(const size_t blockSize, const MemoryMode mode, MemoryController* pShared) :
+	m_blockSize(blockSize),
+	m_memory(nullptr),
+	m_mask(0),
+	m_pReservation(nullptr),
+	m_reservedSize(0),
+	m_pageCount((blockSize + PAGE_SIZE - 1) >> PAGE_SHIFT),
+	m_pFetchTail(nullptr),
+	m_watchBegin(0),
+	m_watchEnd(0),
+	m_codeWritten(false),
+	m_codeWriteLow(0),
+	m_codeWriteHigh(0),
+	m_codeWrites(0)
 {
-	// ensure we are not trying to read memory that is not allocated to us
-	assert(address < m_blockSize);
+	// addresses are masked into the smallest power of two that holds memory
+	uintptr_t reach = PAGE_SIZE;
+	while (reach < blockSize)
+		reach <<= 1;
+
+	m_mask = reach - 1;
+
+	// another view of memory that is already there, which from then on belongs to all of them
+	if (pShared != nullptr)
+	{
+		if (pShared->m_memory == nullptr ||
+			mode != MM_FLAT ||
+			blockSize != pShared->m_blockSize)
+			throw std::runtime_error("Only MM_FLAT memory of the same size can be shared");
+
+		if (pShared->m_pSharing == nullptr)
+		{
+			pShared->m_pSharing = std::make_shared<Sharing>();
+			pShared->m_pSharing->m_pReservation = pShared->m_pReservation;
+			pShared->m_pSharing->m_reservedSize = pShared->m_reservedSize;
+			pShared->m_pSharing->m_views.push_back(pShared);
+		}
+
+		m_memory = pShared->m_memory;
+		m_pReservation = pShared->m_pReservation;
+		m_reservedSize = pShared->m_reservedSize;
+		m_dirty.resize(pShared->m_dirty.size());
+
+		m_pSharing = pShared->m_pSharing;
+
+		std::lock_guard<std::mutex> sharingGuard(m_pSharing->m_mutex);
+		m_pSharing->m_views.push_back(this);
+		return;
+	}
+
+	if (mode == MM_PAGED)
+	{
+		// nothing is allocated until the guest writes to it
+		m_directory.resize((m_pageCount + (static_cast<size_t>(1) << TABLE_SHIFT) - 1) >> TABLE_SHIFT);
+		m_dirty.resize(m_pageCount);
+
+		FlushTlb();
+
+#if __linux__
+		// a page followed by a guard page, for instructions at the end of memory to fault in when they read past it
+		uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
 
-	return m_memory[address];
+		m_reservedSize = pageSize * 2;
+
+		void* pReservation = mmap(nullptr, m_reservedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (pReservation == MAP_FAILED)
+			throw std::bad_alloc();
+
+		m_pReservation = static_cast<uint8_t*>(pReservation);
+		m_pFetchTail = m_pReservation + pageSize;
+
+		if (mprotect(m_pReservation, pageSize, PROT_READ | PROT_WRITE) == -1)
+		{
+			munmap(m_pReservation, m_reservedSize);
+			throw std::bad_alloc();
+		}
+
+		std::call_once(g_handlerInstalled, InstallFaultHandler);
+#endif
+		return;
+	}
+
+	// the last byte of a write at the top of the masked range can land one page past it
+	m_dirty.resize((reach >> PAGE_SHIFT) + 1);
+
+#if __linux__
+	// the reservation is a guard page, the masked range and another guard page. Only the pages memory is in
+	// are accessible, and memory starts far enough into the first of them to end where the last one does, so
+	// any byte past it faults. Pages are only backed once they are touched, and images can be mapped over them
+	uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+	size_t accessibleSize = (blockSize + pageSize - 1) & ~(pageSize - 1);
+	size_t slack = accessibleSize - blockSize;
+
+	m_reservedSize = pageSize + ((slack + reach + pageSize - 1) & ~(pageSize - 1)) + pageSize;
+
+	void* pReservation = mmap(nullptr, m_reservedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (pReservation == MAP_FAILED)
+		throw std::bad_alloc();
+
+	m_pReservation = static_cast<uint8_t*>(pReservation);
+	m_memory = m_pReservation + pageSize + slack;
+
+	if (accessibleSize != 0 &&
+		mprotect(m_pReservation + pageSize, accessibleSize, PROT_READ | PROT_WRITE) == -1)
+	{
+		munmap(m_pReservation, m_reservedSize);
+		throw std::bad_alloc();
+	}
+
+	std::call_once(g_handlerInstalled, InstallFaultHandler);
+#else
+	// without guard regions the whole masked range has to be there, along with the end of a fetch
+	m_reservedSize = reach + FETCH_SIZE;
+	m_memory = new uint8_t[m_reservedSize];
+	m_pReservation = m_memory;
+#endif
 }
-const uint16_t MemoryController::Read16(const uintptr_t address) const
+
+void MemoryController::MapImage(const SharedImage& image)
 {
-	// ensure we are not trying to read memory that is not allocated to us
-	assert(address < m_blockSize - 1);
+	uintptr_t origin = image.GetOrigin();
+
+	// ensure the image does not go past the memory allocated to us
+	if (origin + image.GetCodeSize() > m_blockSize)
+		throw std::runtime_error("Image does not fit in memory");
+
+#if __linux__
+	// pages are separate allocations, so the image is copied into them from a temporary view
+	if (m_memory == nullptr &&
+		image.GetMapFile() != -1)
+	{
+		void* pView = mmap(nullptr, image.GetMapSize(), PROT_READ, MAP_PRIVATE, image.GetMapFile(),
+			static_cast<off_t>(image.GetMapOffset()));
+		if (pView == MAP_FAILED)
+			throw std::runtime_error("Could not map image");
+
+		WriteBlock(origin, static_cast<uint8_t*>(pView) + (origin - image.GetMapAddress()), image.GetCodeSize());
+
+		munmap(pView, image.GetMapSize());
+		return;
+	}
 
-	// faster than bitwise
-	return *reinterpret_cast<uint16_t*>(&m_memory[address]);
+	// memory that is not a whole number of host pages does not start on one, and is copied into
+	uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+
+	if (image.GetMapFile() != -1 &&
+		((reinterpret_cast<uintptr_t>(m_memory) + image.GetMapAddress()) & (pageSize - 1)) == 0)
+	{
+		uintptr_t address = image.GetMapAddress();
+
+		void* pView = mmap(m_memory + address, image.GetMapSize(), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, image.GetMapFile(), static_cast<off_t>(image.GetMapOffset()));
+		if (pView == MAP_FAILED)
+			throw std::runtime_error("Could not map image");
+
+		// a directly mapped file has its header in front of the code, which only costs
+		// a private copy of that page when it is actually there
+		for (uintptr_t i = address; i < origin; ++i)
+		{
+			if (m_memory[i] != 0)
+				m_memory[i] = 0;
+		}
+
+		for (uintptr_t page = address >> PAGE_SHIFT; page < (address + image.GetMapSize()) >> PAGE_SHIFT; ++page)
+			m_dirty[page] = 1;
+		return;
+	}
+#endif
+
+	WriteBlock(origin, image.GetCode(), image.GetCodeSize());
 }
-const uint32_t MemoryController::Read32(const uintptr_t address) const
+
+void MemoryController::ReadBlock(const uintptr_t address, uint8_t* pData, const size_t size) const
 {
 	// ensure we are not trying to read memory that is not allocated to us
-	assert(address < m_blockSize - 3);
+	if (address + size > m_blockSize)
+		throw std::runtime_error("Read outside of memory");
+
+	if (m_memory != nullptr)
+	{
+		memcpy(pData, m_memory + address, size);
+		return;
+	}
 
-	return *reinterpret_cast<uint32_t*>(&m_memory[address]);
+	// a page at a time, so accesses that cross pages land in both
+	for (size_t done = 0; done < size;)
+	{
+		uintptr_t current = address + done;
+		uintptr_t offset = current & (PAGE_SIZE - 1);
+		size_t count = std::min<size_t>(size - done, PAGE_SIZE - offset);
+
+		memcpy(pData + done, TranslateRead(current >> PAGE_SHIFT) + offset, count);
+		done += count;
+	}
 }
 
-void MemoryController::Write8(const uintptr_t address, const uint8_t data)
+void MemoryController::WriteBlock(const uintptr_t address, const uint8_t* pData, const size_t size)
 {
 	// ensure we are not trying to write to memory that is not allocated to us
-	assert(address < m_blockSize);
+	if (address + size > m_blockSize)
+		throw std::runtime_error("Write outside of memory");
+
+	if (size != 0)
+		CheckCodeWrite(address, size);
 
-	m_memory[address] = data;
+	if (m_memory != nullptr)
+	{
+		memcpy(m_memory + address, pData, size);
+		MarkDirtyRange(address, size);
+		return;
+	}
+
+	for (size_t done = 0; done < size;)
+	{
+		uintptr_t current = address + done;
+		uintptr_t offset = current & (PAGE_SIZE - 1);
+		size_t count = std::min<size_t>(size - done, PAGE_SIZE - offset);
+
+		memcpy(TranslateWrite(current >> PAGE_SHIFT) + offset, pData + done, count);
+		done += count;
+	}
 }
 
-void MemoryController::Write16(const uintptr_t address, const uint16_t data)
+uint8_t* MemoryController::GetWriteSpan(const uintptr_t address, size_t& size)
 {
-	// ensure we are not trying to write to memory that is not allocated to us
-	assert(address < m_blockSize - 1);
+	if (address >= m_blockSize)
+		throw std::runtime_error("Write outside of memory");
+
+	size = std::min<size_t>(size, m_blockSize - address);
+	if (m_memory == nullptr)
+		size = std::min<size_t>(size, PAGE_SIZE - (address & (PAGE_SIZE - 1)));
 
-	*reinterpret_cast<uint16_t*>(&m_memory[address]) = data;
+	if (size != 0)
+		CheckCodeWrite(address, size);
+
+	if (m_memory != nullptr)
+	{
+		MarkDirtyRange(address, size);
+		return m_memory + address;
+	}
+
+	return TranslateWrite(address >> PAGE_SHIFT) + (address & (PAGE_SIZE - 1));
 }
 
-void MemoryController::Write32(const uintptr_t address, const uint32_t data)
+void MemoryController::Copy(const uintptr_t dst, const uintptr_t src, const size_t size)
 {
-	// ensure we are not trying to write to memory that is not allocated to us
-	assert(address < m_blockSize);
+	CheckRange(dst, size);
+	CheckRange(src, size);
+
+	if (size == 0)
+		return;
 
-	*reinterpret_cast<uint32_t*>(&m_memory[address]) = data;
+	CheckCodeWrite(dst, size);
+
+	// the host's memmove is as wide as its vector units go
+	if (m_memory != nullptr)
+	{
+		memmove(m_memory + dst, m_memory + src, size);
+		MarkDirtyRange(dst, size);
+		return;
+	}
+
+	// copying forwards a page at a time would overwrite source it has not read yet
+	if (dst > src &&
+		dst < src + size)
+	{
+		std::vector<uint8_t> buffer(size);
+		ReadBlock(src, buffer.data(), size);
+		WriteBlock(dst, buffer.data(), size);
+		return;
+	}
+
+	for (size_t done = 0; done < size;)
+	{
+		uintptr_t from = src + done;
+		uintptr_t to = dst + done;
+		size_t count = std::min<size_t>({ size - done, PAGE_SIZE - (from & (PAGE_SIZE - 1)), PAGE_SIZE - (to & (PAGE_SIZE - 1)) });
+
+		const uint8_t* pFrom = TranslateRead(from >> PAGE_SHIFT) + (from & (PAGE_SIZE - 1));
+		memmove(TranslateWrite(to >> PAGE_SHIFT) + (to & (PAGE_SIZE - 1)), pFrom, count);
+		done += count;
+	}
+}
+
+void MemoryController::Fill(const uintptr_t dst, const uint8_t value, const size_t size)
+{
+	CheckRange(dst, size);
+
+	if (size == 0)
+		return;
+
+	CheckCodeWrite(dst, size);
+
+	if (m_memory != nullptr)
+	{
+		memset(m_memory + dst, value, size);
+		MarkDirtyRange(dst, size);
+		return;
+	}
+
+	for (size_t done = 0; done < size;)
+	{
+		uintptr_t current = dst + done;
+		uintptr_t offset = current & (PAGE_SIZE - 1);
+		size_t count = std::min<size_t>(size - done, PAGE_SIZE - offset);
+
+		memset(TranslateWrite(current >> PAGE_SHIFT) + offset, value, count);
+		done += count;
+	}
+}
+
+size_t MemoryController::Compare(const uintptr_t a, const uintptr_t b, const size_t size) const
+{
+	CheckRange(a, size);
+	CheckRange(b, size);
+
+	if (m_memory != nullptr)
+		return FindDifference(m_memory + a, m_memory + b, size);
+
+	for (size_t done = 0; done < size;)
+	{
+		uintptr_t left = a + done;
+		uintptr_t right = b + done;
+		size_t count = std::min<size_t>({ size - done, PAGE_SIZE - (left & (PAGE_SIZE - 1)), PAGE_SIZE - (right & (PAGE_SIZE - 1)) });
+
+		size_t difference = FindDifference(TranslateRead(left >> PAGE_SHIFT) + (left & (PAGE_SIZE - 1)),
+			TranslateRead(right >> PAGE_SHIFT) + (right & (PAGE_SIZE - 1)), count);
+		if (difference != count)
+			return done + difference;
+
+		done += count;
+	}
+
+	return size;
+}
+
+size_t MemoryController::Find(const uintptr_t address, const uint8_t value, const size_t size) const
+{
+	CheckRange(address, size);
+
+	for (size_t done = 0; done < size;)
+	{
+		uintptr_t current = address + done;
+		uintptr_t offset = current & (PAGE_SIZE - 1);
+		size_t count = m_memory != nullptr ? size : std::min<size_t>(size - done, PAGE_SIZE - offset);
+
+		const uint8_t* pData = m_memory != nullptr ? m_memory + address : TranslateRead(current >> PAGE_SHIFT) + offset;
+		const void* pFound = memchr(pData, value, count);
+		if (pFound != nullptr)
+			return done + static_cast<size_t>(static_cast<const uint8_t*>(pFound) - pData);
+
+		done += count;
+	}
+
+	return size;
+}
+
+uint16_t MemoryController::Checksum(const uintptr_t address, const size_t size) const
+{
+	CheckRange(address, size);
+
+	// summing the little endian words gives the sum of the big endian ones with its bytes swapped, and a piece
+	// that starts at an odd offset pairs its bytes the other way around
+	uint64_t sum = 0;
+	for (size_t done = 0; done < size;)
+	{
+		uintptr_t current = address + done;
+		uintptr_t offset = current & (PAGE_SIZE - 1);
+		size_t count = m_memory != nullptr ? size : std::min<size_t>(size - done, PAGE_SIZE - offset);
+
+		const uint8_t* pData = m_memory != nullptr ? m_memory + address : TranslateRead(current >> PAGE_SHIFT) + offset;
+		uint16_t piece = FoldSum(SumWords(pData, count));
+		sum += (done & 1) != 0 ? SwapBytes(piece) : piece;
+
+		done += count;
+	}
+
+	return static_cast<uint16_t>(~SwapBytes(FoldSum(sum)));
+}
+
+uint32_t MemoryController::CompareExchange32(const uintptr_t address, const uint32_t expected, const uint32_t desired)
+{
+	uint8_t* pData = GetAtomic(address);
+
+	uint32_t previous;
+	if (IsHostAligned(pData) == true)
+		previous = AtomicCompareExchange(pData, expected, desired);
+	else
+	{
+		std::unique_lock<std::mutex> lock = LockUnaligned();
+
+		memcpy(&previous, pData, sizeof(previous));
+		if (previous == expected)
+			memcpy(pData, &desired, sizeof(desired));
+	}
+
+	// reported once it is there for whoever takes it
+	if (previous == expected)
+		CheckCodeWrite(address, sizeof(uint32_t));
+
+	return previous;
+}
+
+uint32_t MemoryController::FetchAdd32(const uintptr_t address, const uint32_t value)
+{
+	uint8_t* pData = GetAtomic(address);
+
+	uint32_t previous;
+	if (IsHostAligned(pData) == true)
+		previous = AtomicFetchAdd(pData, value);
+	else
+	{
+		std::unique_lock<std::mutex> lock = LockUnaligned();
+
+		memcpy(&previous, pData, sizeof(previous));
+		uint32_t sum = previous + value;
+		memcpy(pData, &sum, sizeof(sum));
+	}
+
+	CheckCodeWrite(address, sizeof(uint32_t));
+
+	return previous;
+}
+
+Blacklight::VM::MemoryMode MemoryController::GetMemoryMode() const
+{
+	return m_memory == nullptr ? MM_PAGED : MM_FLAT;
+}
+
+size_t MemoryController::GetBlockSize() const
+{
+	return m_blockSize;
+}
+
+bool MemoryController::IsShared() const
+{
+	return m_pSharing != nullptr;
 }
 
 uint8_t* MemoryController::GetRawMemory()
@@ -65,7 +611,489 @@ uint8_t* MemoryController::GetRawMemory()
 	return m_memory;
 }
 
+const uint8_t* MemoryController::GetRawMemory() const
+{
+	return m_memory;
+}
+
+uintptr_t MemoryController::GetAddressMask() const
+{
+	return m_mask;
+}
+
+uint8_t* MemoryController::GetDirtyMap()
+{
+	return m_dirty.data();
+}
+
+std::shared_ptr<const MemorySnapshot> MemoryController::TakeSnapshot()
+{
+	if (m_pSharing != nullptr)
+		throw std::runtime_error("Shared memory can not be snapshotted");
+
+	std::shared_ptr<MemorySnapshot> pSnapshot(new MemorySnapshot(m_blockSize, GetMemoryMode()));
+
+	if (m_memory == nullptr)
+	{
+		// the snapshot takes the pages written since the last one and shares the rest with it, and
+		// memory then shares all of them with the snapshot
+		pSnapshot->m_pParent = m_pBase;
+		pSnapshot->m_pages.resize(m_pageCount, nullptr);
+
+		for (size_t page = 0; page < m_pageCount; ++page)
+		{
+			const std::unique_ptr<uint8_t*[]>& pTable = m_directory[page >> TABLE_SHIFT];
+			if (pTable == nullptr)
+				continue;
+
+			uint8_t* pData = pTable[page & ((1 << TABLE_SHIFT) - 1)];
+			pSnapshot->m_pages[page] = pData;
+
+			if (pData != nullptr &&
+				m_dirty[page] != 0)
+				pSnapshot->m_owned.emplace_back(pData);
+		}
+
+		std::fill(m_dirty.begin(), m_dirty.end(), 0);
+
+		// the next write to every page has to miss so that it gets its own copy
+		FlushTlb();
+
+		m_pBase = pSnapshot;
+		return pSnapshot;
+	}
+
+#if __linux__
+	// the file holds the pages memory is in, from the start of the first one. Only pages with
+	// something in them are written, the rest of it reads as zero
+	size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t offset = static_cast<size_t>(reinterpret_cast<uintptr_t>(m_memory) & (pageSize - 1));
+	uint8_t* pPages = m_memory - offset;
+	size_t size = (offset + m_blockSize + pageSize - 1) & ~(pageSize - 1);
+
+	pSnapshot->m_file = memfd_create("BlacklightVM snapshot", MFD_CLOEXEC);
+	if (pSnapshot->m_file == -1 ||
+		ftruncate(pSnapshot->m_file, static_cast<off_t>(size)) == -1)
+		throw std::runtime_error("Could not create snapshot");
+
+	for (size_t page = 0; page < size; page += PAGE_SIZE)
+	{
+		if (memcmp(pPages + page, ZERO_PAGE, PAGE_SIZE) == 0)
+			continue;
+
+		if (pwrite(pSnapshot->m_file, pPages + page, PAGE_SIZE, static_cast<off_t>(page)) != static_cast<ssize_t>(PAGE_SIZE))
+			throw std::runtime_error("Could not write snapshot");
+	}
+
+	void* pView = mmap(nullptr, size, PROT_READ, MAP_SHARED, pSnapshot->m_file, 0);
+	if (pView == MAP_FAILED)
+		throw std::runtime_error("Could not map snapshot");
+
+	pSnapshot->m_pView = static_cast<const uint8_t*>(pView) + offset;
+	pSnapshot->m_viewSize = m_blockSize;
+	pSnapshot->m_viewOffset = offset;
+
+	// memory shares the snapshot's pages until it writes to them
+	if (mmap(pPages, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, pSnapshot->m_file, 0) == MAP_FAILED)
+		throw std::runtime_error("Could not map snapshot");
+#else
+	pSnapshot->m_copy.assign(m_memory, m_memory + m_blockSize);
+	pSnapshot->m_pView = pSnapshot->m_copy.data();
+	pSnapshot->m_viewSize = m_blockSize;
+#endif
+
+	std::fill(m_dirty.begin(), m_dirty.end(), 0);
+
+	m_pBase = pSnapshot;
+	return pSnapshot;
+}
+
+void MemoryController::Restore(const std::shared_ptr<const MemorySnapshot>& pSnapshot)
+{
+	const MemorySnapshot& snapshot = *pSnapshot;
+
+	if (snapshot.m_blockSize != m_blockSize ||
+		snapshot.m_mode != GetMemoryMode())
+		throw std::runtime_error("Snapshot does not match memory");
+	if (m_pSharing != nullptr)
+		throw std::runtime_error("Shared memory can not be restored");
+
+	// anything else is restored whole and tracked from then on
+	const bool whole = pSnapshot != m_pBase;
+
+	if (m_memory == nullptr)
+	{
+		for (size_t page = whole ? 0 : NextDirty(0); page < m_pageCount; page = whole ? page + 1 : NextDirty(page + 1))
+		{
+			std::unique_ptr<uint8_t*[]>& pTable = m_directory[page >> TABLE_SHIFT];
+			if (pTable == nullptr &&
+				snapshot.m_pages[page] == nullptr)
+				continue;
+
+			if (pTable == nullptr)
+				pTable.reset(new uint8_t*[static_cast<size_t>(1) << TABLE_SHIFT]());
+
+			// only pages written since the snapshot belong to memory
+			uint8_t*& pData = pTable[page & ((1 << TABLE_SHIFT) - 1)];
+			if (m_dirty[page] != 0)
+				delete[]pData;
+
+			pData = const_cast<uint8_t*>(snapshot.m_pages[page]);
+			m_dirty[page] = 0;
+
+			CheckCodeWrite(page << PAGE_SHIFT, PAGE_SIZE);
+		}
+
+		// entries may point at pages that are gone, or that are shared again
+		FlushTlb();
+	}
+	else if (whole == false)
+	{
+		for (size_t page = NextDirty(0); page < m_dirty.size(); page = NextDirty(page + 1))
+		{
+			uintptr_t offset = page << PAGE_SHIFT;
+			m_dirty[page] = 0;
+
+			// a write that faulted at the end of memory still marked where it was going
+			if (offset >= snapshot.m_viewSize)
+				continue;
+
+			size_t count = std::min<size_t>(PAGE_SIZE, snapshot.m_viewSize - offset);
+			memcpy(m_memory + offset, snapshot.m_pView + offset, count);
+
+			CheckCodeWrite(offset, count);
+		}
+	}
+	else
+	{
+#if __linux__
+		// sharing the snapshot's pages drops every page of our own
+		if (mmap(m_memory - snapshot.m_viewOffset, snapshot.m_viewOffset + snapshot.m_viewSize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, snapshot.m_file, 0) == MAP_FAILED)
+			throw std::runtime_error("Could not map snapshot");
+#else
+		memcpy(m_memory, snapshot.m_pView, snapshot.m_viewSize);
+#endif
+
+		std::fill(m_dirty.begin(), m_dirty.end(), 0);
+		CheckCodeWrite(0, m_blockSize);
+	}
+
+	m_pBase = pSnapshot;
+}
+
+size_t MemoryController::GetResidentSize() const
+{
+	if (m_memory != nullptr)
+		return m_blockSize;
+
+	size_t pages = 0;
+	for (const std::unique_ptr<uint8_t*[]>& pTable : m_directory)
+	{
+		if (pTable == nullptr)
+			continue;
+
+		for (uintptr_t i = 0; i < (static_cast<uintptr_t>(1) << TABLE_SHIFT); ++i)
+		{
+			if (pTable[i] != nullptr)
+				++pages;
+		}
+	}
+
+	return pages * PAGE_SIZE;
+}
+
+void MemoryController::WatchCode(const uintptr_t address, const size_t size)
+{
+	std::unique_lock<std::mutex> lock;
+	if (m_pSharing != nullptr)
+		lock = std::unique_lock<std::mutex>(m_pSharing->m_mutex);
+
+	m_watchBegin = address;
+	m_watchEnd = address + size;
+	m_codeWritten = false;
+}
+
+void MemoryController::TakeCodeWrite(uintptr_t& low, uintptr_t& high)
+{
+	// taking the lock also makes the code another thread wrote visible to whoever decodes it next
+	std::unique_lock<std::mutex> lock;
+	if (m_pSharing != nullptr)
+		lock = std::unique_lock<std::mutex>(m_pSharing->m_mutex);
+
+	low = m_codeWriteLow;
+	high = m_codeWriteHigh;
+
+	m_codeWritten = false;
+}
+
+void MemoryController::RecordCodeWrite(const uintptr_t address, const size_t size)
+{
+	if (m_pSharing == nullptr)
+	{
+		AddCodeWrite(address, size);
+		return;
+	}
+
+	// every thread running the code has to throw away what it decoded from it
+	std::lock_guard<std::mutex> sharingGuard(m_pSharing->m_mutex);
+	for (MemoryController* pView : m_pSharing->m_views)
+	{
+		if (address + size > pView->m_watchBegin &&
+			address < pView->m_watchEnd)
+			pView->AddCodeWrite(address, size);
+	}
+}
+
+void MemoryController::AddCodeWrite(const uintptr_t address, const size_t size)
+{
+	uintptr_t last = address + size - 1;
+
+	++m_codeWrites;
+
+	// grow the written range until somebody takes it
+	if (m_codeWritten == false)
+	{
+		m_codeWriteLow = address;
+		m_codeWriteHigh = last;
+		m_codeWritten = true;
+	}
+	else
+	{
+		if (address < m_codeWriteLow)
+			m_codeWriteLow = address;
+		if (last > m_codeWriteHigh)
+			m_codeWriteHigh = last;
+	}
+}
+
+void MemoryController::CheckRange(const uintptr_t address, const size_t size) const
+{
+	if (address + size > m_blockSize)
+		throw std::runtime_error("Access outside of memory");
+}
+
+uint8_t* MemoryController::GetAtomic(const uintptr_t address)
+{
+	CheckRange(address, sizeof(uint32_t));
+	if ((address & (sizeof(uint32_t) - 1)) != 0)
+		throw std::runtime_error("Atomic access is not aligned");
+
+	// an aligned dword never crosses a page
+	if (m_memory == nullptr)
+		return TranslateWrite(address >> PAGE_SHIFT) + (address & (PAGE_SIZE - 1));
+
+	MarkDirty(address, sizeof(uint32_t));
+
+	return m_memory + address;
+}
+
+bool MemoryController::IsWholePage(const uintptr_t page) const
+{
+	return ((page + 1) << PAGE_SHIFT) <= m_blockSize;
+}
+
+bool MemoryController::IsHostAligned(const uint8_t* pData)
+{
+	return (reinterpret_cast<uintptr_t>(pData) & (sizeof(uint32_t) - 1)) == 0;
+}
+
+std::unique_lock<std::mutex> MemoryController::LockUnaligned()
+{
+	if (m_pSharing == nullptr)
+		return std::unique_lock<std::mutex>();
+
+	return std::unique_lock<std::mutex>(m_pSharing->m_mutex);
+}
+
+void MemoryController::MarkDirtyRange(const uintptr_t address, const size_t size)
+{
+	if (size == 0)
+		return;
+
+	for (uintptr_t page = address >> PAGE_SHIFT; page <= (address + size - 1) >> PAGE_SHIFT; ++page)
+		m_dirty[page] = 1;
+}
+
+const uint8_t* MemoryController::TranslateRead(const uintptr_t page) const
+{
+	const std::unique_ptr<uint8_t*[]>& pTable = m_directory[page >> TABLE_SHIFT];
+
+	const uint8_t* pData = ZERO_PAGE;
+	if (pTable != nullptr &&
+		pTable[page & ((1 << TABLE_SHIFT) - 1)] != nullptr)
+		pData = pTable[page & ((1 << TABLE_SHIFT) - 1)];
+
+	// the zero page is only ever read through, writes miss their own TLB and allocate
+	if (IsWholePage(page) == true)
+		m_readTlb[page & (TLB_SIZE - 1)] = { page, const_cast<uint8_t*>(pData) };
+
+	return pData;
+}
+
+uint8_t* MemoryController::TranslateWrite(const uintptr_t page)
+{
+	std::unique_ptr<uint8_t*[]>& pTable = m_directory[page >> TABLE_SHIFT];
+	if (pTable == nullptr)
+		pTable.reset(new uint8_t*[static_cast<size_t>(1) << TABLE_SHIFT]());
+
+	// pages that are not there yet are allocated, and pages shared with the snapshot are copied
+	uint8_t*& pData = pTable[page & ((1 << TABLE_SHIFT) - 1)];
+	if (pData == nullptr)
+		pData = new uint8_t[PAGE_SIZE]();
+	else if (m_dirty[page] == 0)
+	{
+		uint8_t* pCopy = new uint8_t[PAGE_SIZE];
+		memcpy(pCopy, pData, PAGE_SIZE);
+
+		pData = pCopy;
+	}
+
+	m_dirty[page] = 1;
+
+	// the read TLB may still have this page as the zero page
+	if (IsWholePage(page) == true)
+	{
+		m_readTlb[page & (TLB_SIZE - 1)] = { page, pData };
+		m_writeTlb[page & (TLB_SIZE - 1)] = { page, pData };
+	}
+
+	return pData;
+}
+
+size_t MemoryController::NextDirty(size_t page) const
+{
+	const size_t count = m_dirty.size();
+
+	// eight clean pages at a time
+	while (page < count &&
+		(page & 7) != 0 &&
+		m_dirty[page] == 0)
+		++page;
+
+	for (; page + 8 <= count; page += 8)
+	{
+		uint64_t pages;
+		memcpy(&pages, &m_dirty[page], sizeof(pages));
+
+		if (pages != 0)
+			break;
+	}
+
+	while (page < count &&
+		m_dirty[page] == 0)
+		++page;
+
+	return page;
+}
+
+void MemoryController::FlushTlb()
+{
+	for (size_t i = 0; i < TLB_SIZE; ++i)
+	{
+		m_readTlb[i] = { UINTPTR_MAX, nullptr };
+		m_writeTlb[i] = { UINTPTR_MAX, nullptr };
+	}
+}
+
+const uint8_t* MemoryController::FetchSlow(const uintptr_t address) const
+{
+	if (address + FETCH_SIZE <= m_blockSize)
+	{
+		ReadBlock(address, m_fetchBuffer, FETCH_SIZE);
+		return m_fetchBuffer;
+	}
+
+	// an instruction at the end of memory faults as soon as it reads past it, as it does in flat memory
+	if (address >= m_blockSize ||
+		m_pFetchTail == nullptr)
+		throw std::runtime_error("Fetch outside of memory");
+
+	size_t size = m_blockSize - address;
+	ReadBlock(address, m_pFetchTail - size, size);
+
+	return m_pFetchTail - size;
+}
+
+MemoryController::FaultTrap::FaultTrap(const MemoryController* pMemory) :
+	m_pMemory(pMemory),
+	m_pPrevious(t_pTrap)
+{
+	t_pTrap = this;
+}
+
+bool MemoryController::FaultTrap::Catches(const uintptr_t hostAddress) const
+{
+	uintptr_t begin = reinterpret_cast<uintptr_t>(m_pMemory->m_pReservation);
+
+	return hostAddress >= begin &&
+		hostAddress < begin + m_pMemory->m_reservedSize;
+}
+
+MemoryController::FaultTrap::~FaultTrap()
+{
+	t_pTrap = m_pPrevious;
+}
+
+MemorySnapshot::MemorySnapshot(const size_t blockSize, const MemoryMode mode) :
+	m_blockSize(blockSize),
+	m_mode(mode),
+	m_file(-1),
+	m_pView(nullptr),
+	m_viewSize(0),
+	m_viewOffset(0)
+{
+}
+
+MemorySnapshot::~MemorySnapshot()
+{
+#if __linux__
+	// memory mapped from the file keeps its own reference to it
+	if (m_file != -1)
+	{
+		if (m_pView != nullptr)
+			munmap(const_cast<uint8_t*>(m_pView - m_viewOffset), m_viewOffset + m_viewSize);
+		close(m_file);
+	}
+#endif
+}
+
 MemoryController::~MemoryController()
 {
+	// the reservation goes along with the last view of it
+	if (m_pSharing != nullptr)
+	{
+		std::lock_guard<std::mutex> sharingGuard(m_pSharing->m_mutex);
+
+		std::vector<MemoryController*>& views = m_pSharing->m_views;
+		views.erase(std::find(views.begin(), views.end(), this));
+		return;
+	}
+
+	if (m_memory == nullptr)
+	{
+		// clean pages belong to the snapshot
+		for (size_t page = NextDirty(0); page < m_pageCount; page = NextDirty(page + 1))
+			delete[]m_directory[page >> TABLE_SHIFT][page & ((1 << TABLE_SHIFT) - 1)];
+
+#if __linux__
+		munmap(m_pReservation, m_reservedSize);
+#endif
+		return;
+	}
+
+#if __linux__
+	munmap(m_pReservation, m_reservedSize);
+#else
 	delete[]m_memory;
+#endif
+}
+
+MemoryController::Sharing::~Sharing()
+{
+#if __linux__
+	munmap(m_pReservation, m_reservedSize);
+#else
+	delete[]m_pReservation;
+#endif
 }
\ No newline at end of file
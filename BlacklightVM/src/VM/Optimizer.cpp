@@ -0,0 +1,1104 @@
+#include <VM/Optimizer.h>
+#include <VM/CPU.h>
+#include <VM/InstructionGeneration/InstructionGeneration.h>
+#include <VM/Linker.h>
+
+#include <cstring>
+#include <map>
+#include <set>
+#include <stdexcept>
+
+using Blacklight::VM::Optimizer;
+
+using namespace Blacklight::VM;
+using namespace Blacklight::VM::InstructionGeneration;
+
+namespace
+{
+	// the flags CMP sets are tracked apart from the rest of R_CND, which it keeps
+	constexpr uint32_t FLAGS = 1u << R_COUNT;
+	constexpr uint32_t ALL_REGISTERS = ((1u << R_COUNT) - 1) | FLAGS;
+	// passes stop once nothing changes, or after this many rounds
+	constexpr int MAX_ROUNDS = 16;
+
+	uint32_t Bit(const uint8_t reg)
+	{
+		return 1u << reg;
+	}
+
+	// Returns the bits that stand for a register, R_CND being the flags as well
+	uint32_t Mask(const uint8_t reg)
+	{
+		return reg == R_CND ? Bit(reg) | FLAGS : Bit(reg);
+	}
+
+	struct Op
+	{
+		uint32_t m_address;
+		// the encoding, for everything that is not position dependent
+		std::vector<uint8_t> m_bytes;
+
+		uint8_t m_op;
+		uint8_t m_low;
+		bool m_imm;
+		uint8_t m_dst;
+		uint8_t m_src;
+		// immediates sign extended, the address reached for LD, ST, BR, JMP and CALL
+		// with an immediate, and the code for CX and TRAP
+		uint32_t m_value;
+	};
+
+	struct Block
+	{
+		std::vector<Op> m_ops;
+		bool m_fallsThrough;
+		// the block it falls through to, always the next one laid out
+		uint32_t m_next;
+	};
+
+	// what is known about the registers and flags at a point in the code
+	struct State
+	{
+		bool m_known[R_COUNT];
+		uint32_t m_values[R_COUNT];
+		bool m_flagsKnown;
+		uint32_t m_flags;
+
+		void Set(const uint8_t reg, const uint32_t value)
+		{
+			m_known[reg] = true;
+			m_values[reg] = value;
+
+			if (reg == R_CND)
+			{
+				m_flagsKnown = true;
+				m_flags = value & (F_P | F_E | F_N);
+			}
+		}
+
+		void Forget(const uint8_t reg)
+		{
+			m_known[reg] = false;
+			if (reg == R_CND)
+				m_flagsKnown = false;
+		}
+
+		void ForgetAll()
+		{
+			memset(m_known, 0, sizeof(m_known));
+			m_flagsKnown = false;
+		}
+
+		// Keeps what both agree on, returns whether anything was forgotten
+		bool Merge(const State& other)
+		{
+			bool changed = false;
+			for (int i = 0; i < R_COUNT; ++i)
+			{
+				if (m_known[i] == true &&
+					(other.m_known[i] == false || other.m_values[i] != m_values[i]))
+				{
+					m_known[i] = false;
+					changed = true;
+				}
+			}
+
+			if (m_flagsKnown == true &&
+				(other.m_flagsKnown == false || other.m_flags != m_flags))
+			{
+				m_flagsKnown = false;
+				changed = true;
+			}
+
+			return changed;
+		}
+	};
+
+	// the size bits, byte before word before dword as the instruction table checks them
+	bool IsByte(const Op& op)
+	{
+		return (op.m_low & 0x4) != 0;
+	}
+
+	bool IsWord(const Op& op)
+	{
+		return (op.m_low & 0x4) == 0 && (op.m_low & 0x2) != 0;
+	}
+
+	uint32_t SignExtend(const Op& op, const uint32_t value)
+	{
+		if (IsByte(op))
+			return static_cast<uint32_t>(static_cast<int8_t>(value));
+		if (IsWord(op))
+			return static_cast<uint32_t>(static_cast<int16_t>(value));
+
+		return value;
+	}
+
+	uint32_t ZeroExtend(const Op& op, const uint32_t value)
+	{
+		if (IsByte(op))
+			return static_cast<uint8_t>(value);
+		if (IsWord(op))
+			return static_cast<uint16_t>(value);
+
+		return value;
+	}
+
+	uint32_t Read(const std::vector<uint8_t>& bytes, const size_t at, const size_t size)
+	{
+		uint32_t value = 0;
+		for (size_t i = 0; i < size; ++i)
+			value |= static_cast<uint32_t>(bytes[at + i]) << (i * 8);
+
+		return value;
+	}
+
+	Op Decode(const uint8_t* pCode, const uint32_t origin, const size_t size, const uint32_t address)
+	{
+		if (address < origin ||
+			address - origin >= size)
+			throw std::runtime_error("Code reaches outside of the image");
+
+		size_t at = address - origin;
+
+		Op op = {};
+		op.m_address = address;
+		op.m_op = pCode[at] >> 4;
+		op.m_low = pCode[at] & 0xF;
+		op.m_imm = (op.m_low & 0x8) != 0;
+
+		size_t immediateSize = IsByte(op) ? 1 : (IsWord(op) ? 2 : 4);
+
+		size_t length = 2;
+		switch (op.m_op)
+		{
+		case OP_LD:
+		case OP_ST:
+			length = op.m_imm ? 6 : 2;
+			break;
+		case OP_LDV:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_AND:
+		case OP_CMP:
+			length = op.m_imm ? 2 + immediateSize : 2;
+			break;
+		case OP_PUSH:
+		case OP_BR:
+			length = op.m_imm ? 5 : 2;
+			break;
+		case OP_JMP:
+		case OP_CALL:
+			length = op.m_imm ? 1 + immediateSize : 2;
+			break;
+		case OP_RET:
+			length = 1;
+			break;
+		case OP_TRAP:
+			// the extended page
+			length = op.m_imm ? 4 : 2;
+			break;
+		}
+
+		if (at + length > size)
+			throw std::runtime_error("An instruction runs off the end of the image");
+
+		op.m_bytes.assign(pCode + at, pCode + at + length);
+		if (length > 1)
+		{
+			op.m_dst = op.m_bytes[1] >> 4;
+			op.m_src = op.m_bytes[1] & 0xF;
+		}
+
+		switch (op.m_op)
+		{
+		case OP_LD:
+		case OP_ST:
+			if (op.m_imm)
+				op.m_value = address + 6 + Read(op.m_bytes, 2, 4);
+			break;
+		case OP_LDV:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_AND:
+		case OP_CMP:
+			if (op.m_imm)
+				op.m_value = SignExtend(op, Read(op.m_bytes, 2, immediateSize));
+			break;
+		case OP_PUSH:
+			if (op.m_imm)
+				op.m_value = Read(op.m_bytes, 1, 4);
+			break;
+		case OP_BR:
+			if (op.m_imm)
+				op.m_value = address + 5 + Read(op.m_bytes, 1, 4);
+			break;
+		case OP_JMP:
+		case OP_CALL:
+			if (op.m_imm)
+				op.m_value = static_cast<uint32_t>(address + length + SignExtend(op, Read(op.m_bytes, 1, immediateSize)));
+			break;
+		case OP_CX:
+		case OP_TRAP:
+			op.m_value = op.m_bytes[1];
+			break;
+		}
+
+		return op;
+	}
+
+	// Returns the registers an instruction names as operands
+	uint32_t GetOperands(const Op& op)
+	{
+		switch (op.m_op)
+		{
+		case OP_LD:
+		case OP_LDV:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_AND:
+		case OP_CMP:
+			return Bit(op.m_dst) | (op.m_imm ? 0 : Bit(op.m_src));
+		case OP_ST:
+			return Bit(op.m_src) | (op.m_imm ? 0 : Bit(op.m_dst));
+		case OP_NOT:
+		case OP_POP:
+			return Bit(op.m_dst);
+		case OP_PUSH:
+		case OP_BR:
+		case OP_JMP:
+		case OP_CALL:
+			return op.m_imm ? 0 : Bit(op.m_src);
+		case OP_TRAP:
+			// the extended page names its registers after the opcode
+			return op.m_imm ? Bit(op.m_bytes[2] >> 4) | Bit(op.m_bytes[2] & 0xF) | Bit(op.m_bytes[3] >> 4) : 0;
+		default:
+			return 0;
+		}
+	}
+
+	// Returns the registers an instruction reads. Anything that leaves the code reads them all
+	uint32_t GetUses(const Op& op)
+	{
+		switch (op.m_op)
+		{
+		case OP_LD:
+		case OP_LDV:
+			return op.m_imm ? 0 : Mask(op.m_src);
+		case OP_ST:
+			return Mask(op.m_src) | (op.m_imm ? 0 : Mask(op.m_dst));
+		case OP_ADD:
+		case OP_SUB:
+		case OP_AND:
+			return Mask(op.m_dst) | (op.m_imm ? 0 : Mask(op.m_src));
+		case OP_NOT:
+			return Mask(op.m_dst);
+		case OP_CMP:
+			return Mask(op.m_dst) | (op.m_imm ? 0 : Mask(op.m_src));
+		case OP_PUSH:
+			return Bit(R_SF) | (op.m_imm ? 0 : Mask(op.m_src));
+		case OP_POP:
+			return Bit(R_SF);
+		case OP_BR:
+			return FLAGS;
+		case OP_JMP:
+			return 0;
+		default:
+			return ALL_REGISTERS;
+		}
+	}
+
+	// Returns the registers an instruction always writes over
+	uint32_t GetDefs(const Op& op)
+	{
+		switch (op.m_op)
+		{
+		case OP_LD:
+			return (op.m_low & 0x7) != 0 ? Mask(op.m_dst) : 0;
+		case OP_LDV:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_AND:
+		case OP_NOT:
+			return Mask(op.m_dst);
+		case OP_CMP:
+			return FLAGS;
+		case OP_PUSH:
+			return Bit(R_SF);
+		case OP_POP:
+			return Mask(op.m_dst) | Bit(R_SF);
+		default:
+			return 0;
+		}
+	}
+
+	// Returns whether all an instruction does is write registers
+	bool IsPure(const Op& op)
+	{
+		switch (op.m_op)
+		{
+		case OP_LDV:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_AND:
+		case OP_NOT:
+		case OP_CMP:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool EndsBlock(const Op& op)
+	{
+		return op.m_op == OP_BR ||
+			op.m_op == OP_JMP ||
+			op.m_op == OP_CALL ||
+			op.m_op == OP_RET ||
+			(op.m_op == OP_TRAP && op.m_imm == false && op.m_value == TC_HALT);
+	}
+
+	bool FallsThrough(const Op& op)
+	{
+		return op.m_op != OP_JMP &&
+			op.m_op != OP_RET &&
+			(op.m_op != OP_TRAP || op.m_imm == true || op.m_value != TC_HALT);
+	}
+
+	// Works out what an instruction leaves in its destination, returns false if that is not known
+	bool Evaluate(const State& state, const Op& op, uint32_t& result)
+	{
+		bool sourceKnown = op.m_imm || state.m_known[op.m_src];
+		uint32_t source = op.m_imm ? op.m_value : state.m_values[op.m_src];
+		uint32_t dst = state.m_values[op.m_dst];
+
+		switch (op.m_op)
+		{
+		case OP_LDV:
+			result = op.m_imm ? source : ZeroExtend(op, source);
+			return sourceKnown;
+		case OP_ADD:
+			result = dst + (op.m_imm ? source : SignExtend(op, source));
+			break;
+		case OP_SUB:
+			result = dst - (op.m_imm ? source : SignExtend(op, source));
+			break;
+		case OP_AND:
+			result = dst & (op.m_imm ? source : ZeroExtend(op, source));
+			break;
+		case OP_NOT:
+			result = ~dst;
+			return state.m_known[op.m_dst];
+		default:
+			return false;
+		}
+
+		return sourceKnown && state.m_known[op.m_dst];
+	}
+
+	void Apply(State& state, const Op& op)
+	{
+		uint32_t result;
+
+		switch (op.m_op)
+		{
+		case OP_LD:
+			if ((op.m_low & 0x7) != 0)
+				state.Forget(op.m_dst);
+			break;
+		case OP_LDV:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_AND:
+		case OP_NOT:
+			if (Evaluate(state, op, result))
+				state.Set(op.m_dst, result);
+			else
+				state.Forget(op.m_dst);
+			break;
+		case OP_CMP:
+		{
+			uint32_t dst = state.m_values[op.m_dst];
+			uint32_t src = op.m_imm ? op.m_value : ZeroExtend(op, state.m_values[op.m_src]);
+
+			if (state.m_known[op.m_dst] == false ||
+				(op.m_imm == false && state.m_known[op.m_src] == false))
+			{
+				state.Forget(R_CND);
+				break;
+			}
+
+			uint32_t flags = src > dst ? F_P : (src == dst ? F_E : F_N);
+			if (state.m_known[R_CND])
+				state.Set(R_CND, (state.m_values[R_CND] & ~(F_P | F_E | F_N)) | flags);
+			else
+			{
+				state.m_flagsKnown = true;
+				state.m_flags = flags;
+			}
+			break;
+		}
+		case OP_PUSH:
+			state.Forget(R_SF);
+			break;
+		case OP_POP:
+			state.Forget(op.m_dst);
+			state.Forget(R_SF);
+			break;
+		case OP_CALL:
+		case OP_CX:
+		case OP_TRAP:
+			state.ForgetAll();
+			break;
+		}
+	}
+
+	// Builds an LDV of a constant in the smallest encoding
+	Op MakeLoad(const Op& from, const uint8_t dst, const uint32_t value)
+	{
+		int32_t extended = static_cast<int32_t>(value);
+		Size size = SZ_DWORD;
+		if (extended >= INT8_MIN && extended <= INT8_MAX)
+			size = SZ_BYTE;
+		else if (extended >= INT16_MIN && extended <= INT16_MAX)
+			size = SZ_WORD;
+
+		Op op = {};
+		op.m_address = from.m_address;
+		op.m_op = OP_LDV;
+		op.m_low = LDV(true, size) & 0xF;
+		op.m_imm = true;
+		op.m_dst = dst;
+		op.m_value = value;
+
+		op.m_bytes = { LDV(true, size), Reg(static_cast<RegisterE>(dst)) };
+		for (size_t i = 0; i < (size == SZ_BYTE ? 1u : (size == SZ_WORD ? 2u : 4u)); ++i)
+			op.m_bytes.push_back(static_cast<uint8_t>(value >> (i * 8)));
+
+		return op;
+	}
+
+	Op MakeMove(const Op& from, const uint8_t dst, const uint8_t src)
+	{
+		Op op = {};
+		op.m_address = from.m_address;
+		op.m_op = OP_LDV;
+		op.m_low = LDV(false) & 0xF;
+		op.m_dst = dst;
+		op.m_src = src;
+		op.m_bytes = { LDV(false), Reg(static_cast<RegisterE>(dst), static_cast<RegisterE>(src)) };
+
+		return op;
+	}
+
+	std::string GetLabel(const uint32_t address)
+	{
+		return "L" + std::to_string(address);
+	}
+
+	// The code of an image as basic blocks, by the address they started at
+	class Program
+	{
+	public:
+		Program(const uint8_t* pCode, const uint32_t origin, const size_t size, Optimizer::Stats& stats) :
+			m_origin(origin),
+			m_end(origin),
+			m_stats(stats)
+		{
+			// everything reachable from the origin, following every edge
+			std::map<uint32_t, Op> ops;
+			std::set<uint32_t> leaders = { origin };
+			std::vector<uint32_t> work = { origin };
+
+			while (work.empty() == false)
+			{
+				uint32_t address = work.back();
+				work.pop_back();
+				if (ops.count(address) != 0)
+					continue;
+
+				Op op = Decode(pCode, origin, size, address);
+
+				if ((GetOperands(op) & Bit(R_PRG)) != 0)
+					throw std::runtime_error("R_PRG is used as an operand");
+				if (op.m_imm == false &&
+					(op.m_op == OP_BR || op.m_op == OP_JMP || op.m_op == OP_CALL))
+					throw std::runtime_error("Code jumps or calls through a register");
+
+				uint32_t next = address + static_cast<uint32_t>(op.m_bytes.size());
+				if (op.m_op == OP_BR || op.m_op == OP_JMP || op.m_op == OP_CALL)
+				{
+					work.push_back(op.m_value);
+					leaders.insert(op.m_value);
+				}
+				if (FallsThrough(op))
+					work.push_back(next);
+				if (EndsBlock(op))
+					leaders.insert(next);
+
+				ops.emplace(address, std::move(op));
+			}
+
+			// instructions may not share bytes
+			uint32_t end = origin;
+			for (const auto& entry : ops)
+			{
+				if (entry.first < end)
+					throw std::runtime_error("Instructions overlap");
+
+				end = entry.first + static_cast<uint32_t>(entry.second.m_bytes.size());
+			}
+			m_end = end;
+
+			for (const auto& entry : ops)
+			{
+				const Op& op = entry.second;
+				if ((op.m_op == OP_LD || op.m_op == OP_ST) &&
+					op.m_imm &&
+					op.m_value >= origin && op.m_value < m_end)
+					throw std::runtime_error("Code loads or stores inside of itself");
+			}
+
+			m_stats.m_instructionsBefore = ops.size();
+			m_stats.m_sizeBefore = m_end - origin;
+
+			Block* pBlock = nullptr;
+			for (auto& entry : ops)
+			{
+				Op& op = entry.second;
+
+				if (pBlock == nullptr ||
+					leaders.count(op.m_address) != 0)
+				{
+					if (pBlock != nullptr)
+					{
+						pBlock->m_fallsThrough = true;
+						pBlock->m_next = op.m_address;
+					}
+
+					pBlock = &m_blocks[op.m_address];
+				}
+
+				pBlock->m_ops.push_back(op);
+
+				if (EndsBlock(op))
+				{
+					pBlock->m_fallsThrough = FallsThrough(op);
+					pBlock->m_next = op.m_address + static_cast<uint32_t>(op.m_bytes.size());
+					pBlock = nullptr;
+				}
+			}
+		}
+
+		void Optimize()
+		{
+			for (int round = 0; round < MAX_ROUNDS; ++round)
+			{
+				bool changed = RemoveUnreachable();
+				changed |= ThreadJumps();
+				changed |= PropagateConstants();
+				changed |= RemoveStackTraffic();
+				changed |= RemoveDeadCode();
+
+				if (changed == false)
+					break;
+			}
+
+			m_stats.m_instructionsAfter = 0;
+			for (const auto& entry : m_blocks)
+				m_stats.m_instructionsAfter += entry.second.m_ops.size();
+		}
+
+		// Lays the blocks out as an object, in the order they were in
+		Object GetObject() const
+		{
+			Object object;
+			object.m_name = "image";
+			std::vector<Fragment>& text = object.m_sections[SC_TEXT];
+
+			auto data = [&text]() -> Fragment&
+			{
+				if (text.empty() == true ||
+					text.back().m_kind != FK_DATA)
+				{
+					text.push_back(Fragment());
+					text.back().m_kind = FK_DATA;
+				}
+
+				return text.back();
+			};
+
+			auto branch = [&text](const uint8_t opcode, const uint32_t target)
+			{
+				Fragment fragment = {};
+				fragment.m_kind = FK_BRANCH;
+				fragment.m_opcode = opcode;
+				fragment.m_symbol = GetLabel(target);
+				text.push_back(fragment);
+			};
+
+			for (auto it = m_blocks.begin(); it != m_blocks.end(); ++it)
+			{
+				const Block& block = it->second;
+
+				Fragment& start = data();
+				object.m_symbols[GetLabel(it->first)] = { SC_TEXT, text.size() - 1, start.m_bytes.size(), false };
+
+				for (const Op& op : block.m_ops)
+				{
+					if ((op.m_op == OP_JMP || op.m_op == OP_CALL) && op.m_imm)
+					{
+						branch(op.m_op, op.m_value);
+						continue;
+					}
+
+					Fragment& fragment = data();
+
+					if (op.m_imm &&
+						(op.m_op == OP_BR || op.m_op == OP_LD || op.m_op == OP_ST))
+					{
+						// only the address moves, everything in front of it stays as it was
+						size_t prefix = op.m_op == OP_BR ? 1 : 2;
+						fragment.m_bytes.insert(fragment.m_bytes.end(), op.m_bytes.begin(), op.m_bytes.begin() + prefix);
+
+						Fixup fixup = {};
+						fixup.m_offset = fragment.m_bytes.size();
+						fixup.m_end = fixup.m_offset + 4;
+						fixup.m_relative = true;
+						if (op.m_op == OP_BR)
+							fixup.m_symbol = GetLabel(op.m_value);
+						else
+							fixup.m_addend = static_cast<int32_t>(op.m_value);
+						fragment.m_fixups.push_back(fixup);
+
+						fragment.m_bytes.insert(fragment.m_bytes.end(), 4, 0);
+						continue;
+					}
+
+					fragment.m_bytes.insert(fragment.m_bytes.end(), op.m_bytes.begin(), op.m_bytes.end());
+				}
+
+				// blocks only ever fall through to the next one, this is just in case
+				auto next = std::next(it);
+				if (block.m_fallsThrough == true &&
+					(next == m_blocks.end() || next->first != block.m_next))
+					branch(OP_JMP, block.m_next);
+			}
+
+			return object;
+		}
+
+		uint32_t GetEnd() const
+		{
+			return m_end;
+		}
+	private:
+		// Returns the blocks a block can go to next, calls included
+		std::vector<uint32_t> GetSuccessors(const Block& block, const bool calls) const
+		{
+			std::vector<uint32_t> successors;
+			if (block.m_fallsThrough == true)
+				successors.push_back(block.m_next);
+
+			if (block.m_ops.empty() == false)
+			{
+				const Op& last = block.m_ops.back();
+				if ((last.m_op == OP_JMP || last.m_op == OP_BR) ||
+					(last.m_op == OP_CALL && calls == true))
+					successors.push_back(last.m_value);
+			}
+
+			return successors;
+		}
+
+		// Returns the blocks entered with nothing known about them, the origin and everything called
+		std::set<uint32_t> GetRoots() const
+		{
+			std::set<uint32_t> roots = { m_origin };
+			for (const auto& entry : m_blocks)
+			{
+				if (entry.second.m_ops.empty() == false &&
+					entry.second.m_ops.back().m_op == OP_CALL)
+					roots.insert(entry.second.m_ops.back().m_value);
+			}
+
+			return roots;
+		}
+
+		bool RemoveUnreachable()
+		{
+			std::set<uint32_t> reached;
+			std::vector<uint32_t> work = { m_origin };
+
+			while (work.empty() == false)
+			{
+				uint32_t address = work.back();
+				work.pop_back();
+				if (reached.insert(address).second == false)
+					continue;
+
+				for (uint32_t successor : GetSuccessors(m_blocks.at(address), true))
+					work.push_back(successor);
+			}
+
+			bool changed = false;
+			for (auto it = m_blocks.begin(); it != m_blocks.end();)
+			{
+				if (reached.count(it->first) != 0)
+				{
+					++it;
+					continue;
+				}
+
+				m_stats.m_unreachable += it->second.m_ops.size();
+				it = m_blocks.erase(it);
+				changed = true;
+			}
+
+			return changed;
+		}
+
+		// Returns where a jump to a block really ends up, past blocks that do nothing but go somewhere else
+		uint32_t Resolve(uint32_t address) const
+		{
+			std::set<uint32_t> seen;
+			while (seen.insert(address).second == true)
+			{
+				const Block& block = m_blocks.at(address);
+
+				if (block.m_ops.empty() == true &&
+					block.m_fallsThrough == true)
+					address = block.m_next;
+				else if (block.m_ops.size() == 1 &&
+					block.m_ops[0].m_op == OP_JMP)
+					address = block.m_ops[0].m_value;
+				else
+					break;
+			}
+
+			return address;
+		}
+
+		bool ThreadJumps()
+		{
+			bool changed = false;
+
+			for (auto it = m_blocks.begin(); it != m_blocks.end(); ++it)
+			{
+				Block& block = it->second;
+				if (block.m_ops.empty() == true)
+					continue;
+
+				Op& last = block.m_ops.back();
+				if (last.m_op != OP_JMP &&
+					last.m_op != OP_BR &&
+					last.m_op != OP_CALL)
+					continue;
+
+				uint32_t target = Resolve(last.m_value);
+				if (target != last.m_value)
+				{
+					last.m_value = target;
+					++m_stats.m_threaded;
+					changed = true;
+				}
+
+				// a jump to the next block, or a branch that goes there either way, does nothing
+				auto next = std::next(it);
+				if (last.m_op == OP_JMP &&
+					next != m_blocks.end() &&
+					next->first == target)
+				{
+					block.m_ops.pop_back();
+					block.m_fallsThrough = true;
+					block.m_next = target;
+					++m_stats.m_threaded;
+					changed = true;
+				}
+				else if (last.m_op == OP_BR &&
+					block.m_fallsThrough == true &&
+					block.m_next == target)
+				{
+					block.m_ops.pop_back();
+					++m_stats.m_threaded;
+					changed = true;
+				}
+			}
+
+			return changed;
+		}
+
+		bool PropagateConstants()
+		{
+			State unknown;
+			unknown.ForgetAll();
+
+			std::map<uint32_t, State> in;
+			std::vector<uint32_t> work;
+			for (uint32_t root : GetRoots())
+			{
+				in[root] = unknown;
+				work.push_back(root);
+			}
+
+			while (work.empty() == false)
+			{
+				uint32_t address = work.back();
+				work.pop_back();
+
+				const Block& block = m_blocks.at(address);
+				State state = in[address];
+				for (const Op& op : block.m_ops)
+					Apply(state, op);
+
+				for (uint32_t successor : GetSuccessors(block, false))
+				{
+					auto found = in.find(successor);
+					if (found == in.end())
+					{
+						in[successor] = state;
+						work.push_back(successor);
+					}
+					else if (found->second.Merge(state) == true)
+						work.push_back(successor);
+				}
+			}
+
+			bool changed = false;
+			for (auto& entry : m_blocks)
+			{
+				Block& block = entry.second;
+				State state = in[entry.first];
+
+				for (size_t i = 0; i < block.m_ops.size();)
+				{
+					Op& op = block.m_ops[i];
+					uint32_t result;
+
+					if (op.m_op == OP_BR &&
+						state.m_flagsKnown == true)
+					{
+						// the branch always goes the same way
+						++m_stats.m_folded;
+						changed = true;
+
+						if ((op.m_low & state.m_flags & (F_P | F_E | F_N)) != 0)
+						{
+							op.m_op = OP_JMP;
+							op.m_low = JMP(true) & 0xF;
+							block.m_fallsThrough = false;
+						}
+						else
+						{
+							block.m_ops.erase(block.m_ops.begin() + i);
+							continue;
+						}
+					}
+					else if (op.m_op == OP_LDV &&
+						op.m_imm == false &&
+						op.m_dst == op.m_src &&
+						(op.m_low & 0x6) == 0)
+					{
+						// a dword move into the register it came from
+						++m_stats.m_folded;
+						changed = true;
+
+						block.m_ops.erase(block.m_ops.begin() + i);
+						continue;
+					}
+					else if (IsPure(op) &&
+						op.m_op != OP_CMP &&
+						Evaluate(state, op, result) == true)
+					{
+						// the register already holds it
+						if (state.m_known[op.m_dst] == true &&
+							state.m_values[op.m_dst] == result)
+						{
+							++m_stats.m_folded;
+							changed = true;
+
+							block.m_ops.erase(block.m_ops.begin() + i);
+							continue;
+						}
+
+						Op load = MakeLoad(op, op.m_dst, result);
+						if (op.m_op != OP_LDV &&
+							load.m_bytes.size() <= op.m_bytes.size())
+						{
+							++m_stats.m_folded;
+							changed = true;
+
+							op = load;
+						}
+					}
+
+					Apply(state, op);
+					++i;
+				}
+			}
+
+			return changed;
+		}
+
+		bool RemoveStackTraffic()
+		{
+			bool changed = false;
+
+			for (auto& entry : m_blocks)
+			{
+				std::vector<Op>& ops = entry.second.m_ops;
+
+				for (size_t i = 0; i + 1 < ops.size(); ++i)
+				{
+					Op& push = ops[i];
+					Op& pop = ops[i + 1];
+
+					if (push.m_op != OP_PUSH ||
+						pop.m_op != OP_POP ||
+						pop.m_dst == R_SF ||
+						(push.m_imm == false && push.m_src == R_SF))
+						continue;
+
+					++m_stats.m_stack;
+					changed = true;
+
+					if (push.m_imm == true)
+						push = MakeLoad(pop, pop.m_dst, push.m_value);
+					else if (push.m_src != pop.m_dst)
+						push = MakeMove(pop, pop.m_dst, push.m_src);
+					else
+					{
+						ops.erase(ops.begin() + i, ops.begin() + i + 2);
+						--i;
+						continue;
+					}
+
+					ops.erase(ops.begin() + i + 1);
+				}
+			}
+
+			return changed;
+		}
+
+		bool RemoveDeadCode()
+		{
+			// registers live on the way into each block, until they stop growing
+			std::map<uint32_t, uint32_t> liveIn;
+			for (bool grown = true; grown == true;)
+			{
+				grown = false;
+
+				for (auto it = m_blocks.rbegin(); it != m_blocks.rend(); ++it)
+				{
+					uint32_t live = GetLiveOut(it->second, liveIn);
+					for (auto op = it->second.m_ops.rbegin(); op != it->second.m_ops.rend(); ++op)
+						live = (live & ~GetDefs(*op)) | GetUses(*op);
+
+					uint32_t& in = liveIn[it->first];
+					if ((live & ~in) != 0)
+					{
+						in |= live;
+						grown = true;
+					}
+				}
+			}
+
+			bool changed = false;
+			for (auto& entry : m_blocks)
+			{
+				std::vector<Op>& ops = entry.second.m_ops;
+				uint32_t live = GetLiveOut(entry.second, liveIn);
+
+				for (size_t i = ops.size(); i-- > 0;)
+				{
+					if (IsPure(ops[i]) &&
+						(GetDefs(ops[i]) & live) == 0)
+					{
+						++m_stats.m_dead;
+						changed = true;
+
+						ops.erase(ops.begin() + i);
+						continue;
+					}
+
+					live = (live & ~GetDefs(ops[i])) | GetUses(ops[i]);
+				}
+			}
+
+			return changed;
+		}
+
+		uint32_t GetLiveOut(const Block& block, std::map<uint32_t, uint32_t>& liveIn) const
+		{
+			uint32_t live = 0;
+			for (uint32_t successor : GetSuccessors(block, false))
+				live |= liveIn[successor];
+
+			return live;
+		}
+
+		uint32_t m_origin;
+		uint32_t m_end;
+		std::map<uint32_t, Block> m_blocks;
+		Optimizer::Stats& m_stats;
+	};
+}
+
+Optimizer::Optimizer() :
+	m_stats()
+{
+}
+
+std::vector<uint8_t> Optimizer::Optimize(const uint8_t* pImage, const size_t size)
+{
+	if (size < 8)
+		throw std::runtime_error("Image is too short for its header");
+
+	m_stats = {};
+
+	uint32_t stackSize;
+	uint32_t origin;
+	memcpy(&stackSize, pImage, sizeof(stackSize));
+	memcpy(&origin, pImage + 4, sizeof(origin));
+
+	std::vector<uint8_t> image(pImage, pImage + size);
+
+	try
+	{
+		Program program(pImage + 8, origin, size - 8, m_stats);
+		program.Optimize();
+
+		Linker linker;
+		linker.SetStackSize(stackSize);
+		linker.SetOrigin(origin);
+		linker.Add(program.GetObject());
+
+		std::vector<uint8_t> optimized = linker.Link();
+		m_stats.m_sizeAfter = optimized.size() - 8;
+
+		// whatever comes after the code stays where it was
+		size_t codeSize = program.GetEnd() - origin;
+		if (m_stats.m_sizeAfter > codeSize)
+			throw std::runtime_error("The optimized code is larger than the original");
+
+		optimized.resize(8 + codeSize, 0);
+		optimized.insert(optimized.end(), pImage + 8 + codeSize, pImage + size);
+
+		m_stats.m_optimized = true;
+		return optimized;
+	}
+	catch (const std::exception& e)
+	{
+		Stats stats = {};
+		stats.m_reason = e.what();
+		m_stats = stats;
+	}
+
+	return image;
+}
+
+const Optimizer::Stats& Optimizer::GetStats() const
+{
+	return m_stats;
+}
\ No newline at end of file
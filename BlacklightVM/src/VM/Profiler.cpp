@@ -0,0 +1,194 @@
+#include <VM/Profiler.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+using Blacklight::VM::Profiler;
+
+namespace
+{
+	// format of the binary file, all values in host byte order:
+	//	"BLVP", u32 version, u32 sample interval
+	//	u32 count, then count of u8 opcode, u64 executions		(only opcodes that ran)
+	//	u64 branches taken, u64 branches not taken
+	//	u32 count, then count of u32 address, u64 samples
+	//	u32 count, then count of u32 caller, u32 callee, u64 calls
+	//	u32 count, then count of u32 depth, depth of u32 function, u64 samples
+	constexpr char MAGIC[4] = { 'B', 'L', 'V', 'P' };
+	constexpr uint32_t VERSION = 1;
+
+	template<typename T>
+	void Put(std::ofstream& out, const T value)
+	{
+		out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+}
+
+Profiler::Profiler(const uint32_t sampleInterval) :
+	m_sampleInterval(sampleInterval != 0 ? sampleInterval : 1),
+	m_untilSample(m_sampleInterval),
+	m_opcodeCounts(),
+	m_branchCounts(),
+	m_overflow(0)
+{
+}
+
+void Profiler::Start(const uint32_t address)
+{
+	if (m_shadowStack.empty() == true)
+		m_shadowStack.push_back(address);
+}
+
+void Profiler::RecordCall(const uint32_t target)
+{
+	++m_callGraph[std::make_pair(m_shadowStack.back(), target)];
+
+	if (m_shadowStack.size() < MAX_DEPTH)
+		m_shadowStack.push_back(target);
+	else
+		++m_overflow;
+}
+
+void Profiler::RecordReturn()
+{
+	if (m_overflow > 0)
+		--m_overflow;
+	// a RET without a CALL leaves the outermost function where it is
+	else if (m_shadowStack.size() > 1)
+		m_shadowStack.pop_back();
+}
+
+uint64_t Profiler::GetOpcodeCount(const OpcodeE op) const
+{
+	uint64_t count = 0;
+	for (uint8_t variant = 0; variant < 0x10; ++variant)
+		count += m_opcodeCounts[(op << 4) | variant];
+
+	return count;
+}
+
+uint64_t Profiler::GetEncodingCount(const uint8_t opcode) const
+{
+	return m_opcodeCounts[opcode];
+}
+
+uint64_t Profiler::GetBranchesTaken() const
+{
+	return m_branchCounts[1];
+}
+
+uint64_t Profiler::GetBranchesNotTaken() const
+{
+	return m_branchCounts[0];
+}
+
+const std::map<uint32_t, uint64_t>& Profiler::GetSamples() const
+{
+	return m_samples;
+}
+
+const std::map<std::pair<uint32_t, uint32_t>, uint64_t>& Profiler::GetCallGraph() const
+{
+	return m_callGraph;
+}
+
+void Profiler::SaveFoldedStacks(const char* path) const
+{
+	std::ofstream out(path);
+	if (out.is_open() == false)
+		throw std::runtime_error("Could not open profile");
+
+	char name[0x10];
+	for (const auto& stack : m_stacks)
+	{
+		for (size_t i = 0; i < stack.first.size(); ++i)
+		{
+			snprintf(name, sizeof(name), i == 0 ? "0x%08X" : ";0x%08X", stack.first[i]);
+			out << name;
+		}
+
+		out << ' ' << stack.second << '\n';
+	}
+
+	if (out.good() == false)
+		throw std::runtime_error("Could not write profile");
+}
+
+void Profiler::Save(const char* path) const
+{
+	std::ofstream out(path, std::ios_base::binary);
+	if (out.is_open() == false)
+		throw std::runtime_error("Could not open profile");
+
+	out.write(MAGIC, sizeof(MAGIC));
+	Put(out, VERSION);
+	Put(out, m_sampleInterval);
+
+	uint32_t opcodes = 0;
+	for (uint64_t count : m_opcodeCounts)
+		opcodes += count != 0;
+
+	Put(out, opcodes);
+	for (size_t i = 0; i < 0x100; ++i)
+	{
+		if (m_opcodeCounts[i] == 0)
+			continue;
+
+		Put(out, static_cast<uint8_t>(i));
+		Put(out, m_opcodeCounts[i]);
+	}
+
+	Put(out, m_branchCounts[1]);
+	Put(out, m_branchCounts[0]);
+
+	Put(out, static_cast<uint32_t>(m_samples.size()));
+	for (const auto& sample : m_samples)
+	{
+		Put(out, sample.first);
+		Put(out, sample.second);
+	}
+
+	Put(out, static_cast<uint32_t>(m_callGraph.size()));
+	for (const auto& edge : m_callGraph)
+	{
+		Put(out, edge.first.first);
+		Put(out, edge.first.second);
+		Put(out, edge.second);
+	}
+
+	Put(out, static_cast<uint32_t>(m_stacks.size()));
+	for (const auto& stack : m_stacks)
+	{
+		Put(out, static_cast<uint32_t>(stack.first.size()));
+		for (uint32_t function : stack.first)
+			Put(out, function);
+		Put(out, stack.second);
+	}
+
+	if (out.good() == false)
+		throw std::runtime_error("Could not write profile");
+}
+
+void Profiler::Clear()
+{
+	memset(m_opcodeCounts, 0, sizeof(m_opcodeCounts));
+	memset(m_branchCounts, 0, sizeof(m_branchCounts));
+
+	m_samples.clear();
+	m_callGraph.clear();
+	m_stacks.clear();
+	m_shadowStack.clear();
+	m_overflow = 0;
+
+	m_untilSample = m_sampleInterval;
+}
+
+void Profiler::Sample(const uint32_t address)
+{
+	m_untilSample = m_sampleInterval;
+
+	++m_samples[address];
+	++m_stacks[m_shadowStack];
+}
\ No newline at end of file
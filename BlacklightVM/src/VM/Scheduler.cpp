@@ -0,0 +1,293 @@
+#include <VM/Scheduler.h>
+
+#include <algorithm>
+#include <exception>
+
+using Blacklight::VM::Scheduler;
+
+Scheduler::Scheduler(const size_t workerCount, const uint64_t quantum) :
+	m_quantum(quantum),
+	m_nextWorker(0),
+	m_queued(0),
+	m_unfinished(0),
+	m_stop(false)
+{
+	size_t count = workerCount;
+	if (count == 0)
+		count = std::max(std::thread::hardware_concurrency(), 1u);
+
+	// every queue has to exist before any worker tries to steal from it
+	for (size_t i = 0; i < count; ++i)
+	{
+		m_workers.emplace_back(new Worker());
+		m_workers.back()->m_slices = 0;
+		m_workers.back()->m_steals = 0;
+	}
+
+	for (size_t i = 0; i < count; ++i)
+		m_workers[i]->m_thread = std::thread(&Scheduler::WorkerMain, this, i);
+}
+
+size_t Scheduler::Add(CPU* pCPU)
+{
+	Instance* pInstance = new Instance();
+	pInstance->m_pCPU = pCPU;
+	pInstance->m_instructions = 0;
+	pInstance->m_slices = 0;
+	pInstance->m_finished = false;
+	pInstance->m_faulted = false;
+	pInstance->m_parking = false;
+	pInstance->m_parked = false;
+
+	size_t id;
+	{
+		std::lock_guard<std::mutex> instanceGuard(m_instanceMutex);
+
+		id = m_instances.size();
+		m_instances.emplace_back(pInstance);
+	}
+
+	{
+		std::lock_guard<std::mutex> stateGuard(m_stateMutex);
+		++m_unfinished;
+	}
+
+	// spread new CPUs around, stealing evens out the rest
+	Queue(m_nextWorker++ % m_workers.size(), pInstance);
+
+	return id;
+}
+
+void Scheduler::Wait()
+{
+	std::unique_lock<std::mutex> lock(m_stateMutex);
+
+	m_finishedCondition.wait(lock, [this] { return m_unfinished == 0 || m_stop == true; });
+}
+
+void Scheduler::Wait(const size_t id)
+{
+	Instance* pInstance;
+	{
+		std::lock_guard<std::mutex> instanceGuard(m_instanceMutex);
+
+		pInstance = m_instances.at(id).get();
+	}
+
+	std::unique_lock<std::mutex> lock(m_stateMutex);
+
+	m_finishedCondition.wait(lock, [this, pInstance] { return pInstance->m_finished == true || m_stop == true; });
+}
+
+void Scheduler::Park(const size_t id)
+{
+	Instance* pInstance;
+	{
+		std::lock_guard<std::mutex> instanceGuard(m_instanceMutex);
+
+		pInstance = m_instances.at(id).get();
+	}
+
+	std::lock_guard<std::mutex> stateGuard(m_stateMutex);
+	pInstance->m_parking = true;
+}
+
+void Scheduler::Resume(const size_t id)
+{
+	Instance* pInstance;
+	{
+		std::lock_guard<std::mutex> instanceGuard(m_instanceMutex);
+
+		pInstance = m_instances.at(id).get();
+	}
+
+	// resumed before its quantum ended, so the worker running it queues it as usual
+	{
+		std::lock_guard<std::mutex> stateGuard(m_stateMutex);
+
+		if (pInstance->m_parked == false)
+		{
+			pInstance->m_parking = false;
+			return;
+		}
+
+		pInstance->m_parked = false;
+	}
+
+	Queue(m_nextWorker++ % m_workers.size(), pInstance);
+}
+
+Scheduler::InstanceStats Scheduler::GetInstanceStats(const size_t id) const
+{
+	std::lock_guard<std::mutex> instanceGuard(m_instanceMutex);
+
+	const Instance& instance = *m_instances.at(id);
+
+	return { instance.m_instructions, instance.m_slices, instance.m_finished, instance.m_faulted };
+}
+
+std::vector<Scheduler::InstanceStats> Scheduler::GetInstanceStats() const
+{
+	std::lock_guard<std::mutex> instanceGuard(m_instanceMutex);
+
+	std::vector<InstanceStats> stats;
+	stats.reserve(m_instances.size());
+
+	for (const std::unique_ptr<Instance>& pInstance : m_instances)
+		stats.push_back({ pInstance->m_instructions, pInstance->m_slices, pInstance->m_finished, pInstance->m_faulted });
+
+	return stats;
+}
+
+std::vector<Scheduler::WorkerStats> Scheduler::GetWorkerStats() const
+{
+	std::vector<WorkerStats> stats;
+	stats.reserve(m_workers.size());
+
+	for (const std::unique_ptr<Worker>& pWorker : m_workers)
+		stats.push_back({ pWorker->m_slices, pWorker->m_steals });
+
+	return stats;
+}
+
+void Scheduler::Stop()
+{
+	{
+		std::lock_guard<std::mutex> stateGuard(m_stateMutex);
+
+		if (m_stop == true)
+			return;
+
+		m_stop = true;
+	}
+
+	m_workCondition.notify_all();
+	m_finishedCondition.notify_all();
+
+	for (std::unique_ptr<Worker>& pWorker : m_workers)
+	{
+		if (pWorker->m_thread.joinable())
+			pWorker->m_thread.join();
+	}
+}
+
+Scheduler::~Scheduler()
+{
+	Stop();
+}
+
+void Scheduler::WorkerMain(const size_t index)
+{
+	Worker& worker = *m_workers[index];
+
+	while (m_stop == false)
+	{
+		Instance* pInstance = Take(index);
+
+		if (pInstance == nullptr)
+		{
+			std::unique_lock<std::mutex> lock(m_stateMutex);
+
+			m_workCondition.wait(lock, [this] { return m_queued > 0 || m_stop == true; });
+			if (m_stop == true)
+				return;
+
+			continue;
+		}
+
+		CPU& cpu = *pInstance->m_pCPU;
+
+		// a CPU that throws is dropped rather than taking the worker down with it
+		try
+		{
+			pInstance->m_instructions += cpu.Run(m_quantum);
+		}
+		catch (const std::exception&)
+		{
+			pInstance->m_faulted = true;
+		}
+
+		++pInstance->m_slices;
+		++worker.m_slices;
+
+		if (cpu.IsFinished() == false &&
+			pInstance->m_faulted == false)
+		{
+			// a parked CPU stays out of the queues until whatever it waits for resumes it
+			bool parked;
+			{
+				std::lock_guard<std::mutex> stateGuard(m_stateMutex);
+
+				parked = pInstance->m_parking;
+				pInstance->m_parking = false;
+				pInstance->m_parked = parked;
+			}
+
+			if (parked == false)
+				Queue(index, pInstance);
+			continue;
+		}
+
+		pInstance->m_finished = true;
+
+		// every finish wakes the waiters, some of them wait for one CPU rather than all of them
+		std::lock_guard<std::mutex> stateGuard(m_stateMutex);
+		--m_unfinished;
+		m_finishedCondition.notify_all();
+	}
+}
+
+Scheduler::Instance* Scheduler::Take(const size_t index)
+{
+	Instance* pInstance = nullptr;
+
+	// own queue first, oldest first so every CPU gets its turn
+	{
+		Worker& worker = *m_workers[index];
+		std::lock_guard<std::mutex> queueGuard(worker.m_mutex);
+
+		if (worker.m_queue.empty() == false)
+		{
+			pInstance = worker.m_queue.front();
+			worker.m_queue.pop_front();
+		}
+	}
+
+	// then the newest from everyone else
+	for (size_t i = 1; i < m_workers.size() && pInstance == nullptr; ++i)
+	{
+		Worker& victim = *m_workers[(index + i) % m_workers.size()];
+		std::lock_guard<std::mutex> queueGuard(victim.m_mutex);
+
+		if (victim.m_queue.empty() == false)
+		{
+			pInstance = victim.m_queue.back();
+			victim.m_queue.pop_back();
+
+			++m_workers[index]->m_steals;
+		}
+	}
+
+	if (pInstance != nullptr)
+		--m_queued;
+
+	return pInstance;
+}
+
+void Scheduler::Queue(const size_t index, Instance* pInstance)
+{
+	// counted before it can be taken, so the count never drops below what is queued
+	++m_queued;
+	{
+		Worker& worker = *m_workers[index];
+		std::lock_guard<std::mutex> queueGuard(worker.m_mutex);
+
+		worker.m_queue.push_back(pInstance);
+	}
+
+	// taking the lock keeps the wake up from slipping in between a sleeping worker's check and its wait
+	{
+		std::lock_guard<std::mutex> stateGuard(m_stateMutex);
+	}
+	m_workCondition.notify_one();
+}
\ No newline at end of file
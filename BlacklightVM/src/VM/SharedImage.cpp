@@ -0,0 +1,161 @@
+#include <VM/SharedImage.h>
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#if __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using Blacklight::VM::SharedImage;
+
+namespace
+{
+	// size of the image header, the stack size followed by the origin
+	constexpr size_t HEADER_SIZE = 8;
+}
+
+SharedImage::SharedImage(const char* path) :
+	m_stackSize(0),
+	m_origin(0),
+	m_codeSize(0),
+	m_mapFile(-1),
+	m_mapOffset(0),
+	m_mapAddress(0),
+	m_mapSize(0)
+{
+#if __linux__
+	int file = open(path, O_RDONLY | O_CLOEXEC);
+	if (file == -1)
+		throw std::runtime_error("Could not open image");
+
+	struct stat info;
+	uint32_t header[2];
+
+	if (fstat(file, &info) == -1 ||
+		info.st_size < static_cast<off_t>(HEADER_SIZE) ||
+		pread(file, header, sizeof(header), 0) != sizeof(header))
+	{
+		close(file);
+		throw std::runtime_error("Could not read image header");
+	}
+
+	m_stackSize = header[0];
+	m_origin = header[1];
+	m_codeSize = static_cast<size_t>(info.st_size) - HEADER_SIZE;
+
+	// the mapping covers every page the code touches
+	uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+	uintptr_t end = (m_origin + m_codeSize + pageSize - 1) & ~(pageSize - 1);
+
+	m_mapAddress = m_origin & ~(pageSize - 1);
+	m_mapSize = end - m_mapAddress;
+
+	// the code already sits at its page offset in the file, which leaves the header in front of it
+	if (m_origin >= HEADER_SIZE &&
+		(m_origin - HEADER_SIZE) % pageSize == 0)
+	{
+		m_mapFile = file;
+		return;
+	}
+
+	// otherwise it is laid out once for every CPU that maps it
+	m_mapFile = memfd_create("BlacklightVM image", MFD_CLOEXEC);
+	if (m_mapFile == -1 ||
+		ftruncate(m_mapFile, static_cast<off_t>(m_mapSize)) == -1)
+	{
+		close(file);
+		if (m_mapFile != -1)
+			close(m_mapFile);
+		throw std::runtime_error("Could not create image mapping");
+	}
+
+	uint8_t buffer[0x10000];
+	for (size_t copied = 0; copied < m_codeSize;)
+	{
+		ssize_t count = pread(file, buffer, sizeof(buffer), static_cast<off_t>(HEADER_SIZE + copied));
+		if (count <= 0 ||
+			pwrite(m_mapFile, buffer, static_cast<size_t>(count), static_cast<off_t>(m_origin - m_mapAddress + copied)) != count)
+		{
+			close(file);
+			close(m_mapFile);
+			throw std::runtime_error("Could not read image");
+		}
+
+		copied += static_cast<size_t>(count);
+	}
+
+	close(file);
+#else
+	std::ifstream in(path, std::ios_base::binary);
+	if (in.is_open() == false)
+		throw std::runtime_error("Could not open image");
+
+	std::vector<uint8_t> data(
+		(std::istreambuf_iterator<char>(in)),
+		std::istreambuf_iterator<char>());
+
+	if (data.size() < HEADER_SIZE)
+		throw std::runtime_error("Could not read image header");
+
+	memcpy(&m_stackSize, data.data(), sizeof(m_stackSize));
+	memcpy(&m_origin, data.data() + sizeof(m_stackSize), sizeof(m_origin));
+	m_codeSize = data.size() - HEADER_SIZE;
+
+	m_code.assign(data.begin() + HEADER_SIZE, data.end());
+#endif
+}
+
+uint32_t SharedImage::GetStackSize() const
+{
+	return m_stackSize;
+}
+
+uint32_t SharedImage::GetOrigin() const
+{
+	return m_origin;
+}
+
+size_t SharedImage::GetCodeSize() const
+{
+	return m_codeSize;
+}
+
+int SharedImage::GetMapFile() const
+{
+	return m_mapFile;
+}
+
+uint64_t SharedImage::GetMapOffset() const
+{
+	return m_mapOffset;
+}
+
+uintptr_t SharedImage::GetMapAddress() const
+{
+	return m_mapAddress;
+}
+
+size_t SharedImage::GetMapSize() const
+{
+	return m_mapSize;
+}
+
+const uint8_t* SharedImage::GetCode() const
+{
+	return m_code.data();
+}
+
+SharedImage::~SharedImage()
+{
+#if __linux__
+	// mappings keep their own reference to the file
+	if (m_mapFile != -1)
+		close(m_mapFile);
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,379 @@
+#include <VM/SocketTable.h>
+#include <VM/CPU.h>
+
+#include <algorithm>
+
+#if __linux__
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using Blacklight::VM::SocketTable;
+
+namespace
+{
+	// Returns whether size bytes at a guest address are all inside of memory
+	bool Fits(Blacklight::VM::CPU& cpu, const uint32_t address, const uint32_t size)
+	{
+		return static_cast<uint64_t>(address) + size <= cpu.GetMemoryController().GetBlockSize();
+	}
+
+#if __linux__
+	bool WouldBlock()
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+#endif
+}
+
+SocketTable::SocketTable() :
+	m_hasDeadline(false)
+{
+}
+
+bool SocketTable::Trap(CPU& cpu, const uint8_t tc)
+{
+	MemoryController& mc = cpu.GetMemoryController();
+
+	uint32_t a = cpu.GetRegister(R_A);
+	uint32_t b = cpu.GetRegister(R_B);
+	uint32_t c = cpu.GetRegister(R_C);
+	uint32_t d = cpu.GetRegister(R_D);
+
+	int32_t result = -1;
+	m_wait.clear();
+
+	// only a SELECT that is being retried keeps its deadline
+	if (tc != TC_SELECT)
+		m_hasDeadline = false;
+
+#if __linux__
+	int fd = Find(a);
+
+	switch (tc)
+	{
+	case TC_SOCKET:
+		fd = socket(static_cast<int>(a), static_cast<int>(b) | SOCK_NONBLOCK | SOCK_CLOEXEC, static_cast<int>(c));
+		if (fd != -1)
+			result = static_cast<int32_t>(Insert(fd));
+		break;
+	case TC_LISTEN:
+		if (fd != -1)
+			result = listen(fd, static_cast<int>(b));
+		break;
+	case TC_BIND:
+	{
+		sockaddr_storage address = {};
+		if (fd != -1 &&
+			c <= sizeof(address) &&
+			Fits(cpu, b, c))
+		{
+			mc.ReadBlock(b, reinterpret_cast<uint8_t*>(&address), c);
+			result = bind(fd, reinterpret_cast<sockaddr*>(&address), c);
+		}
+		break;
+	}
+	case TC_ACCEPT:
+	{
+		if (fd == -1)
+			break;
+
+		sockaddr_storage address;
+		socklen_t length = sizeof(address);
+
+		int client = accept4(fd, reinterpret_cast<sockaddr*>(&address), &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client == -1 &&
+			WouldBlock())
+		{
+			m_wait.push_back({ fd, SE_READ });
+			return false;
+		}
+		if (client == -1)
+			break;
+
+		result = static_cast<int32_t>(Insert(client));
+
+		// the address is truncated to the space the guest gave, which is told how much there was
+		if (b != 0 &&
+			c != 0 &&
+			Fits(cpu, c, sizeof(uint32_t)))
+		{
+			uint32_t space = mc.Read32(c);
+			uint32_t count = std::min<uint32_t>(space, length);
+
+			if (Fits(cpu, b, count))
+				cpu.WriteInput(b, reinterpret_cast<const uint8_t*>(&address), count);
+			cpu.WriteInput(c, reinterpret_cast<const uint8_t*>(&length), sizeof(uint32_t));
+		}
+		break;
+	}
+	case TC_SELECT:
+		return Select(cpu);
+	case TC_RECV:
+	{
+		if (fd == -1 ||
+			Fits(cpu, b, c) == false)
+			break;
+
+		m_buffer.resize(TRANSFER_SIZE);
+
+		ssize_t count = recv(fd, m_buffer.data(), std::min<size_t>(c, TRANSFER_SIZE), static_cast<int>(d) | MSG_DONTWAIT);
+		if (count == -1 &&
+			WouldBlock())
+		{
+			m_wait.push_back({ fd, SE_READ });
+			return false;
+		}
+
+		if (count > 0)
+			cpu.WriteInput(b, m_buffer.data(), static_cast<size_t>(count));
+		result = static_cast<int32_t>(count);
+		break;
+	}
+	case TC_SEND:
+	{
+		if (fd == -1 ||
+			Fits(cpu, b, c) == false)
+			break;
+
+		m_buffer.resize(TRANSFER_SIZE);
+
+		size_t size = std::min<size_t>(c, TRANSFER_SIZE);
+		mc.ReadBlock(b, m_buffer.data(), size);
+
+		// a peer that went away is an error for the guest, not a signal for the host
+		ssize_t count = send(fd, m_buffer.data(), size, static_cast<int>(d) | MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (count == -1 &&
+			WouldBlock())
+		{
+			m_wait.push_back({ fd, SE_WRITE });
+			return false;
+		}
+
+		result = static_cast<int32_t>(count);
+		break;
+	}
+	case TC_SHUTDOWN:
+		if (fd != -1)
+			result = shutdown(fd, static_cast<int>(b));
+		break;
+	case TC_CLOSE:
+		if (fd != -1)
+		{
+			m_sockets[a] = -1;
+			result = close(fd);
+		}
+		break;
+	}
+#endif
+
+	cpu.GetRegister(R_A) = static_cast<Register>(result);
+	return true;
+}
+
+const std::vector<Blacklight::VM::SocketWait>& SocketTable::GetWait() const
+{
+	return m_wait;
+}
+
+int SocketTable::GetWaitTimeout() const
+{
+	if (m_hasDeadline == false)
+		return -1;
+
+	auto left = std::chrono::duration_cast<std::chrono::milliseconds>(m_deadline - std::chrono::steady_clock::now()).count();
+
+	// rounded up, so the wait does not end just short of the deadline
+	return static_cast<int>(std::max<decltype(left)>(left + 1, 0));
+}
+
+void SocketTable::Wait() const
+{
+#if __linux__
+	std::vector<pollfd> polled;
+	for (const SocketWait& wait : m_wait)
+		polled.push_back({ wait.m_fd, static_cast<short>(wait.m_events), 0 });
+
+	// interrupted or not, the trap finds out for itself when it is retried
+	poll(polled.data(), polled.size(), GetWaitTimeout());
+#endif
+}
+
+SocketTable::~SocketTable()
+{
+#if __linux__
+	for (int fd : m_sockets)
+	{
+		if (fd != -1)
+			close(fd);
+	}
+#endif
+}
+
+int SocketTable::Find(const uint32_t handle) const
+{
+	if (handle >= m_sockets.size())
+		return -1;
+
+	return m_sockets[handle];
+}
+
+uint32_t SocketTable::Insert(const int fd)
+{
+	// the lowest free handle, like a host fd
+	auto it = std::find(m_sockets.begin(), m_sockets.end(), -1);
+	if (it != m_sockets.end())
+	{
+		*it = fd;
+		return static_cast<uint32_t>(it - m_sockets.begin());
+	}
+
+	m_sockets.push_back(fd);
+	return static_cast<uint32_t>(m_sockets.size() - 1);
+}
+
+bool SocketTable::Select(CPU& cpu)
+{
+	MemoryController& mc = cpu.GetMemoryController();
+
+	// handles past the end of the table were never opened, so they are left alone rather than read, which also
+	// keeps a count near UINT32_MAX from wrapping the size of the sets or having them allocated
+	size_t count = std::min<size_t>(cpu.GetRegister(R_A), m_sockets.size());
+	uint32_t sets[3] = { cpu.GetRegister(R_B), cpu.GetRegister(R_C), cpu.GetRegister(R_D) };
+	uint32_t timeout = cpu.GetRegister(R_E);
+
+	int32_t result = -1;
+
+#if __linux__
+	// read, write and except, a bit per handle
+	const size_t bytes = (count + 7) / 8;
+	std::vector<uint8_t> bits[3];
+
+	for (int i = 0; i < 3; ++i)
+	{
+		bits[i].resize(bytes);
+
+		if (sets[i] != 0 &&
+			Fits(cpu, sets[i], static_cast<uint32_t>(bytes)) == false)
+		{
+			cpu.GetRegister(R_A) = static_cast<Register>(result);
+			return true;
+		}
+
+		if (sets[i] != 0)
+			mc.ReadBlock(sets[i], bits[i].data(), bytes);
+	}
+
+	std::vector<pollfd> polled;
+	std::vector<uint32_t> handles;
+
+	for (uint32_t handle = 0; handle < count; ++handle)
+	{
+		short events = 0;
+		if (bits[0][handle / 8] & (1 << (handle % 8)))
+			events |= POLLIN;
+		if (bits[1][handle / 8] & (1 << (handle % 8)))
+			events |= POLLOUT;
+		if (bits[2][handle / 8] & (1 << (handle % 8)))
+			events |= POLLPRI;
+
+		if (events == 0)
+			continue;
+
+		int fd = Find(handle);
+		if (fd == -1)
+		{
+			cpu.GetRegister(R_A) = static_cast<Register>(result);
+			return true;
+		}
+
+		polled.push_back({ fd, events, 0 });
+		handles.push_back(handle);
+	}
+
+	if (poll(polled.data(), polled.size(), 0) == -1)
+	{
+		m_hasDeadline = false;
+		cpu.GetRegister(R_A) = static_cast<Register>(result);
+		return true;
+	}
+
+	result = 0;
+	for (int i = 0; i < 3; ++i)
+		std::fill(bits[i].begin(), bits[i].end(), 0);
+
+	for (size_t i = 0; i < polled.size(); ++i)
+	{
+		const uint32_t handle = handles[i];
+		const short ready = polled[i].revents;
+		const uint8_t bit = static_cast<uint8_t>(1 << (handle % 8));
+
+		// hang ups and errors are readable and writable, like select on the host
+		const bool set[3] =
+		{
+			(polled[i].events & POLLIN) && (ready & (POLLIN | POLLHUP | POLLERR)),
+			(polled[i].events & POLLOUT) && (ready & (POLLOUT | POLLHUP | POLLERR)),
+			(polled[i].events & POLLPRI) && (ready & POLLPRI)
+		};
+
+		for (int j = 0; j < 3; ++j)
+		{
+			if (set[j] == false)
+				continue;
+
+			bits[j][handle / 8] |= bit;
+			++result;
+		}
+	}
+
+	bool expired = false;
+	if (result == 0 &&
+		timeout != 0 &&
+		Fits(cpu, timeout, 2 * sizeof(uint32_t)))
+	{
+		auto now = std::chrono::steady_clock::now();
+
+		// { seconds, microseconds }, only counted from the first time round
+		if (m_hasDeadline == false)
+		{
+			m_deadline = now +
+				std::chrono::seconds(static_cast<int32_t>(mc.Read32(timeout))) +
+				std::chrono::microseconds(static_cast<int32_t>(mc.Read32(timeout + 4)));
+			m_hasDeadline = true;
+		}
+
+		expired = now >= m_deadline;
+	}
+
+	// nothing is ready and there is time left to wait for it
+	if (result == 0 &&
+		expired == false &&
+		(timeout == 0 || m_hasDeadline == true))
+	{
+		for (const pollfd& entry : polled)
+		{
+			uint32_t events = 0;
+			if (entry.events & (POLLIN | POLLPRI))
+				events |= SE_READ;
+			if (entry.events & POLLOUT)
+				events |= SE_WRITE;
+
+			m_wait.push_back({ entry.fd, events });
+		}
+		return false;
+	}
+
+	m_hasDeadline = false;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		if (sets[i] != 0)
+			cpu.WriteInput(sets[i], bits[i].data(), bytes);
+	}
+#endif
+
+	cpu.GetRegister(R_A) = static_cast<Register>(result);
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include <VM/ThreadGroup.h>
+
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::ThreadGroup;
+
+ThreadGroup::ThreadGroup(Scheduler& scheduler, const size_t maxThreads) :
+	m_scheduler(scheduler),
+	m_maxThreads(maxThreads),
+	m_running(0),
+	m_stats()
+{
+}
+
+void ThreadGroup::Start(CPU* pCPU)
+{
+	if (pCPU->m_memory.GetMemoryMode() != MM_FLAT)
+		throw std::runtime_error("Threads need MM_FLAT memory");
+	if (pCPU->m_pTraceWriter != nullptr ||
+		pCPU->m_pTraceReader != nullptr)
+		throw std::runtime_error("A CPU that traces can not run threads");
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	if (m_threads.empty() == false)
+		throw std::runtime_error("Thread group has already started");
+
+	pCPU->m_pThreadGroup = this;
+	pCPU->m_threadId = 0;
+	m_threads.push_back({ nullptr, pCPU, 0, false, false, 0, {} });
+	++m_running;
+
+	// the scheduler never calls back into the group with its own locks held, so it is added under ours
+	m_threads.back().m_schedulerId = m_scheduler.Add(pCPU);
+}
+
+void ThreadGroup::Wait()
+{
+	std::vector<size_t> ids;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_finishedCondition.wait(lock, [this] { return m_running == 0; });
+
+		for (const Thread& thread : m_threads)
+			ids.push_back(thread.m_schedulerId);
+	}
+
+	// a thread finishes inside of Run, a little before the scheduler is done with its CPU
+	for (size_t id : ids)
+		m_scheduler.Wait(id);
+}
+
+void ThreadGroup::Wait(const uint32_t id)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	if (id >= m_threads.size())
+		throw std::runtime_error("Waited for a thread that was never spawned");
+
+	m_finishedCondition.wait(lock, [this, id] { return m_threads[id].m_finished == true; });
+}
+
+size_t ThreadGroup::GetThreadCount() const
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	return m_threads.size();
+}
+
+CPU* ThreadGroup::GetThread(const uint32_t id) const
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	return m_threads.at(id).m_pCPU;
+}
+
+ThreadGroup::Stats ThreadGroup::GetStats() const
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	return m_stats;
+}
+
+uint32_t ThreadGroup::Spawn(CPU& parent, const uint32_t entry, const uint32_t stack, const Register argument)
+{
+	// the place is taken up front, copying the parent's decoded code is left outside of the lock
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+
+		if (m_maxThreads != 0 &&
+			m_running >= m_maxThreads)
+		{
+			++m_stats.m_refused;
+			return UINT32_MAX;
+		}
+
+		++m_running;
+	}
+
+	std::unique_ptr<CPU> pCPU;
+	try
+	{
+		pCPU = parent.Spawn(entry, stack, argument);
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		--m_running;
+		throw;
+	}
+
+	CPU* pThread = pCPU.get();
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	uint32_t id = static_cast<uint32_t>(m_threads.size());
+	pThread->m_pThreadGroup = this;
+	pThread->m_threadId = id;
+
+	m_threads.push_back({ std::move(pCPU), pThread, 0, false, false, 0, {} });
+	++m_stats.m_spawned;
+
+	// it is in the group before it runs, so it can finish and be joined whenever it likes
+	m_threads.back().m_schedulerId = m_scheduler.Add(pThread);
+
+	return id;
+}
+
+bool ThreadGroup::Join(const CPU& cpu, const uint32_t id, Register& result)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	if (id >= m_threads.size())
+		throw std::runtime_error("Joined a thread that was never spawned");
+	if (id == cpu.m_threadId)
+		throw std::runtime_error("A thread can not join itself");
+
+	Thread& thread = m_threads[id];
+	if (thread.m_faulted == true)
+		throw std::runtime_error("Joined a thread that faulted");
+
+	// rather than trying again every quantum, it sits out until Finish resumes it
+	if (thread.m_finished == false)
+	{
+		thread.m_joiners.push_back(cpu.m_threadId);
+		m_scheduler.Park(m_threads[cpu.m_threadId].m_schedulerId);
+
+		return false;
+	}
+
+	result = thread.m_result;
+	++m_stats.m_joins;
+
+	return true;
+}
+
+void ThreadGroup::Finish(const uint32_t id, const Register result, const bool faulted)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	Thread& thread = m_threads[id];
+	if (thread.m_finished == true)
+		return;
+
+	thread.m_finished = true;
+	thread.m_faulted = faulted;
+	thread.m_result = result;
+
+	--m_running;
+	if (faulted == true)
+		++m_stats.m_faulted;
+
+	// a fault is passed on to them when they try the TC_JOIN again
+	for (uint32_t joiner : thread.m_joiners)
+		m_scheduler.Resume(m_threads[joiner].m_schedulerId);
+	thread.m_joiners.clear();
+
+	// under the lock, as a waiter may destroy the group as soon as it sees this
+	m_finishedCondition.notify_all();
+}
\ No newline at end of file
@@ -0,0 +1,310 @@
+#include <VM/Trace.h>
+
+#include <cstring>
+#include <stdexcept>
+
+using Blacklight::VM::TraceReader;
+using Blacklight::VM::TraceWriter;
+
+namespace
+{
+	// a trace starts with "BLVT", a u32 version and the u64 block size, then every event as
+	// its TraceEventE followed by:
+	//	TE_IMAGE	u32 stack size, u32 origin, varint size, the code
+	//	TE_INPUT	varint address, varint size, the bytes
+	//	TE_START	varint of each register
+	//	TE_RESULT	signed varint address from the last result, varint mask of the registers that
+	//				changed, signed varint of how much each changed by, u8 finished
+	constexpr char MAGIC[4] = { 'B', 'L', 'V', 'T' };
+	constexpr uint32_t VERSION = 1;
+}
+
+TraceWriter::TraceWriter(const char* path, const size_t blockSize) :
+	m_out(path, std::ios_base::binary),
+	m_lastAddress(0),
+	m_closing(false),
+	m_failed(false)
+{
+	if (m_out.is_open() == false)
+		throw std::runtime_error("Could not create trace");
+
+	PutBytes(reinterpret_cast<const uint8_t*>(MAGIC), sizeof(MAGIC));
+	for (size_t i = 0; i < sizeof(VERSION); ++i)
+		Put(static_cast<uint8_t>(VERSION >> (i * 8)));
+	for (size_t i = 0; i < sizeof(uint64_t); ++i)
+		Put(static_cast<uint8_t>(static_cast<uint64_t>(blockSize) >> (i * 8)));
+
+	m_thread = std::thread(&TraceWriter::WriterMain, this);
+}
+
+void TraceWriter::WriteImage(const uint32_t stackSize, const uint32_t origin, const uint8_t* pCode, const size_t size)
+{
+	Put(TE_IMAGE);
+	for (size_t i = 0; i < sizeof(stackSize); ++i)
+		Put(static_cast<uint8_t>(stackSize >> (i * 8)));
+	for (size_t i = 0; i < sizeof(origin); ++i)
+		Put(static_cast<uint8_t>(origin >> (i * 8)));
+	PutVarint(size);
+	PutBytes(pCode, size);
+
+	Flush(false);
+}
+
+void TraceWriter::WriteInput(const uint32_t address, const uint8_t* pData, const size_t size)
+{
+	Put(TE_INPUT);
+	PutVarint(address);
+	PutVarint(size);
+	PutBytes(pData, size);
+
+	Flush(false);
+}
+
+void TraceWriter::WriteStart(const uint32_t* pRegisters)
+{
+	Put(TE_START);
+	for (size_t i = 0; i < R_COUNT; ++i)
+		PutVarint(pRegisters[i]);
+
+	Flush(false);
+}
+
+void TraceWriter::WriteResult(const uint32_t address, const uint32_t* pBefore, const uint32_t* pAfter, const bool finished)
+{
+	Put(TE_RESULT);
+	PutSigned(static_cast<int64_t>(address) - m_lastAddress);
+	m_lastAddress = address;
+
+	uint32_t changed = 0;
+	for (size_t i = 0; i < R_COUNT; ++i)
+	{
+		if (pBefore[i] != pAfter[i])
+			changed |= 1 << i;
+	}
+
+	PutVarint(changed);
+	for (size_t i = 0; i < R_COUNT; ++i)
+	{
+		if (changed & (1 << i))
+			PutSigned(static_cast<int32_t>(pAfter[i] - pBefore[i]));
+	}
+
+	Put(finished ? 1 : 0);
+
+	Flush(false);
+}
+
+void TraceWriter::Close()
+{
+	if (m_thread.joinable() == false)
+		return;
+
+	Put(TE_END);
+	Flush(true);
+
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		m_closing = true;
+	}
+	m_condition.notify_one();
+
+	m_thread.join();
+	m_out.close();
+
+	if (m_failed == true)
+		throw std::runtime_error("Could not write trace");
+}
+
+TraceWriter::~TraceWriter()
+{
+	try
+	{
+		Close();
+	}
+	catch (const std::exception&)
+	{
+	}
+}
+
+void TraceWriter::Put(const uint8_t data)
+{
+	m_buffer.push_back(data);
+}
+
+void TraceWriter::PutVarint(uint64_t data)
+{
+	// 7 bits at a time, lowest first, the top bit set on all but the last
+	while (data >= 0x80)
+	{
+		Put(static_cast<uint8_t>(data | 0x80));
+		data >>= 7;
+	}
+
+	Put(static_cast<uint8_t>(data));
+}
+
+void TraceWriter::PutSigned(const int64_t data)
+{
+	// zigzag, so small negative numbers stay small
+	PutVarint((static_cast<uint64_t>(data) << 1) ^ static_cast<uint64_t>(data >> 63));
+}
+
+void TraceWriter::PutBytes(const uint8_t* pData, const size_t size)
+{
+	m_buffer.insert(m_buffer.end(), pData, pData + size);
+}
+
+void TraceWriter::Flush(const bool force)
+{
+	if (m_buffer.size() < FLUSH_SIZE &&
+		force == false)
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+
+		m_pending.push_back(std::move(m_buffer));
+	}
+	m_condition.notify_one();
+
+	m_buffer.clear();
+	m_buffer.reserve(FLUSH_SIZE);
+}
+
+void TraceWriter::WriterMain()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	for (;;)
+	{
+		m_condition.wait(lock, [this] { return m_pending.empty() == false || m_closing == true; });
+
+		if (m_pending.empty() == true)
+			return;
+
+		std::vector<uint8_t> buffer = std::move(m_pending.front());
+		m_pending.pop_front();
+
+		// the guest keeps recording while this is written
+		lock.unlock();
+		m_out.write(reinterpret_cast<const char*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+		bool failed = m_out.good() == false;
+		lock.lock();
+
+		m_failed = m_failed || failed;
+	}
+}
+
+TraceReader::TraceReader(const char* path) :
+	m_in(path, std::ios_base::binary),
+	m_blockSize(0),
+	m_lastAddress(0)
+{
+	if (m_in.is_open() == false)
+		throw std::runtime_error("Could not open trace");
+
+	char magic[sizeof(MAGIC)];
+	m_in.read(magic, sizeof(magic));
+	if (m_in.good() == false ||
+		memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+		throw std::runtime_error("Not a trace");
+
+	uint32_t version = 0;
+	for (size_t i = 0; i < sizeof(version); ++i)
+		version |= static_cast<uint32_t>(Get()) << (i * 8);
+
+	if (version != VERSION)
+		throw std::runtime_error("Unsupported trace version");
+
+	uint64_t blockSize = 0;
+	for (size_t i = 0; i < sizeof(blockSize); ++i)
+		blockSize |= static_cast<uint64_t>(Get()) << (i * 8);
+
+	m_blockSize = static_cast<size_t>(blockSize);
+}
+
+size_t TraceReader::GetBlockSize() const
+{
+	return m_blockSize;
+}
+
+void TraceReader::Read(TraceEvent& event)
+{
+	event.m_kind = static_cast<TraceEventE>(Get());
+
+	switch (event.m_kind)
+	{
+	case TE_IMAGE:
+	{
+		event.m_stackSize = 0;
+		for (size_t i = 0; i < sizeof(event.m_stackSize); ++i)
+			event.m_stackSize |= static_cast<uint32_t>(Get()) << (i * 8);
+		event.m_origin = 0;
+		for (size_t i = 0; i < sizeof(event.m_origin); ++i)
+			event.m_origin |= static_cast<uint32_t>(Get()) << (i * 8);
+
+		event.m_data.resize(static_cast<size_t>(GetVarint()));
+		m_in.read(reinterpret_cast<char*>(event.m_data.data()), static_cast<std::streamsize>(event.m_data.size()));
+		break;
+	}
+	case TE_INPUT:
+		event.m_address = static_cast<uint32_t>(GetVarint());
+
+		event.m_data.resize(static_cast<size_t>(GetVarint()));
+		m_in.read(reinterpret_cast<char*>(event.m_data.data()), static_cast<std::streamsize>(event.m_data.size()));
+		break;
+	case TE_START:
+		for (size_t i = 0; i < R_COUNT; ++i)
+			event.m_registers[i] = static_cast<uint32_t>(GetVarint());
+		break;
+	case TE_RESULT:
+	{
+		m_lastAddress += static_cast<uint32_t>(GetSigned());
+		event.m_address = m_lastAddress;
+
+		uint64_t changed = GetVarint();
+		for (size_t i = 0; i < R_COUNT; ++i)
+			event.m_registers[i] = changed & (1 << i) ? static_cast<uint32_t>(GetSigned()) : 0;
+
+		event.m_finished = Get() != 0;
+		break;
+	}
+	case TE_END:
+		break;
+	default:
+		throw std::runtime_error("Corrupt trace");
+	}
+
+	if (m_in.good() == false)
+		throw std::runtime_error("Trace is cut short");
+}
+
+uint8_t TraceReader::Get()
+{
+	char data = 0;
+	m_in.get(data);
+
+	return static_cast<uint8_t>(data);
+}
+
+uint64_t TraceReader::GetVarint()
+{
+	uint64_t data = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		uint8_t part = Get();
+		data |= static_cast<uint64_t>(part & 0x7F) << shift;
+
+		if ((part & 0x80) == 0)
+			break;
+	}
+
+	return data;
+}
+
+int64_t TraceReader::GetSigned()
+{
+	uint64_t data = GetVarint();
+
+	return static_cast<int64_t>(data >> 1) ^ -static_cast<int64_t>(data & 1);
+}
\ No newline at end of file
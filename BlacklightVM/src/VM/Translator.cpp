@@ -0,0 +1,580 @@
+#include <VM/Translator.h>
+#include <VM/Arch.h>
+#include <VM/DecodeCache.h>
+#include <VM/Native.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+using Blacklight::VM::Translator;
+
+using namespace Blacklight::VM;
+
+namespace
+{
+	std::string Hex(const uint64_t value)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "0x%llX", static_cast<unsigned long long>(value));
+
+		return buf;
+	}
+
+	std::string Reg(const uint8_t reg)
+	{
+		return "r[" + std::to_string(reg) + "]";
+	}
+
+	std::string Label(const uint32_t address)
+	{
+		return "L_" + Hex(address).substr(2);
+	}
+
+	bool IsIdentifier(const std::string& name)
+	{
+		if (name.empty() == true ||
+			(name[0] >= '0' && name[0] <= '9'))
+			return false;
+
+		for (char c : name)
+		{
+			if ((c < 'a' || c > 'z') && (c < 'A' || c > 'Z') && (c < '0' || c > '9') && c != '_')
+				return false;
+		}
+
+		return true;
+	}
+
+	// Returns whether an instruction hands control somewhere other than the next one, or may
+	bool EndsBlock(const MicroOp& op)
+	{
+		switch (op.m_kind)
+		{
+		case UOP_BR_IMM:
+		case UOP_BR:
+		case UOP_JMP_IMM:
+		case UOP_JMP:
+		case UOP_CALL_IMM:
+		case UOP_CALL:
+		case UOP_RET:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Returns whether the translated code goes on to the next instruction, BR when it is not taken
+	bool FallsThrough(const MicroOp& op)
+	{
+		return op.m_kind != UOP_JMP_IMM &&
+			op.m_kind != UOP_JMP &&
+			op.m_kind != UOP_CALL_IMM &&
+			op.m_kind != UOP_CALL &&
+			op.m_kind != UOP_RET;
+	}
+
+	// Returns whether the translated code goes through the switch over the blocks, to an address in a register
+	bool Dispatches(const MicroOp& op)
+	{
+		return op.m_kind == UOP_BR ||
+			op.m_kind == UOP_JMP ||
+			op.m_kind == UOP_CALL ||
+			op.m_kind == UOP_RET;
+	}
+
+	bool HasTarget(const MicroOp& op)
+	{
+		return op.m_kind == UOP_BR_IMM ||
+			op.m_kind == UOP_JMP_IMM ||
+			op.m_kind == UOP_CALL_IMM;
+	}
+
+	bool IsStore(const MicroOp& op)
+	{
+		switch (op.m_kind)
+		{
+		case UOP_ST8_ABS:
+		case UOP_ST16_ABS:
+		case UOP_ST32_ABS:
+		case UOP_ST8:
+		case UOP_ST16:
+		case UOP_ST32:
+		case UOP_PUSH_IMM:
+		case UOP_PUSH:
+		case UOP_CALL_IMM:
+		case UOP_CALL:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// The code of an image, decoded
+	class Image
+	{
+	public:
+		Image(const uint8_t* pCode, const uint32_t origin, const size_t size) :
+			m_code(pCode, pCode + size),
+			m_origin(origin),
+			m_size(size),
+			m_ops(size),
+			m_reached(size, 0),
+			m_starts(size, 0),
+			m_blockLengths(size, 0)
+		{
+			// padded so that decoding the last few bytes never reads past them
+			m_code.resize(size + MemoryController::FETCH_SIZE, 0);
+
+			Decode();
+			FindBlocks();
+		}
+
+		// Returns whether an instruction at an offset is translated
+		bool IsTranslated(const size_t offset) const
+		{
+			return offset < m_size &&
+				m_reached[offset] != 0 &&
+				m_ops[offset].m_kind != UOP_INTERP;
+		}
+
+		std::string Translate(const std::string& name, Translator::Stats& stats) const
+		{
+			// the span of translated code, which is all the CPU watches while it runs it
+			size_t begin = m_size;
+			size_t end = 0;
+			bool dispatches = false;
+			for (size_t offset = 0; offset < m_size; ++offset)
+			{
+				if (m_reached[offset] == 0)
+					continue;
+
+				if (IsTranslated(offset) == false)
+				{
+					++stats.m_exits;
+					continue;
+				}
+
+				++stats.m_instructions;
+				if (m_starts[offset] != 0)
+					++stats.m_blocks;
+				dispatches |= Dispatches(m_ops[offset]);
+
+				begin = std::min(begin, offset);
+				end = std::max(end, offset + m_ops[offset].m_length);
+			}
+			if (begin > end)
+				begin = end = 0;
+
+			std::string out;
+			out += "// Translated ahead of time from a BlacklightVM image by the Translator, do not edit\n";
+			out += "#include <VM/CPU.h>\n";
+			out += "#include <VM/Native.h>\n\n";
+			out += "#include <cstring>\n\n";
+			out += "namespace\n{\n";
+			out += "\tvoid Run(Blacklight::VM::NativeContext& context)\n\t{\n";
+			out += "\t\tusing namespace Blacklight::VM;\n\n";
+			out += "\t\tMemoryController& mc = *context.m_pMemory;\n";
+			out += "\t\tuint64_t budget = context.m_budget;\n\n";
+			out += "\t\tuint32_t r[R_COUNT];\n";
+			out += "\t\tmemcpy(r, context.m_pRegisters, sizeof(r));\n\n";
+			out += "\t\tuint32_t prg = r[R_PRG];\n\n";
+			// the label would go unused without anything to jump to it, which compilers warn about
+			if (dispatches == true)
+				out += "\tL_DISPATCH:\n";
+			out += "\t\tswitch (prg)\n\t\t{\n";
+			for (size_t offset = 0; offset < m_size; ++offset)
+			{
+				if (m_starts[offset] != 0 && IsTranslated(offset) == true)
+					out += "\t\tcase " + Hex(m_origin + offset) + "u: goto " + Label(static_cast<uint32_t>(m_origin + offset)) + ";\n";
+			}
+			out += "\t\tdefault: goto L_EXIT;\n";
+			out += "\t\t}\n\n";
+
+			size_t position = 0;
+			for (size_t offset = 0; offset < m_size; ++offset)
+			{
+				if (IsTranslated(offset) == false)
+					continue;
+
+				const MicroOp& op = m_ops[offset];
+				uint32_t address = static_cast<uint32_t>(m_origin + offset);
+				uint32_t next = address + op.m_length;
+
+				if (m_starts[offset] != 0)
+				{
+					position = 0;
+
+					std::string length = std::to_string(m_blockLengths[offset]);
+					out += "\t" + Label(address) + ":\n";
+					out += "\t\tif (budget < " + length + ")\n";
+					out += "\t\t{\n\t\t\tprg = " + Hex(address) + "u;\n\t\t\tgoto L_EXIT;\n\t\t}\n";
+					out += "\t\tbudget -= " + length + ";\n";
+				}
+
+				++position;
+				size_t remaining = m_blockLengths[BlockOf(offset)] - position;
+
+				out += Instruction(op, address, remaining);
+
+				if (FallsThrough(op) == true &&
+					NextTranslated(offset) != next - m_origin)
+					out += "\t\t" + Goto(next) + "\n";
+			}
+
+			out += "\tL_EXIT:\n";
+			out += "\t\tr[R_PRG] = prg;\n";
+			out += "\t\tmemcpy(context.m_pRegisters, r, sizeof(r));\n";
+			out += "\t\tcontext.m_budget = budget;\n";
+			out += "\t\t(void)mc;\n";
+			out += "\t}\n}\n\n";
+
+			uint64_t hash = HashNativeCode(m_code.data() + begin, end - begin);
+			out += "extern const Blacklight::VM::NativeImage " + name + " =\n{\n";
+			out += "\t" + Hex(m_origin + begin) + "u, " + Hex(end - begin) + "u, " + Hex(hash) + "ull, Run\n";
+			out += "};\n";
+
+			return out;
+		}
+	private:
+		// Decodes everything reached from the origin or along the linear sweep, marking where blocks start
+		void Decode()
+		{
+			if (m_size == 0)
+				return;
+
+			std::vector<size_t> pending;
+			for (size_t offset = 0; offset < m_size; offset += DecodeCache::Decode(&m_code[offset], static_cast<uint32_t>(m_origin + offset), m_size - offset).m_length)
+				pending.push_back(offset);
+
+			m_starts[0] = 1;
+
+			while (pending.empty() == false)
+			{
+				size_t offset = pending.back();
+				pending.pop_back();
+
+				if (m_reached[offset] != 0)
+					continue;
+				m_reached[offset] = 1;
+
+				const MicroOp op = DecodeCache::Decode(&m_code[offset], static_cast<uint32_t>(m_origin + offset), m_size - offset);
+				m_ops[offset] = op;
+
+				size_t next = offset + op.m_length;
+				bool halts = op.m_kind == UOP_INTERP &&
+					((m_code[offset] >> 4) & 0xF) == OP_TRAP &&
+					(m_code[offset] & 0x8) == 0 &&
+					m_code[offset + 1] == TC_HALT;
+
+				// the instruction after anything that leaves the block is where it comes back, if anywhere
+				if ((op.m_kind == UOP_INTERP || EndsBlock(op) == true) &&
+					next < m_size)
+					m_starts[next] = 1;
+
+				if (op.m_kind != UOP_JMP_IMM && op.m_kind != UOP_JMP && op.m_kind != UOP_RET &&
+					halts == false &&
+					next < m_size)
+					pending.push_back(next);
+
+				if (HasTarget(op) == true &&
+					op.m_imm - m_origin < m_size)
+				{
+					m_starts[op.m_imm - m_origin] = 1;
+					pending.push_back(op.m_imm - m_origin);
+				}
+			}
+		}
+
+		// Returns the next translated instruction after an offset, m_size if there is none
+		size_t NextTranslated(const size_t offset) const
+		{
+			for (size_t next = offset + 1; next < m_size; ++next)
+			{
+				if (IsTranslated(next) == true)
+					return next;
+			}
+
+			return m_size;
+		}
+
+		// Returns the start of the block an instruction is in
+		size_t BlockOf(size_t offset) const
+		{
+			while (m_starts[offset] == 0)
+				offset = m_previous[offset];
+
+			return offset;
+		}
+
+		// Starts a block wherever the instruction laid out before does not fall into it, then counts each block
+		void FindBlocks()
+		{
+			m_previous.assign(m_size, 0);
+
+			size_t previous = m_size;
+			for (size_t offset = 0; offset < m_size; ++offset)
+			{
+				if (IsTranslated(offset) == false)
+					continue;
+
+				const MicroOp& op = m_ops[offset];
+				if (FallsThrough(op) == true)
+				{
+					size_t next = offset + op.m_length;
+					if (IsTranslated(next) == true &&
+						NextTranslated(offset) != next)
+						m_starts[next] = 1;
+				}
+
+				if (previous == m_size ||
+					FallsThrough(m_ops[previous]) == false ||
+					EndsBlock(m_ops[previous]) == true ||
+					previous + m_ops[previous].m_length != offset)
+					m_starts[offset] = 1;
+
+				m_previous[offset] = previous;
+				previous = offset;
+			}
+
+			size_t start = m_size;
+			for (size_t offset = 0; offset < m_size; ++offset)
+			{
+				if (IsTranslated(offset) == false)
+					continue;
+
+				if (m_starts[offset] != 0)
+					start = offset;
+
+				++m_blockLengths[start];
+			}
+		}
+
+		// Returns the statement that carries on at an address, inside the translated code or back in the CPU
+		std::string Goto(const uint32_t address) const
+		{
+			size_t offset = address - m_origin;
+			if (IsTranslated(offset) == true)
+				return "goto " + Label(address) + ";";
+
+			return "{ prg = " + Hex(address) + "u; goto L_EXIT; }";
+		}
+
+		// Returns the C++ for an instruction, remaining being how many instructions of its block come after it
+		std::string Instruction(const MicroOp& op, const uint32_t address, const size_t remaining) const
+		{
+			std::string dst = Reg(op.m_dst);
+			std::string src = Reg(op.m_src);
+			std::string imm = Hex(op.m_imm) + "u";
+			std::string ret = Hex(address + op.m_length) + "u";
+
+			std::string out;
+			switch (op.m_kind)
+			{
+			case UOP_NOP:
+				break;
+			case UOP_LD8_ABS:
+				out = dst + " = mc.Read8(" + imm + ");";
+				break;
+			case UOP_LD16_ABS:
+				out = dst + " = mc.Read16(" + imm + ");";
+				break;
+			case UOP_LD32_ABS:
+				out = dst + " = mc.Read32(" + imm + ");";
+				break;
+			case UOP_LD8:
+				out = dst + " = mc.Read8(" + src + ");";
+				break;
+			case UOP_LD16:
+				out = dst + " = mc.Read16(" + src + ");";
+				break;
+			case UOP_LD32:
+				out = dst + " = mc.Read32(" + src + ");";
+				break;
+			case UOP_LDV_IMM:
+				out = dst + " = " + imm + ";";
+				break;
+			case UOP_LDV8:
+				out = dst + " = static_cast<uint8_t>(" + src + ");";
+				break;
+			case UOP_LDV16:
+				out = dst + " = static_cast<uint16_t>(" + src + ");";
+				break;
+			case UOP_LDV32:
+				out = dst + " = " + src + ";";
+				break;
+			case UOP_ST8_ABS:
+				out = "mc.Write8(" + imm + ", static_cast<uint8_t>(" + src + "));";
+				break;
+			case UOP_ST16_ABS:
+				out = "mc.Write16(" + imm + ", static_cast<uint16_t>(" + src + "));";
+				break;
+			case UOP_ST32_ABS:
+				out = "mc.Write32(" + imm + ", " + src + ");";
+				break;
+			case UOP_ST8:
+				out = "mc.Write8(" + dst + ", static_cast<uint8_t>(" + src + "));";
+				break;
+			case UOP_ST16:
+				out = "mc.Write16(" + dst + ", static_cast<uint16_t>(" + src + "));";
+				break;
+			case UOP_ST32:
+				out = "mc.Write32(" + dst + ", " + src + ");";
+				break;
+			case UOP_PUSH_IMM:
+				out = "r[R_SF] -= 4; mc.Write32(r[R_SF], " + imm + ");";
+				break;
+			case UOP_PUSH:
+				out = "r[R_SF] -= 4; mc.Write32(r[R_SF], " + src + ");";
+				break;
+			case UOP_POP:
+				out = dst + " = mc.Read32(r[R_SF]); r[R_SF] += 4;";
+				break;
+			case UOP_ADD_IMM:
+				out = dst + " += " + imm + ";";
+				break;
+			case UOP_ADD8:
+				out = dst + " += static_cast<int8_t>(" + src + ");";
+				break;
+			case UOP_ADD16:
+				out = dst + " += static_cast<int16_t>(" + src + ");";
+				break;
+			case UOP_ADD32:
+				out = dst + " += " + src + ";";
+				break;
+			case UOP_SUB_IMM:
+				out = dst + " -= " + imm + ";";
+				break;
+			case UOP_SUB8:
+				out = dst + " -= static_cast<int8_t>(" + src + ");";
+				break;
+			case UOP_SUB16:
+				out = dst + " -= static_cast<int16_t>(" + src + ");";
+				break;
+			case UOP_SUB32:
+				out = dst + " -= " + src + ";";
+				break;
+			case UOP_AND_IMM:
+				out = dst + " &= " + imm + ";";
+				break;
+			case UOP_AND8:
+				out = dst + " &= static_cast<uint8_t>(" + src + ");";
+				break;
+			case UOP_AND16:
+				out = dst + " &= static_cast<uint16_t>(" + src + ");";
+				break;
+			case UOP_AND32:
+				out = dst + " &= " + src + ";";
+				break;
+			case UOP_NOT:
+				out = dst + " = ~" + dst + ";";
+				break;
+			case UOP_CMP_IMM:
+			case UOP_CMP8:
+			case UOP_CMP16:
+			case UOP_CMP32:
+			{
+				// the flags are cleared before either side is read, as CPU::Compare does
+				std::string value = imm;
+				if (op.m_kind == UOP_CMP8)
+					value = "static_cast<uint8_t>(" + src + ")";
+				else if (op.m_kind == UOP_CMP16)
+					value = "static_cast<uint16_t>(" + src + ")";
+				else if (op.m_kind == UOP_CMP32)
+					value = src;
+
+				out = "{ r[R_CND] &= ~(F_P | F_E | F_N); uint32_t d = " + dst + "; uint32_t s = " + value +
+					"; r[R_CND] |= s > d ? F_P : (s == d ? F_E : F_N); }";
+				break;
+			}
+			case UOP_BR_IMM:
+				out = "if (r[R_CND] & " + std::to_string(op.m_dst) + ") " + Goto(op.m_imm);
+				break;
+			case UOP_BR:
+				out = "if (r[R_CND] & " + std::to_string(op.m_dst) + ") { prg = " + src + "; goto L_DISPATCH; }";
+				break;
+			case UOP_JMP_IMM:
+				out = Goto(op.m_imm);
+				break;
+			case UOP_JMP:
+				out = "prg = " + src + "; goto L_DISPATCH;";
+				break;
+			case UOP_CALL_IMM:
+				out = "r[R_SF] -= 4; mc.Write32(r[R_SF], " + ret + "); prg = " + imm + ";";
+				break;
+			case UOP_CALL:
+				out = "r[R_SF] -= 4; mc.Write32(r[R_SF], " + ret + "); prg = " + src + ";";
+				break;
+			case UOP_RET:
+				out = "prg = mc.Read32(r[R_SF]); r[R_SF] += 4; goto L_DISPATCH;";
+				break;
+			default:
+				throw std::runtime_error("Can not translate the instruction at " + Hex(address));
+			}
+
+			std::string lines = "\t\t" + out + "\n";
+
+			// a store that wrote over the translated code leaves the rest to the CPU, which stops running it
+			if (IsStore(op) == true)
+			{
+				lines += "\t\tif (mc.HasCodeWrite() == true)\n";
+				lines += "\t\t{\n";
+				if (remaining != 0)
+					lines += "\t\t\tbudget += " + std::to_string(remaining) + ";\n";
+				// CALL has already set prg to where it goes
+				if (op.m_kind != UOP_CALL_IMM && op.m_kind != UOP_CALL)
+					lines += "\t\t\tprg = " + Hex(address + op.m_length) + "u;\n";
+				lines += "\t\t\tgoto L_EXIT;\n";
+				lines += "\t\t}\n";
+			}
+
+			if (op.m_kind == UOP_CALL_IMM)
+				lines += "\t\t" + Goto(op.m_imm) + "\n";
+			else if (op.m_kind == UOP_CALL)
+				lines += "\t\tgoto L_DISPATCH;\n";
+
+			return lines;
+		}
+
+		std::vector<uint8_t> m_code;
+		uint32_t m_origin;
+		size_t m_size;
+
+		std::vector<MicroOp> m_ops;
+		std::vector<uint8_t> m_reached;
+		std::vector<uint8_t> m_starts;
+		// instructions in the block starting at each offset
+		std::vector<size_t> m_blockLengths;
+		// the translated instruction laid out before each one
+		std::vector<size_t> m_previous;
+	};
+}
+
+Translator::Translator() :
+	m_stats()
+{
+}
+
+std::string Translator::Translate(const uint8_t* pImage, const size_t size, const std::string& name)
+{
+	if (size < 8)
+		throw std::runtime_error("Image is too short for its header");
+	if (IsIdentifier(name) == false)
+		throw std::runtime_error("Not an identifier: " + name);
+
+	m_stats = {};
+
+	uint32_t origin;
+	memcpy(&origin, pImage + 4, sizeof(origin));
+
+	Image image(pImage + 8, origin, size - 8);
+
+	return image.Translate(name, m_stats);
+}
+
+const Translator::Stats& Translator::GetStats() const
+{
+	return m_stats;
+}
\ No newline at end of file
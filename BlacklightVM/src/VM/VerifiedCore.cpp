@@ -0,0 +1,397 @@
+#include <VM/CPU.h>
+
+#include <cstring>
+
+using Blacklight::VM::CPU;
+using Blacklight::VM::MicroOp;
+using Blacklight::VM::Register;
+
+// GCC and Clang can jump straight from one handler to the next, everything else uses a switch
+#ifndef BLACKLIGHT_VM_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define BLACKLIGHT_VM_COMPUTED_GOTO 1
+#else
+#define BLACKLIGHT_VM_COMPUTED_GOTO 0
+#endif
+#endif
+
+// the slot for the program counter. Proven code only goes on to proven instructions, so
+// it is inside of the image and decoded, or thrown away since and UOP_UNDECODED
+#define VM_KIND() ((pOp = &ops[prg - begin])->m_kind)
+// the slot for a program counter that came from a register or the instruction table,
+// or UOP_COUNT when no proven instruction starts there
+#define VM_CHECKED_KIND() (prg - begin < count && verified[prg - begin] != 0 ? VM_KIND() : UOP_COUNT)
+
+#if BLACKLIGHT_VM_COMPUTED_GOTO
+#define VM_OP(kind) L_##kind:
+#define VM_DISPATCH() goto *s_handlers[VM_KIND()]
+#define VM_DISPATCH_CHECKED() goto *s_handlers[VM_CHECKED_KIND()]
+#else
+#define VM_OP(kind) case kind:
+#define VM_DISPATCH() { checked = false; continue; }
+#define VM_DISPATCH_CHECKED() { checked = true; continue; }
+#endif
+
+// retires an instruction, then moves on to the next one unless the budget ran out
+#define VM_NEXT() { if (--budget == 0) goto L_EXIT; VM_DISPATCH(); }
+#define VM_NEXT_CHECKED() { if (--budget == 0) goto L_EXIT; VM_DISPATCH_CHECKED(); }
+// a store through a register may have landed on code, which is no longer proven
+#define VM_NEXT_STORE() { if (m_memory.HasCodeWrite() == true) { InvalidateCodeWrite(); VM_NEXT_CHECKED(); } VM_NEXT(); }
+
+uint64_t CPU::RunVerified(const uint64_t maxInstructions)
+{
+	if (m_finished == true ||
+		maxInstructions == 0)
+		return 0;
+
+	uint64_t budget = maxInstructions;
+
+	// the register file and program counter live in locals while the core runs,
+	// and are only written back for whatever goes through the instruction table
+	Register r[R_COUNT];
+	memcpy(r, m_registers, sizeof(r));
+
+	Register prg = r[R_PRG];
+
+	uint32_t begin = m_decodeCache.GetAddress();
+	uint32_t count = static_cast<uint32_t>(m_decodeCache.GetSize());
+	const MicroOp* ops = m_decodeCache.GetOps();
+	const uint8_t* verified = m_verifier.GetMap();
+	const MicroOp* pOp = nullptr;
+
+	FusionStats& fusionStats = m_decodeCache.GetFusionStats();
+
+#if BLACKLIGHT_VM_COMPUTED_GOTO
+	// must stay in the order of MicroOpE, followed by the slot for code that is not proven
+	static void* const s_handlers[UOP_COUNT + 1] =
+	{
+		&&L_UOP_UNDECODED, &&L_UOP_INTERP, &&L_UOP_NOP,
+		&&L_UOP_LD8_ABS, &&L_UOP_LD16_ABS, &&L_UOP_LD32_ABS,
+		&&L_UOP_LD8, &&L_UOP_LD16, &&L_UOP_LD32,
+		&&L_UOP_LDV_IMM, &&L_UOP_LDV8, &&L_UOP_LDV16, &&L_UOP_LDV32,
+		&&L_UOP_ST8_ABS, &&L_UOP_ST16_ABS, &&L_UOP_ST32_ABS,
+		&&L_UOP_ST8, &&L_UOP_ST16, &&L_UOP_ST32,
+		&&L_UOP_PUSH_IMM, &&L_UOP_PUSH, &&L_UOP_POP,
+		&&L_UOP_ADD_IMM, &&L_UOP_ADD8, &&L_UOP_ADD16, &&L_UOP_ADD32,
+		&&L_UOP_SUB_IMM, &&L_UOP_SUB8, &&L_UOP_SUB16, &&L_UOP_SUB32,
+		&&L_UOP_AND_IMM, &&L_UOP_AND8, &&L_UOP_AND16, &&L_UOP_AND32,
+		&&L_UOP_NOT,
+		&&L_UOP_CMP_IMM, &&L_UOP_CMP8, &&L_UOP_CMP16, &&L_UOP_CMP32,
+		&&L_UOP_BR_IMM, &&L_UOP_BR,
+		&&L_UOP_JMP_IMM, &&L_UOP_JMP,
+		&&L_UOP_CALL_IMM, &&L_UOP_CALL,
+		&&L_UOP_RET,
+		&&L_UOP_CMP_IMM_BR, &&L_UOP_CMP8_BR, &&L_UOP_CMP16_BR, &&L_UOP_CMP32_BR,
+		&&L_UOP_LDV_ADD, &&L_UOP_LDV_SUB,
+		&&L_UOP_PUSH_IMM_CALL, &&L_UOP_PUSH_CALL,
+		&&L_UOP_COUNT
+	};
+	static_assert(UOP_PUSH_CALL + 1 == UOP_COUNT, "s_handlers is out of date");
+
+	VM_DISPATCH_CHECKED();
+#else
+	// the switch needs to know which way it got here
+	bool checked = true;
+
+	for (;;)
+	{
+		switch (checked == true ? VM_CHECKED_KIND() : VM_KIND())
+		{
+#endif
+	VM_OP(UOP_UNDECODED)
+	VM_OP(UOP_INTERP)
+	VM_OP(UOP_COUNT)
+	{
+		// everything that is not proven, along with CX and TRAP, goes through the instruction table
+		r[R_PRG] = prg;
+		memcpy(m_registers, r, sizeof(r));
+
+		uint8_t opcode = m_memory.Read8(prg);
+		unsigned char inst = (opcode >> 4) & 0xF;
+
+		m_instructions[inst](this, opcode);
+
+		SyncDecodeCache();
+
+		memcpy(r, m_registers, sizeof(r));
+		prg = r[R_PRG];
+
+		if (m_finished == true)
+		{
+			--budget;
+			goto L_EXIT;
+		}
+
+		// host code may have loaded another image
+		begin = m_decodeCache.GetAddress();
+		count = static_cast<uint32_t>(m_decodeCache.GetSize());
+		ops = m_decodeCache.GetOps();
+		verified = m_verifier.GetMap();
+		VM_NEXT_CHECKED();
+	}
+	VM_OP(UOP_NOP)
+		prg += pOp->m_length;
+		VM_NEXT();
+	VM_OP(UOP_LD8_ABS)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = m_memory.Read8(pOp->m_imm);
+		VM_NEXT();
+	VM_OP(UOP_LD16_ABS)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = m_memory.Read16(pOp->m_imm);
+		VM_NEXT();
+	VM_OP(UOP_LD32_ABS)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = m_memory.Read32(pOp->m_imm);
+		VM_NEXT();
+	VM_OP(UOP_LD8)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = m_memory.Read8(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_LD16)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = m_memory.Read16(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_LD32)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = m_memory.Read32(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_LDV_IMM)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = pOp->m_imm;
+		VM_NEXT();
+	VM_OP(UOP_LDV8)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = static_cast<uint8_t>(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_LDV16)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = static_cast<uint16_t>(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_LDV32)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = r[pOp->m_src];
+		VM_NEXT();
+	// stores to a fixed address were proven to stay out of the code
+	VM_OP(UOP_ST8_ABS)
+		prg += pOp->m_length;
+		m_memory.Write8(pOp->m_imm, r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_ST16_ABS)
+		prg += pOp->m_length;
+		m_memory.Write16(pOp->m_imm, r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_ST32_ABS)
+		prg += pOp->m_length;
+		m_memory.Write32(pOp->m_imm, r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_ST8)
+		prg += pOp->m_length;
+		m_memory.Write8(r[pOp->m_dst], r[pOp->m_src]);
+		VM_NEXT_STORE();
+	VM_OP(UOP_ST16)
+		prg += pOp->m_length;
+		m_memory.Write16(r[pOp->m_dst], r[pOp->m_src]);
+		VM_NEXT_STORE();
+	VM_OP(UOP_ST32)
+		prg += pOp->m_length;
+		m_memory.Write32(r[pOp->m_dst], r[pOp->m_src]);
+		VM_NEXT_STORE();
+	VM_OP(UOP_PUSH_IMM)
+		r[R_SF] -= sizeof(int);
+		prg += pOp->m_length;
+		m_memory.Write32(r[R_SF], pOp->m_imm);
+		VM_NEXT_STORE();
+	VM_OP(UOP_PUSH)
+		r[R_SF] -= sizeof(int);
+		prg += pOp->m_length;
+		m_memory.Write32(r[R_SF], r[pOp->m_src]);
+		VM_NEXT_STORE();
+	VM_OP(UOP_POP)
+		r[pOp->m_dst] = m_memory.Read32(r[R_SF]);
+		r[R_SF] += sizeof(int);
+		prg += pOp->m_length;
+		VM_NEXT();
+	VM_OP(UOP_ADD_IMM)
+		prg += pOp->m_length;
+		r[pOp->m_dst] += pOp->m_imm;
+		VM_NEXT();
+	VM_OP(UOP_ADD8)
+		prg += pOp->m_length;
+		r[pOp->m_dst] += static_cast<int8_t>(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_ADD16)
+		prg += pOp->m_length;
+		r[pOp->m_dst] += static_cast<int16_t>(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_ADD32)
+		prg += pOp->m_length;
+		r[pOp->m_dst] += r[pOp->m_src];
+		VM_NEXT();
+	VM_OP(UOP_SUB_IMM)
+		prg += pOp->m_length;
+		r[pOp->m_dst] -= pOp->m_imm;
+		VM_NEXT();
+	VM_OP(UOP_SUB8)
+		prg += pOp->m_length;
+		r[pOp->m_dst] -= static_cast<int8_t>(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_SUB16)
+		prg += pOp->m_length;
+		r[pOp->m_dst] -= static_cast<int16_t>(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_SUB32)
+		prg += pOp->m_length;
+		r[pOp->m_dst] -= r[pOp->m_src];
+		VM_NEXT();
+	VM_OP(UOP_AND_IMM)
+		prg += pOp->m_length;
+		r[pOp->m_dst] &= pOp->m_imm;
+		VM_NEXT();
+	VM_OP(UOP_AND8)
+		prg += pOp->m_length;
+		r[pOp->m_dst] &= static_cast<uint8_t>(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_AND16)
+		prg += pOp->m_length;
+		r[pOp->m_dst] &= static_cast<uint16_t>(r[pOp->m_src]);
+		VM_NEXT();
+	VM_OP(UOP_AND32)
+		prg += pOp->m_length;
+		r[pOp->m_dst] &= r[pOp->m_src];
+		VM_NEXT();
+	VM_OP(UOP_NOT)
+		prg += pOp->m_length;
+		r[pOp->m_dst] = ~r[pOp->m_dst];
+		VM_NEXT();
+	VM_OP(UOP_CMP_IMM)
+	VM_OP(UOP_CMP8)
+	VM_OP(UOP_CMP16)
+	VM_OP(UOP_CMP32)
+		Compare(r, *pOp, pOp->m_kind - UOP_CMP_IMM);
+		prg += pOp->m_length;
+		VM_NEXT();
+	VM_OP(UOP_BR_IMM)
+		prg = (r[R_CND] & pOp->m_dst) ? pOp->m_imm : prg + pOp->m_length;
+		VM_NEXT();
+	VM_OP(UOP_BR)
+		if (r[R_CND] & pOp->m_dst)
+		{
+			prg = r[pOp->m_src];
+			VM_NEXT_CHECKED();
+		}
+		prg += pOp->m_length;
+		VM_NEXT();
+	VM_OP(UOP_JMP_IMM)
+		prg = pOp->m_imm;
+		VM_NEXT();
+	VM_OP(UOP_JMP)
+		prg = r[pOp->m_src];
+		VM_NEXT_CHECKED();
+	VM_OP(UOP_CALL_IMM)
+		r[R_SF] -= sizeof(int);
+		m_memory.Write32(r[R_SF], prg + pOp->m_length);
+		prg = pOp->m_imm;
+		VM_NEXT_STORE();
+	VM_OP(UOP_CALL)
+		r[R_SF] -= sizeof(int);
+		m_memory.Write32(r[R_SF], prg + pOp->m_length);
+		prg = r[pOp->m_src];
+		SyncDecodeCache();
+		VM_NEXT_CHECKED();
+	VM_OP(UOP_RET)
+		prg = m_memory.Read32(r[R_SF]);
+		r[R_SF] += sizeof(int);
+		VM_NEXT_CHECKED();
+	VM_OP(UOP_CMP_IMM_BR)
+	VM_OP(UOP_CMP8_BR)
+	VM_OP(UOP_CMP16_BR)
+	VM_OP(UOP_CMP32_BR)
+	{
+		const MicroOp& br = pOp[pOp->m_length];
+
+		Compare(r, *pOp, pOp->m_kind - UOP_CMP_IMM_BR);
+		prg += pOp->m_length;
+
+		// the BR does not fit in the budget
+		if (budget == 1)
+			VM_NEXT();
+
+		prg = (r[R_CND] & br.m_dst) ? br.m_imm : prg + br.m_length;
+
+		++fusionStats.m_executed[FUSION_CMP_BR];
+		--budget;
+		VM_NEXT();
+	}
+	VM_OP(UOP_LDV_ADD)
+	{
+		const MicroOp& alu = pOp[pOp->m_length];
+
+		prg += pOp->m_length;
+		r[pOp->m_dst] = pOp->m_imm;
+
+		if (budget == 1)
+			VM_NEXT();
+
+		prg += alu.m_length;
+		r[alu.m_dst] += r[alu.m_src];
+
+		++fusionStats.m_executed[FUSION_LDV_ALU];
+		--budget;
+		VM_NEXT();
+	}
+	VM_OP(UOP_LDV_SUB)
+	{
+		const MicroOp& alu = pOp[pOp->m_length];
+
+		prg += pOp->m_length;
+		r[pOp->m_dst] = pOp->m_imm;
+
+		if (budget == 1)
+			VM_NEXT();
+
+		prg += alu.m_length;
+		r[alu.m_dst] -= r[alu.m_src];
+
+		++fusionStats.m_executed[FUSION_LDV_ALU];
+		--budget;
+		VM_NEXT();
+	}
+	VM_OP(UOP_PUSH_IMM_CALL)
+	VM_OP(UOP_PUSH_CALL)
+	{
+		const MicroOp& call = pOp[pOp->m_length];
+
+		r[R_SF] -= sizeof(int);
+		prg += pOp->m_length;
+		m_memory.Write32(r[R_SF], pOp->m_kind == UOP_PUSH_IMM_CALL ? pOp->m_imm : r[pOp->m_src]);
+
+		// the push rewrote code, which may have been the CALL
+		if (m_memory.HasCodeWrite() == true)
+		{
+			InvalidateCodeWrite();
+			VM_NEXT_CHECKED();
+		}
+
+		if (budget == 1)
+			VM_NEXT();
+
+		r[R_SF] -= sizeof(int);
+		m_memory.Write32(r[R_SF], prg + call.m_length);
+		prg = call.m_imm;
+
+		++fusionStats.m_executed[FUSION_PUSH_CALL];
+		--budget;
+		VM_NEXT_STORE();
+	}
+#if !BLACKLIGHT_VM_COMPUTED_GOTO
+		}
+	}
+#endif
+
+L_EXIT:
+	r[R_PRG] = prg;
+	memcpy(m_registers, r, sizeof(r));
+
+	return maxInstructions - budget;
+}
\ No newline at end of file
@@ -0,0 +1,281 @@
+#include <VM/Verifier.h>
+#include <VM/Arch.h>
+#include <VM/DecodeCache.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+using Blacklight::VM::Verifier;
+
+using namespace Blacklight::VM;
+
+namespace
+{
+	static_assert(R_COUNT == 16, "Register nibbles no longer name a register each");
+
+	// Returns how many bytes a load or store to a fixed address moves, 0 for anything else
+	uint32_t GetAccessSize(const MicroOpE kind)
+	{
+		switch (kind)
+		{
+		case UOP_LD8_ABS:
+		case UOP_ST8_ABS:
+			return 1;
+		case UOP_LD16_ABS:
+		case UOP_ST16_ABS:
+			return 2;
+		case UOP_LD32_ABS:
+		case UOP_ST32_ABS:
+			return 4;
+		default:
+			return 0;
+		}
+	}
+
+	bool IsStore(const MicroOpE kind)
+	{
+		return kind == UOP_ST8_ABS || kind == UOP_ST16_ABS || kind == UOP_ST32_ABS;
+	}
+
+	// Returns why an instruction can not be proven on its own, nullptr if it can
+	const char* Check(const MicroOp& op, const uint32_t origin, const size_t size, const size_t memorySize)
+	{
+		// the decoder leaves instructions running off the end of the image to the table, one byte long
+		if (op.m_kind == UOP_INTERP && op.m_length == 1)
+			return "runs off the end of the image";
+
+		uint32_t accessSize = GetAccessSize(op.m_kind);
+		if (accessSize == 0)
+			return nullptr;
+
+		if (static_cast<uint64_t>(op.m_imm) + accessSize > memorySize)
+			return IsStore(op.m_kind) == true ? "stores outside of memory" : "loads from outside of memory";
+
+		if (IsStore(op.m_kind) == true &&
+			static_cast<uint64_t>(op.m_imm) + accessSize > origin &&
+			op.m_imm < static_cast<uint64_t>(origin) + size)
+			return "stores into the code";
+
+		return nullptr;
+	}
+
+	// Returns whether execution carries on after an instruction
+	bool FallsThrough(const MicroOp& op, const uint8_t* code)
+	{
+		switch (op.m_kind)
+		{
+		case UOP_JMP_IMM:
+		case UOP_JMP:
+		case UOP_RET:
+			return false;
+		case UOP_INTERP:
+			return ((code[0] >> 4) & 0xF) != OP_TRAP ||
+				(code[0] & 0x8) != 0 ||
+				code[1] != TC_HALT;
+		default:
+			return true;
+		}
+	}
+
+	// Returns whether an instruction goes to a fixed address
+	bool HasTarget(const MicroOp& op)
+	{
+		return op.m_kind == UOP_BR_IMM ||
+			op.m_kind == UOP_JMP_IMM ||
+			op.m_kind == UOP_CALL_IMM;
+	}
+}
+
+Verifier::Verifier() :
+	m_origin(0),
+	m_stats()
+{
+}
+
+void Verifier::Verify(const uint8_t* pCode, const uint32_t origin, const size_t size, const size_t memorySize)
+{
+	m_origin = origin;
+	m_map.assign(size, 0);
+	m_regions.clear();
+	m_issues.clear();
+	m_stats = {};
+
+	if (size == 0)
+		return;
+
+	// padded so that decoding the last few bytes never reads past them
+	std::vector<uint8_t> code(pCode, pCode + size);
+	code.resize(size + MemoryController::FETCH_SIZE, 0);
+
+	std::vector<MicroOp> ops(size);
+	std::vector<uint8_t> reached(size, 0);
+	std::vector<const char*> reasons(size, nullptr);
+
+	// (successor, instruction) for every edge between instructions, to take proofs back along
+	std::vector<std::pair<uint32_t, uint32_t>> edges;
+
+	std::vector<uint32_t> pending = { 0 };
+	while (pending.empty() == false)
+	{
+		uint32_t offset = pending.back();
+		pending.pop_back();
+
+		if (reached[offset] != 0)
+			continue;
+		reached[offset] = 1;
+
+		const MicroOp op = DecodeCache::Decode(&code[offset], origin + offset, size - offset);
+		ops[offset] = op;
+
+		reasons[offset] = Check(op, origin, size, memorySize);
+		if (reasons[offset] != nullptr)
+			continue;
+
+		uint32_t successors[2];
+		size_t count = 0;
+		if (FallsThrough(op, &code[offset]) == true)
+			successors[count++] = origin + offset + op.m_length;
+		if (HasTarget(op) == true)
+			successors[count++] = op.m_imm;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			uint32_t successor = successors[i] - origin;
+			if (successor >= size)
+			{
+				reasons[offset] = "goes to an address outside of the image";
+				break;
+			}
+
+			edges.emplace_back(successor, offset);
+			pending.push_back(successor);
+		}
+	}
+
+	// instructions that start inside another one are decoded two ways, neither can be trusted
+	size_t previous = SIZE_MAX;
+	for (size_t offset = 0; offset < size; ++offset)
+	{
+		if (reached[offset] == 0)
+			continue;
+
+		if (previous != SIZE_MAX &&
+			previous + ops[previous].m_length > offset)
+		{
+			reasons[previous] = "overlaps the next instruction";
+			reasons[offset] = "starts inside of another instruction";
+		}
+
+		if (previous == SIZE_MAX ||
+			offset + ops[offset].m_length > previous + ops[previous].m_length)
+			previous = offset;
+
+		++m_stats.m_instructions;
+	}
+
+	// an instruction is only proven when everything it goes on to is, so take
+	// the proof back from every instruction that leads to one that is not
+	std::sort(edges.begin(), edges.end());
+
+	std::vector<uint32_t> unproven;
+	for (size_t offset = 0; offset < size; ++offset)
+	{
+		if (reached[offset] == 0)
+			continue;
+
+		if (reasons[offset] != nullptr)
+		{
+			m_issues.push_back({ origin + static_cast<uint32_t>(offset), reasons[offset] });
+			unproven.push_back(static_cast<uint32_t>(offset));
+		}
+		else
+		{
+			m_map[offset] = 1;
+		}
+	}
+
+	while (unproven.empty() == false)
+	{
+		uint32_t offset = unproven.back();
+		unproven.pop_back();
+
+		auto it = std::lower_bound(edges.begin(), edges.end(), std::make_pair(offset, static_cast<uint32_t>(0)));
+		for (; it != edges.end() && it->first == offset; ++it)
+		{
+			if (m_map[it->second] == 0)
+				continue;
+
+			m_map[it->second] = 0;
+			unproven.push_back(it->second);
+		}
+	}
+
+	// runs of proven instructions laid end to end
+	for (size_t offset = 0; offset < size; ++offset)
+	{
+		if (m_map[offset] == 0)
+			continue;
+
+		++m_stats.m_verified;
+
+		uint32_t begin = origin + static_cast<uint32_t>(offset);
+		uint32_t end = begin + ops[offset].m_length;
+		if (m_regions.empty() == false &&
+			m_regions.back().m_end == begin)
+			m_regions.back().m_end = end;
+		else
+			m_regions.push_back({ begin, end });
+	}
+
+	m_stats.m_regions = m_regions.size();
+}
+
+void Verifier::VerifyImage(const uint8_t* pImage, const size_t size, const size_t memorySize)
+{
+	if (size < 8)
+		throw std::runtime_error("Image is too short for its header");
+
+	uint32_t origin;
+	memcpy(&origin, pImage + 4, sizeof(origin));
+
+	Verify(pImage + 8, origin, size - 8, memorySize);
+}
+
+void Verifier::Restore(const uint32_t origin, const uint8_t* pMap, const size_t size, std::vector<VerifiedRegion> regions, std::vector<VerifierIssue> issues, const Stats& stats)
+{
+	m_origin = origin;
+	m_map.assign(pMap, pMap + size);
+	m_regions = std::move(regions);
+	m_issues = std::move(issues);
+	m_stats = stats;
+}
+
+void Verifier::Invalidate(const uint32_t low, const uint32_t high)
+{
+	if (m_map.empty() == true)
+		return;
+
+	// any instruction starting up to MAX_SPAN - 1 bytes before the write may depend on it
+	uint32_t first = std::max(low, m_origin + DecodeCache::MAX_SPAN - 1) - (DecodeCache::MAX_SPAN - 1) - m_origin;
+	uint32_t last = std::min<uint32_t>(high - m_origin, static_cast<uint32_t>(m_map.size() - 1));
+
+	for (uint32_t i = first; i <= last && i < m_map.size(); ++i)
+		m_map[i] = 0;
+}
+
+const std::vector<Blacklight::VM::VerifiedRegion>& Verifier::GetRegions() const
+{
+	return m_regions;
+}
+
+const std::vector<Blacklight::VM::VerifierIssue>& Verifier::GetIssues() const
+{
+	return m_issues;
+}
+
+const Verifier::Stats& Verifier::GetStats() const
+{
+	return m_stats;
+}
\ No newline at end of file
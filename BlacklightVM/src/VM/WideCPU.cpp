@@ -0,0 +1,569 @@
+#include <VM/WideCPU.h>
+#include <VM/Encoding.h>
+#include <VM/Semantics.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+using Blacklight::VM::MemoryController;
+using Blacklight::VM::WideCPU;
+using Blacklight::VM::WideOp;
+using Blacklight::VM::WideRegister;
+
+namespace
+{
+	// Returns the kind for an operation's size bits, the qword one when none are set
+	Blacklight::VM::WideOpE BySize(const Blacklight::VM::WideOpE kind8, const bool b, const bool w, const bool d)
+	{
+		return static_cast<Blacklight::VM::WideOpE>(kind8 + (b ? 0 : (w ? 1 : (d ? 2 : 3))));
+	}
+}
+
+WideCPU::WideCPU(const size_t blockSize, const MemoryMode memoryMode) :
+	m_finished(false),
+	m_memory(blockSize, memoryMode),
+	m_registers(),
+	m_instructionCount(0),
+	m_imageOrigin(0),
+	m_uncached()
+{
+	enum { PRG_START = 0x2000 };
+
+	// guest addresses are host addresses into the reservation, which a 32-bit host can not hold
+	if (sizeof(uintptr_t) < sizeof(WideRegister))
+		throw std::runtime_error("A WideCPU needs a 64-bit host");
+
+	m_registers[R_PRG] = PRG_START;
+	m_registers[R_SB] = 0x1000;
+	m_registers[R_SF] = 0x1000;
+	m_registers[R_CND] = 0;
+}
+
+MemoryController& WideCPU::GetMemoryController()
+{
+	return m_memory;
+}
+
+WideRegister& WideCPU::GetRegister(const uint32_t reg)
+{
+	return m_registers[reg];
+}
+
+void WideCPU::NotifyFinished()
+{
+	m_finished = true;
+}
+
+bool WideCPU::IsFinished() const
+{
+	return m_finished;
+}
+
+uint64_t WideCPU::GetInstructionCount() const
+{
+	return m_instructionCount;
+}
+
+void WideCPU::LoadImage(const char* path)
+{
+	SharedImage image(path);
+
+	LoadImage(image);
+}
+
+void WideCPU::LoadImage(const SharedImage& image)
+{
+	// map the code rather than copy it
+	m_memory.MapImage(image);
+
+	PrepareImage(image.GetStackSize(), image.GetOrigin(), image.GetCodeSize());
+}
+
+void WideCPU::LoadImage(const uint8_t* buf, size_t size)
+{
+	uint32_t stackSize = reinterpret_cast<const uint32_t*>(buf)[0];
+	uint32_t origin = reinterpret_cast<const uint32_t*>(buf)[1];
+
+	// copy the memory
+	m_memory.WriteBlock(origin, buf + 8, size - 8);
+
+	PrepareImage(stackSize, origin, size - 8);
+}
+
+void WideCPU::WriteInput(const uint64_t address, const uint8_t* pData, const size_t size)
+{
+	m_memory.WriteBlock(address, pData, size);
+}
+
+void WideCPU::PrepareImage(const uint32_t stackSize, const uint32_t origin, const size_t size)
+{
+	// set stack base and program counter
+	m_registers[R_SB] = stackSize;
+	m_registers[R_SF] = stackSize;
+	m_registers[R_PRG] = origin;
+
+	// the image is decoded as it runs, and watched for self-modification
+	m_imageOrigin = origin;
+	m_ops.assign(size, WideOp{ WOP_UNDECODED, 0, 0, 0, 0 });
+
+	m_memory.WatchCode(origin, size);
+}
+
+WideOp WideCPU::Decode(const uint8_t* code, const uint64_t address, const size_t available)
+{
+	Encoding encoding = Split(code, available, true);
+	bool imm = encoding.m_imm;
+	bool b = encoding.m_b;
+	bool w = encoding.m_w;
+	bool d = encoding.m_d;
+
+	WideOp op{ WOP_INTERP, encoding.m_dst, encoding.m_src, encoding.m_length, 0 };
+	bool relative = false;
+
+	switch (encoding.m_op)
+	{
+	case OP_LD:
+		op.m_kind = imm ? BySize(WOP_LD8_ABS, b, w, d) : BySize(WOP_LD8, b, w, d);
+		relative = imm;
+		break;
+	case OP_LDV:
+		op.m_kind = imm ? WOP_LDV_IMM : BySize(WOP_LDV8, b, w, d);
+		break;
+	case OP_ST:
+		op.m_kind = imm ? BySize(WOP_ST8_ABS, b, w, d) : BySize(WOP_ST8, b, w, d);
+		relative = imm;
+		break;
+	case OP_PUSH:
+		op.m_kind = imm ? WOP_PUSH_IMM : WOP_PUSH;
+		break;
+	case OP_POP:
+		op.m_kind = WOP_POP;
+		break;
+	case OP_ADD:
+		op.m_kind = imm ? WOP_ADD_IMM : BySize(WOP_ADD8, b, w, d);
+		break;
+	case OP_SUB:
+		op.m_kind = imm ? WOP_SUB_IMM : BySize(WOP_SUB8, b, w, d);
+		break;
+	case OP_AND:
+		op.m_kind = imm ? WOP_AND_IMM : BySize(WOP_AND8, b, w, d);
+		break;
+	case OP_NOT:
+		op.m_kind = WOP_NOT;
+		break;
+	case OP_CMP:
+		op.m_kind = imm ? WOP_CMP_IMM : BySize(WOP_CMP8, b, w, d);
+		break;
+	case OP_BR:
+		// the P/E/N bits line up with the flags in R_CND
+		op.m_kind = imm ? WOP_BR_IMM : WOP_BR;
+		op.m_dst = encoding.m_low & 0x7;
+		relative = imm;
+		break;
+	case OP_JMP:
+		op.m_kind = imm ? WOP_JMP_IMM : WOP_JMP;
+		relative = imm;
+		break;
+	case OP_CALL:
+		op.m_kind = imm ? WOP_CALL_IMM : WOP_CALL;
+		relative = imm;
+		break;
+	case OP_RET:
+		op.m_kind = WOP_RET;
+		break;
+	default:
+		// CX and TRAP are interpreted, along with the extended page TRAP escapes to
+		op.m_kind = WOP_INTERP;
+		break;
+	}
+
+	// addresses and branch targets are relative to the next instruction
+	if (encoding.m_immLength != 0 &&
+		available >= op.m_length)
+		op.m_imm = ReadImmediate<uint64_t>(code, encoding) + (relative == true ? address + op.m_length : 0);
+
+	return op;
+}
+
+const WideOp& WideCPU::DecodeAt(const uint64_t prg)
+{
+	size_t blockSize = m_memory.GetBlockSize();
+	if (prg >= blockSize)
+		throw std::runtime_error("Instruction outside of guest memory");
+
+	uint8_t code[MAX_LENGTH] = {};
+	size_t available = static_cast<size_t>(std::min<uint64_t>(MAX_LENGTH, blockSize - prg));
+	m_memory.ReadBlock(prg, code, available);
+
+	WideOp op = Decode(code, prg, available);
+	if (op.m_length > available)
+		throw std::runtime_error("Instruction runs past the end of guest memory");
+
+	// a slot can only hold what the code watch sees all of
+	uint64_t offset = prg - m_imageOrigin;
+	if (offset < m_ops.size() &&
+		offset + op.m_length <= m_ops.size())
+	{
+		m_ops[offset] = op;
+		return m_ops[offset];
+	}
+
+	m_uncached = op;
+	return m_uncached;
+}
+
+void WideCPU::Run()
+{
+	while (IsFinished() == false)
+		Run(UINT64_MAX);
+}
+
+uint64_t WideCPU::Run(const uint64_t maxInstructions)
+{
+	// a guest access outside of memory faults in a guard region and comes back here
+	MemoryController::FaultTrap trap(&m_memory);
+#if __linux__
+	if (sigsetjmp(trap.m_jump, 0) != 0)
+	{
+		m_finished = true;
+		throw std::runtime_error("Memory access outside of guest memory");
+	}
+#endif
+
+	// the host may have written code since it last ran
+	SyncDecodeCache();
+
+	WideRegister* r = m_registers;
+	WideRegister& prg = m_registers[R_PRG];
+	WideRegister& sf = m_registers[R_SF];
+	WideRegister& cnd = m_registers[R_CND];
+
+	uint64_t budget = maxInstructions;
+
+	while (m_finished == false &&
+		budget > 0)
+	{
+		uint64_t offset = prg - m_imageOrigin;
+		const WideOp* pOp = offset < m_ops.size() ? &m_ops[offset] : nullptr;
+
+		if (pOp == nullptr ||
+			pOp->m_kind == WOP_UNDECODED)
+			pOp = &DecodeAt(prg);
+
+		const WideOp& op = *pOp;
+
+		--budget;
+
+		// each micro-op must update the program counter like the instruction it came from
+		switch (op.m_kind)
+		{
+		case WOP_INTERP:
+			Interpret();
+			SyncDecodeCache();
+			break;
+		case WOP_LD8_ABS:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read8(op.m_imm);
+			break;
+		case WOP_LD16_ABS:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read16(op.m_imm);
+			break;
+		case WOP_LD32_ABS:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read32(op.m_imm);
+			break;
+		case WOP_LD64_ABS:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read64(op.m_imm);
+			break;
+		case WOP_LD8:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read8(r[op.m_src]);
+			break;
+		case WOP_LD16:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read16(r[op.m_src]);
+			break;
+		case WOP_LD32:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read32(r[op.m_src]);
+			break;
+		case WOP_LD64:
+			prg += op.m_length;
+			r[op.m_dst] = m_memory.Read64(r[op.m_src]);
+			break;
+		case WOP_LDV_IMM:
+			prg += op.m_length;
+			r[op.m_dst] = op.m_imm;
+			break;
+		case WOP_LDV8:
+			prg += op.m_length;
+			r[op.m_dst] = static_cast<uint8_t>(r[op.m_src]);
+			break;
+		case WOP_LDV16:
+			prg += op.m_length;
+			r[op.m_dst] = static_cast<uint16_t>(r[op.m_src]);
+			break;
+		case WOP_LDV32:
+			prg += op.m_length;
+			r[op.m_dst] = static_cast<uint32_t>(r[op.m_src]);
+			break;
+		case WOP_LDV64:
+			prg += op.m_length;
+			r[op.m_dst] = r[op.m_src];
+			break;
+		case WOP_ST8_ABS:
+			prg += op.m_length;
+			m_memory.Write8(op.m_imm, static_cast<uint8_t>(r[op.m_src]));
+			SyncDecodeCache();
+			break;
+		case WOP_ST16_ABS:
+			prg += op.m_length;
+			m_memory.Write16(op.m_imm, static_cast<uint16_t>(r[op.m_src]));
+			SyncDecodeCache();
+			break;
+		case WOP_ST32_ABS:
+			prg += op.m_length;
+			m_memory.Write32(op.m_imm, static_cast<uint32_t>(r[op.m_src]));
+			SyncDecodeCache();
+			break;
+		case WOP_ST64_ABS:
+			prg += op.m_length;
+			m_memory.Write64(op.m_imm, r[op.m_src]);
+			SyncDecodeCache();
+			break;
+		case WOP_ST8:
+			prg += op.m_length;
+			m_memory.Write8(r[op.m_dst], static_cast<uint8_t>(r[op.m_src]));
+			SyncDecodeCache();
+			break;
+		case WOP_ST16:
+			prg += op.m_length;
+			m_memory.Write16(r[op.m_dst], static_cast<uint16_t>(r[op.m_src]));
+			SyncDecodeCache();
+			break;
+		case WOP_ST32:
+			prg += op.m_length;
+			m_memory.Write32(r[op.m_dst], static_cast<uint32_t>(r[op.m_src]));
+			SyncDecodeCache();
+			break;
+		case WOP_ST64:
+			prg += op.m_length;
+			m_memory.Write64(r[op.m_dst], r[op.m_src]);
+			SyncDecodeCache();
+			break;
+		case WOP_PUSH_IMM:
+			sf -= sizeof(WideRegister);
+			prg += op.m_length;
+			m_memory.Write64(sf, op.m_imm);
+			SyncDecodeCache();
+			break;
+		case WOP_PUSH:
+			sf -= sizeof(WideRegister);
+			prg += op.m_length;
+			m_memory.Write64(sf, r[op.m_src]);
+			SyncDecodeCache();
+			break;
+		case WOP_POP:
+			r[op.m_dst] = m_memory.Read64(sf);
+			sf += sizeof(WideRegister);
+			prg += op.m_length;
+			break;
+		case WOP_ADD_IMM:
+			prg += op.m_length;
+			r[op.m_dst] += op.m_imm;
+			break;
+		case WOP_ADD8:
+			prg += op.m_length;
+			r[op.m_dst] += static_cast<int8_t>(r[op.m_src]);
+			break;
+		case WOP_ADD16:
+			prg += op.m_length;
+			r[op.m_dst] += static_cast<int16_t>(r[op.m_src]);
+			break;
+		case WOP_ADD32:
+			prg += op.m_length;
+			r[op.m_dst] += static_cast<int32_t>(r[op.m_src]);
+			break;
+		case WOP_ADD64:
+			prg += op.m_length;
+			r[op.m_dst] += r[op.m_src];
+			break;
+		case WOP_SUB_IMM:
+			prg += op.m_length;
+			r[op.m_dst] -= op.m_imm;
+			break;
+		case WOP_SUB8:
+			prg += op.m_length;
+			r[op.m_dst] -= static_cast<int8_t>(r[op.m_src]);
+			break;
+		case WOP_SUB16:
+			prg += op.m_length;
+			r[op.m_dst] -= static_cast<int16_t>(r[op.m_src]);
+			break;
+		case WOP_SUB32:
+			prg += op.m_length;
+			r[op.m_dst] -= static_cast<int32_t>(r[op.m_src]);
+			break;
+		case WOP_SUB64:
+			prg += op.m_length;
+			r[op.m_dst] -= r[op.m_src];
+			break;
+		case WOP_AND_IMM:
+			prg += op.m_length;
+			r[op.m_dst] &= op.m_imm;
+			break;
+		case WOP_AND8:
+			prg += op.m_length;
+			r[op.m_dst] &= static_cast<uint8_t>(r[op.m_src]);
+			break;
+		case WOP_AND16:
+			prg += op.m_length;
+			r[op.m_dst] &= static_cast<uint16_t>(r[op.m_src]);
+			break;
+		case WOP_AND32:
+			prg += op.m_length;
+			r[op.m_dst] &= static_cast<uint32_t>(r[op.m_src]);
+			break;
+		case WOP_AND64:
+			prg += op.m_length;
+			r[op.m_dst] &= r[op.m_src];
+			break;
+		case WOP_NOT:
+			prg += op.m_length;
+			r[op.m_dst] = ~r[op.m_dst];
+			break;
+		case WOP_CMP_IMM:
+			cnd = ClearFlags(cnd);
+			cnd |= CompareFlag(r[op.m_dst], op.m_imm);
+			prg += op.m_length;
+			break;
+		case WOP_CMP8:
+			cnd = ClearFlags(cnd);
+			cnd |= CompareFlag<WideRegister>(r[op.m_dst], static_cast<uint8_t>(r[op.m_src]));
+			prg += op.m_length;
+			break;
+		case WOP_CMP16:
+			cnd = ClearFlags(cnd);
+			cnd |= CompareFlag<WideRegister>(r[op.m_dst], static_cast<uint16_t>(r[op.m_src]));
+			prg += op.m_length;
+			break;
+		case WOP_CMP32:
+			cnd = ClearFlags(cnd);
+			cnd |= CompareFlag<WideRegister>(r[op.m_dst], static_cast<uint32_t>(r[op.m_src]));
+			prg += op.m_length;
+			break;
+		case WOP_CMP64:
+			cnd = ClearFlags(cnd);
+			cnd |= CompareFlag(r[op.m_dst], r[op.m_src]);
+			prg += op.m_length;
+			break;
+		case WOP_BR_IMM:
+			if (cnd & op.m_dst)
+				prg = op.m_imm;
+			else
+				prg += op.m_length;
+			break;
+		case WOP_BR:
+			if (cnd & op.m_dst)
+				prg = r[op.m_src];
+			else
+				prg += op.m_length;
+			break;
+		case WOP_JMP_IMM:
+			prg = op.m_imm;
+			break;
+		case WOP_JMP:
+			prg = r[op.m_src];
+			break;
+		case WOP_CALL_IMM:
+			sf -= sizeof(WideRegister);
+			prg += op.m_length;
+			m_memory.Write64(sf, prg);
+			prg = op.m_imm;
+			SyncDecodeCache();
+			break;
+		case WOP_CALL:
+			sf -= sizeof(WideRegister);
+			prg += op.m_length;
+			m_memory.Write64(sf, prg);
+			prg = r[op.m_src];
+			SyncDecodeCache();
+			break;
+		case WOP_RET:
+			prg = m_memory.Read64(sf);
+			sf += sizeof(WideRegister);
+			break;
+		default:
+			throw std::runtime_error("Invalid micro-op");
+		}
+	}
+
+	uint64_t count = maxInstructions - budget;
+	m_instructionCount += count;
+
+	return count;
+}
+
+void WideCPU::Interpret()
+{
+	WideRegister& prg = m_registers[R_PRG];
+	WideRegister& a = m_registers[R_A];
+
+	uint8_t opcode = m_memory.Read8(prg);
+	if (((opcode >> 4) & 0xF) == OP_CX)
+		throw std::runtime_error("CX is not supported on a WideCPU");
+
+	// the immediate bit escapes to the extended opcode page
+	if ((opcode & 0x8) != 0)
+	{
+		RunExtended(m_memory, m_registers);
+		return;
+	}
+
+	uint8_t tc = m_memory.Read8(prg + 1);
+
+	switch (tc)
+	{
+	case TC_PUTC:
+		putchar(static_cast<int>(a));
+		break;
+	case TC_PUTS:
+	{
+		// up to the terminator or the end of memory
+		uint64_t length = 0;
+		while (a + length < m_memory.GetBlockSize() &&
+			m_memory.Read8(a + length) != 0)
+			putchar(m_memory.Read8(a + length++));
+
+		a = length;
+		break;
+	}
+	case TC_GETCHAR:
+		a = static_cast<WideRegister>(static_cast<int64_t>(getchar()));
+		break;
+	case TC_HALT:
+		NotifyFinished();
+		return;
+	default:
+		throw std::runtime_error("Trap is not supported on a WideCPU");
+	}
+
+	prg += 2;
+}
+
+void WideCPU::InvalidateCodeWrite()
+{
+	uintptr_t low;
+	uintptr_t high;
+	m_memory.TakeCodeWrite(low, high);
+
+	// a slot depends on the bytes of its whole instruction, so the ones just before the write go too
+	uint64_t first = low >= m_imageOrigin + MAX_LENGTH ? low - m_imageOrigin - (MAX_LENGTH - 1) : 0;
+	uint64_t last = std::min<uint64_t>(high - m_imageOrigin, m_ops.size() - 1);
+
+	for (uint64_t offset = first; offset <= last; ++offset)
+		m_ops[offset].m_kind = WOP_UNDECODED;
+}
\ No newline at end of file
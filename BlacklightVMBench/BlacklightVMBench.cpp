@@ -0,0 +1,20 @@
+#include "MemoryBenchmarks.h"
+#include "NetworkBenchmarks.h"
+#include "WorkloadBenchmarks.h"
+
+int main()
+{
+	constexpr uint32_t ITERATIONS = 2000000;
+	constexpr size_t REPETITIONS = 7;
+
+	if (Memory::RunGuardBenchmarks(ITERATIONS, REPETITIONS) == false)
+		return 1;
+
+	if (Workload::RunWorkloadBenchmarks(REPETITIONS) == false)
+		return 1;
+
+	if (Network::RunEchoBenchmarks(16, 2000, 64) == false)
+		return 1;
+
+	return 0;
+}
\ No newline at end of file
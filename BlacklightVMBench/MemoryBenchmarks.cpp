@@ -0,0 +1,129 @@
+#include "MemoryBenchmarks.h"
+
+#include <VM/CPU.h>
+#include <VM/InstructionGeneration/InstructionGeneration.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+using namespace Blacklight::VM;
+using namespace InstructionGeneration;
+
+namespace
+{
+	constexpr uint32_t STACK_SIZE = 0x1000;
+	constexpr uint32_t ORIGIN = 0x2000;
+	constexpr uint32_t DATA = 0x8000;
+	// instructions in each iteration of the loop
+	constexpr uint32_t LOOP_LENGTH = 10;
+
+	void Dword(std::vector<uint8_t>& image, const uint32_t data)
+	{
+		for (int i = 0; i < 4; ++i)
+			image.push_back(static_cast<uint8_t>(data >> (i * 8)));
+	}
+
+	// a loop that is nothing but loads, stores, pushes and pops around a counter
+	std::vector<uint8_t> BuildImage(const uint32_t iterations)
+	{
+		std::vector<uint8_t> image;
+		Dword(image, STACK_SIZE);
+		Dword(image, ORIGIN);
+
+		image.insert(image.end(), { LDV(true), Reg(R_C) });
+		Dword(image, iterations);
+		image.insert(image.end(), { LDV(true), Reg(R_D) });
+		Dword(image, DATA);
+
+		size_t loop = image.size();
+		image.insert(image.end(), { LD(false, SZ_DWORD), Reg(R_A, R_D) });
+		image.insert(image.end(), { ADD(true), Reg(R_A) });
+		Dword(image, 1);
+		image.insert(image.end(), { ST(false), Reg(R_D, R_A) });
+		image.insert(image.end(), { ADD(true), Reg(R_D) });
+		Dword(image, 4);
+		// walks the same page over and over
+		image.insert(image.end(), { AND(true), Reg(R_D) });
+		Dword(image, DATA | 0xFFC);
+		image.insert(image.end(), { PUSH(false), Reg(R_A, R_A) });
+		image.insert(image.end(), { POP(), Reg(R_B) });
+		image.insert(image.end(), { SUB(true), Reg(R_C) });
+		Dword(image, 1);
+		image.insert(image.end(), { CMP(true), Reg(R_C) });
+		Dword(image, 0);
+		// loop while 0 is below the counter
+		image.push_back(BR(true, F_N));
+		Dword(image, static_cast<uint32_t>(loop - (image.size() + 4)));
+
+		image.insert(image.end(), { TRAP(), static_cast<uint8_t>(TC_HALT) });
+
+		return image;
+	}
+
+	const char* GetModeName(const DispatchMode mode)
+	{
+		switch (mode)
+		{
+		case DM_TABLE:
+			return "table";
+		case DM_DECODED:
+			return "decoded";
+		case DM_THREADED:
+			return "threaded";
+		default:
+			return "jit";
+		}
+	}
+}
+
+bool Memory::RunGuardBenchmarks(const uint32_t iterations, const size_t repetitions)
+{
+#if BLACKLIGHT_VM_UNCHECKED
+	std::cout << "Beginning memory benchmarks, unchecked accesses\n";
+#else
+	std::cout << "Beginning memory benchmarks, guarded accesses\n";
+#endif
+
+	std::vector<uint8_t> image = BuildImage(iterations);
+	const double instructions = 3.0 + static_cast<double>(iterations) * LOOP_LENGTH;
+
+	for (MemoryMode memoryMode : { MM_FLAT, MM_PAGED })
+	{
+		for (DispatchMode mode : { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT })
+		{
+			std::vector<double> seconds;
+
+			for (size_t i = 0; i < repetitions; ++i)
+			{
+				CPU cpu(0x10000, mode, memoryMode);
+				cpu.LoadImage(image.data(), image.size());
+
+				auto begin = std::chrono::steady_clock::now();
+				cpu.Run();
+				seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+
+				// the counter has to have run all the way down, every pass through the loop adding one to a slot
+				if (cpu.GetRegister(R_C) != 0 ||
+					cpu.GetInstructionCount() != static_cast<uint64_t>(instructions))
+				{
+					std::cout << GetModeName(mode) << " finished in the wrong state\n";
+					return false;
+				}
+			}
+
+			std::sort(seconds.begin(), seconds.end());
+			double median = seconds[seconds.size() / 2];
+
+			std::cout << std::left << std::setw(6) << (memoryMode == MM_FLAT ? "flat" : "paged")
+				<< std::setw(10) << GetModeName(mode) << std::right << std::fixed << std::setprecision(1)
+				<< std::setw(9) << instructions / seconds.front() / 1e6 << " MIPS best"
+				<< std::setw(9) << instructions / median / 1e6 << " MIPS median"
+				<< std::setprecision(2) << std::setw(8) << median * 1e9 / instructions << " ns/instruction\n";
+		}
+	}
+
+	return true;
+}
\ No newline at end of file
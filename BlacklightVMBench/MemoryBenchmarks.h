@@ -0,0 +1,12 @@
+#ifndef VMBENCH_MEMORYBENCHMARKS_H_
+#define VMBENCH_MEMORYBENCHMARKS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Memory
+{
+	bool RunGuardBenchmarks(const uint32_t iterations, const size_t repetitions);
+}
+
+#endif
\ No newline at end of file
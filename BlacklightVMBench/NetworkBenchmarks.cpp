@@ -0,0 +1,307 @@
+#include "NetworkBenchmarks.h"
+
+#include <VM/CPU.h>
+#include <VM/EventLoop.h>
+#include <VM/InstructionGeneration/InstructionGeneration.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if __linux__
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace Blacklight::VM;
+using namespace InstructionGeneration;
+
+#if __linux__
+namespace
+{
+	constexpr uint32_t STACK_SIZE = 0x1000;
+	constexpr uint32_t ORIGIN = 0x2000;
+	constexpr uint32_t BUFFER = 0x8000;
+	constexpr uint32_t BUFFER_SIZE = 0x4000;
+	constexpr uint16_t BASE_PORT = 47300;
+	// how long the client keeps trying to reach a server that is not listening yet
+	constexpr auto CONNECT_TIMEOUT = std::chrono::seconds(5);
+
+	void Dword(std::vector<uint8_t>& image, const uint32_t data)
+	{
+		for (int i = 0; i < 4; ++i)
+			image.push_back(static_cast<uint8_t>(data >> (i * 8)));
+	}
+
+	void Load(std::vector<uint8_t>& image, const RegisterE reg, const uint32_t data)
+	{
+		image.insert(image.end(), { LDV(true), Reg(reg) });
+		Dword(image, data);
+	}
+
+	void Move(std::vector<uint8_t>& image, const RegisterE dst, const RegisterE src)
+	{
+		image.insert(image.end(), { LDV(false), Reg(dst, src) });
+	}
+
+	void Trap(std::vector<uint8_t>& image, const TrapCode tc)
+	{
+		image.insert(image.end(), { TRAP(), static_cast<uint8_t>(tc) });
+	}
+
+	// emits a branch or jump with its offset left for Patch, returns where the offset goes
+	size_t Branch(std::vector<uint8_t>& image, const uint8_t opcode)
+	{
+		image.push_back(opcode);
+		Dword(image, 0);
+
+		return image.size() - 4;
+	}
+
+	void Patch(std::vector<uint8_t>& image, const size_t at, const size_t target)
+	{
+		uint32_t offset = static_cast<uint32_t>(target - (at + 4));
+		for (int i = 0; i < 4; ++i)
+			image[at + i] = static_cast<uint8_t>(offset >> (i * 8));
+	}
+
+	// a server on 127.0.0.1:port that echoes everything one client sends it until the client hangs up
+	std::vector<uint8_t> BuildImage(const uint16_t port)
+	{
+		std::vector<uint8_t> image;
+		Dword(image, STACK_SIZE);
+		Dword(image, ORIGIN);
+
+		// E holds the listening socket
+		Load(image, R_A, AF_INET);
+		Load(image, R_B, SOCK_STREAM);
+		Load(image, R_C, 0);
+		Trap(image, TC_SOCKET);
+		Move(image, R_E, R_A);
+
+		Load(image, R_B, 0);
+		size_t addressAt = image.size() - 4;
+		Load(image, R_C, sizeof(sockaddr_in));
+		Trap(image, TC_BIND);
+
+		Move(image, R_A, R_E);
+		Load(image, R_B, 1);
+		Trap(image, TC_LISTEN);
+
+		// F holds the client
+		Move(image, R_A, R_E);
+		Load(image, R_B, 0);
+		Load(image, R_C, 0);
+		Trap(image, TC_ACCEPT);
+		Move(image, R_F, R_A);
+
+		size_t loop = image.size();
+		Move(image, R_A, R_F);
+		Load(image, R_B, BUFFER);
+		Load(image, R_C, BUFFER_SIZE);
+		Load(image, R_D, 0);
+		Trap(image, TC_RECV);
+
+		// done once the client hangs up or anything fails
+		image.insert(image.end(), { CMP(true), Reg(R_A) });
+		Dword(image, 0);
+		size_t hungUp = Branch(image, BR(true, F_E));
+		image.insert(image.end(), { CMP(true), Reg(R_A) });
+		Dword(image, static_cast<uint32_t>(-1));
+		size_t failed = Branch(image, BR(true, F_E));
+
+		Move(image, R_C, R_A);
+		Move(image, R_A, R_F);
+		Load(image, R_B, BUFFER);
+		Load(image, R_D, 0);
+		Trap(image, TC_SEND);
+		Patch(image, Branch(image, JMP(true)), loop);
+
+		Patch(image, hungUp, image.size());
+		Patch(image, failed, image.size());
+		Move(image, R_A, R_F);
+		Trap(image, TC_CLOSE);
+		Move(image, R_A, R_E);
+		Trap(image, TC_CLOSE);
+		Trap(image, TC_HALT);
+
+		// the address to bind to goes after the code
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		uint32_t addressOffset = static_cast<uint32_t>(image.size() - 8);
+		for (int i = 0; i < 4; ++i)
+			image[addressAt + i] = static_cast<uint8_t>((ORIGIN + addressOffset) >> (i * 8));
+
+		const uint8_t* pAddress = reinterpret_cast<const uint8_t*>(&address);
+		image.insert(image.end(), pAddress, pAddress + sizeof(address));
+
+		return image;
+	}
+
+	const char* GetModeName(const DispatchMode mode)
+	{
+		switch (mode)
+		{
+		case DM_TABLE:
+			return "table";
+		case DM_DECODED:
+			return "decoded";
+		case DM_THREADED:
+			return "threaded";
+		default:
+			return "jit";
+		}
+	}
+
+	// Connects to every server, then sends each a message and waits for it to come back, roundTrips times.
+	// Returns how long the round trips took, or a negative time if a server could not be reached or got it wrong
+	double RunClient(const size_t servers, const uint32_t roundTrips, const size_t messageSize)
+	{
+		std::vector<int> sockets;
+		bool failed = false;
+
+		for (size_t i = 0; i < servers && failed == false; ++i)
+		{
+			sockaddr_in address = {};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(static_cast<uint16_t>(BASE_PORT + i));
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+			// the server may not be listening yet
+			auto deadline = std::chrono::steady_clock::now() + CONNECT_TIMEOUT;
+			for (;;)
+			{
+				int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+				if (fd != -1 &&
+					connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0)
+				{
+					int noDelay = 1;
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+					sockets.push_back(fd);
+					break;
+				}
+
+				if (fd != -1)
+					close(fd);
+
+				if (std::chrono::steady_clock::now() > deadline)
+				{
+					failed = true;
+					break;
+				}
+
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		std::vector<uint8_t> message(messageSize);
+		std::vector<uint8_t> reply(messageSize);
+		for (size_t i = 0; i < messageSize; ++i)
+			message[i] = static_cast<uint8_t>(i * 7);
+
+		auto begin = std::chrono::steady_clock::now();
+
+		for (uint32_t round = 0; round < roundTrips && failed == false; ++round)
+		{
+			// every server has a message in flight at once, so the loop has several guests ready at a time
+			for (int fd : sockets)
+			{
+				if (send(fd, message.data(), messageSize, MSG_NOSIGNAL) != static_cast<ssize_t>(messageSize))
+					failed = true;
+			}
+
+			for (int fd : sockets)
+			{
+				size_t received = 0;
+				while (received < messageSize && failed == false)
+				{
+					ssize_t count = recv(fd, reply.data() + received, messageSize - received, 0);
+					if (count <= 0)
+						failed = true;
+					else
+						received += static_cast<size_t>(count);
+				}
+
+				if (reply != message)
+					failed = true;
+			}
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+		// hanging up is what lets the servers halt
+		for (int fd : sockets)
+			close(fd);
+
+		return failed == true ? -1.0 : seconds;
+	}
+}
+#endif
+
+bool Network::RunEchoBenchmarks(const size_t servers, const uint32_t roundTrips, const size_t messageSize)
+{
+#if __linux__
+	std::cout << "Beginning network benchmarks, " << servers << " echo servers on one thread\n";
+
+	std::vector<std::vector<uint8_t>> images;
+	for (size_t i = 0; i < servers; ++i)
+		images.push_back(BuildImage(static_cast<uint16_t>(BASE_PORT + i)));
+
+	for (DispatchMode mode : { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT })
+	{
+		std::vector<std::unique_ptr<CPU>> cpus;
+		EventLoop loop;
+
+		for (const std::vector<uint8_t>& image : images)
+		{
+			cpus.emplace_back(new CPU(0x10000, mode));
+			cpus.back()->LoadImage(image.data(), image.size());
+			loop.Add(cpus.back().get());
+		}
+
+		double seconds = -1.0;
+		std::thread client([&] { seconds = RunClient(servers, roundTrips, messageSize); });
+
+		loop.Run();
+		client.join();
+
+		uint64_t suspensions = 0;
+		for (size_t i = 0; i < servers; ++i)
+		{
+			EventLoop::InstanceStats stats = loop.GetInstanceStats(i);
+			if (stats.m_faulted == true)
+				seconds = -1.0;
+
+			suspensions += stats.m_suspensions;
+		}
+
+		if (seconds < 0.0)
+		{
+			std::cout << GetModeName(mode) << " did not echo every message back\n";
+			return false;
+		}
+
+		double trips = static_cast<double>(servers) * roundTrips;
+
+		std::cout << std::left << std::setw(10) << GetModeName(mode) << std::right << std::fixed << std::setprecision(0)
+			<< std::setw(10) << trips / seconds << " round trips/s"
+			<< std::setprecision(1) << std::setw(8) << trips * messageSize * 2 / seconds / 1e6 << " MB/s"
+			<< std::setprecision(2) << std::setw(8) << static_cast<double>(suspensions) / trips << " suspensions/round trip\n";
+	}
+#else
+	std::cout << "Skipping network benchmarks, guest sockets need Linux\n";
+#endif
+
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,12 @@
+#ifndef VMBENCH_NETWORKBENCHMARKS_H_
+#define VMBENCH_NETWORKBENCHMARKS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Network
+{
+	bool RunEchoBenchmarks(const size_t servers, const uint32_t roundTrips, const size_t messageSize);
+}
+
+#endif
\ No newline at end of file
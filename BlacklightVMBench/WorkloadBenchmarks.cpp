@@ -0,0 +1,650 @@
+#include "WorkloadBenchmarks.h"
+
+#include <VM/Batch.h>
+#include <VM/CPU.h>
+#include <VM/InstructionGeneration/Program.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace Blacklight::VM;
+using namespace InstructionGeneration;
+
+namespace
+{
+	using BenchProgram = Program<1024>;
+
+	constexpr size_t BLOCK_SIZE = 0x20000;
+	constexpr uint32_t DATA = 0x8000;
+	constexpr uint32_t COPY_SOURCE = 0x8000;
+	constexpr uint32_t COPY_DESTINATION = 0xC000;
+	constexpr uint32_t COPY_BYTES = 0x4000;
+
+	constexpr uint32_t FIBONACCI = 25;
+	// copies of the opcode in each iteration of an opcode loop
+	constexpr size_t UNROLL = 16;
+
+	const DispatchMode DISPATCH_MODES[] = { DM_TABLE, DM_DECODED, DM_THREADED, DM_JIT, DM_VERIFIED };
+	const MemoryMode MEMORY_MODES[] = { MM_FLAT, MM_PAGED };
+
+	const char* const OPCODE_NAMES[OP_COUNT] =
+	{
+		"ld", "ldv", "st", "push", "pop", "add", "sub", "and", "not", "cmp", "br", "jmp", "call", "ret", "cx", "trap"
+	};
+
+	// Ends a loop that runs until R_C counts down to zero
+	constexpr void CountDown(BenchProgram& program, const Label loop)
+	{
+		program.Sub(R_C, 1);
+		program.Cmp(R_C, 0);
+		program.Br(F_N, loop);
+	}
+
+	// adds, subtracts, ANDs and NOTs over a few registers
+	constexpr BenchProgram BuildArithmetic()
+	{
+		BenchProgram program;
+		Label loop = program.NewLabel();
+
+		program.Ldv(R_C, 400000);
+		program.Ldv(R_A, 0);
+		program.Ldv(R_B, 1);
+
+		program.Bind(loop);
+		program.Add(R_A, R_B);
+		program.Add(R_B, 3);
+		program.Sub(R_A, 7);
+		program.And(R_A, 0x7FFFFFFF);
+		program.Not(R_B);
+		program.Not(R_B);
+		program.Ldv(R_D, R_A);
+		program.Add(R_D, R_B);
+		CountDown(program, loop);
+
+		program.Trap(TC_HALT);
+		return program;
+	}
+
+	// the naive recursive fibonacci of FIBONACCI into R_A
+	constexpr BenchProgram BuildRecursion()
+	{
+		BenchProgram program;
+		Label fibonacci = program.NewLabel();
+		Label done = program.NewLabel();
+
+		program.Ldv(R_A, FIBONACCI);
+		program.Call(fibonacci, SZ_BYTE);
+		program.Trap(TC_HALT);
+
+		program.Bind(fibonacci);
+		program.Cmp(R_A, 2);
+		program.Br(F_P, done);
+		program.Push(R_A);
+		program.Sub(R_A, 1);
+		program.Call(fibonacci);
+		program.Pop(R_B);
+		program.Push(R_A);
+		program.Ldv(R_A, R_B);
+		program.Sub(R_A, 2);
+		program.Call(fibonacci);
+		program.Pop(R_B);
+		program.Add(R_A, R_B);
+		program.Bind(done);
+		program.Ret();
+
+		return program;
+	}
+
+	// fills a buffer, then copies it a dword at a time and scans the copy a byte at a time for 0x5A, over and over
+	constexpr BenchProgram BuildMemory()
+	{
+		BenchProgram program;
+		Label fill = program.NewLabel();
+		Label outer = program.NewLabel();
+		Label copy = program.NewLabel();
+		Label scan = program.NewLabel();
+		Label skip = program.NewLabel();
+
+		program.Ldv(R_A, 0);
+		program.Ldv(R_D, COPY_SOURCE);
+		program.Ldv(R_C, COPY_BYTES / 4);
+		program.Bind(fill);
+		program.Add(R_A, 0x01234567);
+		program.St(R_D, R_A);
+		program.Add(R_D, 4);
+		CountDown(program, fill);
+
+		program.Ldv(R_G, 0);
+		program.Ldv(R_E, 24);
+		program.Bind(outer);
+
+		program.Ldv(R_D, COPY_SOURCE);
+		program.Ldv(R_F, COPY_DESTINATION);
+		program.Ldv(R_C, COPY_BYTES / 4);
+		program.Bind(copy);
+		program.Ld(R_A, R_D);
+		program.St(R_F, R_A);
+		program.Add(R_D, 4);
+		program.Add(R_F, 4);
+		CountDown(program, copy);
+
+		program.Ldv(R_F, COPY_DESTINATION);
+		program.Ldv(R_C, COPY_BYTES);
+		program.Bind(scan);
+		program.Ld(R_A, R_F, SZ_BYTE);
+		program.Add(R_F, 1);
+		program.Cmp(R_A, 0x5A);
+		program.Br(F_P | F_N, skip);
+		program.Add(R_G, 1);
+		program.Bind(skip);
+		CountDown(program, scan);
+
+		program.Sub(R_E, 1);
+		program.Cmp(R_E, 0);
+		program.Br(F_N, outer);
+
+		program.Trap(TC_HALT);
+		return program;
+	}
+
+	// a four way branch on two bits of a golden ratio walk, which no predictor sees through for long
+	constexpr BenchProgram BuildBranches()
+	{
+		BenchProgram program;
+		Label loop = program.NewLabel();
+		Label zero = program.NewLabel();
+		Label one = program.NewLabel();
+		Label two = program.NewLabel();
+		Label next = program.NewLabel();
+
+		program.Ldv(R_C, 400000);
+		program.Ldv(R_A, 0);
+		program.Ldv(R_G, 0);
+		program.Ldv(R_H, 0);
+
+		program.Bind(loop);
+		program.Add(R_A, 0x9E3779B9);
+		program.Ldv(R_B, R_A);
+		program.And(R_B, 0x300);
+		program.Cmp(R_B, 0x100);
+		program.Br(F_P, zero);
+		program.Br(F_E, one);
+		program.Cmp(R_B, 0x200);
+		program.Br(F_E, two);
+		program.Add(R_H, 3);
+		program.Jmp(next, SZ_BYTE);
+		program.Bind(zero);
+		program.Add(R_G, 1);
+		program.Jmp(next, SZ_BYTE);
+		program.Bind(one);
+		program.Add(R_G, 2);
+		program.Jmp(next, SZ_BYTE);
+		program.Bind(two);
+		program.Add(R_H, 1);
+		program.Bind(next);
+		CountDown(program, loop);
+
+		program.Trap(TC_HALT);
+		return program;
+	}
+
+	// pushes five values and pops them back into other registers
+	constexpr BenchProgram BuildStack()
+	{
+		BenchProgram program;
+		Label loop = program.NewLabel();
+
+		program.Ldv(R_C, 250000);
+		program.Ldv(R_A, 1);
+		program.Ldv(R_B, 2);
+		program.Ldv(R_D, 3);
+
+		program.Bind(loop);
+		program.Push(R_A);
+		program.Push(R_B);
+		program.Push(R_C);
+		program.Push(7);
+		program.Push(R_D);
+		program.Pop(R_E);
+		program.Pop(R_F);
+		program.Pop(R_G);
+		program.Pop(R_H);
+		program.Pop(R_I);
+		program.Add(R_A, R_F);
+		program.Add(R_B, R_E);
+		program.Add(R_D, R_I);
+		CountDown(program, loop);
+
+		program.Trap(TC_HALT);
+		return program;
+	}
+
+	enum OpcodeLoopE
+	{
+		OL_EMPTY,	// the loop alone, what every other loop's time is measured from
+		OL_LDV,
+		OL_LDV_IMMEDIATE,
+		OL_ADD,
+		OL_ADD_IMMEDIATE,
+		OL_SUB_IMMEDIATE,
+		OL_AND_IMMEDIATE,
+		OL_NOT,
+		OL_CMP_IMMEDIATE,
+		OL_LD,
+		OL_ST,
+		OL_PUSH_POP,
+		OL_BR,
+		OL_JMP,
+		OL_CALL_RET,
+		OL_COUNT
+	};
+
+	const char* const OPCODE_LOOP_NAMES[OL_COUNT] =
+	{
+		"loop", "ldv r", "ldv imm", "add r", "add imm", "sub imm", "and imm", "not", "cmp imm", "ld", "st", "push/pop", "br", "jmp", "call/ret"
+	};
+
+	// a count down around UNROLL copies of one opcode
+	template<OpcodeLoopE LOOP>
+	constexpr BenchProgram BuildOpcodeLoop()
+	{
+		BenchProgram program;
+		Label loop = program.NewLabel();
+		Label function = program.NewLabel();
+
+		program.Ldv(R_C, 100000);
+		program.Ldv(R_A, 1);
+		program.Ldv(R_B, 2);
+		program.Ldv(R_D, DATA);
+
+		program.Bind(loop);
+		for (size_t i = 0; i < UNROLL; ++i)
+		{
+			switch (LOOP)
+			{
+			case OL_EMPTY:
+				break;
+			case OL_LDV:
+				program.Ldv(R_A, R_B);
+				break;
+			case OL_LDV_IMMEDIATE:
+				program.Ldv(R_A, 5);
+				break;
+			case OL_ADD:
+				program.Add(R_A, R_B);
+				break;
+			case OL_ADD_IMMEDIATE:
+				program.Add(R_A, 1);
+				break;
+			case OL_SUB_IMMEDIATE:
+				program.Sub(R_A, 1);
+				break;
+			case OL_AND_IMMEDIATE:
+				program.And(R_A, 0x7F);
+				break;
+			case OL_NOT:
+				program.Not(R_A);
+				break;
+			case OL_CMP_IMMEDIATE:
+				program.Cmp(R_A, 5);
+				break;
+			case OL_LD:
+				program.Ld(R_A, R_D);
+				break;
+			case OL_ST:
+				program.St(R_D, R_A);
+				break;
+			case OL_PUSH_POP:
+				// half as many pairs, so there are as many instructions as in the other loops
+				if (i % 2 == 0)
+					program.Push(R_A);
+				else
+					program.Pop(R_B);
+				break;
+			case OL_BR:
+			case OL_JMP:
+				// taken, to the next instruction
+			{
+				Label next = program.NewLabel();
+				if (LOOP == OL_BR)
+					program.Br(F_P | F_E | F_N, next);
+				else
+					program.Jmp(next, SZ_BYTE);
+				program.Bind(next);
+				break;
+			}
+			case OL_CALL_RET:
+				program.Call(function, SZ_BYTE);
+				break;
+			default:
+				break;
+			}
+		}
+		CountDown(program, loop);
+		program.Trap(TC_HALT);
+
+		program.Bind(function);
+		program.Ret();
+
+		return program;
+	}
+
+	// Returns the image of a program that was built and encoded at compile time
+	template<BenchProgram (*BUILD)()>
+	std::vector<uint8_t> GetImage()
+	{
+		constexpr BenchProgram PROGRAM = BUILD();
+		constexpr auto IMAGE = PROGRAM.GetImage<PROGRAM.GetSize()>();
+
+		return { IMAGE.begin(), IMAGE.end() };
+	}
+
+	template<size_t... LOOPS>
+	std::vector<std::vector<uint8_t>> GetOpcodeLoopImages(std::index_sequence<LOOPS...>)
+	{
+		return { GetImage<BuildOpcodeLoop<static_cast<OpcodeLoopE>(LOOPS)>>()... };
+	}
+
+	struct GuestWorkload
+	{
+		const char* m_name;
+		std::vector<uint8_t> m_image;
+	};
+
+	// What a run ended with, which every core has to agree on
+	struct Result
+	{
+		double m_seconds;
+		uint64_t m_instructions;
+		Register m_registers[R_SF];
+	};
+
+	struct Statistics
+	{
+		double m_best;
+		double m_median;
+		// the standard deviation as a fraction of the mean
+		double m_deviation;
+	};
+
+	const char* GetModeName(const DispatchMode mode)
+	{
+		switch (mode)
+		{
+		case DM_TABLE:
+			return "table";
+		case DM_DECODED:
+			return "decoded";
+		case DM_THREADED:
+			return "threaded";
+		case DM_VERIFIED:
+			return "verified";
+		default:
+			return "jit";
+		}
+	}
+
+	const char* GetMemoryModeName(const MemoryMode memoryMode)
+	{
+		return memoryMode == MM_FLAT ? "flat" : "paged";
+	}
+
+	Result RunImage(const std::vector<uint8_t>& image, const DispatchMode mode, const MemoryMode memoryMode)
+	{
+		CPU cpu(BLOCK_SIZE, mode, memoryMode);
+		cpu.LoadImage(image.data(), image.size());
+
+		auto begin = std::chrono::steady_clock::now();
+		cpu.Run();
+
+		Result result = {};
+		result.m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		result.m_instructions = cpu.GetInstructionCount();
+		for (uint32_t i = 0; i < R_SF; ++i)
+			result.m_registers[i] = cpu.GetRegister(i);
+
+		return result;
+	}
+
+	bool IsSameResult(const Result& a, const Result& b)
+	{
+		return a.m_instructions == b.m_instructions &&
+			std::equal(std::begin(a.m_registers), std::end(a.m_registers), std::begin(b.m_registers));
+	}
+
+	Statistics GetStatistics(std::vector<double> seconds)
+	{
+		std::sort(seconds.begin(), seconds.end());
+
+		double mean = 0.0;
+		for (double s : seconds)
+			mean += s;
+		mean /= static_cast<double>(seconds.size());
+
+		double variance = 0.0;
+		for (double s : seconds)
+			variance += (s - mean) * (s - mean);
+		variance /= static_cast<double>(seconds.size());
+
+		return { seconds.front(), seconds[seconds.size() / 2], std::sqrt(variance) / mean };
+	}
+
+	// Runs an image once to warm up, then repetitions more times, and checks every run against reference
+	bool Measure(const std::vector<uint8_t>& image, const DispatchMode mode, const MemoryMode memoryMode,
+		const size_t repetitions, const Result& reference, Statistics& statistics)
+	{
+		std::vector<double> seconds;
+
+		for (size_t i = 0; i <= repetitions; ++i)
+		{
+			Result result = RunImage(image, mode, memoryMode);
+			if (IsSameResult(result, reference) == false)
+				return false;
+
+			if (i != 0)
+				seconds.push_back(result.m_seconds);
+		}
+
+		statistics = GetStatistics(seconds);
+		return true;
+	}
+
+	// Runs an image on every lane of a Batch once to warm up, then repetitions more times, and checks every
+	// lane of every run against reference
+	bool MeasureBatch(const std::vector<uint8_t>& image, const size_t repetitions, const Result& reference, Statistics& statistics)
+	{
+		std::vector<double> seconds;
+
+		for (size_t i = 0; i <= repetitions; ++i)
+		{
+			std::vector<std::unique_ptr<CPU>> cpus;
+			Batch batch;
+			for (size_t lane = 0; lane < Batch::MAX_LANES; ++lane)
+			{
+				cpus.emplace_back(new CPU(BLOCK_SIZE, DM_THREADED));
+				cpus.back()->LoadImage(image.data(), image.size());
+				batch.Add(cpus.back().get());
+			}
+
+			auto begin = std::chrono::steady_clock::now();
+			batch.Run();
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+			for (size_t lane = 0; lane < Batch::MAX_LANES; ++lane)
+			{
+				Result result = {};
+				result.m_instructions = batch.GetLaneStats(lane).m_instructions + cpus[lane]->GetInstructionCount();
+				for (uint32_t r = 0; r < R_SF; ++r)
+					result.m_registers[r] = cpus[lane]->GetRegister(r);
+
+				if (IsSameResult(result, reference) == false)
+					return false;
+			}
+
+			if (i != 0)
+				seconds.push_back(elapsed);
+		}
+
+		statistics = GetStatistics(seconds);
+		return true;
+	}
+
+	// Prints the opcodes that make up most of what a workload runs
+	void PrintOpcodeMix(const GuestWorkload& workload)
+	{
+		Profiler profiler;
+		CPU cpu(BLOCK_SIZE, DM_TABLE);
+		cpu.LoadImage(workload.m_image.data(), workload.m_image.size());
+		cpu.SetProfiler(&profiler);
+		cpu.Run();
+
+		std::vector<std::pair<uint64_t, int>> counts;
+		for (int op = 0; op < OP_COUNT; ++op)
+			counts.push_back({ profiler.GetOpcodeCount(static_cast<OpcodeE>(op)), op });
+		std::sort(counts.rbegin(), counts.rend());
+
+		double total = static_cast<double>(cpu.GetInstructionCount());
+		std::cout << std::left << std::setw(12) << workload.m_name << std::right << std::fixed << std::setprecision(2)
+			<< std::setw(6) << total / 1e6 << "M instructions,";
+
+		for (size_t i = 0; i < 5 && counts[i].first != 0; ++i)
+		{
+			std::cout << " " << OPCODE_NAMES[counts[i].second] << " " << std::setprecision(0)
+				<< static_cast<double>(counts[i].first) * 100.0 / total << "%";
+		}
+		std::cout << "\n";
+	}
+}
+
+bool Workload::RunWorkloadBenchmarks(const size_t repetitions)
+{
+	std::cout << "Beginning workload benchmarks, median of " << repetitions << " runs after a warm up\n";
+
+	const std::vector<GuestWorkload> workloads =
+	{
+		{ "arithmetic", GetImage<BuildArithmetic>() },
+		{ "recursion", GetImage<BuildRecursion>() },
+		{ "memory", GetImage<BuildMemory>() },
+		{ "branches", GetImage<BuildBranches>() },
+		{ "stack", GetImage<BuildStack>() }
+	};
+
+	// every core has to end up where the instruction table does
+	std::vector<Result> references;
+	for (const GuestWorkload& workload : workloads)
+	{
+		references.push_back(RunImage(workload.m_image, DM_TABLE, MM_FLAT));
+		PrintOpcodeMix(workload);
+	}
+
+	// fib(n) is fib(n - 1) + fib(n - 2) from fib(0) = 0 and fib(1) = 1
+	uint32_t fibonacci[2] = { 0, 1 };
+	for (uint32_t i = 1; i < FIBONACCI; ++i)
+		fibonacci[(i + 1) % 2] = fibonacci[0] + fibonacci[1];
+	if (references[1].m_registers[R_A] != fibonacci[FIBONACCI % 2])
+	{
+		std::cout << "recursion computed the wrong fibonacci number\n";
+		return false;
+	}
+
+	for (MemoryMode memoryMode : MEMORY_MODES)
+	{
+		for (size_t i = 0; i < workloads.size(); ++i)
+		{
+			for (DispatchMode mode : DISPATCH_MODES)
+			{
+				Statistics statistics;
+				if (Measure(workloads[i].m_image, mode, memoryMode, repetitions, references[i], statistics) == false)
+				{
+					std::cout << workloads[i].m_name << " finished in the wrong state on " << GetModeName(mode) << "\n";
+					return false;
+				}
+
+				double instructions = static_cast<double>(references[i].m_instructions);
+
+				std::cout << std::left << std::setw(6) << GetMemoryModeName(memoryMode) << std::setw(10) << GetModeName(mode)
+					<< std::setw(12) << workloads[i].m_name << std::right << std::fixed << std::setprecision(1)
+					<< std::setw(9) << instructions / statistics.m_best / 1e6 << " MIPS best"
+					<< std::setw(9) << instructions / statistics.m_median / 1e6 << " MIPS median"
+					<< std::setprecision(2) << std::setw(8) << statistics.m_median * 1e9 / instructions << " ns/instruction"
+					<< std::setprecision(1) << std::setw(6) << statistics.m_deviation * 100.0 << "% deviation\n";
+			}
+		}
+	}
+
+	// every lane of a batch runs the same workload, counted across the lanes
+	for (size_t i = 0; i < workloads.size(); ++i)
+	{
+		Statistics statistics;
+		if (MeasureBatch(workloads[i].m_image, repetitions, references[i], statistics) == false)
+		{
+			std::cout << workloads[i].m_name << " finished in the wrong state on a batch\n";
+			return false;
+		}
+
+		double instructions = static_cast<double>(references[i].m_instructions * Batch::MAX_LANES);
+
+		std::cout << std::left << std::setw(6) << GetMemoryModeName(MM_FLAT) << std::setw(10) << "batch"
+			<< std::setw(12) << workloads[i].m_name << std::right << std::fixed << std::setprecision(1)
+			<< std::setw(9) << instructions / statistics.m_best / 1e6 << " MIPS best"
+			<< std::setw(9) << instructions / statistics.m_median / 1e6 << " MIPS median"
+			<< std::setprecision(2) << std::setw(8) << statistics.m_median * 1e9 / instructions << " ns/instruction"
+			<< std::setprecision(1) << std::setw(6) << statistics.m_deviation * 100.0 << "% deviation\n";
+	}
+
+	// what each opcode adds to the empty loop, per instruction
+	std::vector<std::vector<uint8_t>> loops = GetOpcodeLoopImages(std::make_index_sequence<OL_COUNT>());
+
+	std::vector<Result> loopReferences;
+	for (const std::vector<uint8_t>& image : loops)
+		loopReferences.push_back(RunImage(image, DM_TABLE, MM_FLAT));
+
+	for (MemoryMode memoryMode : MEMORY_MODES)
+	{
+		std::cout << std::left << std::setw(16) << std::string("ns/opcode ") + GetMemoryModeName(memoryMode);
+		for (DispatchMode mode : DISPATCH_MODES)
+			std::cout << std::right << std::setw(10) << GetModeName(mode);
+		std::cout << "\n";
+
+		Statistics empty[std::size(DISPATCH_MODES)];
+		for (size_t i = 0; i < OL_COUNT; ++i)
+		{
+			std::cout << std::left << std::setw(16) << OPCODE_LOOP_NAMES[i];
+
+			for (size_t mode = 0; mode < std::size(DISPATCH_MODES); ++mode)
+			{
+				Statistics statistics;
+				if (Measure(loops[i], DISPATCH_MODES[mode], memoryMode, repetitions, loopReferences[i], statistics) == false)
+				{
+					std::cout << "\n" << OPCODE_LOOP_NAMES[i] << " finished in the wrong state on " << GetModeName(DISPATCH_MODES[mode]) << "\n";
+					return false;
+				}
+
+				double cost;
+				if (i == OL_EMPTY)
+				{
+					empty[mode] = statistics;
+					cost = statistics.m_median / static_cast<double>(loopReferences[i].m_instructions);
+				}
+				else
+				{
+					cost = (statistics.m_median - empty[mode].m_median) /
+						static_cast<double>(loopReferences[i].m_instructions - loopReferences[OL_EMPTY].m_instructions);
+				}
+
+				std::cout << std::right << std::fixed << std::setprecision(2) << std::setw(10) << std::max(cost, 0.0) * 1e9;
+			}
+			std::cout << "\n";
+		}
+	}
+
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,13 @@
+#ifndef VMBENCH_WORKLOADBENCHMARKS_H_
+#define VMBENCH_WORKLOADBENCHMARKS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Workload
+{
+	// Runs the standard guest workloads, then loops of a single opcode, on every core and memory mode
+	bool RunWorkloadBenchmarks(const size_t repetitions);
+}
+
+#endif
\ No newline at end of file